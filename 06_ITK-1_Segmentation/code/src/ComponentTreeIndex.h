@@ -0,0 +1,439 @@
+/**
+\file ComponentTreeIndex.h
+
+\brief Max-tree of an image for answering connected threshold queries without touching the whole volume
+
+The tree is built once: voxels are sorted by decreasing intensity and merged with a union-find table
+(Berger et al., "Effective component tree computation with application to pattern recognition in
+astronomical imaging", ICIP 2007). Every node is a connected component of an upper level set {I >= t}
+and its voxels are laid out contiguously, so the component of a seed at any lower threshold is a single
+range of the layout.
+
+A query (seed, lower, upper) climbs from the seed to the largest component whose level is still >= lower.
+If no voxel of that component is above upper, the component is the answer and is copied out directly;
+otherwise the region is flood-filled from the seed, which only visits voxels of that component. Either
+way the cost is proportional to the size of the component, not the size of the volume.
+
+The index can be saved and loaded so that it is built only once per image. The saved index records the
+geometry of the image and the size and modification time of its file, so that IsBuiltFrom() can tell a stale
+index apart from reading only the header of the image file.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <limits>
+#include <numeric>
+#include <vector>
+
+#include "itkImage.h"
+#include "itkImageIOFactory.h"
+#include "itksys/SystemTools.hxx"
+
+#include "ParallelRegionGrowing.h"
+
+template< class TImageType >
+class ComponentTreeIndex
+{
+public:
+  typedef typename TImageType::PixelType PixelType;
+  typedef typename TImageType::IndexType IndexType;
+  typedef typename TImageType::RegionType RegionType;
+  static const unsigned int ImageDimension = TImageType::ImageDimension;
+
+  //! Default Constructor
+  ComponentTreeIndex() : m_sourceBytes(0), m_sourceTime(0), m_root(0), m_stamp(0)
+  {
+  }
+
+  //! Default Destructor
+  ~ComponentTreeIndex()
+  {
+  }
+
+  //! Build the index of an image (face connectivity, same as itk::ConnectedThresholdImageFilter)
+  void Build(typename TImageType::Pointer image)
+  {
+    m_region = image->GetBufferedRegion();
+    m_origin = image->GetOrigin();
+    m_spacing = image->GetSpacing();
+    m_direction = image->GetDirection();
+    const size_t voxels = m_neighborhood.Initialize(m_region.GetSize(), false);
+    if (voxels >= std::numeric_limits< uint32_t >::max())
+    {
+      itkGenericExceptionMacro("Image too large for ComponentTreeIndex: " << voxels << " voxels");
+    }
+    m_level.assign(image->GetBufferPointer(), image->GetBufferPointer() + voxels);
+
+    // decreasing intensity, ties broken by position so that the tree is reproducible
+    std::vector< uint32_t > sorted(voxels);
+    std::iota(sorted.begin(), sorted.end(), 0);
+    std::sort(sorted.begin(), sorted.end(), [&](uint32_t a, uint32_t b)
+    {
+      return (m_level[a] > m_level[b]) || ((m_level[a] == m_level[b]) && (a < b));
+    });
+
+    // union-find over the sorted voxels; parents are always processed after their children
+    const uint32_t unprocessed = std::numeric_limits< uint32_t >::max();
+    std::vector< uint32_t > zpar(voxels, unprocessed);
+    m_parent.assign(voxels, 0);
+    for (size_t i = 0; i < voxels; i++)
+    {
+      const uint32_t p = sorted[i];
+      m_parent[p] = p;
+      zpar[p] = p;
+      m_neighborhood.ForEach(p, [&](size_t n)
+      {
+        if (zpar[n] == unprocessed)
+        {
+          return;
+        }
+        uint32_t r = static_cast< uint32_t >(n);
+        while (zpar[r] != r)
+        {
+          zpar[r] = zpar[zpar[r]];
+          r = zpar[r];
+        }
+        if (r != p)
+        {
+          m_parent[r] = p;
+          zpar[r] = p;
+        }
+      });
+    }
+    m_root = sorted.back();
+
+    // canonicalize: every voxel points to the representative of its node, every representative to its parent node
+    for (size_t i = voxels; i-- > 0;)
+    {
+      const uint32_t p = sorted[i], q = m_parent[p];
+      if (m_level[m_parent[q]] == m_level[q])
+      {
+        m_parent[p] = m_parent[q];
+      }
+    }
+
+    // subtree sizes and maxima, children first
+    m_area.assign(voxels, 1);
+    m_maximum = m_level;
+    for (size_t i = 0; i < voxels; i++)
+    {
+      const uint32_t p = sorted[i];
+      if (p != m_root)
+      {
+        m_area[m_parent[p]] += m_area[p];
+        m_maximum[m_parent[p]] = std::max(m_maximum[m_parent[p]], m_maximum[p]);
+      }
+    }
+
+    // lay out every subtree contiguously, parents first
+    m_start.assign(voxels, 0);
+    m_order.assign(voxels, 0);
+    std::vector< uint32_t > next(voxels, 0);
+    for (size_t i = voxels; i-- > 0;)
+    {
+      const uint32_t p = sorted[i];
+      if (p == m_root)
+      {
+        m_start[p] = 0;
+        next[p] = 0;
+      }
+      else if (IsCanonical(p))
+      {
+        m_start[p] = next[m_parent[p]];
+        next[m_parent[p]] += m_area[p];
+        next[p] = m_start[p];
+      }
+      else
+      {
+        m_order[next[m_parent[p]]++] = p;
+        continue;
+      }
+      m_order[next[p]++] = p;
+    }
+    m_stamps.clear();
+  }
+
+  //! Remember the size and modification time of the file the index is built from, for IsBuiltFrom()
+  void SetSourceFile(const std::string &fileName)
+  {
+    m_sourceBytes = itksys::SystemTools::FileLength(fileName);
+    m_sourceTime = itksys::SystemTools::ModifiedTime(fileName);
+  }
+
+  /**
+  \brief Whether the index was built from this image file, as far as its header, size and modification time tell
+
+  Only the header of the file is read. The index must have been built with SetSourceFile() or loaded.
+  */
+  bool IsBuiltFrom(const std::string &fileName) const
+  {
+    if ((itksys::SystemTools::FileLength(fileName) != m_sourceBytes) ||
+      (itksys::SystemTools::ModifiedTime(fileName) != m_sourceTime))
+    {
+      return false;
+    }
+    itk::ImageIOBase::Pointer imageIO = itk::ImageIOFactory::CreateImageIO(fileName.c_str(), itk::ImageIOFactory::ReadMode);
+    if (imageIO.IsNull())
+    {
+      return false;
+    }
+    imageIO->SetFileName(fileName);
+    imageIO->ReadImageInformation();
+    if (imageIO->GetNumberOfDimensions() != ImageDimension)
+    {
+      return false;
+    }
+    const double tolerance = 1e-6;
+    for (unsigned int d = 0; d < ImageDimension; d++)
+    {
+      if ((imageIO->GetDimensions(d) != m_region.GetSize()[d]) ||
+        (std::abs(imageIO->GetOrigin(d) - m_origin[d]) > tolerance) ||
+        (std::abs(imageIO->GetSpacing(d) - m_spacing[d]) > tolerance))
+      {
+        return false;
+      }
+      const std::vector< double > axis = imageIO->GetDirection(d);
+      for (unsigned int e = 0; e < ImageDimension; e++)
+      {
+        if (std::abs(axis[e] - m_direction[e][d]) > tolerance)
+        {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  /**
+  \brief Connected region of the seed within [lower, upper]
+
+  \param seed Seed index; an empty region is returned if it lies outside the image or the window
+  \param lower Lowest intensity included in the region
+  \param upper Highest intensity included in the region
+  \param region Linear offsets (in the buffer) of the voxels in the region
+  */
+  void Query(const IndexType &seed, PixelType lower, PixelType upper, std::vector< uint32_t > &region)
+  {
+    region.clear();
+    if (!m_region.IsInside(seed))
+    {
+      return;
+    }
+    const uint32_t voxel = static_cast< uint32_t >(m_neighborhood.Linear(seed, m_region.GetIndex()));
+    if ((m_level[voxel] < lower) || (upper < m_level[voxel]))
+    {
+      return;
+    }
+
+    // largest component of {I >= lower} that holds the seed
+    uint32_t node = IsCanonical(voxel) ? voxel : m_parent[voxel];
+    while ((node != m_root) && (m_level[m_parent[node]] >= lower))
+    {
+      node = m_parent[node];
+    }
+
+    if (m_maximum[node] <= upper)
+    {
+      region.assign(m_order.begin() + m_start[node], m_order.begin() + m_start[node] + m_area[node]);
+      return;
+    }
+
+    // the window cuts through the component; flood fill from the seed, which stays inside it
+    if (m_stamps.size() != m_level.size())
+    {
+      m_stamps.assign(m_level.size(), 0);
+      m_stamp = 0;
+    }
+    if (++m_stamp == 0)
+    {
+      std::fill(m_stamps.begin(), m_stamps.end(), 0);
+      m_stamp = 1;
+    }
+    m_stamps[voxel] = m_stamp;
+    region.push_back(voxel);
+    for (size_t i = 0; i < region.size(); i++)
+    {
+      m_neighborhood.ForEach(region[i], [&](size_t n)
+      {
+        if ((m_stamps[n] != m_stamp) && (lower <= m_level[n]) && (m_level[n] <= upper))
+        {
+          m_stamps[n] = m_stamp;
+          region.push_back(static_cast< uint32_t >(n));
+        }
+      });
+    }
+  }
+
+  //! Image with the same geometry as the indexed image, replaceValue inside the region and 0 elsewhere
+  template< class TOutputImage >
+  typename TOutputImage::Pointer GetRegionImage(const std::vector< uint32_t > &region, typename TOutputImage::PixelType replaceValue) const
+  {
+    typename TOutputImage::Pointer output = TOutputImage::New();
+    output->SetRegions(m_region);
+    output->SetOrigin(m_origin);
+    output->SetSpacing(m_spacing);
+    output->SetDirection(m_direction);
+    output->Allocate();
+    output->FillBuffer(0);
+    typename TOutputImage::PixelType *buffer = output->GetBufferPointer();
+    for (size_t i = 0; i < region.size(); i++)
+    {
+      buffer[region[i]] = replaceValue;
+    }
+    return output;
+  }
+
+  //! Write the index to a file
+  void Save(const std::string &fileName) const
+  {
+    std::ofstream file(fileName.c_str(), std::ios::binary);
+    if (!file.is_open())
+    {
+      itkGenericExceptionMacro("Could not open '" << fileName << "' for writing");
+    }
+    WriteHeader(file);
+    file.write(reinterpret_cast< const char * >(&m_root), sizeof(m_root));
+    WriteArray(file, m_level);
+    WriteArray(file, m_maximum);
+    WriteArray(file, m_parent);
+    WriteArray(file, m_area);
+    WriteArray(file, m_start);
+    WriteArray(file, m_order);
+    if (!file.good())
+    {
+      itkGenericExceptionMacro("Could not write '" << fileName << "'");
+    }
+  }
+
+  //! Read an index written by Save()
+  void Load(const std::string &fileName)
+  {
+    std::ifstream file(fileName.c_str(), std::ios::binary);
+    if (!file.is_open())
+    {
+      itkGenericExceptionMacro("Could not open '" << fileName << "' for reading");
+    }
+    if (!ReadHeader(file))
+    {
+      itkGenericExceptionMacro("'" << fileName << "' is not a component tree index of this pixel type and dimension");
+    }
+    const size_t voxels = m_neighborhood.Initialize(m_region.GetSize(), false);
+    file.read(reinterpret_cast< char * >(&m_root), sizeof(m_root));
+    ReadArray(file, m_level, voxels);
+    ReadArray(file, m_maximum, voxels);
+    ReadArray(file, m_parent, voxels);
+    ReadArray(file, m_area, voxels);
+    ReadArray(file, m_start, voxels);
+    ReadArray(file, m_order, voxels);
+    if (!file.good())
+    {
+      itkGenericExceptionMacro("'" << fileName << "' is truncated");
+    }
+    m_stamps.clear();
+  }
+
+private:
+  //! Identifies the file format; bump the version when the layout changes
+  static const uint32_t FileVersion = 2;
+
+  //! Representatives are either the root or have a parent at a different level
+  bool IsCanonical(uint32_t voxel) const
+  {
+    return (voxel == m_root) || (m_level[m_parent[voxel]] != m_level[voxel]);
+  }
+
+  void WriteHeader(std::ofstream &file) const
+  {
+    const char magic[8] = { 'C', 'T', 'R', 'E', 'E', 'I', 'D', 'X' };
+    const uint32_t header[3] = { FileVersion, ImageDimension, static_cast< uint32_t >(sizeof(PixelType)) };
+    file.write(magic, sizeof(magic));
+    file.write(reinterpret_cast< const char * >(header), sizeof(header));
+    file.write(reinterpret_cast< const char * >(&m_sourceBytes), sizeof(m_sourceBytes));
+    file.write(reinterpret_cast< const char * >(&m_sourceTime), sizeof(m_sourceTime));
+    for (unsigned int d = 0; d < ImageDimension; d++)
+    {
+      const int64_t index = m_region.GetIndex()[d];
+      const uint64_t size = m_region.GetSize()[d];
+      const double origin = m_origin[d], spacing = m_spacing[d];
+      file.write(reinterpret_cast< const char * >(&index), sizeof(index));
+      file.write(reinterpret_cast< const char * >(&size), sizeof(size));
+      file.write(reinterpret_cast< const char * >(&origin), sizeof(origin));
+      file.write(reinterpret_cast< const char * >(&spacing), sizeof(spacing));
+      for (unsigned int e = 0; e < ImageDimension; e++)
+      {
+        const double direction = m_direction[d][e];
+        file.write(reinterpret_cast< const char * >(&direction), sizeof(direction));
+      }
+    }
+  }
+
+  bool ReadHeader(std::ifstream &file)
+  {
+    char magic[8];
+    uint32_t header[3];
+    file.read(magic, sizeof(magic));
+    file.read(reinterpret_cast< char * >(header), sizeof(header));
+    if (!file.good() || (std::string(magic, sizeof(magic)) != "CTREEIDX") || (header[0] != FileVersion) ||
+      (header[1] != ImageDimension) || (header[2] != sizeof(PixelType)))
+    {
+      return false;
+    }
+    file.read(reinterpret_cast< char * >(&m_sourceBytes), sizeof(m_sourceBytes));
+    file.read(reinterpret_cast< char * >(&m_sourceTime), sizeof(m_sourceTime));
+    for (unsigned int d = 0; d < ImageDimension; d++)
+    {
+      int64_t index;
+      uint64_t size;
+      double origin, spacing;
+      file.read(reinterpret_cast< char * >(&index), sizeof(index));
+      file.read(reinterpret_cast< char * >(&size), sizeof(size));
+      file.read(reinterpret_cast< char * >(&origin), sizeof(origin));
+      file.read(reinterpret_cast< char * >(&spacing), sizeof(spacing));
+      m_region.SetIndex(d, index);
+      m_region.SetSize(d, size);
+      m_origin[d] = origin;
+      m_spacing[d] = spacing;
+      for (unsigned int e = 0; e < ImageDimension; e++)
+      {
+        double direction;
+        file.read(reinterpret_cast< char * >(&direction), sizeof(direction));
+        m_direction[d][e] = direction;
+      }
+    }
+    return file.good();
+  }
+
+  template< class TValue >
+  static void WriteArray(std::ofstream &file, const std::vector< TValue > &values)
+  {
+    file.write(reinterpret_cast< const char * >(values.data()), values.size() * sizeof(TValue));
+  }
+
+  template< class TValue >
+  static void ReadArray(std::ifstream &file, std::vector< TValue > &values, size_t count)
+  {
+    values.resize(count);
+    file.read(reinterpret_cast< char * >(values.data()), count * sizeof(TValue));
+  }
+
+  RegionType m_region;
+  typename TImageType::PointType m_origin;
+  typename TImageType::SpacingType m_spacing;
+  typename TImageType::DirectionType m_direction;
+  FrontierNeighborhood< ImageDimension > m_neighborhood;
+  uint64_t m_sourceBytes; //! size of the image file the index was built from
+  int64_t m_sourceTime; //! modification time of that file, in seconds
+
+  std::vector< PixelType > m_level, m_maximum; //! intensity of every voxel; highest intensity in the subtree of every node
+  std::vector< uint32_t > m_parent; //! representative of the node (or of the parent node, for representatives)
+  std::vector< uint32_t > m_area, m_start; //! size of the subtree of every node and where it starts in m_order
+  std::vector< uint32_t > m_order; //! voxels laid out so that every subtree is contiguous
+  uint32_t m_root;
+
+  std::vector< uint32_t > m_stamps; //! visit marks for flood-filled queries, never cleared between queries
+  uint32_t m_stamp;
+};
@@ -0,0 +1,425 @@
+/**
+\file ConnectedComponentLabeling.h
+
+\brief Multithreaded labelling of every connected component of a thresholded image, with per-component statistics
+
+The image is cut into slabs along the last axis and every thread labels whole slabs with a raster scan,
+linking each foreground voxel to its backward face neighbours in a union-find forest that lives directly
+on the voxel offsets. Slabs are then stitched along their boundaries with a lock-free union (compare-and-swap
+on the root being linked); the smaller offset always becomes the root, so every component ends up rooted at
+its first voxel in raster order and the final labels 1..N follow that order regardless of the thread count.
+
+The last pass writes the final labels and accumulates, per slab, the voxel count, bounding box and intensity
+sum of every component the slab touches; the per-slab statistics are merged in slab order afterwards. The slabs
+have a fixed number of slices that depends only on the image size, not on the thread count, so the intensity
+sums are added in the same order and the results are identical for any number of threads.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <limits>
+#include <unordered_map>
+#include <vector>
+
+#include "itkImage.h"
+
+#include "ParallelRegionGrowing.h"
+
+template< class TInputImage, class TLabelImage >
+class ConnectedComponentLabeling
+{
+public:
+  typedef typename TInputImage::PixelType InputPixelType;
+  typedef typename TLabelImage::PixelType LabelType;
+  static const unsigned int ImageDimension = TInputImage::ImageDimension;
+
+  //! Statistics of one component
+  struct ComponentStatistics
+  {
+    LabelType label;
+    size_t voxels;
+    double volume; //! in physical units (voxels times the product of the spacing)
+    long minimum[ImageDimension], maximum[ImageDimension]; //! bounding box, as image indices
+    double sum; //! sum of the input intensities inside the component
+    double mean;
+  };
+
+  //! Default Constructor
+  ConnectedComponentLabeling() :
+    m_lower(itk::NumericTraits< InputPixelType >::NonpositiveMin()),
+    m_upper(itk::NumericTraits< InputPixelType >::max()),
+    m_threads(0)
+  {
+  }
+
+  //! Default Destructor
+  ~ConnectedComponentLabeling()
+  {
+  }
+
+  //! Sets the Input Image; it is thresholded with [lower, upper] and also provides the intensities for the statistics
+  void SetInputImage(typename TInputImage::Pointer inputImage)
+  {
+    m_inputImage = inputImage;
+  }
+
+  //! Lowest intensity of the foreground
+  void SetLower(InputPixelType lower)
+  {
+    m_lower = lower;
+  }
+
+  //! Highest intensity of the foreground
+  void SetUpper(InputPixelType upper)
+  {
+    m_upper = upper;
+  }
+
+  //! Number of threads to use; 0 picks the hardware concurrency
+  void SetNumberOfThreads(unsigned int threads)
+  {
+    m_threads = threads;
+  }
+
+  //! Do the computation here
+  void Update()
+  {
+    const typename TInputImage::RegionType region = m_inputImage->GetBufferedRegion();
+    const InputPixelType *input = m_inputImage->GetBufferPointer();
+    const unsigned int threads = ResolveNumberOfThreads(m_threads);
+
+    size_t stride[ImageDimension], voxels = 1;
+    for (unsigned int d = 0; d < ImageDimension; d++)
+    {
+      stride[d] = voxels;
+      voxels *= region.GetSize()[d];
+    }
+    if (voxels >= Background)
+    {
+      itkGenericExceptionMacro("Image too large for ConnectedComponentLabeling: " << voxels << " voxels");
+    }
+    const unsigned int slabAxis = ImageDimension - 1;
+    const size_t planeSize = stride[slabAxis], slices = region.GetSize()[slabAxis];
+
+    // slabs of about BlockVoxels voxels, handed out through an atomic counter to balance uneven slabs; the
+    // partition depends only on the image size, so the sums are split the same way for any number of threads
+    const size_t slicesPerBlock = std::max< size_t >(1, BlockVoxels / std::max< size_t >(1, planeSize));
+    const size_t blocks = std::max< size_t >(1, (slices + slicesPerBlock - 1) / slicesPerBlock);
+    std::vector< size_t > blockStart(blocks + 1);
+    for (size_t b = 0; b <= blocks; b++)
+    {
+      blockStart[b] = std::min(slices, b * slicesPerBlock) * planeSize;
+    }
+
+    m_parent.reset(new std::atomic< uint32_t >[voxels]);
+    std::atomic< uint32_t > *parent = m_parent.get();
+
+    // first pass: local union-find inside every slab
+    RunBlocks(threads, blocks, [&](size_t b)
+    {
+      size_t coordinate[ImageDimension];
+      Coordinate(blockStart[b], stride, coordinate);
+      for (size_t v = blockStart[b]; v < blockStart[b + 1]; v++)
+      {
+        if ((m_lower <= input[v]) && (input[v] <= m_upper))
+        {
+          parent[v].store(static_cast< uint32_t >(v), std::memory_order_relaxed);
+          for (unsigned int d = 0; d < ImageDimension; d++)
+          {
+            // neighbours in the previous slab are linked when stitching
+            if ((coordinate[d] > 0) && ((d != slabAxis) || (v - stride[d] >= blockStart[b])) &&
+              (parent[v - stride[d]].load(std::memory_order_relaxed) != Background))
+            {
+              Union(parent, static_cast< uint32_t >(v), static_cast< uint32_t >(v - stride[d]));
+            }
+          }
+        }
+        else
+        {
+          parent[v].store(Background, std::memory_order_relaxed);
+        }
+        Advance(region, coordinate);
+      }
+    });
+
+    // stitch every slab to the one before it
+    RunBlocks(threads, blocks, [&](size_t b)
+    {
+      if ((b == 0) || (blockStart[b] == blockStart[b + 1]))
+      {
+        return;
+      }
+      for (size_t v = blockStart[b]; v < blockStart[b] + planeSize; v++)
+      {
+        if ((parent[v].load(std::memory_order_relaxed) != Background) &&
+          (parent[v - planeSize].load(std::memory_order_relaxed) != Background))
+        {
+          Union(parent, static_cast< uint32_t >(v), static_cast< uint32_t >(v - planeSize));
+        }
+      }
+    });
+
+    // final labels: roots numbered in raster order
+    m_outputImage = TLabelImage::New();
+    m_outputImage->CopyInformation(m_inputImage);
+    m_outputImage->SetRegions(region);
+    m_outputImage->Allocate();
+    LabelType *output = m_outputImage->GetBufferPointer();
+
+    std::vector< size_t > roots(blocks + 1, 0);
+    RunBlocks(threads, blocks, [&](size_t b)
+    {
+      for (size_t v = blockStart[b]; v < blockStart[b + 1]; v++)
+      {
+        roots[b + 1] += (parent[v].load(std::memory_order_relaxed) == v);
+      }
+    });
+    for (size_t b = 0; b < blocks; b++)
+    {
+      roots[b + 1] += roots[b];
+    }
+    if (roots[blocks] > static_cast< size_t >(itk::NumericTraits< LabelType >::max()))
+    {
+      itkGenericExceptionMacro("Too many components (" << roots[blocks] << ") for the label pixel type");
+    }
+    RunBlocks(threads, blocks, [&](size_t b)
+    {
+      size_t label = roots[b];
+      for (size_t v = blockStart[b]; v < blockStart[b + 1]; v++)
+      {
+        if (parent[v].load(std::memory_order_relaxed) == v)
+        {
+          output[v] = static_cast< LabelType >(++label);
+        }
+      }
+    });
+
+    // second pass: label every voxel and gather the statistics of each slab
+    const typename TInputImage::SpacingType spacing = m_inputImage->GetSpacing();
+    double voxelVolume = 1;
+    for (unsigned int d = 0; d < ImageDimension; d++)
+    {
+      voxelVolume *= spacing[d];
+    }
+    std::vector< std::unordered_map< LabelType, ComponentStatistics > > partial(blocks);
+    RunBlocks(threads, blocks, [&](size_t b)
+    {
+      size_t coordinate[ImageDimension];
+      Coordinate(blockStart[b], stride, coordinate);
+      ComponentStatistics *current = nullptr;
+      for (size_t v = blockStart[b]; v < blockStart[b + 1]; v++)
+      {
+        const uint32_t p = parent[v].load(std::memory_order_relaxed);
+        if (p == Background)
+        {
+          output[v] = 0;
+        }
+        else
+        {
+          const uint32_t root = Find(parent, static_cast< uint32_t >(v));
+          const LabelType label = output[root];
+          if (root != v)
+          {
+            output[v] = label;
+          }
+          if ((current == nullptr) || (current->label != label))
+          {
+            current = &Statistics(partial[b], label);
+          }
+          current->voxels++;
+          current->sum += input[v];
+          for (unsigned int d = 0; d < ImageDimension; d++)
+          {
+            const long index = region.GetIndex()[d] + static_cast< long >(coordinate[d]);
+            current->minimum[d] = std::min(current->minimum[d], index);
+            current->maximum[d] = std::max(current->maximum[d], index);
+          }
+        }
+        Advance(region, coordinate);
+      }
+    });
+
+    // merge in block order so that the sums do not depend on the scheduling
+    m_components.assign(roots[blocks], ComponentStatistics());
+    for (size_t c = 0; c < m_components.size(); c++)
+    {
+      Reset(m_components[c], static_cast< LabelType >(c + 1));
+    }
+    for (size_t b = 0; b < blocks; b++)
+    {
+      for (typename std::unordered_map< LabelType, ComponentStatistics >::const_iterator it = partial[b].begin(); it != partial[b].end(); ++it)
+      {
+        ComponentStatistics &total = m_components[it->first - 1];
+        total.voxels += it->second.voxels;
+        total.sum += it->second.sum;
+        for (unsigned int d = 0; d < ImageDimension; d++)
+        {
+          total.minimum[d] = std::min(total.minimum[d], it->second.minimum[d]);
+          total.maximum[d] = std::max(total.maximum[d], it->second.maximum[d]);
+        }
+      }
+    }
+    for (size_t c = 0; c < m_components.size(); c++)
+    {
+      m_components[c].volume = m_components[c].voxels * voxelVolume;
+      m_components[c].mean = m_components[c].sum / m_components[c].voxels;
+    }
+    m_parent.reset();
+  }
+
+  //! Get the label image here; 0 is background, components are numbered 1..N in raster order of their first voxel
+  typename TLabelImage::Pointer GetOutput()
+  {
+    return m_outputImage;
+  }
+
+  //! Statistics of component i are at position i-1
+  const std::vector< ComponentStatistics > &GetComponents() const
+  {
+    return m_components;
+  }
+
+  //! Write one line of statistics per component
+  void WriteStatistics(const std::string &fileName) const
+  {
+    std::ofstream file(fileName.c_str());
+    if (!file.is_open())
+    {
+      itkGenericExceptionMacro("Could not open '" << fileName << "' for writing");
+    }
+    file << "Label,Voxels,Volume";
+    for (unsigned int d = 0; d < ImageDimension; d++)
+    {
+      file << ",Min_" << d;
+    }
+    for (unsigned int d = 0; d < ImageDimension; d++)
+    {
+      file << ",Max_" << d;
+    }
+    file << ",MeanIntensity\n";
+    file.precision(10);
+    for (size_t c = 0; c < m_components.size(); c++)
+    {
+      const ComponentStatistics &component = m_components[c];
+      file << static_cast< double >(component.label) << "," << component.voxels << "," << component.volume;
+      for (unsigned int d = 0; d < ImageDimension; d++)
+      {
+        file << "," << component.minimum[d];
+      }
+      for (unsigned int d = 0; d < ImageDimension; d++)
+      {
+        file << "," << component.maximum[d];
+      }
+      file << "," << component.mean << "\n";
+    }
+  }
+
+private:
+  static const uint32_t Background = std::numeric_limits< uint32_t >::max();
+  static const size_t BlockVoxels = 1 << 18; //! voxels per slab (at least one slice)
+
+  //! Run function(block) for every block, handing blocks out through an atomic counter
+  template< class TFunction >
+  static void RunBlocks(unsigned int threads, size_t blocks, TFunction function)
+  {
+    std::atomic< size_t > next(0);
+    ForEachRange(threads, threads, [&](size_t, size_t)
+    {
+      for (size_t b = next++; b < blocks; b = next++)
+      {
+        function(b);
+      }
+    });
+  }
+
+  //! Root of a voxel, halving the path on the way (safe while other threads link roots)
+  static uint32_t Find(std::atomic< uint32_t > *parent, uint32_t v)
+  {
+    uint32_t p = parent[v].load(std::memory_order_relaxed);
+    while (p != v)
+    {
+      const uint32_t grandparent = parent[p].load(std::memory_order_relaxed);
+      parent[v].store(grandparent, std::memory_order_relaxed);
+      v = grandparent;
+      p = parent[v].load(std::memory_order_relaxed);
+    }
+    return v;
+  }
+
+  //! Lock-free union: the larger root is linked below the smaller one if it is still a root
+  static void Union(std::atomic< uint32_t > *parent, uint32_t a, uint32_t b)
+  {
+    while (true)
+    {
+      a = Find(parent, a);
+      b = Find(parent, b);
+      if (a == b)
+      {
+        return;
+      }
+      if (a > b)
+      {
+        std::swap(a, b);
+      }
+      uint32_t expected = b;
+      if (parent[b].compare_exchange_strong(expected, a, std::memory_order_relaxed))
+      {
+        return;
+      }
+    }
+  }
+
+  //! Coordinate of a linear offset
+  static void Coordinate(size_t offset, const size_t *stride, size_t *coordinate)
+  {
+    for (int d = ImageDimension - 1; d >= 0; d--)
+    {
+      coordinate[d] = offset / stride[d];
+      offset -= coordinate[d] * stride[d];
+    }
+  }
+
+  //! Advance a raster coordinate by one voxel
+  static void Advance(const typename TInputImage::RegionType &region, size_t *coordinate)
+  {
+    for (unsigned int d = 0; (d < ImageDimension) && (++coordinate[d] == region.GetSize()[d]); d++)
+    {
+      coordinate[d] = 0;
+    }
+  }
+
+  static void Reset(ComponentStatistics &statistics, LabelType label)
+  {
+    statistics.label = label;
+    statistics.voxels = 0;
+    statistics.volume = 0;
+    statistics.sum = 0;
+    statistics.mean = 0;
+    for (unsigned int d = 0; d < ImageDimension; d++)
+    {
+      statistics.minimum[d] = std::numeric_limits< long >::max();
+      statistics.maximum[d] = std::numeric_limits< long >::min();
+    }
+  }
+
+  static ComponentStatistics &Statistics(std::unordered_map< LabelType, ComponentStatistics > &statistics, LabelType label)
+  {
+    typename std::unordered_map< LabelType, ComponentStatistics >::iterator it = statistics.find(label);
+    if (it == statistics.end())
+    {
+      it = statistics.insert(std::make_pair(label, ComponentStatistics())).first;
+      Reset(it->second, label);
+    }
+    return it->second;
+  }
+
+  typename TInputImage::Pointer m_inputImage;
+  typename TLabelImage::Pointer m_outputImage;
+  std::unique_ptr< std::atomic< uint32_t >[] > m_parent;
+  std::vector< ComponentStatistics > m_components;
+  InputPixelType m_lower, m_upper;
+  unsigned int m_threads;
+};
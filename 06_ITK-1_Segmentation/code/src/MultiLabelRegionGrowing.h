@@ -0,0 +1,208 @@
+/**
+\file MultiLabelRegionGrowing.h
+
+\brief Grow several labelled regions, each with its own intensity window, in a single parallel traversal
+
+All seeds start in the same frontier and the regions grow level by level (one voxel of geodesic distance
+per level) using the same per-thread queues as ParallelRegionGrowing. A voxel belongs to the first region
+that reaches it; if two or more regions reach it in the same level, the seed that was added first wins.
+Voxels are claimed with an atomic minimum over the seed order, so the result is deterministic and does not
+depend on the number of threads.
+*/
+
+#pragma once
+
+#include "ParallelRegionGrowing.h"
+
+template< class TInputImage, class TOutputImage >
+class MultiLabelRegionGrowing
+{
+public:
+  typedef typename TInputImage::PixelType InputPixelType;
+  typedef typename TOutputImage::PixelType OutputPixelType;
+  typedef typename TInputImage::IndexType IndexType;
+  static const unsigned int ImageDimension = TInputImage::ImageDimension;
+
+  //! A seed with the label it grows and the intensity window of its region
+  struct Seed
+  {
+    IndexType index;
+    OutputPixelType label;
+    InputPixelType lower, upper;
+  };
+
+  //! Default Constructor
+  MultiLabelRegionGrowing() : m_fullConnectivity(false), m_threads(0)
+  {
+  }
+
+  //! Default Destructor
+  ~MultiLabelRegionGrowing()
+  {
+  }
+
+  //! Sets the Input Image
+  void SetInputImage(typename TInputImage::Pointer inputImage)
+  {
+    m_inputImage = inputImage;
+  }
+
+  /**
+  \brief Add a seed; the order in which seeds are added is the tie-break order
+
+  \param index Seed location; seeds outside the image or outside their own window are ignored
+  \param label Value written into the region grown from this seed
+  \param lower Lowest intensity included in this region
+  \param upper Highest intensity included in this region
+  */
+  void AddSeed(const IndexType &index, OutputPixelType label, InputPixelType lower, InputPixelType upper)
+  {
+    Seed seed;
+    seed.index = index;
+    seed.label = label;
+    seed.lower = lower;
+    seed.upper = upper;
+    m_seeds.push_back(seed);
+  }
+
+  //! Remove all seeds
+  void ClearSeeds()
+  {
+    m_seeds.clear();
+  }
+
+  //! Face connectivity (default) or full connectivity
+  void SetFullConnectivity(bool fullConnectivity)
+  {
+    m_fullConnectivity = fullConnectivity;
+  }
+
+  //! Number of threads to use; 0 picks the hardware concurrency
+  void SetNumberOfThreads(unsigned int threads)
+  {
+    m_threads = threads;
+  }
+
+  //! Do the computation here
+  void Update()
+  {
+    const typename TInputImage::RegionType region = m_inputImage->GetBufferedRegion();
+    const InputPixelType *input = m_inputImage->GetBufferPointer();
+
+    const size_t voxels = m_neighborhood.Initialize(region.GetSize(), m_fullConnectivity);
+    const unsigned int threads = ResolveNumberOfThreads(m_threads);
+
+    if (m_seeds.size() >= Settled - 1)
+    {
+      itkGenericExceptionMacro("Too many seeds for MultiLabelRegionGrowing: " << m_seeds.size());
+    }
+
+    // 0 = not yet reached, otherwise 1 + the order of the seed whose region holds the voxel;
+    // the top bit marks voxels whose level has been completed so that they can no longer change hands
+    std::unique_ptr< std::atomic< uint32_t >[] > claim(new std::atomic< uint32_t >[voxels]);
+    std::atomic< uint32_t > *claimBuffer = claim.get();
+    ForEachRange(threads, voxels, [&](size_t begin, size_t end)
+    {
+      for (size_t i = begin; i < end; i++)
+      {
+        claimBuffer[i].store(0, std::memory_order_relaxed);
+      }
+    });
+
+    StealingFrontier current(threads);
+    for (size_t s = 0; s < m_seeds.size(); s++)
+    {
+      if (!region.IsInside(m_seeds[s].index))
+      {
+        continue;
+      }
+      const size_t seed = m_neighborhood.Linear(m_seeds[s].index, region.GetIndex());
+      if (IsIncluded(s, input[seed]) && Claim(claimBuffer[seed], static_cast< uint32_t >(s + 1)))
+      {
+        current.Queue(0).push_back(seed);
+      }
+    }
+    Settle(claimBuffer, current.Queue(0));
+
+    GrowLevelSynchronous(threads, current, [&](size_t voxel, std::vector< size_t > &next)
+    {
+      const uint32_t owner = claimBuffer[voxel].load(std::memory_order_relaxed) & ~Settled;
+      m_neighborhood.ForEach(voxel, [&](size_t neighbor)
+      {
+        if (((claimBuffer[neighbor].load(std::memory_order_relaxed) & Settled) == 0) && IsIncluded(owner - 1, input[neighbor]) &&
+          Claim(claimBuffer[neighbor], owner))
+        {
+          next.push_back(neighbor);
+        }
+      });
+    },
+    [&](const std::vector< size_t > &level)
+    {
+      Settle(claimBuffer, level);
+    });
+
+    // same geometry as the input, every region gets the label of its seed and the rest 0
+    m_outputImage = TOutputImage::New();
+    m_outputImage->CopyInformation(m_inputImage);
+    m_outputImage->SetRegions(region);
+    m_outputImage->Allocate();
+    OutputPixelType *output = m_outputImage->GetBufferPointer();
+    ForEachRange(threads, voxels, [&](size_t begin, size_t end)
+    {
+      for (size_t i = begin; i < end; i++)
+      {
+        const uint32_t owner = claimBuffer[i].load(std::memory_order_relaxed) & ~Settled;
+        output[i] = (owner == 0) ? OutputPixelType(0) : m_seeds[owner - 1].label;
+      }
+    });
+  }
+
+  //! Get the output here
+  typename TOutputImage::Pointer GetOutput()
+  {
+    return m_outputImage;
+  }
+
+private:
+  static const uint32_t Settled = 0x80000000u;
+
+  //! Intensity test against the window of the given seed
+  bool IsIncluded(size_t seed, InputPixelType value) const
+  {
+    return (m_seeds[seed].lower <= value) && (value <= m_seeds[seed].upper);
+  }
+
+  /**
+  \brief Atomic minimum of the claim of a voxel that has not been settled yet
+
+  \return True if the voxel was unclaimed, i.e. the caller is the one who queues it
+  */
+  static bool Claim(std::atomic< uint32_t > &claim, uint32_t owner)
+  {
+    uint32_t current = claim.load(std::memory_order_relaxed);
+    while (((current & Settled) == 0) && ((current == 0) || (owner < current)))
+    {
+      if (claim.compare_exchange_weak(current, owner, std::memory_order_relaxed))
+      {
+        return (current == 0);
+      }
+    }
+    return false;
+  }
+
+  //! Freeze the owners of a completed level
+  static void Settle(std::atomic< uint32_t > *claim, const std::vector< size_t > &level)
+  {
+    for (size_t i = 0; i < level.size(); i++)
+    {
+      claim[level[i]].store(claim[level[i]].load(std::memory_order_relaxed) | Settled, std::memory_order_relaxed);
+    }
+  }
+
+  typename TInputImage::Pointer m_inputImage;
+  typename TOutputImage::Pointer m_outputImage;
+  std::vector< Seed > m_seeds;
+  FrontierNeighborhood< ImageDimension > m_neighborhood;
+  bool m_fullConnectivity;
+  unsigned int m_threads;
+};
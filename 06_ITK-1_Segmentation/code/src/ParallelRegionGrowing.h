@@ -0,0 +1,530 @@
+/**
+\file ParallelRegionGrowing.h
+
+\brief Multithreaded drop-in replacement for itk::ConnectedThresholdImageFilter
+
+The region is grown as a level-synchronous breadth-first search: every thread owns a frontier queue for
+the current level, expands it into its own queue for the next level and, once its queue runs dry, steals
+chunks from the queues of the other threads. A voxel is claimed with an atomic exchange, so every voxel
+enters the region exactly once and the result does not depend on the number of threads or their timing.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "itkImage.h"
+
+/**
+\brief Reusable barrier for a fixed number of threads (C++11 has no std::barrier)
+*/
+class FrontierBarrier
+{
+public:
+  //! Actual Constructor
+  explicit FrontierBarrier(unsigned int count) : m_count(count), m_waiting(0), m_generation(0)
+  {
+  }
+
+  //! Block until all threads have arrived
+  void Wait()
+  {
+    std::unique_lock< std::mutex > lock(m_mutex);
+    const unsigned int generation = m_generation;
+    if (++m_waiting == m_count)
+    {
+      m_waiting = 0;
+      ++m_generation;
+      m_condition.notify_all();
+      return;
+    }
+    m_condition.wait(lock, [&] { return generation != m_generation; });
+  }
+
+private:
+  std::mutex m_mutex;
+  std::condition_variable m_condition;
+  const unsigned int m_count;
+  unsigned int m_waiting, m_generation;
+};
+
+/**
+\brief Per-thread frontier queues of one BFS level; chunks are handed out through an atomic cursor per queue,
+which is also what other threads use to steal work
+*/
+class StealingFrontier
+{
+public:
+  //! Actual Constructor
+  explicit StealingFrontier(unsigned int threads) : m_queues(threads), m_cursors(new Cursor[threads]), m_threads(threads)
+  {
+    Rewind();
+  }
+
+  //! The queue owned by the given thread
+  std::vector< size_t > &Queue(unsigned int thread)
+  {
+    return m_queues[thread];
+  }
+
+  //! Reset all cursors so that the queues can be consumed again
+  void Rewind()
+  {
+    for (unsigned int t = 0; t < m_threads; t++)
+    {
+      m_cursors[t].position.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  //! Clear all queues (keeps the capacity around for the next level)
+  void Clear()
+  {
+    for (unsigned int t = 0; t < m_threads; t++)
+    {
+      m_queues[t].clear();
+    }
+    Rewind();
+  }
+
+  //! True if no thread has anything queued
+  bool Empty() const
+  {
+    for (unsigned int t = 0; t < m_threads; t++)
+    {
+      if (!m_queues[t].empty())
+      {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /**
+  \brief Grab the next chunk of work, starting with the queue of the calling thread and then stealing from the others
+
+  \param thread The calling thread
+  \param begin Pointer to the first voxel of the chunk
+  \param end Pointer past the last voxel of the chunk
+  \return False once every queue has been exhausted
+  */
+  bool Next(unsigned int thread, const size_t *&begin, const size_t *&end)
+  {
+    for (unsigned int i = 0; i < m_threads; i++)
+    {
+      const unsigned int victim = (thread + i) % m_threads;
+      const std::vector< size_t > &queue = m_queues[victim];
+      if (m_cursors[victim].position.load(std::memory_order_relaxed) >= queue.size())
+      {
+        continue;
+      }
+      const size_t first = m_cursors[victim].position.fetch_add(ChunkSize, std::memory_order_relaxed);
+      if (first < queue.size())
+      {
+        begin = queue.data() + first;
+        end = queue.data() + std::min(first + ChunkSize, queue.size());
+        return true;
+      }
+    }
+    return false;
+  }
+
+private:
+  //! Number of voxels handed out per grab; small enough to balance, large enough to keep the cursor cold
+  static const size_t ChunkSize = 256;
+
+  //! Cursor padded to its own cache line so that threads do not fight over neighbouring cursors
+  struct Cursor
+  {
+    std::atomic< size_t > position;
+    char padding[64 - sizeof(std::atomic< size_t >)];
+  };
+
+  std::vector< std::vector< size_t > > m_queues;
+  std::unique_ptr< Cursor[] > m_cursors;
+  const unsigned int m_threads;
+};
+
+/**
+\brief Split [0, count) into one contiguous range per thread and run the function on each of them
+
+\param threads Number of threads
+\param count Number of items
+\param function Callable taking (begin, end)
+*/
+template< class TFunction >
+void ForEachRange(unsigned int threads, size_t count, TFunction function)
+{
+  std::vector< std::thread > pool;
+  const size_t step = (count + threads - 1) / threads;
+  for (unsigned int t = 0; t < threads; t++)
+  {
+    const size_t begin = std::min(count, t * step), end = std::min(count, begin + step);
+    pool.push_back(std::thread(function, begin, end));
+  }
+  for (size_t t = 0; t < pool.size(); t++)
+  {
+    pool[t].join();
+  }
+}
+
+//! Resolve a requested thread count, 0 meaning all cores
+inline unsigned int ResolveNumberOfThreads(unsigned int threads)
+{
+  return (threads == 0) ? std::max(1u, std::thread::hardware_concurrency()) : threads;
+}
+
+/**
+\brief Run a level-synchronous breadth-first search over per-thread frontier queues
+
+Every thread drains its own queue of the current level (and then steals from the others), calling
+expand(voxel, queue) to push the voxels of the next level into its own queue. Once all threads are done
+with a level, settle(queue) is called by each thread on the queue it produced, before that level is expanded.
+
+\param threads Number of threads
+\param frontier Queues holding the first level (the seeds); it is consumed
+\param expand Callable taking (size_t voxel, std::vector< size_t > &next)
+\param settle Callable taking (const std::vector< size_t > &level)
+*/
+template< class TExpand, class TSettle >
+void GrowLevelSynchronous(unsigned int threads, StealingFrontier &frontier, TExpand expand, TSettle settle)
+{
+  StealingFrontier next(threads);
+  StealingFrontier *frontiers[2] = { &frontier, &next };
+  FrontierBarrier barrier(threads);
+  bool done = frontier.Empty();
+
+  auto worker = [&](unsigned int thread)
+  {
+    unsigned int level = 0;
+    while (!done)
+    {
+      StealingFrontier &in = *frontiers[level % 2], &out = *frontiers[(level + 1) % 2];
+      std::vector< size_t > &mine = out.Queue(thread);
+      const size_t *begin, *end;
+      while (in.Next(thread, begin, end))
+      {
+        for (; begin != end; ++begin)
+        {
+          expand(*begin, mine);
+        }
+      }
+      barrier.Wait();
+      settle(static_cast< const std::vector< size_t > & >(mine));
+      if (thread == 0)
+      {
+        in.Clear();
+        out.Rewind();
+        done = out.Empty();
+      }
+      barrier.Wait();
+      level++;
+    }
+  };
+
+  std::vector< std::thread > pool;
+  for (unsigned int t = 1; t < threads; t++)
+  {
+    pool.push_back(std::thread(worker, t));
+  }
+  worker(0);
+  for (size_t t = 0; t < pool.size(); t++)
+  {
+    pool[t].join();
+  }
+}
+
+/**
+\brief Neighbourhood of a voxel in a linearly indexed buffer, with face or full connectivity
+*/
+template< unsigned int VDimension >
+class FrontierNeighborhood
+{
+public:
+  /**
+  \brief Set up strides and neighbour offsets
+
+  \param size Size of the buffer along each axis
+  \param fullConnectivity Use all 3^Dimension-1 neighbours instead of the 2*Dimension face neighbours
+  \return Number of voxels in the buffer
+  */
+  template< class TSize >
+  size_t Initialize(const TSize &size, bool fullConnectivity)
+  {
+    size_t voxels = 1;
+    for (unsigned int d = 0; d < VDimension; d++)
+    {
+      m_size[d] = size[d];
+      m_stride[d] = voxels;
+      voxels *= m_size[d];
+    }
+
+    m_neighbors.clear();
+    int offset[VDimension];
+    for (unsigned int d = 0; d < VDimension; d++)
+    {
+      offset[d] = -1;
+    }
+    while (true)
+    {
+      unsigned int nonZero = 0;
+      for (unsigned int d = 0; d < VDimension; d++)
+      {
+        nonZero += (offset[d] != 0);
+      }
+      if ((nonZero == 1) || (fullConnectivity && (nonZero > 0)))
+      {
+        Neighbor neighbor;
+        neighbor.delta = 0;
+        for (unsigned int d = 0; d < VDimension; d++)
+        {
+          neighbor.offset[d] = offset[d];
+          neighbor.delta += offset[d] * static_cast< std::ptrdiff_t >(m_stride[d]);
+        }
+        m_neighbors.push_back(neighbor);
+      }
+
+      // odometer-style increment over {-1, 0, 1}^Dimension
+      unsigned int d = 0;
+      while ((d < VDimension) && (offset[d] == 1))
+      {
+        offset[d++] = -1;
+      }
+      if (d == VDimension)
+      {
+        break;
+      }
+      offset[d]++;
+    }
+    return voxels;
+  }
+
+  //! Linear offset of an index relative to the start of the buffer
+  template< class TIndex >
+  size_t Linear(const TIndex &index, const TIndex &start) const
+  {
+    size_t voxel = 0;
+    for (unsigned int d = 0; d < VDimension; d++)
+    {
+      voxel += (index[d] - start[d]) * m_stride[d];
+    }
+    return voxel;
+  }
+
+  //! Call function(neighbor) for every neighbour of the voxel that lies inside the buffer
+  template< class TFunction >
+  void ForEach(size_t voxel, TFunction function) const
+  {
+    size_t coordinate[VDimension];
+    size_t remainder = voxel;
+    for (int d = VDimension - 1; d >= 0; d--)
+    {
+      coordinate[d] = remainder / m_stride[d];
+      remainder -= coordinate[d] * m_stride[d];
+    }
+
+    for (size_t n = 0; n < m_neighbors.size(); n++)
+    {
+      bool inside = true;
+      for (unsigned int d = 0; (d < VDimension) && inside; d++)
+      {
+        const int offset = m_neighbors[n].offset[d];
+        inside = !(((offset < 0) && (coordinate[d] == 0)) || ((offset > 0) && (coordinate[d] + 1 == m_size[d])));
+      }
+      if (inside)
+      {
+        function(voxel + m_neighbors[n].delta);
+      }
+    }
+  }
+
+private:
+  struct Neighbor
+  {
+    int offset[VDimension];
+    std::ptrdiff_t delta;
+  };
+
+  std::vector< Neighbor > m_neighbors;
+  size_t m_size[VDimension], m_stride[VDimension];
+};
+
+/**
+\brief Parallel connected threshold segmentation
+
+Usage mirrors itk::ConnectedThresholdImageFilter:
+\verbatim
+ParallelRegionGrowing< InputImageType, OutputImageType > grower;
+grower.SetInputImage(image);
+grower.SetLower(1100);
+grower.SetUpper(2000);
+grower.SetReplaceValue(1000);
+grower.AddSeed(index);
+grower.Update();
+OutputImageType::Pointer output = grower.GetOutput();
+\endverbatim
+*/
+template< class TInputImage, class TOutputImage >
+class ParallelRegionGrowing
+{
+public:
+  typedef typename TInputImage::PixelType InputPixelType;
+  typedef typename TOutputImage::PixelType OutputPixelType;
+  typedef typename TInputImage::IndexType IndexType;
+  static const unsigned int ImageDimension = TInputImage::ImageDimension;
+
+  //! Default Constructor
+  ParallelRegionGrowing() :
+    m_lower(itk::NumericTraits< InputPixelType >::NonpositiveMin()),
+    m_upper(itk::NumericTraits< InputPixelType >::max()),
+    m_replaceValue(itk::NumericTraits< OutputPixelType >::One),
+    m_fullConnectivity(false),
+    m_threads(0)
+  {
+  }
+
+  //! Default Destructor
+  ~ParallelRegionGrowing()
+  {
+  }
+
+  //! Sets the Input Image
+  void SetInputImage(typename TInputImage::Pointer inputImage)
+  {
+    m_inputImage = inputImage;
+  }
+
+  //! Lowest intensity that is included in the region
+  void SetLower(InputPixelType lower)
+  {
+    m_lower = lower;
+  }
+
+  //! Highest intensity that is included in the region
+  void SetUpper(InputPixelType upper)
+  {
+    m_upper = upper;
+  }
+
+  //! Value written into voxels of the region; everything else is 0
+  void SetReplaceValue(OutputPixelType replaceValue)
+  {
+    m_replaceValue = replaceValue;
+  }
+
+  //! Add a seed; seeds outside the image or outside [lower, upper] are ignored, same as ITK
+  void AddSeed(const IndexType &seed)
+  {
+    m_seeds.push_back(seed);
+  }
+
+  //! Remove all seeds
+  void ClearSeeds()
+  {
+    m_seeds.clear();
+  }
+
+  //! Face connectivity (default, same as ITK) or full connectivity
+  void SetFullConnectivity(bool fullConnectivity)
+  {
+    m_fullConnectivity = fullConnectivity;
+  }
+
+  //! Number of threads to use; 0 picks the hardware concurrency
+  void SetNumberOfThreads(unsigned int threads)
+  {
+    m_threads = threads;
+  }
+
+  //! Do the computation here
+  void Update()
+  {
+    const typename TInputImage::RegionType region = m_inputImage->GetBufferedRegion();
+    const InputPixelType *input = m_inputImage->GetBufferPointer();
+
+    const size_t voxels = m_neighborhood.Initialize(region.GetSize(), m_fullConnectivity);
+    const unsigned int threads = ResolveNumberOfThreads(m_threads);
+
+    // 0 = not yet reached, 1 = part of the region
+    std::unique_ptr< std::atomic< unsigned char >[] > visited(new std::atomic< unsigned char >[voxels]);
+    ForEachRange(threads, voxels, [&](size_t begin, size_t end)
+    {
+      for (size_t i = begin; i < end; i++)
+      {
+        visited[i].store(0, std::memory_order_relaxed);
+      }
+    });
+
+    StealingFrontier current(threads);
+    for (size_t s = 0; s < m_seeds.size(); s++)
+    {
+      if (!region.IsInside(m_seeds[s]))
+      {
+        continue;
+      }
+      const size_t seed = m_neighborhood.Linear(m_seeds[s], region.GetIndex());
+      if (IsIncluded(input[seed]) && (visited[seed].exchange(1) == 0))
+      {
+        current.Queue(0).push_back(seed);
+      }
+    }
+
+    // claim every unvisited, included neighbour for the next level
+    std::atomic< unsigned char > *visitedBuffer = visited.get();
+    GrowLevelSynchronous(threads, current, [&](size_t voxel, std::vector< size_t > &next)
+    {
+      m_neighborhood.ForEach(voxel, [&](size_t neighbor)
+      {
+        if ((visitedBuffer[neighbor].load(std::memory_order_relaxed) == 0) && IsIncluded(input[neighbor]) &&
+          (visitedBuffer[neighbor].exchange(1, std::memory_order_relaxed) == 0))
+        {
+          next.push_back(neighbor);
+        }
+      });
+    },
+    [](const std::vector< size_t > &) {});
+
+    // same geometry as the input, region voxels get the replace value and the rest 0
+    m_outputImage = TOutputImage::New();
+    m_outputImage->CopyInformation(m_inputImage);
+    m_outputImage->SetRegions(region);
+    m_outputImage->Allocate();
+    OutputPixelType *output = m_outputImage->GetBufferPointer();
+    const OutputPixelType replaceValue = m_replaceValue;
+    ForEachRange(threads, voxels, [&](size_t begin, size_t end)
+    {
+      for (size_t i = begin; i < end; i++)
+      {
+        output[i] = visited[i].load(std::memory_order_relaxed) ? replaceValue : OutputPixelType(0);
+      }
+    });
+  }
+
+  //! Get the output here
+  typename TOutputImage::Pointer GetOutput()
+  {
+    return m_outputImage;
+  }
+
+private:
+  //! Same inclusion test as itk::BinaryThresholdImageFunction
+  bool IsIncluded(InputPixelType value) const
+  {
+    return (m_lower <= value) && (value <= m_upper);
+  }
+
+  typename TInputImage::Pointer m_inputImage;
+  typename TOutputImage::Pointer m_outputImage;
+  std::vector< IndexType > m_seeds;
+  FrontierNeighborhood< ImageDimension > m_neighborhood;
+  InputPixelType m_lower, m_upper;
+  OutputPixelType m_replaceValue;
+  bool m_fullConnectivity;
+  unsigned int m_threads;
+};
@@ -0,0 +1,405 @@
+/**
+\file StreamingRegionGrowing.h
+
+\brief Out-of-core connected threshold segmentation for images that do not fit in memory
+
+The image is never read as a whole. It is streamed through itk::ImageFileReader in slabs along the last
+axis and every slab is labelled on its own with a raster scan and a union-find table of its provisional labels,
+which is dropped when the next slab is read. Only the components of a slab that reach its last plane get a
+global label; the last plane is carried to the next slab as global labels, and the components of the next slab
+that touch it are merged with them in a second union-find table over global labels. After the first pass that
+table tells which global labels are connected to a seed; the second pass streams the slabs again, reproduces
+exactly the same labels and pastes the region of every slab into the output file.
+
+Peak memory is one slab of input, of labels and of output, the provisional labels of one slab, one plane of
+global labels and the global table. The global table cannot be limited to the last plane: a component may
+reach a seed only in a later slab after it has left the plane, so every component that ever crossed a slab
+boundary keeps its entry. It has one entry per such component, at most one per voxel of the last planes of all
+slabs (a checkerboard pattern) and usually far fewer; a component that runs through many slabs keeps the
+global label it got first. An exception is thrown if a slab has 2^32 voxels or more, or if the global labels
+run out. The output is the same as that of itk::ConnectedThresholdImageFilter with face connectivity.
+
+The slabs always run along the last axis, so for a 4D image every slab is one or more whole 3D volumes. This
+keeps the merge across slabs to a single plane, but a single volume that does not fit in memory cannot be
+segmented this way; that would need slabs along z with the labels of the whole previous volume kept for the
+merge along t.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <limits>
+#include <vector>
+
+#include "itkImage.h"
+#include "itkImageFileReader.h"
+#include "itkImageFileWriter.h"
+#include "itkImageIOFactory.h"
+
+template< class TInputImage, class TOutputImage >
+class StreamingRegionGrowing
+{
+public:
+  typedef typename TInputImage::PixelType InputPixelType;
+  typedef typename TOutputImage::PixelType OutputPixelType;
+  typedef typename TInputImage::IndexType IndexType;
+  typedef typename TInputImage::RegionType RegionType;
+  static const unsigned int ImageDimension = TInputImage::ImageDimension;
+
+  //! Default Constructor
+  StreamingRegionGrowing() :
+    m_lower(itk::NumericTraits< InputPixelType >::NonpositiveMin()),
+    m_upper(itk::NumericTraits< InputPixelType >::max()),
+    m_replaceValue(itk::NumericTraits< OutputPixelType >::One),
+    m_slabSize(16),
+    m_globalLabels(1)
+  {
+  }
+
+  //! Default Destructor
+  ~StreamingRegionGrowing()
+  {
+  }
+
+  //! The image to segment; it is only ever read one slab at a time
+  void SetInputFileName(const std::string &fileName)
+  {
+    m_inputFileName = fileName;
+  }
+
+  //! The output; needs a format that supports streamed writing (e.g. .nii, .mha, .nrrd, but not .nii.gz)
+  void SetOutputFileName(const std::string &fileName)
+  {
+    m_outputFileName = fileName;
+  }
+
+  //! Number of slices (along the last axis) per slab
+  void SetSlabSize(unsigned int slices)
+  {
+    m_slabSize = std::max(1u, slices);
+  }
+
+  //! Lowest intensity that is included in the region
+  void SetLower(InputPixelType lower)
+  {
+    m_lower = lower;
+  }
+
+  //! Highest intensity that is included in the region
+  void SetUpper(InputPixelType upper)
+  {
+    m_upper = upper;
+  }
+
+  //! Value written into voxels of the region; everything else is 0
+  void SetReplaceValue(OutputPixelType replaceValue)
+  {
+    m_replaceValue = replaceValue;
+  }
+
+  //! Add a seed; seeds outside the image or outside [lower, upper] are ignored, same as ITK
+  void AddSeed(const IndexType &seed)
+  {
+    m_seeds.push_back(seed);
+  }
+
+  //! Do the computation here
+  void Update()
+  {
+    typedef itk::ImageFileReader< TInputImage > ReaderType;
+    typename ReaderType::Pointer reader = ReaderType::New();
+    reader->SetFileName(m_inputFileName);
+    reader->UpdateOutputInformation();
+    const RegionType largest = reader->GetOutput()->GetLargestPossibleRegion();
+    if (!reader->GetImageIO()->CanStreamRead())
+    {
+      std::cerr << "WARNING: '" << m_inputFileName << "' cannot be read in parts, every slab will read the whole image.\n";
+    }
+
+    itk::ImageIOBase::Pointer outputIO = itk::ImageIOFactory::CreateImageIO(m_outputFileName.c_str(), itk::ImageIOFactory::WriteMode);
+    if (outputIO.IsNull() || !outputIO->CanStreamWrite())
+    {
+      itkGenericExceptionMacro("Output '" << m_outputFileName << "' does not support streamed writing, use an uncompressed format such as .nii or .mha");
+    }
+    std::remove(m_outputFileName.c_str()); // the slabs are pasted into a fresh file
+
+    const unsigned int slabAxis = ImageDimension - 1;
+    const size_t slices = largest.GetSize()[slabAxis];
+
+    // first pass: labels of every slab and equivalences of the global labels between slabs
+    m_globalParent.assign(1, 0);
+    m_globalLabels = 1;
+    std::vector< uint32_t > labels, globalLabels, previousPlane, seedGlobals;
+    for (size_t start = 0; start < slices; start += m_slabSize)
+    {
+      const RegionType slab = SlabRegion(largest, start);
+      const InputPixelType *input = ReadSlab(reader, slab);
+      LabelSlab(input, slab, labels);
+      ConnectSlab(slab, labels, previousPlane, globalLabels, true);
+
+      for (size_t s = 0; s < m_seeds.size(); s++)
+      {
+        if (slab.IsInside(m_seeds[s]))
+        {
+          // seeds of components that never reach a slab boundary are found again in the second pass
+          const uint32_t label = labels[Offset(slab, m_seeds[s])];
+          if ((label != 0) && (globalLabels[label] != 0))
+          {
+            seedGlobals.push_back(globalLabels[label]);
+          }
+        }
+      }
+    }
+
+    std::vector< char > seedRoot(m_globalParent.size(), 0);
+    for (size_t s = 0; s < seedGlobals.size(); s++)
+    {
+      seedRoot[Find(m_globalParent, seedGlobals[s])] = 1;
+    }
+
+    // second pass: same labels again, keep those connected to a seed
+    typedef itk::ImageFileWriter< TOutputImage > WriterType;
+    typename WriterType::Pointer writer = WriterType::New();
+    writer->SetFileName(m_outputFileName);
+    previousPlane.clear();
+    m_globalLabels = 1;
+    std::vector< char > inside;
+    for (size_t start = 0; start < slices; start += m_slabSize)
+    {
+      const RegionType slab = SlabRegion(largest, start);
+      const InputPixelType *input = ReadSlab(reader, slab);
+      LabelSlab(input, slab, labels);
+      ConnectSlab(slab, labels, previousPlane, globalLabels, false);
+
+      inside.assign(m_parent.size(), 0);
+      for (size_t label = 1; label < inside.size(); label++)
+      {
+        inside[label] = (globalLabels[label] != 0) && seedRoot[Find(m_globalParent, globalLabels[label])];
+      }
+      for (size_t s = 0; s < m_seeds.size(); s++)
+      {
+        if (slab.IsInside(m_seeds[s]))
+        {
+          inside[labels[Offset(slab, m_seeds[s])]] = (labels[Offset(slab, m_seeds[s])] != 0);
+        }
+      }
+
+      typename TOutputImage::Pointer output = TOutputImage::New();
+      output->CopyInformation(reader->GetOutput());
+      output->SetLargestPossibleRegion(largest);
+      output->SetBufferedRegion(slab);
+      output->SetRequestedRegion(slab);
+      output->Allocate();
+      OutputPixelType *buffer = output->GetBufferPointer();
+      for (size_t i = 0; i < labels.size(); i++)
+      {
+        buffer[i] = inside[labels[i]] ? m_replaceValue : 0;
+      }
+
+      itk::ImageIORegion ioRegion(ImageDimension);
+      for (unsigned int d = 0; d < ImageDimension; d++)
+      {
+        ioRegion.SetIndex(d, slab.GetIndex()[d] - largest.GetIndex()[d]);
+        ioRegion.SetSize(d, slab.GetSize()[d]);
+      }
+      writer->SetInput(output);
+      writer->SetIORegion(ioRegion);
+      writer->Write();
+    }
+  }
+
+private:
+  //! Slab of the image starting at the given slice
+  RegionType SlabRegion(const RegionType &largest, size_t start) const
+  {
+    const unsigned int slabAxis = ImageDimension - 1;
+    RegionType slab = largest;
+    slab.SetIndex(slabAxis, largest.GetIndex()[slabAxis] + start);
+    slab.SetSize(slabAxis, std::min< size_t >(m_slabSize, largest.GetSize()[slabAxis] - start));
+    return slab;
+  }
+
+  //! Read a slab and return a pointer to its first voxel (the buffer may be larger if the IO cannot stream)
+  static const InputPixelType *ReadSlab(typename itk::ImageFileReader< TInputImage >::Pointer reader, const RegionType &slab)
+  {
+    reader->GetOutput()->SetRequestedRegion(slab);
+    reader->Update();
+    const RegionType buffered = reader->GetOutput()->GetBufferedRegion();
+    return reader->GetOutput()->GetBufferPointer() + Offset(buffered, slab.GetIndex());
+  }
+
+  //! Linear offset of an index inside a region
+  static size_t Offset(const RegionType &region, const IndexType &index)
+  {
+    size_t offset = 0, stride = 1;
+    for (unsigned int d = 0; d < ImageDimension; d++)
+    {
+      offset += (index[d] - region.GetIndex()[d]) * stride;
+      stride *= region.GetSize()[d];
+    }
+    return offset;
+  }
+
+  /**
+  \brief Raster-scan labelling of one slab with face connectivity, on its own
+
+  \param input First voxel of the slab
+  \param slab Region of the slab
+  \param labels Set to the labels of the slab, 0 for background; every component has the smallest of its
+  provisional labels, and m_parent holds one entry per provisional label of this slab
+  */
+  void LabelSlab(const InputPixelType *input, const RegionType &slab, std::vector< uint32_t > &labels)
+  {
+    size_t stride[ImageDimension], coordinate[ImageDimension];
+    size_t voxels = 1;
+    for (unsigned int d = 0; d < ImageDimension; d++)
+    {
+      stride[d] = voxels;
+      coordinate[d] = 0;
+      voxels *= slab.GetSize()[d];
+    }
+    if (voxels >= std::numeric_limits< uint32_t >::max())
+    {
+      itkGenericExceptionMacro("Slab too large for StreamingRegionGrowing: " << voxels << " voxels, use fewer slices per slab");
+    }
+    labels.resize(voxels);
+    m_parent.assign(1, 0);
+
+    for (size_t i = 0; i < voxels; i++)
+    {
+      uint32_t label = 0;
+      if ((m_lower <= input[i]) && (input[i] <= m_upper))
+      {
+        // backward face neighbours are already labelled
+        for (unsigned int d = 0; d < ImageDimension; d++)
+        {
+          const uint32_t neighbor = (coordinate[d] > 0) ? labels[i - stride[d]] : 0;
+          if (neighbor == 0)
+          {
+            continue;
+          }
+          if (label == 0)
+          {
+            label = neighbor;
+          }
+          else if (neighbor != label)
+          {
+            Union(m_parent, label, neighbor);
+            label = std::min(label, neighbor);
+          }
+        }
+        if (label == 0)
+        {
+          label = static_cast< uint32_t >(m_parent.size());
+          m_parent.push_back(label);
+        }
+      }
+      labels[i] = label;
+
+      // advance the raster coordinate
+      for (unsigned int d = 0; (d < ImageDimension) && (++coordinate[d] == slab.GetSize()[d]); d++)
+      {
+        coordinate[d] = 0;
+      }
+    }
+
+    for (size_t i = 0; i < voxels; i++)
+    {
+      labels[i] = Find(m_parent, labels[i]);
+    }
+  }
+
+  /**
+  \brief Give global labels to the components of a slab that touch the previous slab or reach the last plane
+
+  Both passes call this in the same order, so they hand out the same global labels.
+
+  \param slab Region of the slab
+  \param labels Labels of the slab, as given by LabelSlab()
+  \param previousPlane Global labels of the last plane of the previous slab (empty for the first slab); replaced by those of this slab
+  \param globalLabels Set to the global label of every label of the slab, 0 for none
+  \param merge Record the equivalences of global labels (first pass) or only reproduce the labels (second pass)
+  */
+  void ConnectSlab(const RegionType &slab, const std::vector< uint32_t > &labels, std::vector< uint32_t > &previousPlane,
+    std::vector< uint32_t > &globalLabels, bool merge)
+  {
+    const size_t planeSize = labels.size() / slab.GetSize()[ImageDimension - 1];
+    globalLabels.assign(m_parent.size(), 0);
+    if (!previousPlane.empty())
+    {
+      for (size_t i = 0; i < planeSize; i++)
+      {
+        const uint32_t label = labels[i], previous = previousPlane[i];
+        if ((label == 0) || (previous == 0))
+        {
+          continue;
+        }
+        if (globalLabels[label] == 0)
+        {
+          globalLabels[label] = previous;
+        }
+        else if (merge)
+        {
+          Union(m_globalParent, globalLabels[label], previous);
+        }
+      }
+    }
+
+    previousPlane.resize(planeSize);
+    const size_t lastPlane = labels.size() - planeSize;
+    for (size_t i = 0; i < planeSize; i++)
+    {
+      const uint32_t label = labels[lastPlane + i];
+      if ((label != 0) && (globalLabels[label] == 0))
+      {
+        if (m_globalLabels == std::numeric_limits< uint32_t >::max())
+        {
+          itkGenericExceptionMacro("StreamingRegionGrowing ran out of global labels, use more slices per slab");
+        }
+        globalLabels[label] = m_globalLabels++;
+        if (merge)
+        {
+          m_globalParent.push_back(globalLabels[label]);
+        }
+      }
+      previousPlane[i] = globalLabels[label];
+    }
+  }
+
+  //! Root of a label in a union-find table, with path halving
+  static uint32_t Find(std::vector< uint32_t > &parent, uint32_t label)
+  {
+    while (parent[label] != label)
+    {
+      parent[label] = parent[parent[label]];
+      label = parent[label];
+    }
+    return label;
+  }
+
+  //! Merge two labels of a union-find table; the smaller root wins
+  static void Union(std::vector< uint32_t > &parent, uint32_t first, uint32_t second)
+  {
+    first = Find(parent, first);
+    second = Find(parent, second);
+    if (first < second)
+    {
+      parent[second] = first;
+    }
+    else if (second < first)
+    {
+      parent[first] = second;
+    }
+  }
+
+  std::string m_inputFileName, m_outputFileName;
+  std::vector< IndexType > m_seeds;
+  std::vector< uint32_t > m_parent; //! provisional labels of the current slab
+  std::vector< uint32_t > m_globalParent; //! global labels of the components that reach a slab boundary
+  InputPixelType m_lower, m_upper;
+  OutputPixelType m_replaceValue;
+  unsigned int m_slabSize;
+  uint32_t m_globalLabels; //! next unused global label
+};
@@ -0,0 +1,150 @@
+/**
+\brief ITK Segmentation Benchmark
+
+Compares itk::ConnectedThresholdImageFilter against ParallelRegionGrowing for increasing thread counts
+and checks that both produce the same output.
+*/
+
+#include <chrono>
+#include <thread>
+
+//! ITK headers
+#include "itkImage.h"
+#include "itkImageFileReader.h"
+#include "itkConnectedThresholdImageFilter.h"
+
+#include "ParallelRegionGrowing.h"
+
+typedef itk::Image<float, 3> ImageType;
+typedef itk::Image<short, 3> OImageType;
+
+/**
+\brief Get the itk::Image
+
+\param The itk::Image which will contain the image data
+\param File name of the image
+*/
+template <class TImageType>
+void SafeReadImage(typename TImageType::Pointer image, const std::string &fName)
+{
+  typedef TImageType ImageType;
+  typedef itk::ImageFileReader< ImageType > ImageReaderType;
+  typename ImageReaderType::Pointer reader = ImageReaderType::New();
+  reader->SetFileName(fName);
+
+  try
+  {
+    reader->Update();
+  }
+  catch (itk::ExceptionObject& e)
+  {
+    std::cerr << "Exception caught: " << e.what() << "\n";
+    return;
+  }
+
+  image->Graft(reader->GetOutput());
+  return;
+}
+
+//! Number of voxels that differ between the two outputs
+size_t countDifferences(OImageType::Pointer first, OImageType::Pointer second)
+{
+  const size_t voxels = first->GetBufferedRegion().GetNumberOfPixels();
+  const OImageType::PixelType *a = first->GetBufferPointer(), *b = second->GetBufferPointer();
+  size_t differences = 0;
+  for (size_t i = 0; i < voxels; i++)
+  {
+    differences += (a[i] != b[i]);
+  }
+  return differences;
+}
+
+void echoUsage(const std::string &exeName)
+{
+  std::cout << exeName << " <inputImageFile> [maxThreads] [repetitions]\n" <<
+    "NOTE - Uses the same seed and window as ITK_Segmentation_Tutorial.\n";
+}
+
+// main entry of program
+int main(int argc, char *argv[])
+{
+  try // to catch exceptions
+  {
+    if (argc < 2)
+    {
+      std::cerr << "Usage: " << std::endl;
+      echoUsage(argv[0]);
+      return EXIT_FAILURE;
+    }
+
+    const unsigned int maxThreads = (argc > 2) ? std::atoi(argv[2]) : std::max(1u, std::thread::hardware_concurrency());
+    const unsigned int repetitions = (argc > 3) ? std::atoi(argv[3]) : 3;
+
+    ImageType::Pointer image = ImageType::New();
+    SafeReadImage<ImageType>(image, argv[1]);
+
+    ImageType::IndexType index;
+    index[0] = 90;
+    index[1] = 120;
+    index[2] = 67;
+
+    typedef std::chrono::high_resolution_clock ClockType;
+    OImageType::Pointer reference;
+    double bestITK = 0;
+    for (unsigned int r = 0; r < repetitions; r++)
+    {
+      typedef itk::ConnectedThresholdImageFilter<ImageType, OImageType> ConnectedFilterType;
+      ConnectedFilterType::Pointer filter = ConnectedFilterType::New();
+      filter->SetInput(image);
+      filter->SetReplaceValue(1000);
+      filter->SetLower(1100);
+      filter->SetUpper(2000);
+      filter->AddSeed(index);
+
+      auto t1 = ClockType::now();
+      filter->Update();
+      auto t2 = ClockType::now();
+      const double elapsed = std::chrono::duration<double, std::milli>(t2 - t1).count();
+      bestITK = (r == 0) ? elapsed : std::min(bestITK, elapsed);
+      reference = filter->GetOutput();
+    }
+    std::cout << "engine,threads,milliseconds,speedup,differences\n";
+    std::cout << "itk,1," << bestITK << ",1,0\n";
+
+    for (unsigned int threads = 1; threads <= maxThreads; threads = (threads < maxThreads) ? std::min(2 * threads, maxThreads) : threads + 1)
+    {
+      double best = 0;
+      size_t differences = 0;
+      for (unsigned int r = 0; r < repetitions; r++)
+      {
+        ParallelRegionGrowing<ImageType, OImageType> filter;
+        filter.SetInputImage(image);
+        filter.SetReplaceValue(1000);
+        filter.SetLower(1100);
+        filter.SetUpper(2000);
+        filter.AddSeed(index);
+        filter.SetNumberOfThreads(threads);
+
+        auto t1 = ClockType::now();
+        filter.Update();
+        auto t2 = ClockType::now();
+        const double elapsed = std::chrono::duration<double, std::milli>(t2 - t1).count();
+        best = (r == 0) ? elapsed : std::min(best, elapsed);
+        differences = countDifferences(reference, filter.GetOutput());
+      }
+      std::cout << "parallel," << threads << "," << best << "," << bestITK / best << "," << differences << "\n";
+      if (differences != 0)
+      {
+        std::cerr << "Output of the parallel engine differs from ITK.\n";
+        return EXIT_FAILURE;
+      }
+    }
+  }
+  catch (itk::ExceptionObject &error)
+  {
+    std::cerr << "Exception caught: " << error << "\n";
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
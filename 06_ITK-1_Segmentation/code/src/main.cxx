@@ -2,6 +2,11 @@
 \brief ITK Segmentation Tutorial
 */
 
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+
 //! ITK headers
 #include "itkImage.h"
 #include "itkImageFileReader.h"
@@ -9,6 +14,13 @@
 #include "itkCastImageFilter.h"
 #include "itkConnectedThresholdImageFilter.h"
 
+#include "ParallelRegionGrowing.h"
+#include "MultiLabelRegionGrowing.h"
+#include "StreamingRegionGrowing.h"
+#include "ComponentTreeIndex.h"
+#include "ConnectedComponentLabeling.h"
+#include "BitMaskImage.h"
+
 #include "itkCastImageFilter.h"
 #include "itkEllipseSpatialObject.h"
 #include "itkImage.h"
@@ -57,23 +69,76 @@ void SafeReadImage(typename TImageType::Pointer image, const std::string &fName)
   return;
 }
 
+/**
+\brief Options that control how the segmentation is done
+*/
+struct SegmentationOptions
+{
+  bool useITK = false; //! run itk::ConnectedThresholdImageFilter instead of the parallel engine
+  unsigned int threads = 0; //! number of threads for the parallel engine, 0 picks all cores
+  std::string seedFile; //! seed file for multi-label segmentation, empty for the single hard-coded seed
+  unsigned int slabSize = 0; //! slices per slab for out-of-core segmentation, 0 reads the whole image
+  std::string indexFile; //! component tree index to load (or build and save) for fast threshold sweeps
+  bool components = false; //! label every component within [lower, upper] instead of growing from the seed
+  bool binaryMask = false; //! write the region as a 0/1 mask instead of the replace value
+  float lower = 1100; //! lowest intensity of the region
+  float upper = 2000; //! highest intensity of the region
+};
+
+/**
+\brief Read the seeds for multi-label segmentation
+
+Every non-empty line that does not start with '#' holds "x,y,z,label,lower,upper". The order of the lines
+is the tie-break order when two regions reach a voxel at the same time.
+
+\param fileName Seed file
+\param filter The filter to which the seeds are added
+*/
+template <typename TFilterType>
+void readSeedFile(const std::string &fileName, TFilterType &filter)
+{
+  std::ifstream file(fileName.c_str());
+  if (!file.is_open())
+  {
+    itkGenericExceptionMacro("Could not open seed file '" << fileName << "'");
+  }
+
+  std::string line;
+  size_t lineNumber = 0;
+  while (std::getline(file, line))
+  {
+    lineNumber++;
+    const size_t first = line.find_first_not_of(" \t\r");
+    if ((first == std::string::npos) || (line[first] == '#'))
+    {
+      continue;
+    }
+    std::replace(line.begin(), line.end(), ',', ' ');
+    std::istringstream stream(line);
+
+    typename TFilterType::IndexType index;
+    double label, lower, upper;
+    if (!(stream >> index[0] >> index[1] >> index[2] >> label >> lower >> upper))
+    {
+      itkGenericExceptionMacro("Malformed seed on line " << lineNumber << " of '" << fileName << "', expected x,y,z,label,lower,upper");
+    }
+    filter.AddSeed(index, static_cast<typename TFilterType::OutputPixelType>(label),
+      static_cast<typename TFilterType::InputPixelType>(lower), static_cast<typename TFilterType::InputPixelType>(upper));
+  }
+}
+
 /**
 \brief Apply connected segmentation filter
 
 \param image itk::Image::Pointer to input image
 \param outputFileName File name of output
+\param options How the segmentation is to be done
 */
 template <typename TImageType>
-void segmentationFilter(typename TImageType::Pointer image, const std::string &outputFileName)
+void segmentationFilter(typename TImageType::Pointer image, const std::string &outputFileName, const SegmentationOptions &options)
 {
   typedef itk::Image<short, 3> OImageType;
-  typedef itk::ConnectedThresholdImageFilter<TImageType, OImageType> ConnectedFilterType;
-  typename ConnectedFilterType::Pointer filter = ConnectedFilterType::New();
-  filter->SetInput(image);
-
-  filter->SetReplaceValue(1000);
-  filter->SetLower(1100);
-  filter->SetUpper(2000);
+  typename OImageType::Pointer output;
 
   typename TImageType::IndexType index;
   // place a random seed point - values are in accordance with example data
@@ -81,22 +146,219 @@ void segmentationFilter(typename TImageType::Pointer image, const std::string &o
   index[1] = 120;
   index[2] = 67;
 
-  filter->AddSeed(index);
-  //filter->AddSeed(index);
-  filter->Update();
+  if (!options.seedFile.empty())
+  {
+    // every seed grows its own label within its own window, all in a single traversal
+    MultiLabelRegionGrowing<TImageType, OImageType> filter;
+    filter.SetInputImage(image);
+    readSeedFile(options.seedFile, filter);
+    filter.SetNumberOfThreads(options.threads);
+    filter.Update();
+    output = filter.GetOutput();
+  }
+  else if (options.useITK)
+  {
+    typedef itk::ConnectedThresholdImageFilter<TImageType, OImageType> ConnectedFilterType;
+    typename ConnectedFilterType::Pointer filter = ConnectedFilterType::New();
+    filter->SetInput(image);
+
+    filter->SetReplaceValue(1000);
+    filter->SetLower(options.lower);
+    filter->SetUpper(options.upper);
+
+    filter->AddSeed(index);
+    //filter->AddSeed(index);
+    filter->Update();
+    output = filter->GetOutput();
+  }
+  else
+  {
+    // same parameters as above, the region is grown on all cores
+    ParallelRegionGrowing<TImageType, OImageType> filter;
+    filter.SetInputImage(image);
+
+    filter.SetReplaceValue(1000);
+    filter.SetLower(options.lower);
+    filter.SetUpper(options.upper);
+
+    filter.AddSeed(index);
+    filter.SetNumberOfThreads(options.threads);
+    filter.Update();
+    output = filter.GetOutput();
+  }
+
+  if (options.binaryMask)
+  {
+    // 1 bit per voxel in memory, 0/1 unsigned char on disk
+    BitMaskImage<3> mask;
+    mask.Pack(output.GetPointer());
+    output = NULL;
+    std::cout << "Region has " << mask.GetNumberOfSetPixels() << " voxels, volume " << mask.GetVolume() << "\n";
+    mask.Write(outputFileName);
+    return;
+  }
+
+  typedef itk::ImageFileWriter<OImageType> WriterType;
+  typename WriterType::Pointer writer = WriterType::New();
+  writer->SetFileName(outputFileName);
+
+  writer->SetInput(output);
+  writer->Update();
+}
+
+/**
+\brief Apply connected segmentation without ever holding the whole image in memory
+
+\param inputFileName File name of input, read one slab at a time
+\param outputFileName File name of output, written one slab at a time
+\param options How the segmentation is to be done
+*/
+template <typename TImageType>
+void streamingSegmentationFilter(const std::string &inputFileName, const std::string &outputFileName, const SegmentationOptions &options)
+{
+  typedef itk::Image<short, TImageType::ImageDimension> OImageType;
+  StreamingRegionGrowing<TImageType, OImageType> filter;
+  filter.SetInputFileName(inputFileName);
+  filter.SetOutputFileName(outputFileName);
+  filter.SetSlabSize(options.slabSize);
+
+  // same parameters as segmentationFilter
+  filter.SetReplaceValue(1000);
+  filter.SetLower(options.lower);
+  filter.SetUpper(options.upper);
+
+  typename TImageType::IndexType index;
+  index.Fill(0); // first volume of a time series
+  index[0] = 90;
+  index[1] = 120;
+  index[2] = 67;
+
+  filter.AddSeed(index);
+  filter.Update();
+}
+
+/**
+\brief Apply connected segmentation through a component tree index of the image
+
+The index is loaded if the index file exists and was built from the input image (same geometry, file size
+and modification time), otherwise it is built from the input image and saved, so that later runs with a
+different window do not need to read the image or traverse the volume again.
+
+\param inputFileName File name of input; only its header is read unless the index needs to be built
+\param outputFileName File name of output
+\param options How the segmentation is to be done
+*/
+template <typename TImageType>
+void indexedSegmentationFilter(const std::string &inputFileName, const std::string &outputFileName, const SegmentationOptions &options)
+{
+  typedef itk::Image<short, 3> OImageType;
+  ComponentTreeIndex<TImageType> index;
+
+  auto t1 = std::chrono::high_resolution_clock::now();
+  bool loaded = false;
+  if (std::ifstream(options.indexFile.c_str()).good())
+  {
+    try
+    {
+      index.Load(options.indexFile);
+      loaded = index.IsBuiltFrom(inputFileName);
+    }
+    catch (itk::ExceptionObject &e)
+    {
+      std::cerr << "Exception caught: " << e.what() << "\n";
+    }
+    if (!loaded)
+    {
+      std::cout << "Index '" << options.indexFile << "' does not belong to '" << inputFileName << "', rebuilding it.\n";
+    }
+  }
+  if (!loaded)
+  {
+    typename TImageType::Pointer image = TImageType::New();
+    SafeReadImage<TImageType>(image, inputFileName);
+    index.Build(image);
+    index.SetSourceFile(inputFileName);
+    index.Save(options.indexFile);
+  }
+  auto t2 = std::chrono::high_resolution_clock::now();
+
+  typename TImageType::IndexType seed;
+  // place a random seed point - values are in accordance with example data
+  seed[0] = 90;
+  seed[1] = 120;
+  seed[2] = 67;
+
+  std::vector<uint32_t> region;
+  index.Query(seed, options.lower, options.upper, region);
+  auto t3 = std::chrono::high_resolution_clock::now();
+  std::cout << "Index ready in " << std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1).count() << " ms, query of [" <<
+    options.lower << ", " << options.upper << "] found " << region.size() << " voxels in " <<
+    std::chrono::duration_cast<std::chrono::microseconds>(t3 - t2).count() << " us\n";
 
   typedef itk::ImageFileWriter<OImageType> WriterType;
-  WriterType::Pointer writer = WriterType::New();
+  typename WriterType::Pointer writer = WriterType::New();
   writer->SetFileName(outputFileName);
+  writer->SetInput(index.template GetRegionImage<OImageType>(region, 1000));
+  writer->Update();
+}
+
+/**
+\brief Label every connected component of the thresholded image and write their statistics
+
+The statistics (voxel count, volume, bounding box and mean intensity per component) are written as a CSV
+file next to the label image, with the same base name.
+
+\param image itk::Image::Pointer to input image
+\param outputFileName File name of the label image
+\param options How the segmentation is to be done
+*/
+template <typename TImageType>
+void componentLabelingFilter(typename TImageType::Pointer image, const std::string &outputFileName, const SegmentationOptions &options)
+{
+  typedef itk::Image<unsigned int, 3> LabelImageType;
+  ConnectedComponentLabeling<TImageType, LabelImageType> filter;
+  filter.SetInputImage(image);
+  filter.SetLower(options.lower);
+  filter.SetUpper(options.upper);
+  filter.SetNumberOfThreads(options.threads);
+  filter.Update();
 
-  writer->SetInput(filter->GetOutput());
+  typedef itk::ImageFileWriter<LabelImageType> WriterType;
+  typename WriterType::Pointer writer = WriterType::New();
+  writer->SetFileName(outputFileName);
+  writer->SetInput(filter.GetOutput());
   writer->Update();
+
+  std::string statisticsFileName = outputFileName;
+  const std::string extensions[] = { ".nii.gz", ".nii", ".mha", ".nrrd" };
+  for (size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++)
+  {
+    if ((statisticsFileName.size() > extensions[i].size()) &&
+      (statisticsFileName.compare(statisticsFileName.size() - extensions[i].size(), extensions[i].size(), extensions[i]) == 0))
+    {
+      statisticsFileName.erase(statisticsFileName.size() - extensions[i].size());
+      break;
+    }
+  }
+  statisticsFileName += ".csv";
+  filter.WriteStatistics(statisticsFileName);
+  std::cout << "Found " << filter.GetComponents().size() << " components, statistics written to " << statisticsFileName << "\n";
 }
 
 void echoUsage(const std::string &exeName)
 {
-  std::cout << exeName << " <inputImageFile> <outputFileName>\n" <<
-    "NOTE - Only 3D images are supported in this example.\n";
+  std::cout << exeName << " <inputImageFile> <outputFileName> [options]\n" <<
+    "Options:\n" <<
+    "  -itk          Use itk::ConnectedThresholdImageFilter instead of the parallel region growing engine\n" <<
+    "  -threads <n>  Number of threads for the parallel engine (default: all cores)\n" <<
+    "  -seeds <file> Multi-label mode; every line of the file is 'x,y,z,label,lower,upper'\n" <<
+    "  -slab <n>     Out-of-core mode; read and write the image <n> slices at a time (3D or 4D, output must be .nii/.mha/.nrrd)\n" <<
+    "  -index <file> Use a component tree index, built and saved to <file> on the first run and loaded afterwards\n" <<
+    "  -components   Label every component within [lower, upper] and write their statistics as CSV next to the output\n" <<
+    "  -mask         Write the region as a 0/1 unsigned char mask and print its volume\n" <<
+    "  -lower <v>    Lowest intensity of the region (default: 1100)\n" <<
+    "  -upper <v>    Highest intensity of the region (default: 2000)\n" <<
+    "NOTE - Only 3D images are supported in this example (3D and 4D with -slab; 4D slabs are whole volumes).\n";
 }
 
 // main entry of program
@@ -105,7 +367,7 @@ int main(int argc, char *argv[])
   try // to catch exceptions
   {
     // basic check to see image file has been put in by the user
-    if( (argc < 2) || (argc > 2) )
+    if( argc < 3 )
     {
       std::cerr << "Usage: " << std::endl;
       echoUsage(argv[0]);
@@ -114,12 +376,81 @@ int main(int argc, char *argv[])
 
     std::string inputFName1 = "", outputFName = "";
 
-    inputFName1 = argv[2];
-    outputFName = argv[3];
+    inputFName1 = argv[1];
+    outputFName = argv[2];
+
+    SegmentationOptions options;
+    for (int i = 3; i < argc; i++)
+    {
+      const std::string option = argv[i];
+      if (option == "-itk")
+      {
+        options.useITK = true;
+      }
+      else if ((option == "-threads") && (i + 1 < argc))
+      {
+        options.threads = std::atoi(argv[++i]);
+      }
+      else if ((option == "-seeds") && (i + 1 < argc))
+      {
+        options.seedFile = argv[++i];
+      }
+      else if ((option == "-slab") && (i + 1 < argc))
+      {
+        options.slabSize = std::atoi(argv[++i]);
+      }
+      else if ((option == "-index") && (i + 1 < argc))
+      {
+        options.indexFile = argv[++i];
+      }
+      else if (option == "-components")
+      {
+        options.components = true;
+      }
+      else if (option == "-mask")
+      {
+        options.binaryMask = true;
+      }
+      else if ((option == "-lower") && (i + 1 < argc))
+      {
+        options.lower = std::atof(argv[++i]);
+      }
+      else if ((option == "-upper") && (i + 1 < argc))
+      {
+        options.upper = std::atof(argv[++i]);
+      }
+      else
+      {
+        std::cerr << "Unknown option '" << option << "'.\n";
+        echoUsage(argv[0]);
+        return EXIT_FAILURE;
+      }
+    }
 
     itk::ImageIOBase::Pointer im_base = itk::ImageIOFactory::CreateImageIO(inputFName1.c_str(), itk::ImageIOFactory::ReadMode);
     im_base->SetFileName(inputFName1);
     im_base->ReadImageInformation();
+
+    typedef float PixelType; // default pixel type is float, all voxel data is static-casted
+    if (options.slabSize > 0)
+    {
+      std::cout << "Doing out-of-core connectivity segmentation...\n";
+      if (im_base->GetNumberOfDimensions() == 3)
+      {
+        streamingSegmentationFilter<itk::Image<PixelType, 3> >(inputFName1, outputFName, options);
+      }
+      else if (im_base->GetNumberOfDimensions() == 4)
+      {
+        streamingSegmentationFilter<itk::Image<PixelType, 4> >(inputFName1, outputFName, options);
+      }
+      else
+      {
+        std::cerr << "Unsupported Image Dimension. Only 3D and 4D images are supported in out-of-core mode.\n";
+        return EXIT_FAILURE;
+      }
+      std::cout << "Finished successfully.\n";
+      return EXIT_SUCCESS;
+    }
     
     // perform basic sanity check
     if (im_base->GetNumberOfDimensions() != 3)
@@ -128,13 +459,28 @@ int main(int argc, char *argv[])
       return EXIT_FAILURE;
     }
 
-    typedef float PixelType; // default pixel type is float, all voxel data is static-casted
     typedef itk::Image<PixelType, 3> ImageType; // define image type
+    if (!options.indexFile.empty())
+    {
+      std::cout << "Doing indexed connectivity segmentation...\n";
+      indexedSegmentationFilter<ImageType>(inputFName1, outputFName, options);
+      std::cout << "Finished successfully.\n";
+      return EXIT_SUCCESS;
+    }
+
     ImageType::Pointer image_1 = ImageType::New(); // initialize new image
     SafeReadImage<ImageType>(image_1, im_base->GetFileName()); // read image along with exceptions
     
-    std::cout << "Doing connectivity segmentation...\n";
-    segmentationFilter<ImageType>(image_1, outputFName);
+    if (options.components)
+    {
+      std::cout << "Doing connected component labeling...\n";
+      componentLabelingFilter<ImageType>(image_1, outputFName, options);
+    }
+    else
+    {
+      std::cout << "Doing connectivity segmentation...\n";
+      segmentationFilter<ImageType>(image_1, outputFName, options);
+    }
     
   }
   catch (itk::ExceptionObject &error)
@@ -0,0 +1,491 @@
+/**
+\file ImageExpression.h
+
+\brief Voxelwise arithmetic on itk::Image that is evaluated in a single pass
+
+Writing `(a * b + c) * mask` with the operators below does not compute anything; it builds a small
+expression object that remembers the images and the operations. EvaluateImageExpression() then allocates
+the output once and computes every voxel in one loop, split over several threads, instead of allocating and
+traversing a full intermediate image per operation as a chain of ITK filters does. The loop body is plain
+inlined arithmetic on buffer pointers, so the compiler is free to vectorize it.
+
+Every operation is done in the type the C++ arithmetic rules give for its two operands, e.g. float * unsigned
+char is float and unsigned char * unsigned char is int, so images of different pixel types can be mixed
+without casting any of them first. Only the final value is cast to the output pixel type.
+
+PromotePixelType gives a pixel type that holds the product of two pixel types, and CastImageExpression()
+moves a part of the expression to that type before the arithmetic, e.g. to multiply two unsigned int images
+in 64 bits.
+
+All images of an expression need to have the same buffered region; the output takes the geometry of the
+first image in the expression.
+
+An expression can be followed by steps (ImageExpressionSteps) that update its result in place, chunk by chunk
+while the chunk is still in the cache. The type of the images a step reads is hidden inside the step, so an
+image whose pixel type is only known at run time adds one instantiation per pixel type instead of multiplying
+the instantiations of the whole expression.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "itkImage.h"
+
+//! Common base of all expressions, used to tell the operators below which arguments are expressions
+template< class TDerived >
+class ImageExpressionBase
+{
+public:
+  const TDerived &Derived() const
+  {
+    return static_cast< const TDerived & >(*this);
+  }
+};
+
+//! An image used in an expression
+template< class TImageType >
+class ImageTerminal : public ImageExpressionBase< ImageTerminal< TImageType > >
+{
+public:
+  typedef typename TImageType::PixelType ValueType;
+
+  explicit ImageTerminal(const TImageType *image) : m_image(image), m_buffer(image->GetBufferPointer())
+  {
+  }
+
+  ValueType Evaluate(size_t offset) const
+  {
+    return m_buffer[offset];
+  }
+
+  //! Append the images of this expression, left to right
+  template< unsigned int VDimension >
+  void CollectImages(std::vector< const itk::ImageBase< VDimension > * > &images) const
+  {
+    images.push_back(m_image);
+  }
+
+private:
+  const TImageType *m_image;
+  const ValueType *m_buffer;
+};
+
+//! A constant used in an expression
+template< class TValueType >
+class ScalarTerminal : public ImageExpressionBase< ScalarTerminal< TValueType > >
+{
+public:
+  typedef TValueType ValueType;
+
+  explicit ScalarTerminal(TValueType value) : m_value(value)
+  {
+  }
+
+  ValueType Evaluate(size_t) const
+  {
+    return m_value;
+  }
+
+  template< unsigned int VDimension >
+  void CollectImages(std::vector< const itk::ImageBase< VDimension > * > &) const
+  {
+  }
+
+private:
+  TValueType m_value;
+};
+
+//! The values of a plain buffer, e.g. the output of the expression a step of ImageExpressionSteps updates
+template< class TValueType >
+class BufferTerminal : public ImageExpressionBase< BufferTerminal< TValueType > >
+{
+public:
+  typedef TValueType ValueType;
+
+  explicit BufferTerminal(const TValueType *buffer) : m_buffer(buffer)
+  {
+  }
+
+  ValueType Evaluate(size_t offset) const
+  {
+    return m_buffer[offset];
+  }
+
+  template< unsigned int VDimension >
+  void CollectImages(std::vector< const itk::ImageBase< VDimension > * > &) const
+  {
+  }
+
+private:
+  const TValueType *m_buffer;
+};
+
+//! An expression whose value is converted to another type before it is used
+template< class TValueType, class TExpression >
+class CastExpression : public ImageExpressionBase< CastExpression< TValueType, TExpression > >
+{
+public:
+  typedef TValueType ValueType;
+
+  explicit CastExpression(const TExpression &expression) : m_expression(expression)
+  {
+  }
+
+  ValueType Evaluate(size_t offset) const
+  {
+    return static_cast< ValueType >(m_expression.Evaluate(offset));
+  }
+
+  template< unsigned int VDimension >
+  void CollectImages(std::vector< const itk::ImageBase< VDimension > * > &images) const
+  {
+    m_expression.CollectImages(images);
+  }
+
+private:
+  TExpression m_expression;
+};
+
+//! Signed or unsigned integer pixel type with the given number of bytes
+template< unsigned int VBytes, bool VSigned > struct IntegerPixelType;
+template<> struct IntegerPixelType< 2, false > { typedef unsigned short Type; };
+template<> struct IntegerPixelType< 2, true > { typedef short Type; };
+template<> struct IntegerPixelType< 4, false > { typedef unsigned int Type; };
+template<> struct IntegerPixelType< 4, true > { typedef int Type; };
+template<> struct IntegerPixelType< 8, false > { typedef unsigned long long Type; };
+template<> struct IntegerPixelType< 8, true > { typedef long long Type; };
+
+/**
+\brief Pixel type of the product of two pixel types
+
+- Two integer types give an integer type twice as wide as the wider one (at most 64 bits), signed if either is
+signed, so that the product cannot overflow (except for 64-bit inputs).
+- Otherwise the result is float, unless one type is double or an integer of 32 bits or more, which float cannot
+hold exactly; then it is double.
+
+E.g. float and unsigned char give float, unsigned char and unsigned char give unsigned short, short and
+unsigned short give int.
+*/
+template< class TPixelA, class TPixelB >
+struct PromotePixelType
+{
+  static const bool IsInteger = std::is_integral< TPixelA >::value && std::is_integral< TPixelB >::value;
+  static const size_t Bytes = (sizeof(TPixelA) > sizeof(TPixelB)) ? sizeof(TPixelA) : sizeof(TPixelB);
+  static const bool IsSigned = std::is_signed< TPixelA >::value || std::is_signed< TPixelB >::value;
+
+  typedef typename std::conditional< IsInteger,
+    typename IntegerPixelType< (2 * Bytes < 8) ? 2 * Bytes : 8, IsSigned >::Type,
+    typename std::conditional< (Bytes >= 8) || (std::is_integral< TPixelA >::value && (sizeof(TPixelA) >= 4)) ||
+      (std::is_integral< TPixelB >::value && (sizeof(TPixelB) >= 4)), double, float >::type >::type Type;
+};
+
+struct AddOperation
+{
+  template< class TLeft, class TRight >
+  static auto Apply(TLeft left, TRight right) -> decltype(left + right)
+  {
+    return left + right;
+  }
+};
+
+struct SubtractOperation
+{
+  template< class TLeft, class TRight >
+  static auto Apply(TLeft left, TRight right) -> decltype(left - right)
+  {
+    return left - right;
+  }
+};
+
+struct MultiplyOperation
+{
+  template< class TLeft, class TRight >
+  static auto Apply(TLeft left, TRight right) -> decltype(left * right)
+  {
+    return left * right;
+  }
+};
+
+struct DivideOperation
+{
+  template< class TLeft, class TRight >
+  static auto Apply(TLeft left, TRight right) -> decltype(left / right)
+  {
+    return left / right;
+  }
+};
+
+//! An operation on two expressions; its value type is the type C++ gives to the operation on the two value types
+template< class TLeft, class TRight, class TOperation >
+class BinaryImageExpression : public ImageExpressionBase< BinaryImageExpression< TLeft, TRight, TOperation > >
+{
+public:
+  typedef decltype(TOperation::Apply(std::declval< typename TLeft::ValueType >(), std::declval< typename TRight::ValueType >())) ValueType;
+
+  BinaryImageExpression(const TLeft &left, const TRight &right) : m_left(left), m_right(right)
+  {
+  }
+
+  ValueType Evaluate(size_t offset) const
+  {
+    return TOperation::Apply(m_left.Evaluate(offset), m_right.Evaluate(offset));
+  }
+
+  template< unsigned int VDimension >
+  void CollectImages(std::vector< const itk::ImageBase< VDimension > * > &images) const
+  {
+    m_left.CollectImages(images);
+    m_right.CollectImages(images);
+  }
+
+private:
+  // held by value, the nodes are small and the expression may outlive the temporaries it was built from
+  TLeft m_left;
+  TRight m_right;
+};
+
+//! Start an expression from an image
+template< class TImageType >
+ImageTerminal< TImageType > MakeImageExpression(const TImageType *image)
+{
+  return ImageTerminal< TImageType >(image);
+}
+
+//! Start an expression from an image
+template< class TImageType >
+ImageTerminal< TImageType > MakeImageExpression(const itk::SmartPointer< TImageType > &image)
+{
+  return ImageTerminal< TImageType >(image.GetPointer());
+}
+
+//! Use the values of a buffer in an expression
+template< class TValueType >
+BufferTerminal< TValueType > MakeBufferExpression(const TValueType *buffer)
+{
+  return BufferTerminal< TValueType >(buffer);
+}
+
+//! Convert the value of an expression to TValueType before it is used further
+template< class TValueType, class TExpression >
+CastExpression< TValueType, TExpression > CastImageExpression(const ImageExpressionBase< TExpression > &expression)
+{
+  return CastExpression< TValueType, TExpression >(expression.Derived());
+}
+
+// expression (op) expression, expression (op) scalar and scalar (op) expression
+#define IMAGE_EXPRESSION_OPERATOR(op, TOperation) \
+  template< class TLeft, class TRight > \
+  BinaryImageExpression< TLeft, TRight, TOperation > operator op(const ImageExpressionBase< TLeft > &left, const ImageExpressionBase< TRight > &right) \
+  { \
+    return BinaryImageExpression< TLeft, TRight, TOperation >(left.Derived(), right.Derived()); \
+  } \
+  template< class TLeft, class TValueType > \
+  typename std::enable_if< std::is_arithmetic< TValueType >::value, BinaryImageExpression< TLeft, ScalarTerminal< TValueType >, TOperation > >::type \
+  operator op(const ImageExpressionBase< TLeft > &left, TValueType right) \
+  { \
+    return BinaryImageExpression< TLeft, ScalarTerminal< TValueType >, TOperation >(left.Derived(), ScalarTerminal< TValueType >(right)); \
+  } \
+  template< class TValueType, class TRight > \
+  typename std::enable_if< std::is_arithmetic< TValueType >::value, BinaryImageExpression< ScalarTerminal< TValueType >, TRight, TOperation > >::type \
+  operator op(TValueType left, const ImageExpressionBase< TRight > &right) \
+  { \
+    return BinaryImageExpression< ScalarTerminal< TValueType >, TRight, TOperation >(ScalarTerminal< TValueType >(left), right.Derived()); \
+  }
+
+IMAGE_EXPRESSION_OPERATOR(+, AddOperation)
+IMAGE_EXPRESSION_OPERATOR(-, SubtractOperation)
+IMAGE_EXPRESSION_OPERATOR(*, MultiplyOperation)
+IMAGE_EXPRESSION_OPERATOR(/, DivideOperation)
+
+#undef IMAGE_EXPRESSION_OPERATOR
+
+//! Compute a range of voxels; kept apart so that the loop only sees local pointers
+template< class TOutputPixelType, class TExpression >
+void EvaluateImageExpressionRange(const TExpression &expression, TOutputPixelType *output, size_t begin, size_t end)
+{
+  for (size_t i = begin; i < end; i++)
+  {
+    output[i] = static_cast< TOutputPixelType >(expression.Evaluate(i));
+  }
+}
+
+/**
+\brief Steps that update the result of an expression in place, see SteppedImageExpression
+
+A step is a function (output, begin, end) that recomputes output[begin, end), usually by evaluating an expression
+that reads the output back through MakeBufferExpression(output), e.g.
+
+  steps.AddStep([mask](float *output, size_t begin, size_t end)
+  {
+    EvaluateImageExpressionRange(MakeBufferExpression(output) * MakeImageExpression(mask), output, begin, end);
+  }, mask);
+
+so every step casts its result to the output pixel type, as a chain of ITK filters does.
+*/
+template< class TOutputImageType >
+class ImageExpressionSteps
+{
+public:
+  typedef typename TOutputImageType::PixelType OutputPixelType;
+  typedef itk::ImageBase< TOutputImageType::ImageDimension > ImageBaseType;
+  typedef std::function< void(OutputPixelType *, size_t, size_t) > StepType;
+
+  //! Append a step; image is the image it reads, checked to have the region of the output (NULL for none)
+  void AddStep(const StepType &step, const ImageBaseType *image)
+  {
+    m_steps.push_back(step);
+    if (image != nullptr)
+    {
+      m_images.push_back(image);
+    }
+  }
+
+  bool IsEmpty() const
+  {
+    return m_steps.empty();
+  }
+
+  //! Run every step on output[begin, end)
+  void Evaluate(OutputPixelType *output, size_t begin, size_t end) const
+  {
+    for (size_t s = 0; s < m_steps.size(); s++)
+    {
+      m_steps[s](output, begin, end);
+    }
+  }
+
+  template< unsigned int VDimension >
+  void CollectImages(std::vector< const itk::ImageBase< VDimension > * > &images) const
+  {
+    images.insert(images.end(), m_images.begin(), m_images.end());
+  }
+
+private:
+  std::vector< StepType > m_steps;
+  std::vector< const ImageBaseType * > m_images;
+};
+
+/**
+\brief An expression followed by steps that update its result in place
+
+The voxels are computed in chunks of ChunkVoxels: first the expression, then every step on the same chunk, so
+the output is written to memory once, as for a single expression. Evaluate it with EvaluateImageExpression() or
+EvaluateMaskedImageExpression() like any other expression.
+*/
+template< class TOutputImageType, class TExpression >
+class SteppedImageExpression : public ImageExpressionBase< SteppedImageExpression< TOutputImageType, TExpression > >
+{
+public:
+  typedef typename TOutputImageType::PixelType ValueType;
+  static const size_t ChunkVoxels = 4096;
+
+  SteppedImageExpression(const TExpression &expression, const ImageExpressionSteps< TOutputImageType > &steps) :
+    m_expression(expression), m_steps(steps)
+  {
+  }
+
+  //! Compute output[begin, end), chunk by chunk
+  void EvaluateRange(ValueType *output, size_t begin, size_t end) const
+  {
+    for (size_t chunk = begin; chunk < end; chunk += ChunkVoxels)
+    {
+      const size_t chunkEnd = std::min< size_t >(end, chunk + ChunkVoxels);
+      EvaluateImageExpressionRange(m_expression, output, chunk, chunkEnd);
+      m_steps.Evaluate(output, chunk, chunkEnd);
+    }
+  }
+
+  template< unsigned int VDimension >
+  void CollectImages(std::vector< const itk::ImageBase< VDimension > * > &images) const
+  {
+    m_expression.CollectImages(images);
+    m_steps.CollectImages(images);
+  }
+
+private:
+  TExpression m_expression;
+  ImageExpressionSteps< TOutputImageType > m_steps;
+};
+
+//! Follow an expression with steps that update its result in place
+template< class TOutputImageType, class TExpression >
+SteppedImageExpression< TOutputImageType, TExpression > MakeSteppedImageExpression(const ImageExpressionBase< TExpression > &expression,
+  const ImageExpressionSteps< TOutputImageType > &steps)
+{
+  return SteppedImageExpression< TOutputImageType, TExpression >(expression.Derived(), steps);
+}
+
+//! Compute a range of voxels of an expression with steps
+template< class TOutputPixelType, class TOutputImageType, class TExpression >
+void EvaluateImageExpressionRange(const SteppedImageExpression< TOutputImageType, TExpression > &expression, TOutputPixelType *output,
+  size_t begin, size_t end)
+{
+  expression.EvaluateRange(output, begin, end);
+}
+
+/**
+\brief Compute an expression into a newly allocated image
+
+\param expression The expression, e.g. (MakeImageExpression(a) * MakeImageExpression(b) + 1) * MakeImageExpression(mask)
+\param threads Number of threads to use; 0 picks the hardware concurrency
+\return Image with the geometry of the first image in the expression
+*/
+template< class TOutputImageType, class TExpression >
+typename TOutputImageType::Pointer EvaluateImageExpression(const ImageExpressionBase< TExpression > &expression, unsigned int threads = 0)
+{
+  typedef typename TOutputImageType::PixelType OutputPixelType;
+  const TExpression &root = expression.Derived();
+
+  std::vector< const itk::ImageBase< TOutputImageType::ImageDimension > * > images;
+  root.CollectImages(images);
+  if (images.empty())
+  {
+    itkGenericExceptionMacro("Image expression does not contain any image");
+  }
+  const typename TOutputImageType::RegionType region = images[0]->GetBufferedRegion();
+  for (size_t i = 1; i < images.size(); i++)
+  {
+    if (images[i]->GetBufferedRegion() != region)
+    {
+      itkGenericExceptionMacro("Image " << i + 1 << " of the expression has a different region than image 1");
+    }
+  }
+
+  typename TOutputImageType::Pointer output = TOutputImageType::New();
+  output->CopyInformation(images[0]);
+  output->SetRegions(region);
+  output->Allocate();
+  OutputPixelType *buffer = output->GetBufferPointer();
+
+  // small images are not worth starting threads for
+  const size_t voxels = region.GetNumberOfPixels();
+  const size_t minimumVoxelsPerThread = 1 << 16;
+  if (threads == 0)
+  {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  threads = static_cast< unsigned int >(std::max< size_t >(1, std::min< size_t >(threads, voxels / minimumVoxelsPerThread)));
+
+  // a lambda rather than a function pointer, so that the overload for stepped expressions is found
+  std::vector< std::thread > workers;
+  for (unsigned int t = 1; t < threads; t++)
+  {
+    workers.push_back(std::thread([&root, buffer, voxels, t, threads]()
+    {
+      EvaluateImageExpressionRange(root, buffer, voxels * t / threads, voxels * (t + 1) / threads);
+    }));
+  }
+  EvaluateImageExpressionRange(root, buffer, 0, voxels / threads);
+  for (size_t t = 0; t < workers.size(); t++)
+  {
+    workers[t].join();
+  }
+
+  return output;
+}
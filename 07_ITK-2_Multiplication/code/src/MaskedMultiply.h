@@ -0,0 +1,220 @@
+/**
+\file MaskedMultiply.h
+
+\brief Evaluate an image expression only inside a mask
+
+A brain or lesion mask is mostly zero, so multiplying with it wastes most of the work on voxels whose result is
+known to be 0. MaskSpans compresses the mask into runs of consecutive non-zero voxels along every row (the
+first axis); EvaluateMaskedImageExpression() then computes the expression only inside those runs and fills the
+gaps between them with memset.
+
+The result is the same as evaluating `expression * mask` everywhere, as long as the expression is finite
+outside the mask. Keep the mask in the expression to use its values, or leave it out for a 0/1 mask.
+*/
+
+#pragma once
+
+#include <cstring>
+
+#include "ImageExpression.h"
+
+template< unsigned int VDimension = 3 >
+class MaskSpans
+{
+public:
+  typedef itk::ImageRegion< VDimension > RegionType;
+
+  //! Consecutive non-zero voxels of one row, as linear offsets [begin, end)
+  struct Span
+  {
+    size_t begin, end;
+  };
+
+  //! Default Constructor
+  MaskSpans() : m_rowLength(0), m_voxels(0)
+  {
+  }
+
+  //! Default Destructor
+  ~MaskSpans()
+  {
+  }
+
+  //! Find the runs of non-zero voxels of every row of the buffered region of the mask
+  template< class TMaskImageType >
+  void Build(const TMaskImageType *mask)
+  {
+    typedef typename TMaskImageType::PixelType MaskPixelType;
+    m_region = mask->GetBufferedRegion();
+    m_rowLength = m_region.GetSize()[0];
+    m_voxels = m_region.GetNumberOfPixels();
+    const size_t rows = (m_rowLength == 0) ? 0 : m_voxels / m_rowLength;
+
+    const MaskPixelType *buffer = mask->GetBufferPointer();
+    m_spans.clear();
+    m_rowSpans.assign(1, 0);
+    m_rowInside.assign(1, 0);
+    m_rowSpans.reserve(rows + 1);
+    m_rowInside.reserve(rows + 1);
+    for (size_t row = 0; row < rows; row++)
+    {
+      const size_t rowBegin = row * m_rowLength, rowEnd = rowBegin + m_rowLength;
+      size_t inside = 0;
+      for (size_t i = rowBegin; i < rowEnd; )
+      {
+        if (buffer[i] == 0)
+        {
+          i++;
+          continue;
+        }
+        Span span;
+        span.begin = i;
+        while ((i < rowEnd) && (buffer[i] != 0))
+        {
+          i++;
+        }
+        span.end = i;
+        inside += span.end - span.begin;
+        m_spans.push_back(span);
+      }
+      m_rowSpans.push_back(m_spans.size());
+      m_rowInside.push_back(m_rowInside.back() + inside);
+    }
+  }
+
+  //! Region of the mask the spans were built from
+  const RegionType &GetRegion() const
+  {
+    return m_region;
+  }
+
+  //! Number of non-zero voxels of the mask
+  size_t GetNumberOfInsideVoxels() const
+  {
+    return m_rowInside.back();
+  }
+
+  //! Fraction of the voxels that are inside the mask
+  double GetDensity() const
+  {
+    return (m_voxels == 0) ? 0.0 : double(GetNumberOfInsideVoxels()) / m_voxels;
+  }
+
+  size_t GetNumberOfRows() const
+  {
+    return m_rowSpans.size() - 1;
+  }
+
+  size_t GetRowLength() const
+  {
+    return m_rowLength;
+  }
+
+  //! Spans from the given row on, in raster order
+  const Span *GetSpans(size_t firstRow) const
+  {
+    return m_spans.data() + m_rowSpans[firstRow];
+  }
+
+  //! Number of spans of rows [firstRow, lastRow)
+  size_t GetNumberOfSpans(size_t firstRow, size_t lastRow) const
+  {
+    return m_rowSpans[lastRow] - m_rowSpans[firstRow];
+  }
+
+  //! First row that has at least the given number of inside voxels before it
+  size_t FindRow(size_t insideVoxels) const
+  {
+    return std::lower_bound(m_rowInside.begin(), m_rowInside.end(), insideVoxels) - m_rowInside.begin();
+  }
+
+private:
+  RegionType m_region;
+  size_t m_rowLength, m_voxels;
+  std::vector< Span > m_spans;
+  std::vector< size_t > m_rowSpans; //! index of the first span of every row, plus the total at the end
+  std::vector< size_t > m_rowInside; //! number of inside voxels before every row, plus the total at the end
+};
+
+//! Compute the spans of rows [firstRow, lastRow) and zero the voxels between them
+template< class TOutputPixelType, class TExpression, unsigned int VDimension >
+void EvaluateMaskedImageExpressionRows(const TExpression &expression, const MaskSpans< VDimension > *spans, TOutputPixelType *output,
+  size_t firstRow, size_t lastRow)
+{
+  const typename MaskSpans< VDimension >::Span *span = spans->GetSpans(firstRow);
+  const size_t count = spans->GetNumberOfSpans(firstRow, lastRow);
+  size_t cursor = firstRow * spans->GetRowLength();
+  for (size_t s = 0; s < count; s++)
+  {
+    std::memset(output + cursor, 0, (span[s].begin - cursor) * sizeof(TOutputPixelType));
+    EvaluateImageExpressionRange(expression, output, span[s].begin, span[s].end);
+    cursor = span[s].end;
+  }
+  std::memset(output + cursor, 0, (lastRow * spans->GetRowLength() - cursor) * sizeof(TOutputPixelType));
+}
+
+/**
+\brief Compute an expression inside the spans of a mask into a newly allocated image; everything else is 0
+
+\param expression The expression, see ImageExpression.h
+\param spans Spans of a mask with the same region as the images of the expression
+\param threads Number of threads to use; 0 picks the hardware concurrency
+\return Image with the geometry of the first image in the expression
+*/
+template< class TOutputImageType, class TExpression >
+typename TOutputImageType::Pointer EvaluateMaskedImageExpression(const ImageExpressionBase< TExpression > &expression,
+  const MaskSpans< TOutputImageType::ImageDimension > &spans, unsigned int threads = 0)
+{
+  typedef typename TOutputImageType::PixelType OutputPixelType;
+  const TExpression &root = expression.Derived();
+
+  std::vector< const itk::ImageBase< TOutputImageType::ImageDimension > * > images;
+  root.CollectImages(images);
+  if (images.empty())
+  {
+    itkGenericExceptionMacro("Image expression does not contain any image");
+  }
+  for (size_t i = 0; i < images.size(); i++)
+  {
+    if (images[i]->GetBufferedRegion() != spans.GetRegion())
+    {
+      itkGenericExceptionMacro("Image " << i + 1 << " of the expression has a different region than the mask");
+    }
+  }
+
+  typename TOutputImageType::Pointer output = TOutputImageType::New();
+  output->CopyInformation(images[0]);
+  output->SetRegions(spans.GetRegion());
+  output->Allocate();
+  OutputPixelType *buffer = output->GetBufferPointer();
+
+  // the threads get contiguous blocks of rows with about the same number of voxels inside the mask
+  const size_t inside = spans.GetNumberOfInsideVoxels();
+  const size_t minimumVoxelsPerThread = 1 << 16;
+  if (threads == 0)
+  {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  threads = static_cast< unsigned int >(std::max< size_t >(1, std::min< size_t >(threads, inside / minimumVoxelsPerThread)));
+
+  std::vector< size_t > firstRow(threads + 1);
+  for (unsigned int t = 0; t < threads; t++)
+  {
+    firstRow[t] = (t == 0) ? 0 : std::max(firstRow[t - 1], std::min(spans.FindRow(inside * t / threads), spans.GetNumberOfRows()));
+  }
+  firstRow[threads] = spans.GetNumberOfRows();
+
+  std::vector< std::thread > workers;
+  for (unsigned int t = 1; t < threads; t++)
+  {
+    workers.push_back(std::thread(EvaluateMaskedImageExpressionRows< OutputPixelType, TExpression, TOutputImageType::ImageDimension >,
+      std::cref(root), &spans, buffer, firstRow[t], firstRow[t + 1]));
+  }
+  EvaluateMaskedImageExpressionRows(root, &spans, buffer, firstRow[0], firstRow[1]);
+  for (size_t t = 0; t < workers.size(); t++)
+  {
+    workers[t].join();
+  }
+
+  return output;
+}
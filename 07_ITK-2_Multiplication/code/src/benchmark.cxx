@@ -0,0 +1,218 @@
+/**
+\brief ITK Multiplication Benchmark
+
+Computes (image * image + image) * mask with a chain of ITK filters (one output image per operation) and
+with the fused expression of ImageExpression.h for increasing thread counts, and checks that both agree.
+
+Then computes image * image * mask everywhere and only inside the mask (MaskedMultiply.h) for masks of
+decreasing density, made by keeping only the first slices of the given mask.
+*/
+
+#include <chrono>
+#include <cmath>
+#include <thread>
+
+//! ITK headers
+#include "itkImage.h"
+#include "itkImageFileReader.h"
+#include "itkMultiplyImageFilter.h"
+#include "itkAddImageFilter.h"
+
+#include "ImageExpression.h"
+#include "MaskedMultiply.h"
+
+typedef itk::Image<float, 3> ImageType;
+typedef itk::Image<unsigned char, 3> MaskImageType;
+
+/**
+\brief Get the itk::Image
+
+\param The itk::Image which will contain the image data
+\param File name of the image
+*/
+template <class TImageType>
+void SafeReadImage(typename TImageType::Pointer image, const std::string &fName)
+{
+  typedef TImageType ImageType;
+  typedef itk::ImageFileReader< ImageType > ImageReaderType;
+  typename ImageReaderType::Pointer reader = ImageReaderType::New();
+  reader->SetFileName(fName);
+
+  try
+  {
+    reader->Update();
+  }
+  catch (itk::ExceptionObject& e)
+  {
+    std::cerr << "Exception caught: " << e.what() << "\n";
+    return;
+  }
+
+  image->Graft(reader->GetOutput());
+  return;
+}
+
+//! Largest difference between the two outputs, relative to the largest value of the reference
+double relativeDifference(ImageType::Pointer reference, ImageType::Pointer other)
+{
+  const size_t voxels = reference->GetBufferedRegion().GetNumberOfPixels();
+  const float *a = reference->GetBufferPointer(), *b = other->GetBufferPointer();
+  double difference = 0, largest = 0;
+  for (size_t i = 0; i < voxels; i++)
+  {
+    difference = std::max(difference, std::abs(double(a[i]) - double(b[i])));
+    largest = std::max(largest, std::abs(double(a[i])));
+  }
+  return (largest > 0) ? difference / largest : difference;
+}
+
+//! Copy of the mask with every slice from the given fraction of slices on cleared
+MaskImageType::Pointer keepFirstSlices(MaskImageType::Pointer mask, double fraction)
+{
+  MaskImageType::Pointer result = MaskImageType::New();
+  result->CopyInformation(mask);
+  result->SetRegions(mask->GetBufferedRegion());
+  result->Allocate();
+  const MaskImageType::SizeType size = mask->GetBufferedRegion().GetSize();
+  const size_t sliceSize = size[0] * size[1], keep = static_cast<size_t>(fraction * size[2] + 0.5) * sliceSize;
+  const unsigned char *input = mask->GetBufferPointer();
+  unsigned char *output = result->GetBufferPointer();
+  for (size_t i = 0; i < sliceSize * size[2]; i++)
+  {
+    output[i] = (i < keep) ? input[i] : 0;
+  }
+  return result;
+}
+
+void echoUsage(const std::string &exeName)
+{
+  std::cout << exeName << " <inputImageFile> <maskFile> [maxThreads] [repetitions]\n" <<
+    "e.g. " << exeName << " ../data/FA.nii.gz ../data/mask.nii.gz\n";
+}
+
+// main entry of program
+int main(int argc, char *argv[])
+{
+  try // to catch exceptions
+  {
+    if (argc < 3)
+    {
+      std::cerr << "Usage: " << std::endl;
+      echoUsage(argv[0]);
+      return EXIT_FAILURE;
+    }
+
+    const unsigned int maxThreads = (argc > 3) ? std::atoi(argv[3]) : std::max(1u, std::thread::hardware_concurrency());
+    const unsigned int repetitions = (argc > 4) ? std::atoi(argv[4]) : 3;
+
+    ImageType::Pointer image = ImageType::New();
+    SafeReadImage<ImageType>(image, argv[1]);
+    MaskImageType::Pointer mask = MaskImageType::New();
+    SafeReadImage<MaskImageType>(mask, argv[2]);
+
+    typedef std::chrono::high_resolution_clock ClockType;
+    ImageType::Pointer reference;
+    double bestITK = 0;
+    for (unsigned int r = 0; r < repetitions; r++)
+    {
+      typedef itk::MultiplyImageFilter<ImageType, ImageType> MultiplyFilterType;
+      typedef itk::AddImageFilter<ImageType, ImageType> AddFilterType;
+      typedef itk::MultiplyImageFilter<ImageType, MaskImageType, ImageType> MaskFilterType;
+      MultiplyFilterType::Pointer multiply = MultiplyFilterType::New();
+      AddFilterType::Pointer add = AddFilterType::New();
+      MaskFilterType::Pointer masking = MaskFilterType::New();
+      multiply->SetInput1(image);
+      multiply->SetInput2(image);
+      add->SetInput1(multiply->GetOutput());
+      add->SetInput2(image);
+      masking->SetInput1(add->GetOutput());
+      masking->SetInput2(mask);
+
+      auto t1 = ClockType::now();
+      masking->Update();
+      auto t2 = ClockType::now();
+      const double elapsed = std::chrono::duration<double, std::milli>(t2 - t1).count();
+      bestITK = (r == 0) ? elapsed : std::min(bestITK, elapsed);
+      reference = masking->GetOutput();
+    }
+    // the ITK filters use their own default number of threads
+    std::cout << "engine,threads,milliseconds,speedup,relativeDifference\n";
+    std::cout << "itk,default," << bestITK << ",1,0\n";
+
+    for (unsigned int threads = 1; threads <= maxThreads; threads = (threads < maxThreads) ? std::min(2 * threads, maxThreads) : threads + 1)
+    {
+      double best = 0, difference = 0;
+      for (unsigned int r = 0; r < repetitions; r++)
+      {
+        const ImageTerminal<ImageType> a = MakeImageExpression(image);
+
+        auto t1 = ClockType::now();
+        ImageType::Pointer output = EvaluateImageExpression<ImageType>((a * a + a) * MakeImageExpression(mask), threads);
+        auto t2 = ClockType::now();
+        const double elapsed = std::chrono::duration<double, std::milli>(t2 - t1).count();
+        best = (r == 0) ? elapsed : std::min(best, elapsed);
+        difference = relativeDifference(reference, output);
+      }
+      std::cout << "fused," << threads << "," << best << "," << bestITK / best << "," << difference << "\n";
+      // ITK adds in double precision, the fused expression in float
+      if (difference > 1e-6)
+      {
+        std::cerr << "Output of the fused expression differs from ITK.\n";
+        return EXIT_FAILURE;
+      }
+    }
+
+    // masked evaluation against dense evaluation, by mask density
+    std::cout << "\ndensity,denseMilliseconds,maskedMilliseconds,spanMilliseconds,speedup,differences\n";
+    const double fractions[] = { 1.0, 0.5, 0.25, 0.1, 0.05, 0.01 };
+    for (size_t f = 0; f < sizeof(fractions) / sizeof(fractions[0]); f++)
+    {
+      MaskImageType::Pointer partialMask = keepFirstSlices(mask, fractions[f]);
+      const ImageTerminal<ImageType> a = MakeImageExpression(image);
+      const ImageTerminal<MaskImageType> m = MakeImageExpression(partialMask);
+
+      double bestDense = 0, bestMasked = 0, bestSpans = 0, density = 0;
+      size_t differences = 0;
+      for (unsigned int r = 0; r < repetitions; r++)
+      {
+        auto t1 = ClockType::now();
+        ImageType::Pointer dense = EvaluateImageExpression<ImageType>(a * a * m, maxThreads);
+        auto t2 = ClockType::now();
+        MaskSpans<3> spans;
+        spans.Build(partialMask.GetPointer());
+        auto t3 = ClockType::now();
+        ImageType::Pointer masked = EvaluateMaskedImageExpression<ImageType>(a * a * m, spans, maxThreads);
+        auto t4 = ClockType::now();
+
+        const double denseTime = std::chrono::duration<double, std::milli>(t2 - t1).count();
+        const double spanTime = std::chrono::duration<double, std::milli>(t3 - t2).count();
+        const double maskedTime = std::chrono::duration<double, std::milli>(t4 - t3).count();
+        bestDense = (r == 0) ? denseTime : std::min(bestDense, denseTime);
+        bestSpans = (r == 0) ? spanTime : std::min(bestSpans, spanTime);
+        bestMasked = (r == 0) ? maskedTime : std::min(bestMasked, maskedTime);
+
+        const size_t voxels = dense->GetBufferedRegion().GetNumberOfPixels();
+        differences = 0;
+        for (size_t i = 0; i < voxels; i++)
+        {
+          differences += (dense->GetBufferPointer()[i] != masked->GetBufferPointer()[i]);
+        }
+        density = spans.GetDensity();
+      }
+      // the spans can be reused for every operation with the same mask, so they are timed on their own
+      std::cout << density << "," << bestDense << "," << bestMasked << "," << bestSpans << "," << bestDense / bestMasked << "," << differences << "\n";
+      if (differences != 0)
+      {
+        std::cerr << "Masked evaluation differs from dense evaluation.\n";
+        return EXIT_FAILURE;
+      }
+    }
+  }
+  catch (itk::ExceptionObject &error)
+  {
+    std::cerr << "Exception caught: " << error << "\n";
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
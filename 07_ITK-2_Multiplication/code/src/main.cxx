@@ -2,10 +2,14 @@
 \brief ITK Multiplication Tutorial
 */
 
+#include <cmath>
+#include <string>
+
 //! ITK headers
 #include "itkImage.h"
 #include "itkImageFileReader.h"
 #include "itkImageFileWriter.h"
+#include "itkImageIOFactory.h"
 #include "itkCastImageFilter.h"
 #include "itkConnectedThresholdImageFilter.h"
 
@@ -25,9 +29,13 @@
 #include "itkNearestNeighborInterpolateImageFunction.h"
 
 #include "itkMultiplyImageFilter.h"
+#include "itkAddImageFilter.h"
 
 #include <itkCorrelationCoefficientHistogramImageToImageMetric.h>
 
+#include "ImageExpression.h"
+#include "MaskedMultiply.h"
+
 
 /**
 \brief Get the itk::Image
@@ -57,36 +65,395 @@ void SafeReadImage(typename TImageType::Pointer image, const std::string &fName)
   return;
 }
 
+/**
+\brief Component type of the pixels of an image file, e.g. itk::ImageIOBase::IOComponentType::FLOAT
+
+\param fName File name of the image
+*/
+itk::ImageIOBase::IOComponentType readComponentType(const std::string &fName)
+{
+  itk::ImageIOBase::Pointer imageIO = itk::ImageIOFactory::CreateImageIO(fName.c_str(), itk::ImageIOFactory::ReadMode);
+  if (imageIO.IsNull())
+  {
+    itkGenericExceptionMacro("Could not read '" << fName << "'");
+  }
+  imageIO->SetFileName(fName);
+  imageIO->ReadImageInformation();
+  return imageIO->GetComponentType();
+}
+
+/**
+\brief Call functor.template Run<TPixelType>() with the pixel type of an ITK component type
+
+\param componentType Component type as given by itk::ImageIOBase::GetComponentType()
+\param functor Object with a templated Run() member
+*/
+template <typename TFunctor>
+void callWithPixelType(itk::ImageIOBase::IOComponentType componentType, TFunctor &functor)
+{
+  switch (componentType)
+  {
+  case itk::ImageIOBase::IOComponentType::UCHAR:
+    functor.template Run<unsigned char>();
+    break;
+  case itk::ImageIOBase::IOComponentType::CHAR:
+    functor.template Run<char>();
+    break;
+  case itk::ImageIOBase::IOComponentType::USHORT:
+    functor.template Run<unsigned short>();
+    break;
+  case itk::ImageIOBase::IOComponentType::SHORT:
+    functor.template Run<short>();
+    break;
+  case itk::ImageIOBase::IOComponentType::UINT:
+    functor.template Run<unsigned int>();
+    break;
+  case itk::ImageIOBase::IOComponentType::INT:
+    functor.template Run<int>();
+    break;
+  case itk::ImageIOBase::IOComponentType::FLOAT:
+    functor.template Run<float>();
+    break;
+  case itk::ImageIOBase::IOComponentType::DOUBLE:
+    functor.template Run<double>();
+    break;
+  default:
+    itkGenericExceptionMacro("Unsupported pixel type: " << itk::ImageIOBase::GetComponentTypeAsString(componentType));
+  }
+}
+
+/**
+\brief Options that control how the multiplication is done
+*/
+struct MultiplicationOptions
+{
+  bool useITK = false; //! chain ITK filters instead of evaluating the fused expression
+  unsigned int threads = 0; //! number of threads for the fused expression, 0 picks all cores
+  std::string addFileName; //! image added to the product, empty for none
+  std::string maskFileName; //! mask the result is multiplied with, empty for none
+  bool dense = false; //! evaluate the fused expression on every voxel instead of only inside the mask
+  unsigned int memoryBudget = 0; //! MiB the streamed ITK pipeline may use, 0 reads the whole images
+};
+
+/**
+\brief Reads the added image or the mask in its own pixel type and appends it to the fused expression as a step
+
+The steps are output = output + add and output = output * mask, each cast to the output pixel type as the chain
+of ITK filters does, so e.g. a float mask of 0.5 halves the product and a short label of 256 multiplies it by
+256. Instantiated per output pixel type and pixel type of the file, not per pair of input pixel types.
+*/
+template <typename TOutputImageType>
+struct AddAndMaskSteps
+{
+  typedef typename TOutputImageType::PixelType OutputPixelType;
+  static const unsigned int Dimension = TOutputImageType::ImageDimension;
+
+  std::string fileName; //! file read by the next Run()
+  bool isMask = false; //! whether the file is the mask or the added image
+  bool buildSpans = false; //! also find the non-zero runs of the mask, compared in its own pixel type
+  ImageExpressionSteps<TOutputImageType> steps;
+  MaskSpans<Dimension> spans;
+
+  template <typename TPixelType>
+  void Run()
+  {
+    typedef itk::Image<TPixelType, Dimension> ImageType;
+    typename ImageType::Pointer image = ImageType::New();
+    SafeReadImage<ImageType>(image, fileName);
+    if (!isMask)
+    {
+      steps.AddStep([image](OutputPixelType *output, size_t begin, size_t end)
+      {
+        EvaluateImageExpressionRange(MakeBufferExpression(output) + MakeImageExpression(image), output, begin, end);
+      }, image.GetPointer());
+      return;
+    }
+    if (buildSpans)
+    {
+      spans.Build(image.GetPointer());
+      std::cout << "Mask covers " << 100 * spans.GetDensity() << "% of the image.\n";
+    }
+    steps.AddStep([image](OutputPixelType *output, size_t begin, size_t end)
+    {
+      EvaluateImageExpressionRange(MakeBufferExpression(output) * MakeImageExpression(image), output, begin, end);
+    }, image.GetPointer());
+  }
+};
+
+/**
+\brief Appends a reader of the added image or the mask, in its own pixel type, and the filter that applies it
+
+Used by the chain of ITK filters, streamed or not; instantiated per output pixel type and pixel type of the file.
+*/
+template <typename TOutputImageType>
+struct AddAndMaskFilters
+{
+  typedef typename TOutputImageType::PixelType OutputPixelType;
+  static const unsigned int Dimension = TOutputImageType::ImageDimension;
+
+  std::string fileName; //! file read by the filters appended by the next Run()
+  bool isMask = false; //! whether the file is the mask or the added image
+  typename TOutputImageType::Pointer result; //! output of the last filter, updated by Run()
+  size_t bytesPerVoxel = 0; //! bytes per voxel of the buffers of the appended readers and filters
+  std::vector<itk::ProcessObject::Pointer> filters; //! keeps the appended readers and filters alive
+
+  template <typename TPixelType>
+  void Run()
+  {
+    typedef itk::Image<TPixelType, Dimension> ImageType;
+    typedef itk::ImageFileReader<ImageType> ReaderType;
+    typename ReaderType::Pointer reader = ReaderType::New();
+    reader->SetFileName(fileName);
+    filters.push_back(reader.GetPointer());
+    if (isMask)
+    {
+      typedef itk::MultiplyImageFilter<TOutputImageType, ImageType, TOutputImageType> MaskFilterType;
+      typename MaskFilterType::Pointer maskFilter = MaskFilterType::New();
+      maskFilter->SetInput1(result);
+      maskFilter->SetInput2(reader->GetOutput());
+      result = maskFilter->GetOutput();
+      filters.push_back(maskFilter.GetPointer());
+    }
+    else
+    {
+      typedef itk::AddImageFilter<TOutputImageType, ImageType, TOutputImageType> AddFilterType;
+      typename AddFilterType::Pointer addFilter = AddFilterType::New();
+      addFilter->SetInput1(result);
+      addFilter->SetInput2(reader->GetOutput());
+      result = addFilter->GetOutput();
+      filters.push_back(addFilter.GetPointer());
+    }
+    bytesPerVoxel += sizeof(TPixelType) + sizeof(OutputPixelType);
+  }
+};
+
 /**
 \brief Apply multiplication filter
 
+Computes (image_1 * image_2 + addImage) * mask, where the added image and the mask are optional. By default the
+whole formula is a single fused pass (see ImageExpression.h); with options.useITK it is a chain of
+itk::MultiplyImageFilter and itk::AddImageFilter, each of which allocates its own output.
+
+With a mask, the fused expression is only computed inside the runs of non-zero voxels of the mask and the rest
+of the output is zero-filled (see MaskedMultiply.h), unless options.dense is set.
+
+Every image keeps its own pixel type; the output pixel type is PromotePixelType of the two inputs. The added image
+and the mask are applied after the product, each result cast to the output pixel type (see AddAndMaskSteps).
+
 \param image_1 itk::Image::Pointer to first image
 \param image_2 itk::Image::Pointer to second image
 \param fOutName File name of output 
+\param options What to compute and how
 */
-template <typename TImageType>
-void multiplicationFilter(typename TImageType::Pointer image_1,
-  typename TImageType::Pointer image_2,
-  const std::string &fOutName)
+template <typename TImageType1, typename TImageType2>
+void multiplicationFilter(typename TImageType1::Pointer image_1,
+  typename TImageType2::Pointer image_2,
+  const std::string &fOutName,
+  const MultiplicationOptions &options)
 {
-  typedef itk::MultiplyImageFilter<TImageType, TImageType> FilterType;
-  typename FilterType::Pointer filter = FilterType::New();
+  typedef typename PromotePixelType<typename TImageType1::PixelType, typename TImageType2::PixelType>::Type OutputPixelType;
+  typedef itk::Image<OutputPixelType, TImageType1::ImageDimension> OImageType;
 
-  filter->SetInput1(image_1);
-  filter->SetInput2(image_2);
-  filter->Update();
-  //typename TImageType::Pointer result = filter->GetOutput();
+  typename OImageType::Pointer result;
+  if (options.useITK)
+  {
+    typedef itk::MultiplyImageFilter<TImageType1, TImageType2, OImageType> FilterType;
+    typename FilterType::Pointer filter = FilterType::New();
+
+    filter->SetInput1(image_1);
+    filter->SetInput2(image_2);
+    AddAndMaskFilters<OImageType> addAndMask;
+    addAndMask.result = filter->GetOutput();
+    if (!options.addFileName.empty())
+    {
+      addAndMask.fileName = options.addFileName;
+      callWithPixelType(readComponentType(options.addFileName), addAndMask);
+    }
+    if (!options.maskFileName.empty())
+    {
+      addAndMask.fileName = options.maskFileName;
+      addAndMask.isMask = true;
+      callWithPixelType(readComponentType(options.maskFileName), addAndMask);
+    }
+    result = addAndMask.result;
+    result->Update();
+  }
+  else
+  {
+    // one pass and one output image, whatever the formula; the inputs are converted voxel by voxel, never as images
+    const CastExpression<OutputPixelType, ImageTerminal<TImageType1> > a = CastImageExpression<OutputPixelType>(MakeImageExpression(image_1));
+    const ImageTerminal<TImageType2> b = MakeImageExpression(image_2);
+    AddAndMaskSteps<OImageType> addAndMask;
+    if (!options.addFileName.empty())
+    {
+      addAndMask.fileName = options.addFileName;
+      callWithPixelType(readComponentType(options.addFileName), addAndMask);
+    }
+    if (!options.maskFileName.empty())
+    {
+      addAndMask.fileName = options.maskFileName;
+      addAndMask.isMask = true;
+      addAndMask.buildSpans = !options.dense;
+      callWithPixelType(readComponentType(options.maskFileName), addAndMask);
+    }
+    if (addAndMask.steps.IsEmpty())
+    {
+      result = EvaluateImageExpression<OImageType>(a * b, options.threads);
+    }
+    else if (addAndMask.buildSpans)
+    {
+      result = EvaluateMaskedImageExpression<OImageType>(MakeSteppedImageExpression(a * b, addAndMask.steps), addAndMask.spans, options.threads);
+    }
+    else
+    {
+      result = EvaluateImageExpression<OImageType>(MakeSteppedImageExpression(a * b, addAndMask.steps), options.threads);
+    }
+  }
 
-  typedef itk::ImageFileWriter<TImageType> WriterType;
+  typedef itk::ImageFileWriter<OImageType> WriterType;
   typename WriterType::Pointer writer = WriterType::New();
-  writer->SetInput(filter->GetOutput());
+  writer->SetInput(result);
   writer->SetFileName(fOutName);
   writer->Write();
 }
 
+/**
+\brief Apply multiplication filter to images that do not fit in memory
+
+Wires itk::ImageFileReader -> itk::MultiplyImageFilter (-> itk::AddImageFilter -> itk::MultiplyImageFilter with
+the mask) -> itk::ImageFileWriter and lets the writer request the output in pieces along the last axis, so only
+one piece of every image of the pipeline is in memory at a time. The number of pieces is chosen so that all
+buffers of one piece fit in options.memoryBudget.
+
+\param inputFName1 File name of first image
+\param inputFName2 File name of second image
+\param fOutName File name of output; needs a format that supports streamed writing (e.g. .nii, .mha, but not .nii.gz)
+\param options What to compute and how
+*/
+template <typename TImageType1, typename TImageType2>
+void streamingMultiplicationFilter(const std::string &inputFName1,
+  const std::string &inputFName2,
+  const std::string &fOutName,
+  const MultiplicationOptions &options)
+{
+  typedef typename PromotePixelType<typename TImageType1::PixelType, typename TImageType2::PixelType>::Type OutputPixelType;
+  typedef itk::Image<OutputPixelType, TImageType1::ImageDimension> OImageType;
+  typedef itk::ImageFileReader<TImageType1> ReaderType1;
+  typedef itk::ImageFileReader<TImageType2> ReaderType2;
+  typename ReaderType1::Pointer reader_1 = ReaderType1::New();
+  reader_1->SetFileName(inputFName1);
+  typename ReaderType2::Pointer reader_2 = ReaderType2::New();
+  reader_2->SetFileName(inputFName2);
+
+  typedef itk::MultiplyImageFilter<TImageType1, TImageType2, OImageType> FilterType;
+  typename FilterType::Pointer filter = FilterType::New();
+  filter->SetInput1(reader_1->GetOutput());
+  filter->SetInput2(reader_2->GetOutput());
+  typename OImageType::Pointer result = filter->GetOutput();
+
+  // every piece holds a buffer of each reader and each filter output
+  size_t bytesPerVoxel = sizeof(typename TImageType1::PixelType) + sizeof(typename TImageType2::PixelType) + sizeof(OutputPixelType);
+
+  AddAndMaskFilters<OImageType> addAndMask;
+  addAndMask.result = result;
+  if (!options.addFileName.empty())
+  {
+    addAndMask.fileName = options.addFileName;
+    callWithPixelType(readComponentType(options.addFileName), addAndMask);
+  }
+  if (!options.maskFileName.empty())
+  {
+    addAndMask.fileName = options.maskFileName;
+    addAndMask.isMask = true;
+    callWithPixelType(readComponentType(options.maskFileName), addAndMask);
+  }
+  result = addAndMask.result;
+  bytesPerVoxel += addAndMask.bytesPerVoxel;
+
+  // pieces are slabs along the last axis, so there cannot be more of them than slices
+  reader_1->UpdateOutputInformation();
+  if (!reader_1->GetImageIO()->CanStreamRead())
+  {
+    std::cerr << "WARNING: '" << inputFName1 << "' cannot be read in parts, every piece will read the whole image.\n";
+  }
+  const typename TImageType1::RegionType largest = reader_1->GetOutput()->GetLargestPossibleRegion();
+  const double pipelineBytes = double(largest.GetNumberOfPixels()) * bytesPerVoxel;
+  const double budgetBytes = double(options.memoryBudget) * 1024 * 1024;
+  const unsigned int slices = largest.GetSize()[TImageType1::ImageDimension - 1];
+  const unsigned int divisions = std::max(1u, std::min(slices, static_cast<unsigned int>(std::ceil(pipelineBytes / budgetBytes))));
+  if (pipelineBytes / divisions > budgetBytes)
+  {
+    std::cerr << "WARNING: one slice of the pipeline needs " << pipelineBytes / slices / (1024 * 1024) << " MiB, more than the budget.\n";
+  }
+
+  itk::ImageIOBase::Pointer outputIO = itk::ImageIOFactory::CreateImageIO(fOutName.c_str(), itk::ImageIOFactory::WriteMode);
+  if ((divisions > 1) && (outputIO.IsNull() || !outputIO->CanStreamWrite()))
+  {
+    itkGenericExceptionMacro("Output '" << fOutName << "' does not support streamed writing, use an uncompressed format such as .nii or .mha");
+  }
+  std::cout << "Streaming " << pipelineBytes / (1024 * 1024) << " MiB of pipeline buffers in " << divisions << " pieces.\n";
+
+  typedef itk::ImageFileWriter<OImageType> WriterType;
+  typename WriterType::Pointer writer = WriterType::New();
+  writer->SetInput(result);
+  writer->SetFileName(fOutName);
+  writer->SetNumberOfStreamDivisions(divisions);
+  writer->Update();
+}
+
+/**
+\brief Reads both inputs in their own pixel types and multiplies them; one instantiation per pair of pixel types
+*/
+struct MultiplicationDispatch
+{
+  std::string inputFName1, inputFName2, outputFName;
+  itk::ImageIOBase::IOComponentType componentType2;
+  MultiplicationOptions options;
+
+  //! Second level, the pixel type of the first input is known
+  template <typename TPixelType1>
+  struct SecondInput
+  {
+    const MultiplicationDispatch *dispatch;
+
+    template <typename TPixelType2>
+    void Run()
+    {
+      typedef itk::Image<TPixelType1, 3> ImageType1;
+      typedef itk::Image<TPixelType2, 3> ImageType2;
+      if (dispatch->options.memoryBudget > 0)
+      {
+        streamingMultiplicationFilter<ImageType1, ImageType2>(dispatch->inputFName1, dispatch->inputFName2, dispatch->outputFName, dispatch->options);
+        return;
+      }
+      typename ImageType1::Pointer image_1 = ImageType1::New();
+      SafeReadImage<ImageType1>(image_1, dispatch->inputFName1);
+      typename ImageType2::Pointer image_2 = ImageType2::New();
+      SafeReadImage<ImageType2>(image_2, dispatch->inputFName2);
+      multiplicationFilter<ImageType1, ImageType2>(image_1, image_2, dispatch->outputFName, dispatch->options);
+    }
+  };
+
+  template <typename TPixelType1>
+  void Run()
+  {
+    SecondInput<TPixelType1> second = { this };
+    callWithPixelType(componentType2, second);
+  }
+};
+
 void echoUsage(const std::string &exeName)
 {
-  std::cout << exeName << " <inputImageFile1> <inputImageFile2> <outputFileName>\n" <<
+  std::cout << exeName << " <inputImageFile1> <inputImageFile2> <outputFileName> [options]\n" <<
+    "Computes (input1 * input2 + add) * mask in a single pass, add and mask are optional.\n" <<
+    "Options:\n" <<
+    "  -add <file>   Image added to the product\n" <<
+    "  -mask <file>  Mask the result is multiplied with\n" <<
+    "  -dense        Compute every voxel instead of only those inside the mask\n" <<
+    "  -threads <n>  Number of threads (default: all cores)\n" <<
+    "  -itk          Use a chain of ITK filters instead of the fused expression\n" <<
+    "  -memory-budget <MiB>  Stream a chain of ITK filters in as many pieces as needed to stay within the budget\n" <<
+    "Every image is read in its own pixel type; the output type holds the product of the inputs (see PromotePixelType).\n" <<
     "NOTE - Only 3D images are supported in this example.\n";
 }
 
@@ -96,7 +463,7 @@ int main(int argc, char *argv[])
   try // to catch exceptions
   {
     // basic check to see image file has been put in by the user
-    if( (argc < 2) )
+    if( (argc < 4) )
     {
       std::cerr << "Usage: " << std::endl;
       echoUsage(argv[0]);
@@ -105,17 +472,52 @@ int main(int argc, char *argv[])
 
     std::string inputFName1 = "", inputFName2 = "", outputFName = "";
     
-    inputFName1 = argv[2];
-    inputFName2 = argv[3];
-    inputMask2 = argv[4];
-    outputFName = argv[5];
+    inputFName1 = argv[1];
+    inputFName2 = argv[2];
+    outputFName = argv[3];
+
+    MultiplicationOptions options;
+    for (int i = 4; i < argc; i++)
+    {
+      const std::string option = argv[i];
+      if (option == "-itk")
+      {
+        options.useITK = true;
+      }
+      else if ((option == "-threads") && (i + 1 < argc))
+      {
+        options.threads = std::atoi(argv[++i]);
+      }
+      else if ((option == "-add") && (i + 1 < argc))
+      {
+        options.addFileName = argv[++i];
+      }
+      else if ((option == "-mask") && (i + 1 < argc))
+      {
+        options.maskFileName = argv[++i];
+      }
+      else if ((option == "-memory-budget") && (i + 1 < argc))
+      {
+        options.memoryBudget = std::atoi(argv[++i]);
+      }
+      else if (option == "-dense")
+      {
+        options.dense = true;
+      }
+      else
+      {
+        std::cerr << "Unknown option '" << option << "'.\n";
+        echoUsage(argv[0]);
+        return EXIT_FAILURE;
+      }
+    }
 
     // perform sanity check
     itk::ImageIOBase::Pointer im_base = itk::ImageIOFactory::CreateImageIO(inputFName1.c_str(), itk::ImageIOFactory::ReadMode);
     im_base->SetFileName(inputFName1);
     im_base->ReadImageInformation();
 
-    itk::ImageIOBase::Pointer im_base_2 = itk::ImageIOFactory::CreateImageIO(inputFName2.c_str(),
+    itk::ImageIOBase::Pointer im_base_2 = itk::ImageIOFactory::CreateImageIO(inputFName2.c_str(), itk::ImageIOFactory::ReadMode);
     im_base_2->SetFileName(inputFName2);
     im_base_2->ReadImageInformation();
     
@@ -131,15 +533,16 @@ int main(int argc, char *argv[])
       return EXIT_FAILURE;
     }
 
-    typedef float PixelType; // default pixel type is float, all voxel data is static-casted
-    typedef itk::Image<PixelType, 3> ImageType; // define image type
-    ImageType::Pointer image_1 = ImageType::New(); // initialize new image
-    SafeReadImage<ImageType>(image_1, im_base->GetFileName()); // read image along with exceptions
-    
-    std::cout << "Doing multiplication...\n";
-    ImageType::Pointer image_2 = ImageType::New();
-    SafeReadImage<ImageType>(image_2, inputFName2);
-    multiplicationFilter<ImageType>(image_1, image_2, outputFName);        
+    // every input is read in its own pixel type, e.g. a float image times an unsigned char mask
+    std::cout << "Doing multiplication of " << im_base->GetComponentTypeAsString(im_base->GetComponentType()) << " and " <<
+      im_base_2->GetComponentTypeAsString(im_base_2->GetComponentType()) << " images...\n";
+    MultiplicationDispatch dispatch;
+    dispatch.inputFName1 = inputFName1;
+    dispatch.inputFName2 = inputFName2;
+    dispatch.outputFName = outputFName;
+    dispatch.componentType2 = im_base_2->GetComponentType();
+    dispatch.options = options;
+    callWithPixelType(im_base->GetComponentType(), dispatch);
   }
   catch (itk::ExceptionObject &error)
   {
@@ -0,0 +1,719 @@
+/**
+\file AffineRegistration.h
+
+\brief Coarse-to-fine affine registration of moving images to one fixed image
+
+Everything that only depends on the fixed image (its pyramid and the samples of every level) is computed
+once by prepareFixedImage() and kept in a FixedImageState, which registerToFixed() only reads. Any number of
+moving images can so be registered against the same state, also at the same time from several threads.
+
+At every level an itk::ImageRegistrationMethod runs on the fixed and moving images of that level, starting
+from the transform found at the previous, coarser level, with half the maximum step length. Optionally several
+such registrations start from different initial transforms at the same time and the best one is kept.
+
+Whatever the pixel type of the input images, the levels and the metric are in float (RegistrationImageType):
+the smoothing of the pyramid would otherwise be rounded to the integers of e.g. short images at every level.
+*/
+
+#pragma once
+
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "itkImage.h"
+#include "itkCastImageFilter.h"
+#include "itkImageFileWriter.h"
+#include "itkImageRegistrationMethod.h"
+#include "itkMultiResolutionPyramidImageFilter.h"
+#include "itkLinearInterpolateImageFunction.h"
+#include "itkRegularStepGradientDescentOptimizer.h"
+#include "itkAffineTransform.h"
+#include "itkTransformFileWriter.h"
+#include "itkImageMomentsCalculator.h"
+#include "itkCommand.h"
+
+#include "AffineResampler.h"
+#include "BitMaskImage.h"
+#include "VoxelSampler.h"
+#include "ParallelMeanSquaresMetric.h"
+#include "RegistrationTelemetry.h"
+#include "TransformCache.h"
+
+/**
+\brief Options that control how the registration is done
+*/
+struct RegistrationOptions
+{
+  unsigned int levels = 1; //! number of pyramid levels, 1 registers at full resolution only
+  std::vector<unsigned int> iterations; //! iterations per level from coarse to fine, empty for the defaults
+  bool compare = false; //! also run the single-level registration and report both
+  SamplingStrategy sampling = SamplingStrategy::Mask; //! how the voxels the metric is computed over are chosen
+  double samplingFraction = 1.0; //! fraction of the candidate voxels the metric is computed over
+  unsigned int seed = 0; //! seed of the sampling, the same seed gives the same samples
+  unsigned int threads = 0; //! threads of the metric, 0 for the hardware concurrency
+  bool verbose = true; //! print a line per level
+  unsigned int starts = 1; //! number of registrations from different initial transforms, the best one is kept
+  double startAngle = 10.0; //! rotation step between the initial transforms, in degrees
+  unsigned int startWarmup = 5; //! iterations before a start can be cancelled
+  double startMargin = 0.2; //! a start is cancelled once its metric is this fraction worse than the best one
+  double maximumStepLength = 0.25; //! maximum step length of the optimizer on the coarsest level, halved per level
+  double minimumStepLength = 0.0001; //! the optimizer of a level stops once its step length is below this
+  TransformCache *cache = NULL; //! if given, finished registrations are taken from it and levels are checkpointed to it
+  unsigned int bsplineMesh = 0; //! mesh elements per axis of the coarsest B-spline grid, 0 for no deformable stage
+  unsigned int bsplineLevels = 2; //! B-spline grid levels, the mesh is doubled for every finer level
+  unsigned int bsplineIterations = 20; //! iterations per B-spline grid level
+  double bsplineStepLength = 1.0; //! maximum step length of the B-spline optimizer
+  RegistrationTelemetry *telemetry = NULL; //! if given, every iteration of every level is written to it
+  std::string runName; //! name of the registration in the telemetry, e.g. the moving image
+
+  //! Iterations at the given level (0 is the coarsest); by default 20 at full resolution, doubled for every coarser level
+  unsigned int GetIterations(unsigned int level) const
+  {
+    if (level < iterations.size())
+    {
+      return iterations[level];
+    }
+    return 20u << (levels - 1 - level);
+  }
+};
+
+typedef itk::AffineTransform<double, 3> TransformType;
+
+//! Pixel type the pyramid levels are smoothed and the metric is computed in
+typedef itk::Image<float, 3> RegistrationImageType;
+
+//! A float copy of the image, for the registration of images of another pixel type
+template <typename TImageType>
+RegistrationImageType::Pointer castForRegistration(TImageType *image)
+{
+  typedef itk::CastImageFilter<TImageType, RegistrationImageType> CastType;
+  typename CastType::Pointer cast = CastType::New();
+  cast->SetInput(image);
+  cast->Update();
+  RegistrationImageType::Pointer output = cast->GetOutput();
+  output->DisconnectPipeline();
+  return output;
+}
+
+//! A float image is registered as it is
+inline RegistrationImageType::Pointer castForRegistration(RegistrationImageType *image)
+{
+  return image;
+}
+
+/**
+\brief What a registration run produced
+*/
+struct RegistrationResult
+{
+  TransformType::ParametersType parameters; //! final affine parameters
+  TransformType::FixedParametersType fixedParameters; //! center of rotation of the affine
+  double metricValue = 0; //! metric value at the final parameters, at full resolution
+  double milliseconds = 0; //! wall time of the optimization, including the moving pyramid
+  bool cancelled = false; //! the registration was stopped early because other starts did better
+  bool cached = false; //! the transform was taken from the cache, metricValue is not known
+
+  //! The final affine transform
+  TransformType::Pointer GetTransform() const
+  {
+    TransformType::Pointer transform = TransformType::New();
+    transform->SetFixedParameters(fixedParameters);
+    transform->SetParameters(parameters);
+    return transform;
+  }
+};
+
+/**
+\brief The fixed image prepared for registration: pyramid and samples of every level, from coarse to fine
+*/
+template <typename TImageType>
+struct FixedImageState
+{
+  typedef typename VoxelSampler<3>::OffsetType OffsetType;
+
+  std::vector<RegistrationImageType::Pointer> levels; //! fixed image of every level in float, the last one at full resolution
+  std::vector<std::vector<OffsetType> > samples; //! linear offsets of the voxels the metric is computed over, per level
+  ContentHasher hash; //! fixed image, mask and options, for the keys of the transform cache (if options.cache is set)
+};
+
+/**
+\brief Smooth and shrink the fixed image into options.levels float levels and draw the samples of every level
+
+\param fixedImage itk::Image::Pointer to fixed image
+\param mask Bit-packed mask of fixed image, used by the mask sampling
+\param options How the registration is to be done
+*/
+template <typename TImageType>
+FixedImageState<TImageType> prepareFixedImage(typename TImageType::Pointer fixedImage,
+  const BitMaskImage<3> &mask,
+  const RegistrationOptions &options)
+{
+  if (mask.GetRegion() != fixedImage->GetLargestPossibleRegion())
+  {
+    itkGenericExceptionMacro("Mask and fixed image do not have the same size");
+  }
+
+  FixedImageState<TImageType> state;
+  if (options.levels > 1)
+  {
+    typedef itk::MultiResolutionPyramidImageFilter<TImageType, RegistrationImageType> PyramidType;
+    typename PyramidType::Pointer pyramid = PyramidType::New();
+    pyramid->SetInput(fixedImage);
+    pyramid->SetNumberOfLevels(options.levels);
+    pyramid->Update();
+    for (unsigned int level = 0; level < options.levels; level++)
+    {
+      RegistrationImageType::Pointer levelImage = pyramid->GetOutput(level);
+      levelImage->DisconnectPipeline(); // so that the registrations never update the pyramid again
+      state.levels.push_back(levelImage);
+    }
+  }
+  else
+  {
+    state.levels.push_back(castForRegistration(fixedImage.GetPointer()));
+  }
+
+  VoxelSampler<3> sampler;
+  sampler.SetStrategy(options.sampling);
+  sampler.SetFraction(options.samplingFraction);
+  sampler.SetSeed(options.seed);
+  sampler.SetMask(&mask, fixedImage);
+  for (unsigned int level = 0; level < state.levels.size(); level++)
+  {
+    sampler.Sample(state.levels[level], level);
+    state.samples.push_back(sampler.GetOffsets());
+  }
+
+  if (options.cache != NULL)
+  {
+    // everything that changes the result, except the moving image which registerToFixed() adds
+    state.hash.AddString("affine-2"); // 2: registered in float
+    state.hash.AddImage(fixedImage.GetPointer());
+    state.hash.Add(mask.GetWords().data(), mask.GetWords().size() * sizeof(mask.GetWords()[0]));
+    state.hash.AddValue(options.levels);
+    for (unsigned int level = 0; level < options.levels; level++)
+    {
+      state.hash.AddValue(options.GetIterations(level));
+    }
+    state.hash.AddValue(options.sampling);
+    state.hash.AddValue(options.samplingFraction);
+    state.hash.AddValue(options.seed);
+    state.hash.AddValue(options.starts);
+    state.hash.AddValue(options.startAngle);
+    state.hash.AddValue(options.startWarmup);
+    state.hash.AddValue(options.startMargin);
+    state.hash.AddValue(options.maximumStepLength);
+    state.hash.AddValue(options.minimumStepLength);
+  }
+  return state;
+}
+
+//! The moving image smoothed and shrunk like the fixed image into float levels, from coarse to fine
+template <typename TImageType>
+std::vector<RegistrationImageType::Pointer> prepareMovingImage(typename TImageType::Pointer movingImage, unsigned int levels)
+{
+  std::vector<RegistrationImageType::Pointer> movingLevels;
+  if (levels > 1)
+  {
+    typedef itk::MultiResolutionPyramidImageFilter<TImageType, RegistrationImageType> PyramidType;
+    typename PyramidType::Pointer pyramid = PyramidType::New();
+    pyramid->SetInput(movingImage);
+    pyramid->SetNumberOfLevels(levels);
+    pyramid->Update();
+    for (unsigned int level = 0; level < levels; level++)
+    {
+      RegistrationImageType::Pointer levelImage = pyramid->GetOutput(level);
+      levelImage->DisconnectPipeline();
+      movingLevels.push_back(levelImage);
+    }
+  }
+  else
+  {
+    movingLevels.push_back(castForRegistration(movingImage.GetPointer()));
+  }
+  return movingLevels;
+}
+
+/**
+\brief Decides which starts of a multi-start registration are cancelled
+
+Every start reports its metric value after the warm-up iteration of the coarsest level and then waits until
+all starts have reported theirs, or have finished the coarsest level without getting that far (see Leave()).
+The starts whose value is more than a margin worse than the best of those values are cancelled, the others run
+to the end. The decision only depends on the values at the warm-up iteration, not on the order in which the
+threads get there, so the same inputs always keep the same start.
+*/
+class MultiStartBoard
+{
+public:
+  MultiStartBoard(unsigned int starts, unsigned int warmupIterations, double margin) :
+    m_warmup(warmupIterations), m_margin(margin), m_waiting(starts), m_arrived(starts, false),
+    m_best(std::numeric_limits<double>::max())
+  {
+  }
+
+  //! Record the value of a start after the given iteration; true if the start is behind and should stop
+  bool Report(unsigned int start, unsigned int iteration, double value)
+  {
+    if (iteration != m_warmup)
+    {
+      return false;
+    }
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_best = std::min(m_best, value);
+    Arrive(start);
+    m_decided.wait(lock, [this]() { return m_waiting == 0; });
+    // the metric is a mean of squares, lower is better
+    return (value > m_best * (1.0 + m_margin));
+  }
+
+  //! The start will not report the warm-up iteration (anymore), e.g. its coarsest level stopped earlier or failed
+  void Leave(unsigned int start)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_arrived[start])
+    {
+      Arrive(start);
+    }
+  }
+
+private:
+  //! Count a start as arrived at the barrier; the last one wakes up the others
+  void Arrive(unsigned int start)
+  {
+    m_arrived[start] = true;
+    if (--m_waiting == 0)
+    {
+      m_decided.notify_all();
+    }
+  }
+
+  unsigned int m_warmup;
+  double m_margin;
+  unsigned int m_waiting; //! starts that have neither reported the warm-up iteration nor left
+  std::vector<bool> m_arrived;
+  double m_best; //! best value at the warm-up iteration, over all starts
+  std::mutex m_mutex;
+  std::condition_variable m_decided;
+};
+
+/**
+\brief Reports every iteration of an optimizer to a MultiStartBoard and stops the optimizer once it is behind
+*/
+class MultiStartObserver : public itk::Command
+{
+public:
+  typedef MultiStartObserver Self;
+  typedef itk::Command Superclass;
+  typedef itk::SmartPointer<Self> Pointer;
+  itkNewMacro(Self);
+
+  typedef itk::RegularStepGradientDescentOptimizer OptimizerType;
+
+  void SetBoard(MultiStartBoard *board, unsigned int start)
+  {
+    m_board = board;
+    m_start = start;
+  }
+
+  bool GetCancelled() const
+  {
+    return m_cancelled;
+  }
+
+  void Execute(itk::Object *caller, const itk::EventObject &event) override
+  {
+    if (!itk::IterationEvent().CheckEvent(&event))
+    {
+      return;
+    }
+    OptimizerType *optimizer = static_cast<OptimizerType *>(caller);
+    if (m_board->Report(m_start, optimizer->GetCurrentIteration(), optimizer->GetValue()))
+    {
+      m_cancelled = true;
+      optimizer->StopOptimization();
+    }
+  }
+
+  void Execute(const itk::Object *, const itk::EventObject &) override
+  {
+  }
+
+protected:
+  MultiStartObserver() : m_board(NULL), m_start(0), m_cancelled(false)
+  {
+  }
+
+private:
+  MultiStartBoard *m_board;
+  unsigned int m_start;
+  bool m_cancelled;
+};
+
+/**
+\brief Run the levels of a registration from the given initial transform
+
+\param fixed The prepared fixed image; only read, so it can be shared between threads
+\param movingLevels Moving image of every level as given by prepareMovingImage(); only read as well
+\param options How the registration is to be done
+\param initialTransform Center and parameters to start from
+\param board If given, the coarsest level reports to it and the registration stops when it is behind
+\param start Number of the start in a multi-start registration, for the telemetry
+\param checkpointKey If not empty, the registration resumes after the last level checkpointed under this key in
+options.cache and checkpoints every level it finishes
+\param movingGradients If given, the gradient of the moving image of every level (see
+ParallelMeanSquaresMetric::ComputeMovingGradient()); otherwise every level computes its own
+*/
+template <typename TImageType>
+RegistrationResult registerLevels(const FixedImageState<TImageType> &fixed,
+  const std::vector<RegistrationImageType::Pointer> &movingLevels,
+  const RegistrationOptions &options,
+  const TransformType *initialTransform,
+  MultiStartBoard *board = NULL,
+  unsigned int start = 0,
+  const std::string &checkpointKey = std::string(),
+  const std::vector<ParallelMeanSquaresMetric<RegistrationImageType, RegistrationImageType>::GradientImageType::Pointer> *movingGradients = NULL)
+{
+  typedef itk::ImageRegistrationMethod<RegistrationImageType, RegistrationImageType> RegistrationType;
+  typedef itk::RegularStepGradientDescentOptimizer OptimizerType;
+  typedef ParallelMeanSquaresMetric<RegistrationImageType, RegistrationImageType> MetricType;
+  typedef itk::LinearInterpolateImageFunction<RegistrationImageType, double> InterpolatorType;
+
+  const unsigned int levels = static_cast<unsigned int>(fixed.levels.size());
+  auto t1 = std::chrono::high_resolution_clock::now();
+
+  RegistrationResult result;
+  result.fixedParameters = initialTransform->GetFixedParameters();
+  result.parameters = initialTransform->GetParameters();
+  result.metricValue = std::numeric_limits<double>::quiet_NaN();
+  double maximumStepLength = options.maximumStepLength;
+  unsigned int firstLevel = 0;
+  if (!checkpointKey.empty())
+  {
+    unsigned int checkpointLevel;
+    const TransformType::Pointer checkpoint = options.cache->LoadCheckpoint(checkpointKey, levels, checkpointLevel);
+    if (checkpoint)
+    {
+      result.fixedParameters = checkpoint->GetFixedParameters();
+      result.parameters = checkpoint->GetParameters();
+      firstLevel = checkpointLevel + 1;
+      maximumStepLength = std::ldexp(maximumStepLength, -static_cast<int>(firstLevel));
+      if (options.verbose)
+      {
+        std::cout << "Resuming after level " << checkpointLevel << " from " << options.cache->GetDirectory() << "\n";
+      }
+    }
+  }
+
+  for (unsigned int level = firstLevel; level < levels; level++)
+  {
+    MetricType::Pointer metric = MetricType::New();
+    InterpolatorType::Pointer interpolator = InterpolatorType::New();
+    RegistrationType::Pointer registration = RegistrationType::New();
+    TransformType::Pointer transform = TransformType::New();
+    OptimizerType::Pointer optimizer = OptimizerType::New();
+
+    // set the parameters
+    registration->SetMetric(metric);
+    registration->SetOptimizer(optimizer);
+    registration->SetTransform(transform);
+    registration->SetInterpolator(interpolator);
+    transform->SetFixedParameters(result.fixedParameters); // center of rotation
+
+    // set the inputs; the pipeline writes into its input images (requested region, modification time), so every
+    // registration gets its own image objects that share the pixels of the prepared images
+    RegistrationImageType::Pointer fixedLevel = RegistrationImageType::New();
+    fixedLevel->Graft(fixed.levels[level]);
+    RegistrationImageType::Pointer movingLevel = RegistrationImageType::New();
+    movingLevel->Graft(movingLevels[level]);
+    registration->SetFixedImage(fixedLevel);
+    registration->SetMovingImage(movingLevel);
+    registration->SetFixedImageRegion(fixedLevel->GetLargestPossibleRegion());
+
+    // compute the metric over the samples only
+    metric->SetFixedImageOffsets(&fixed.samples[level]);
+    if (movingGradients != NULL)
+    {
+      metric->SetComputeGradient(false);
+      metric->SetMovingGradientImage((*movingGradients)[level]);
+    }
+    metric->SetNumberOfWorkers(options.threads);
+
+    // start from the transform of the coarser level
+    registration->SetInitialTransformParameters(result.parameters);
+
+    optimizer->SetMaximumStepLength(maximumStepLength);
+    optimizer->SetMinimumStepLength(options.minimumStepLength);
+    optimizer->SetNumberOfIterations(options.GetIterations(level));
+
+    MultiStartObserver::Pointer observer;
+    if ((board != NULL) && (level == 0))
+    {
+      observer = MultiStartObserver::New();
+      observer->SetBoard(board, start);
+      optimizer->AddObserver(itk::IterationEvent(), observer);
+    }
+    if (options.telemetry != NULL)
+    {
+      TelemetryObserver<MetricType>::Pointer telemetry = TelemetryObserver<MetricType>::New();
+      telemetry->Setup(options.telemetry, metric, options.runName, start, level, t1);
+      optimizer->AddObserver(itk::IterationEvent(), telemetry);
+      optimizer->AddObserver(itk::EndEvent(), telemetry);
+    }
+
+    if (options.verbose)
+    {
+      std::cout << "Level " << level << ": " << fixedLevel->GetLargestPossibleRegion().GetSize() << " voxels, " <<
+        fixed.samples[level].size() << " samples, " << optimizer->GetNumberOfIterations() << " iterations\n";
+    }
+    registration->Update();
+    if (observer)
+    {
+      board->Leave(start); // in case the level stopped before the warm-up iteration
+    }
+
+    result.parameters = registration->GetLastTransformParameters();
+    result.metricValue = optimizer->GetValue();
+    maximumStepLength *= 0.5;
+    if (observer && observer->GetCancelled())
+    {
+      result.cancelled = true;
+      break;
+    }
+    if (!checkpointKey.empty() && (level + 1 < levels))
+    {
+      options.cache->StoreCheckpoint(checkpointKey, level, result.GetTransform());
+    }
+  }
+
+  auto t2 = std::chrono::high_resolution_clock::now();
+  result.milliseconds = std::chrono::duration<double, std::milli>(t2 - t1).count();
+  return result;
+}
+
+/**
+\brief Initial transforms of a multi-start registration
+
+All rotate about the center of mass of the fixed image and move it onto the center of mass of the moving
+image. The first start does not rotate, the others rotate by +-angle about x, y and z in turn, then by
++-2 angle and so on.
+
+\param fixedImage Fixed image, for its center of mass
+\param movingImage Moving image, for its center of mass
+\param starts Number of initial transforms
+\param angle Rotation step in degrees
+*/
+template <typename TImageType>
+std::vector<TransformType::Pointer> multiStartTransforms(const TImageType *fixedImage,
+  const TImageType *movingImage,
+  unsigned int starts,
+  double angle)
+{
+  typedef itk::ImageMomentsCalculator<TImageType> MomentsType;
+  typename MomentsType::Pointer fixedMoments = MomentsType::New();
+  fixedMoments->SetImage(fixedImage);
+  fixedMoments->Compute();
+  typename MomentsType::Pointer movingMoments = MomentsType::New();
+  movingMoments->SetImage(movingImage);
+  movingMoments->Compute();
+
+  TransformType::InputPointType center;
+  TransformType::OutputVectorType translation;
+  for (unsigned int d = 0; d < 3; d++)
+  {
+    center[d] = fixedMoments->GetCenterOfGravity()[d];
+    translation[d] = movingMoments->GetCenterOfGravity()[d] - fixedMoments->GetCenterOfGravity()[d];
+  }
+
+  std::vector<TransformType::Pointer> transforms;
+  for (unsigned int start = 0; start < starts; start++)
+  {
+    TransformType::Pointer transform = TransformType::New();
+    transform->SetCenter(center);
+    if (start > 0)
+    {
+      const unsigned int step = start - 1;
+      const unsigned int axis = (step / 2) % 3;
+      const double radians = ((step % 2 == 0) ? 1.0 : -1.0) * angle * (step / 6 + 1) * 3.14159265358979323846 / 180.0;
+      transform->Rotate((axis + 1) % 3, (axis + 2) % 3, radians); // rotation in the plane normal to the axis
+    }
+    transform->Translate(translation);
+    transforms.push_back(transform);
+  }
+  return transforms;
+}
+
+/**
+\brief Register a moving image to a prepared fixed image, coarse to fine
+
+With options.starts > 1, that many registrations from different initial transforms (see
+multiStartTransforms()) run at the same time on the same prepared images and the one with the lowest final
+metric is kept; starts that fall behind on the coarsest level are cancelled early.
+
+With options.cache set, a registration of the same images with the same options that finished before is not
+run again, and a single-start registration that was interrupted resumes after its last finished level.
+
+\param fixed The prepared fixed image; only read, so it can be shared between threads
+\param movingImage itk::Image::Pointer to moving image
+\param options How the registration is to be done; the levels need to match those of the fixed image
+*/
+template <typename TImageType>
+RegistrationResult registerToFixed(const FixedImageState<TImageType> &fixed,
+  typename TImageType::Pointer movingImage,
+  const RegistrationOptions &options)
+{
+  auto t1 = std::chrono::high_resolution_clock::now();
+  const unsigned int levels = static_cast<unsigned int>(fixed.levels.size());
+
+  RegistrationResult result;
+  std::string key;
+  if (options.cache != NULL)
+  {
+    ContentHasher hash = fixed.hash;
+    hash.AddImage(movingImage.GetPointer());
+    key = hash.GetHex();
+    const TransformType::Pointer cached = options.cache->Load(key);
+    if (cached)
+    {
+      result.fixedParameters = cached->GetFixedParameters();
+      result.parameters = cached->GetParameters();
+      result.metricValue = std::numeric_limits<double>::quiet_NaN();
+      result.cached = true;
+      return result;
+    }
+  }
+
+  const std::vector<RegistrationImageType::Pointer> movingLevels = prepareMovingImage<TImageType>(movingImage, levels);
+  if (options.starts <= 1)
+  {
+    TransformType::Pointer identity = TransformType::New();
+    identity->SetIdentity();
+    result = registerLevels<TImageType>(fixed, movingLevels, options, identity, NULL, 0, key);
+  }
+  else
+  {
+    const std::vector<TransformType::Pointer> initialTransforms =
+      multiStartTransforms<RegistrationImageType>(fixed.levels.back(), movingLevels.back(), options.starts, options.startAngle);
+
+    // the starts share the cores and do not print their levels
+    RegistrationOptions startOptions = options;
+    startOptions.verbose = false;
+    if (startOptions.threads == 0)
+    {
+      startOptions.threads = std::max(1u, std::thread::hardware_concurrency() / options.starts);
+    }
+
+    // the starts share the moving images and their gradients, computed once per level
+    typedef ParallelMeanSquaresMetric<RegistrationImageType, RegistrationImageType> MetricType;
+    std::vector<MetricType::GradientImageType::Pointer> movingGradients;
+    for (unsigned int level = 0; level < levels; level++)
+    {
+      movingGradients.push_back(MetricType::ComputeMovingGradient(movingLevels[level]));
+    }
+
+    MultiStartBoard board(options.starts, options.startWarmup, options.startMargin);
+    std::vector<RegistrationResult> results(options.starts);
+    std::vector<std::string> errors(options.starts);
+    auto runStart = [&](unsigned int start)
+    {
+      try
+      {
+        results[start] = registerLevels<TImageType>(fixed, movingLevels, startOptions, initialTransforms[start], &board, start,
+          std::string(), &movingGradients);
+      }
+      catch (itk::ExceptionObject &error)
+      {
+        errors[start] = error.GetDescription();
+      }
+      board.Leave(start); // the other starts must not wait for a start that failed
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned int start = 1; start < options.starts; start++)
+    {
+      workers.push_back(std::thread(runStart, start));
+    }
+    runStart(0);
+    for (size_t t = 0; t < workers.size(); t++)
+    {
+      workers[t].join();
+    }
+
+    int best = -1;
+    for (unsigned int start = 0; start < options.starts; start++)
+    {
+      if (options.verbose)
+      {
+        std::cout << "Start " << start << ": ";
+        if (!errors[start].empty())
+        {
+          std::cout << "failed, " << errors[start] << "\n";
+        }
+        else
+        {
+          std::cout << (results[start].cancelled ? "cancelled" : "final") << " metric " << results[start].metricValue << "\n";
+        }
+      }
+      if (errors[start].empty() && !results[start].cancelled &&
+        ((best < 0) || (results[start].metricValue < results[best].metricValue)))
+      {
+        best = start;
+      }
+    }
+    if (best < 0)
+    {
+      itkGenericExceptionMacro("None of the " << options.starts << " starts finished");
+    }
+    if (options.verbose)
+    {
+      std::cout << "Kept start " << best << "\n";
+    }
+    result = results[best];
+  }
+  if (options.cache != NULL)
+  {
+    options.cache->Store(key, result.GetTransform(), levels);
+  }
+
+  auto t2 = std::chrono::high_resolution_clock::now();
+  result.milliseconds = std::chrono::duration<double, std::milli>(t2 - t1).count();
+  return result;
+}
+
+/**
+\brief Resample the moving image through the affine transform and write it
+
+\param movingImage itk::Image::Pointer to moving image
+\param transform Affine transform as found by the registration
+\param outputFileName File name of output
+*/
+template <typename TImageType>
+void resampleMovingImage(typename TImageType::Pointer movingImage,
+  const TransformType *transform,
+  const std::string &outputFileName)
+{
+  // apply transformation matrix to moving image, on the grid of the moving image
+  typename TImageType::Pointer resampled = resampleAffine<TImageType>(movingImage.GetPointer(), transform, movingImage.GetPointer(), 0);
+
+  typedef itk::ImageFileWriter<TImageType> WriterType;
+  typename WriterType::Pointer writer = WriterType::New();
+  writer->SetFileName(outputFileName);
+  writer->SetInput(resampled);
+  writer->Update();
+}
+
+//! Write the affine transform as an ITK transform file (e.g. .tfm or .txt)
+inline void writeTransform(const TransformType *transform, const std::string &fileName)
+{
+  itk::TransformFileWriter::Pointer writer = itk::TransformFileWriter::New();
+  writer->SetInput(transform);
+  writer->SetFileName(fileName);
+  writer->Update();
+}
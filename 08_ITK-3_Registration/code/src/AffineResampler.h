@@ -0,0 +1,192 @@
+/**
+\file AffineResampler.h
+
+\brief Resampling of a 3D image through an affine transform, row by row
+
+itk::ResampleImageFilter maps every output voxel to a physical point, through the transform and back to a
+continuous index of the input, and then calls the interpolator on it. For an affine transform all of this is
+one affine map from output index to input index: c = G * i + h. AffineIndexMap works this map out once and
+walks the output rows by adding the first column of G; resampleAffine() interpolates every row in one call
+to TrilinearInterpolator. The slices of the output are shared out among the threads.
+
+Points that map outside of the input get the default value. Like ResampleImageFilter, interpolated values
+are clamped to the range of the pixel type and then cast.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <thread>
+#include <vector>
+
+#include "itkImage.h"
+#include "itkMatrixOffsetTransformBase.h"
+
+#include "TrilinearInterpolator.h"
+
+/**
+\brief Affine map from the index of an output voxel to the continuous index of the input: c = G * i + h
+*/
+class AffineIndexMap
+{
+public:
+  /**
+  \brief Work out the map
+
+  \param input Grid of the image to resample
+  \param transform Affine transform from the output grid to the input, as used by ResampleImageFilter
+  \param reference Grid of the output; the voxels are counted in its largest possible region
+  */
+  AffineIndexMap(const itk::ImageBase<3> *input, const itk::MatrixOffsetTransformBase<double, 3, 3> *transform,
+    const itk::ImageBase<3> *reference)
+  {
+    typedef itk::Matrix<double, 3, 3> MatrixType;
+    const MatrixType inputToIndex = input->GetPhysicalPointToIndex();
+    const MatrixType outputToPoint = reference->GetIndexToPhysicalPoint();
+    const MatrixType A = transform->GetMatrix();
+
+    // G = P2I_in * A * I2P_out and h = P2I_in * (A * O_out + offset - O_in)
+    const MatrixType M = inputToIndex * A * outputToPoint;
+    double shifted[3];
+    for (unsigned int r = 0; r < 3; r++)
+    {
+      shifted[r] = transform->GetOffset()[r] - input->GetOrigin()[r];
+      for (unsigned int c = 0; c < 3; c++)
+      {
+        shifted[r] += A(r, c) * reference->GetOrigin()[c];
+        m_G[r][c] = M(r, c);
+      }
+    }
+    for (unsigned int r = 0; r < 3; r++)
+    {
+      m_h[r] = inputToIndex(r, 0) * shifted[0] + inputToIndex(r, 1) * shifted[1] + inputToIndex(r, 2) * shifted[2];
+    }
+
+    const itk::ImageRegion<3> region = reference->GetLargestPossibleRegion();
+    for (unsigned int d = 0; d < 3; d++)
+    {
+      m_start[d] = region.GetIndex()[d];
+      m_size[d] = region.GetSize()[d];
+    }
+  }
+
+  //! Number of voxels of the output
+  size_t GetNumberOfVoxels() const
+  {
+    return m_size[0] * m_size[1] * m_size[2];
+  }
+
+  //! Continuous input indices of the 'count' output voxels from 'offset' on, in buffer order; may span rows
+  void Fill(size_t offset, size_t count, float *x, float *y, float *z) const
+  {
+    while (count > 0)
+    {
+      const size_t i = offset % m_size[0], j = (offset / m_size[0]) % m_size[1], k = offset / (m_size[0] * m_size[1]);
+      const size_t run = std::min(count, m_size[0] - i);
+
+      // continuous index of the first voxel of the run, then one step of the first column per voxel
+      const double index[3] = { static_cast<double>(m_start[0] + static_cast<itk::IndexValueType>(i)),
+        static_cast<double>(m_start[1] + static_cast<itk::IndexValueType>(j)),
+        static_cast<double>(m_start[2] + static_cast<itk::IndexValueType>(k)) };
+      double base[3];
+      for (unsigned int d = 0; d < 3; d++)
+      {
+        base[d] = m_G[d][0] * index[0] + m_G[d][1] * index[1] + m_G[d][2] * index[2] + m_h[d];
+      }
+      for (size_t n = 0; n < run; n++)
+      {
+        x[n] = static_cast<float>(base[0] + n * m_G[0][0]);
+        y[n] = static_cast<float>(base[1] + n * m_G[1][0]);
+        z[n] = static_cast<float>(base[2] + n * m_G[2][0]);
+      }
+      x += run;
+      y += run;
+      z += run;
+      offset += run;
+      count -= run;
+    }
+  }
+
+private:
+  double m_G[3][3], m_h[3];
+  itk::IndexValueType m_start[3];
+  size_t m_size[3];
+};
+
+//! Interpolated values clamped to the range of the pixel type and cast, like ResampleImageFilter does
+template <typename TPixelType>
+void castInterpolatedValues(const float *values, size_t count, TPixelType *output)
+{
+  const double lowest = static_cast<double>(std::numeric_limits<TPixelType>::lowest());
+  const double highest = static_cast<double>(std::numeric_limits<TPixelType>::max());
+  for (size_t i = 0; i < count; i++)
+  {
+    output[i] = static_cast<TPixelType>(std::min(std::max(static_cast<double>(values[i]), lowest), highest));
+  }
+}
+
+//! Resample slices [firstSlice, lastSlice) of the output
+template <class TImageType>
+void resampleAffineSlices(const TrilinearInterpolator<TImageType> &interpolator, const AffineIndexMap &map,
+  const typename TImageType::RegionType &region, float defaultValue, unsigned int firstSlice, unsigned int lastSlice,
+  typename TImageType::PixelType *output)
+{
+  const size_t width = region.GetSize()[0], height = region.GetSize()[1];
+  std::vector<float> x(width), y(width), z(width), values(width);
+  for (size_t row = firstSlice * height; row < lastSlice * height; row++)
+  {
+    map.Fill(row * width, width, x.data(), y.data(), z.data());
+    interpolator.Evaluate(x.data(), y.data(), z.data(), width, values.data(), NULL, defaultValue);
+    castInterpolatedValues(values.data(), width, output + row * width);
+  }
+}
+
+/**
+\brief Resample an image through an affine transform onto the grid of a reference image
+
+\param input The image to resample
+\param transform Affine transform from the reference (output) grid to the input, as used by ResampleImageFilter
+\param reference Image whose origin, spacing, direction and largest possible region give the output grid
+\param defaultValue Value of the voxels that map outside of the input
+\param threads Number of threads; 0 picks the hardware concurrency
+\return The resampled image
+*/
+template <class TImageType>
+typename TImageType::Pointer resampleAffine(const TImageType *input,
+  const itk::MatrixOffsetTransformBase<double, 3, 3> *transform,
+  const itk::ImageBase<3> *reference,
+  typename TImageType::PixelType defaultValue,
+  unsigned int threads = 0)
+{
+  const AffineIndexMap map(input, transform, reference);
+
+  typename TImageType::Pointer output = TImageType::New();
+  output->CopyInformation(reference);
+  output->SetRegions(reference->GetLargestPossibleRegion());
+  output->Allocate();
+
+  TrilinearInterpolator<TImageType> interpolator;
+  interpolator.SetInputImage(input);
+
+  const typename TImageType::RegionType region = output->GetBufferedRegion();
+  const unsigned int slices = static_cast<unsigned int>(region.GetSize()[2]);
+  threads = (threads == 0) ? std::max(1u, std::thread::hardware_concurrency()) : threads;
+  threads = std::max(1u, std::min(threads, slices));
+
+  std::vector<std::thread> workers;
+  for (unsigned int t = 1; t < threads; t++)
+  {
+    workers.push_back(std::thread(resampleAffineSlices<TImageType>, std::cref(interpolator), std::cref(map), std::cref(region),
+      static_cast<float>(defaultValue), slices * t / threads, slices * (t + 1) / threads, output->GetBufferPointer()));
+  }
+  resampleAffineSlices<TImageType>(interpolator, map, region, static_cast<float>(defaultValue), 0, slices / threads,
+    output->GetBufferPointer());
+  for (size_t t = 0; t < workers.size(); t++)
+  {
+    workers[t].join();
+  }
+
+  return output;
+}
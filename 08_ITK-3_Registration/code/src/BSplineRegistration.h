@@ -0,0 +1,213 @@
+/**
+\file BSplineRegistration.h
+
+\brief Deformable (cubic B-spline free-form deformation) stage after the affine registration
+
+The moving image is first resampled through the affine onto the grid of the fixed image. A B-spline
+transform whose control point grid covers the fixed image is then registered between the fixed image and
+this affinely aligned moving image with ParallelBSplineMeanSquaresMetric, coarse to fine over the control
+point grid: options.bsplineMesh mesh elements per axis first, then twice as many at every further level,
+each level starting from the deformation of the previous one. The images stay at full resolution and the
+samples of the full resolution level of the fixed image are used; like the affine levels, both are in float.
+
+The deformable transform maps fixed to affinely aligned moving points; the whole mapping from fixed to moving
+points is the affine after it (affine(bspline(x))), see composeTransforms().
+*/
+
+#pragma once
+
+#include <chrono>
+#include <iostream>
+
+#include "itkBSplineTransform.h"
+#include "itkBSplineTransformParametersAdaptor.h"
+#include "itkCompositeTransform.h"
+#include "itkImageRegistrationMethod.h"
+#include "itkLinearInterpolateImageFunction.h"
+#include "itkRegularStepGradientDescentOptimizer.h"
+#include "itkResampleImageFilter.h"
+#include "itkTransformFileWriter.h"
+
+#include "AffineRegistration.h"
+#include "AffineResampler.h"
+#include "ParallelBSplineMeanSquaresMetric.h"
+
+typedef itk::BSplineTransform<double, 3, 3> BSplineTransformType;
+typedef itk::CompositeTransform<double, 3> CompositeTransformType;
+
+/**
+\brief What the deformable stage produced
+*/
+struct BSplineResult
+{
+  BSplineTransformType::Pointer transform; //! the deformation, from fixed to affinely aligned moving points
+  double metricValue = 0; //! metric value at the end of the finest grid level
+  double milliseconds = 0; //! wall time of the stage, including the affine resampling
+};
+
+/**
+\brief Register a B-spline deformation on top of an affine registration
+
+\param fixed The prepared fixed image; only its full resolution level and samples are used
+\param movingImage itk::Image::Pointer to moving image
+\param affine The affine found by registerToFixed()
+\param options How the registration is to be done; the bspline* members set up this stage
+*/
+template <typename TImageType>
+BSplineResult registerBSpline(const FixedImageState<TImageType> &fixed,
+  typename TImageType::Pointer movingImage,
+  const TransformType *affine,
+  const RegistrationOptions &options)
+{
+  typedef itk::ImageRegistrationMethod<RegistrationImageType, RegistrationImageType> RegistrationType;
+  typedef itk::RegularStepGradientDescentOptimizer OptimizerType;
+  typedef ParallelBSplineMeanSquaresMetric<RegistrationImageType, RegistrationImageType> MetricType;
+  typedef itk::LinearInterpolateImageFunction<RegistrationImageType, double> InterpolatorType;
+  typedef itk::BSplineTransformParametersAdaptor<BSplineTransformType> AdaptorType;
+
+  auto t1 = std::chrono::high_resolution_clock::now();
+  const RegistrationImageType::Pointer fixedImage = fixed.levels.back();
+  // resampled in float, so that the interpolated values are not rounded to the pixel type of the input
+  const RegistrationImageType::Pointer aligned = resampleAffine<RegistrationImageType>(
+    castForRegistration(movingImage.GetPointer()), affine, fixedImage, 0, options.threads);
+
+  // the control point grid covers the fixed image
+  BSplineTransformType::PhysicalDimensionsType dimensions;
+  for (unsigned int d = 0; d < 3; d++)
+  {
+    dimensions[d] = fixedImage->GetSpacing()[d] * (fixedImage->GetLargestPossibleRegion().GetSize()[d] - 1);
+  }
+  BSplineTransformType::MeshSizeType mesh;
+  mesh.Fill(options.bsplineMesh);
+
+  BSplineResult result;
+  result.transform = BSplineTransformType::New();
+  result.transform->SetTransformDomainOrigin(fixedImage->GetOrigin());
+  result.transform->SetTransformDomainPhysicalDimensions(dimensions);
+  result.transform->SetTransformDomainDirection(fixedImage->GetDirection());
+  result.transform->SetTransformDomainMeshSize(mesh);
+  BSplineTransformType::ParametersType parameters(result.transform->GetNumberOfParameters());
+  parameters.Fill(0.0);
+  result.transform->SetParametersByValue(parameters);
+
+  // the B-spline metric goes through the sampling of itk::ImageToImageMetric, which takes indexes
+  MetricType::FixedImageIndexContainer indexes;
+  indexes.reserve(fixed.samples.back().size());
+  for (size_t s = 0; s < fixed.samples.back().size(); s++)
+  {
+    indexes.push_back(fixedImage->ComputeIndex(fixed.samples.back()[s]));
+  }
+
+  for (unsigned int level = 0; level < options.bsplineLevels; level++)
+  {
+    if (level > 0)
+    {
+      // twice as many mesh elements, with the same deformation
+      for (unsigned int d = 0; d < 3; d++)
+      {
+        mesh[d] *= 2;
+      }
+      typename AdaptorType::Pointer adaptor = AdaptorType::New();
+      adaptor->SetTransform(result.transform);
+      adaptor->SetRequiredTransformDomainOrigin(result.transform->GetTransformDomainOrigin());
+      adaptor->SetRequiredTransformDomainPhysicalDimensions(result.transform->GetTransformDomainPhysicalDimensions());
+      adaptor->SetRequiredTransformDomainDirection(result.transform->GetTransformDomainDirection());
+      adaptor->SetRequiredTransformDomainMeshSize(mesh);
+      adaptor->AdaptTransformParameters();
+    }
+
+    MetricType::Pointer metric = MetricType::New();
+    InterpolatorType::Pointer interpolator = InterpolatorType::New();
+    RegistrationType::Pointer registration = RegistrationType::New();
+    OptimizerType::Pointer optimizer = OptimizerType::New();
+
+    registration->SetMetric(metric);
+    registration->SetOptimizer(optimizer);
+    registration->SetTransform(result.transform);
+    registration->SetInterpolator(interpolator);
+
+    // fresh image objects, as in registerLevels()
+    RegistrationImageType::Pointer fixedLevel = RegistrationImageType::New();
+    fixedLevel->Graft(fixedImage);
+    registration->SetFixedImage(fixedLevel);
+    registration->SetMovingImage(aligned);
+    registration->SetFixedImageRegion(fixedLevel->GetLargestPossibleRegion());
+
+    metric->SetFixedImageIndexes(indexes);
+    metric->SetUseFixedImageIndexes(true);
+    metric->SetNumberOfWorkers(options.threads);
+
+    registration->SetInitialTransformParameters(result.transform->GetParameters());
+    optimizer->SetMaximumStepLength(options.bsplineStepLength);
+    optimizer->SetMinimumStepLength(options.minimumStepLength);
+    optimizer->SetNumberOfIterations(options.bsplineIterations);
+
+    if (options.verbose)
+    {
+      std::cout << "B-spline level " << level << ": " << mesh << " mesh, " << result.transform->GetNumberOfParameters() <<
+        " parameters, " << optimizer->GetNumberOfIterations() << " iterations\n";
+    }
+    registration->Update();
+
+    // the transform refers to the parameters of the optimizer until it gets its own copy
+    result.transform->SetParametersByValue(registration->GetLastTransformParameters());
+    result.metricValue = optimizer->GetValue();
+  }
+
+  auto t2 = std::chrono::high_resolution_clock::now();
+  result.milliseconds = std::chrono::duration<double, std::milli>(t2 - t1).count();
+  return result;
+}
+
+//! The mapping from fixed to moving points: the deformation first, then the affine
+inline CompositeTransformType::Pointer composeTransforms(const TransformType *affine, const BSplineTransformType *bspline)
+{
+  CompositeTransformType::Pointer composite = CompositeTransformType::New();
+  // the transform added last is applied first
+  composite->AddTransform(const_cast<TransformType *>(affine));
+  composite->AddTransform(const_cast<BSplineTransformType *>(bspline));
+  return composite;
+}
+
+/**
+\brief Resample the moving image through affine and deformation onto the grid of the fixed image and write it
+
+\param movingImage itk::Image::Pointer to moving image
+\param fixedImage Image whose grid the output is on
+\param transform The whole mapping as given by composeTransforms()
+\param outputFileName File name of output
+*/
+template <typename TImageType>
+void resampleDeformed(typename TImageType::Pointer movingImage,
+  const itk::ImageBase<3> *fixedImage,
+  const CompositeTransformType *transform,
+  const std::string &outputFileName)
+{
+  typedef itk::LinearInterpolateImageFunction<TImageType, double> InterpolatorType;
+  typedef itk::ResampleImageFilter<TImageType, TImageType> ResampleFilterType;
+  typename ResampleFilterType::Pointer resampler = ResampleFilterType::New();
+  resampler->SetInput(movingImage);
+  resampler->SetTransform(transform);
+  resampler->SetInterpolator(InterpolatorType::New());
+  resampler->SetSize(fixedImage->GetLargestPossibleRegion().GetSize());
+  resampler->SetOutputOrigin(fixedImage->GetOrigin());
+  resampler->SetOutputSpacing(fixedImage->GetSpacing());
+  resampler->SetOutputDirection(fixedImage->GetDirection());
+  resampler->SetDefaultPixelValue(0);
+
+  typedef itk::ImageFileWriter<TImageType> WriterType;
+  typename WriterType::Pointer writer = WriterType::New();
+  writer->SetFileName(outputFileName);
+  writer->SetInput(resampler->GetOutput());
+  writer->Update();
+}
+
+//! Write affine and deformation into one ITK transform file, in the order of composeTransforms()
+inline void writeTransforms(const TransformType *affine, const BSplineTransformType *bspline, const std::string &fileName)
+{
+  itk::TransformFileWriter::Pointer writer = itk::TransformFileWriter::New();
+  writer->SetInput(affine);
+  writer->AddTransform(bspline);
+  writer->SetFileName(fileName);
+  writer->Update();
+}
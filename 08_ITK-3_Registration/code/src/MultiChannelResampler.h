@@ -0,0 +1,389 @@
+/**
+\file MultiChannelResampler.h
+
+\brief Resampling of several images on the same grid through one affine transform in a single pass
+
+Resampling T1, T2, FLAIR and label maps of a subject with one ResampleImageFilter each maps every output
+voxel into the input once per image. MultiChannelResampler maps the voxels once for all channels: the output
+is cut into tiles of consecutive voxels, the continuous input indices of a tile are computed with
+AffineIndexMap and then every channel is interpolated at them, linearly (TrilinearInterpolator) for
+intensities and with the nearest voxel for labels, whose values are copied exactly. The threads take the
+tiles one after the other and keep their coordinate buffers, so nothing is allocated per tile.
+
+All channels need to be on the same grid (origin, spacing, direction and region), as the images of a subject
+usually are after conversion. Every channel is written to its own file.
+
+The output grid is resampled in slabs of whole slices, at most SetSlabVoxels() voxels each, and every slab is
+pasted into the output files (itk::ImageFileWriter::SetIORegion(), as in StreamingRegionGrowing) before the
+next one is resampled. Besides the inputs, which are needed whole for the random access of the interpolation,
+a channel then holds one slab of its output. Files that cannot be written in parts (e.g. compressed .nii.gz)
+keep their whole output in memory until the end.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "itkImage.h"
+#include "itkImageFileWriter.h"
+#include "itkImageIOFactory.h"
+#include "itksys/SystemTools.hxx"
+
+#include "AffineResampler.h"
+#include "TrilinearInterpolator.h"
+
+/**
+\brief One image to resample, in its own pixel type
+*/
+class ResampleChannel
+{
+public:
+  virtual ~ResampleChannel()
+  {
+  }
+
+  //! The image to resample, for its grid
+  virtual const itk::ImageBase<3> *GetInput() const = 0;
+
+  /**
+  \brief Set up the output on the grid of the reference image
+  \return true if the output is written slab by slab, false if it is allocated whole and written by End()
+  */
+  virtual bool Begin(const itk::ImageBase<3> *reference) = 0;
+
+  //! The voxels of this slab of the output grid are resampled next
+  virtual void BeginSlab(const itk::ImageRegion<3> &slab) = 0;
+
+  /**
+  \brief Resample the output voxels [offset, offset + count), all in the current slab
+
+  Called from several threads at the same time, for different voxels.
+
+  \param x, y, z Continuous input indices of the voxels
+  \param offset Linear offset of the first voxel in the output grid
+  \param scratch Buffer of at least count floats the channel may use
+  */
+  virtual void Resample(const float *x, const float *y, const float *z, size_t offset, size_t count, float *scratch) const = 0;
+
+  //! The current slab is resampled; a streamed output writes and frees it
+  virtual void EndSlab() = 0;
+
+  //! All slabs are resampled; an output that is not streamed is written
+  virtual void End() = 0;
+};
+
+/**
+\brief A channel of pixel type TImageType::PixelType, interpolated linearly or with the nearest voxel
+*/
+template <class TImageType>
+class ImageResampleChannel : public ResampleChannel
+{
+public:
+  typedef typename TImageType::PixelType PixelType;
+
+  /**
+  \param input The image to resample
+  \param outputFileName File the resampled image is written to
+  \param label true for nearest voxel interpolation (label maps), false for linear interpolation
+  \param defaultValue Value of the voxels that map outside of the input
+  */
+  ImageResampleChannel(typename TImageType::Pointer input, const std::string &outputFileName, bool label,
+    PixelType defaultValue = 0) :
+    m_input(input), m_outputFileName(outputFileName), m_label(label), m_reference(NULL), m_streamed(false),
+    m_outputOffset(0), m_defaultValue(defaultValue)
+  {
+    m_interpolator.SetInputImage(input);
+    const typename TImageType::RegionType region = input->GetBufferedRegion();
+    for (unsigned int d = 0; d < 3; d++)
+    {
+      m_start[d] = region.GetIndex()[d];
+      m_size[d] = region.GetSize()[d];
+    }
+  }
+
+  const itk::ImageBase<3> *GetInput() const override
+  {
+    return m_input;
+  }
+
+  bool Begin(const itk::ImageBase<3> *reference) override
+  {
+    m_reference = reference;
+    m_outputOffset = 0;
+    m_writer = WriterType::New();
+    m_writer->SetFileName(m_outputFileName);
+
+    // the IO of compressed files can say it streams, but cannot paste into them
+    itk::ImageIOBase::Pointer outputIO = itk::ImageIOFactory::CreateImageIO(m_outputFileName.c_str(), itk::ImageIOFactory::WriteMode);
+    m_streamed = outputIO.IsNotNull() && outputIO->CanStreamWrite() &&
+      (itksys::SystemTools::GetFilenameLastExtension(m_outputFileName) != ".gz");
+    if (m_streamed)
+    {
+      std::remove(m_outputFileName.c_str()); // the slabs are pasted into a fresh file
+      return true;
+    }
+
+    std::cerr << "WARNING: '" << m_outputFileName << "' cannot be written in parts, its whole output is kept in memory.\n";
+    m_output = NewOutput(reference->GetLargestPossibleRegion());
+    return false;
+  }
+
+  void BeginSlab(const itk::ImageRegion<3> &slab) override
+  {
+    if (m_streamed)
+    {
+      const itk::ImageRegion<3> largest = m_reference->GetLargestPossibleRegion();
+      m_outputOffset = (slab.GetIndex()[2] - largest.GetIndex()[2]) * largest.GetSize()[0] * largest.GetSize()[1];
+      m_output = NewOutput(slab);
+    }
+  }
+
+  void Resample(const float *x, const float *y, const float *z, size_t offset, size_t count, float *scratch) const override
+  {
+    PixelType *output = m_output->GetBufferPointer() + (offset - m_outputOffset);
+    if (!m_label)
+    {
+      m_interpolator.Evaluate(x, y, z, count, scratch, NULL, static_cast<float>(m_defaultValue));
+      castInterpolatedValues(scratch, count, output);
+      return;
+    }
+
+    // the voxel whose center is nearest, inside on the same interval as the linear interpolation
+    const PixelType *buffer = m_input->GetBufferPointer();
+    for (size_t n = 0; n < count; n++)
+    {
+      const float c[3] = { x[n], y[n], z[n] };
+      size_t index[3];
+      bool inside = true;
+      for (unsigned int d = 0; (d < 3) && inside; d++)
+      {
+        const double rounded = std::floor(c[d] + 0.5) - m_start[d];
+        inside = (rounded >= 0) && (rounded < m_size[d]);
+        index[d] = inside ? static_cast<size_t>(rounded) : 0;
+      }
+      output[n] = inside ? buffer[index[0] + m_size[0] * (index[1] + m_size[1] * index[2])] : m_defaultValue;
+    }
+  }
+
+  void EndSlab() override
+  {
+    if (!m_streamed)
+    {
+      return;
+    }
+    const itk::ImageRegion<3> largest = m_reference->GetLargestPossibleRegion(), slab = m_output->GetBufferedRegion();
+    itk::ImageIORegion ioRegion(3);
+    for (unsigned int d = 0; d < 3; d++)
+    {
+      ioRegion.SetIndex(d, slab.GetIndex()[d] - largest.GetIndex()[d]);
+      ioRegion.SetSize(d, slab.GetSize()[d]);
+    }
+    m_writer->SetInput(m_output);
+    m_writer->SetIORegion(ioRegion);
+    m_writer->Write();
+    m_output = NULL;
+  }
+
+  void End() override
+  {
+    if (!m_streamed)
+    {
+      m_writer->SetInput(m_output);
+      m_writer->Update();
+      m_output = NULL;
+    }
+    m_writer = NULL;
+  }
+
+private:
+  typedef itk::ImageFileWriter<TImageType> WriterType;
+
+  //! Output image on the grid of the reference image, with the given region in memory
+  typename TImageType::Pointer NewOutput(const itk::ImageRegion<3> &region) const
+  {
+    typename TImageType::Pointer output = TImageType::New();
+    output->CopyInformation(m_reference);
+    output->SetLargestPossibleRegion(m_reference->GetLargestPossibleRegion());
+    output->SetBufferedRegion(region);
+    output->SetRequestedRegion(region);
+    output->Allocate();
+    return output;
+  }
+
+  typename TImageType::Pointer m_input, m_output;
+  std::string m_outputFileName;
+  bool m_label;
+  const itk::ImageBase<3> *m_reference; //! grid of the output, set by Begin()
+  typename WriterType::Pointer m_writer;
+  bool m_streamed; //! the output is written slab by slab
+  size_t m_outputOffset; //! linear offset of the first voxel of m_output in the output grid
+  PixelType m_defaultValue;
+  TrilinearInterpolator<TImageType> m_interpolator;
+  double m_start[3];
+  size_t m_size[3];
+};
+
+/**
+\brief Resamples all its channels through one transform, mapping every output voxel only once
+*/
+class MultiChannelResampler
+{
+public:
+  //! Voxels per tile; the coordinates of a tile (12 bytes per voxel) stay in the cache while the channels use them
+  static const size_t VoxelsPerTile = 4096;
+
+  //! Default output voxels per slab, e.g. 64 MB of a float channel
+  static const size_t DefaultSlabVoxels = size_t(1) << 24;
+
+  //! Default Constructor
+  MultiChannelResampler() : m_threads(0), m_slabVoxels(DefaultSlabVoxels)
+  {
+  }
+
+  //! Add a channel; all channels need to be on the grid of the first one
+  void AddChannel(std::unique_ptr<ResampleChannel> channel)
+  {
+    if (!m_channels.empty())
+    {
+      if (!SameGrid(m_channels.front()->GetInput(), channel->GetInput()))
+      {
+        itkGenericExceptionMacro("All channels need to be on the same grid as the first one");
+      }
+    }
+    m_channels.push_back(std::move(channel));
+  }
+
+  size_t GetNumberOfChannels() const
+  {
+    return m_channels.size();
+  }
+
+  //! Number of threads; 0 picks the hardware concurrency
+  void SetNumberOfThreads(unsigned int threads)
+  {
+    m_threads = threads;
+  }
+
+  //! Output voxels per slab, rounded to whole slices (at least one); every streamed channel holds one slab
+  void SetSlabVoxels(size_t voxels)
+  {
+    m_slabVoxels = voxels;
+  }
+
+  /**
+  \brief Resample every channel onto the grid of the reference image and write it, slab by slab
+
+  \param transform Affine transform from the reference (output) grid to the channels, as used by ResampleImageFilter
+  \param reference Image whose origin, spacing, direction and largest possible region give the output grid
+  */
+  void Resample(const itk::MatrixOffsetTransformBase<double, 3, 3> *transform, const itk::ImageBase<3> *reference)
+  {
+    if (m_channels.empty())
+    {
+      return;
+    }
+    const AffineIndexMap map(m_channels.front()->GetInput(), transform, reference);
+    bool streamed = false;
+    for (size_t c = 0; c < m_channels.size(); c++)
+    {
+      streamed = m_channels[c]->Begin(reference) || streamed;
+    }
+
+    const itk::ImageRegion<3> largest = reference->GetLargestPossibleRegion();
+    const size_t planeVoxels = largest.GetSize()[0] * largest.GetSize()[1], slices = largest.GetSize()[2];
+    // without a streamed channel, slabs would only cost thread starts
+    const size_t slabSlices = streamed ? std::max<size_t>(1, m_slabVoxels / std::max<size_t>(1, planeVoxels)) : slices;
+    for (size_t start = 0; start < slices; start += slabSlices)
+    {
+      itk::ImageRegion<3> slab = largest;
+      slab.SetIndex(2, largest.GetIndex()[2] + start);
+      slab.SetSize(2, std::min(slabSlices, slices - start));
+      for (size_t c = 0; c < m_channels.size(); c++)
+      {
+        m_channels[c]->BeginSlab(slab);
+      }
+      ResampleVoxels(map, start * planeVoxels, slab.GetNumberOfPixels());
+      for (size_t c = 0; c < m_channels.size(); c++)
+      {
+        m_channels[c]->EndSlab();
+      }
+    }
+
+    for (size_t c = 0; c < m_channels.size(); c++)
+    {
+      m_channels[c]->End();
+    }
+  }
+
+private:
+  //! Resample the output voxels [first, first + voxels) of every channel, in tiles shared out among the threads
+  void ResampleVoxels(const AffineIndexMap &map, size_t first, size_t voxels) const
+  {
+    const size_t tileSize = VoxelsPerTile;
+    const size_t tiles = (voxels + tileSize - 1) / tileSize;
+    std::atomic<size_t> nextTile(0);
+    auto worker = [&]()
+    {
+      std::vector<float> x(tileSize), y(tileSize), z(tileSize), scratch(tileSize);
+      for (size_t tile = nextTile++; tile < tiles; tile = nextTile++)
+      {
+        const size_t offset = first + tile * tileSize, count = std::min(tileSize, first + voxels - offset);
+        map.Fill(offset, count, x.data(), y.data(), z.data());
+        for (size_t c = 0; c < m_channels.size(); c++)
+        {
+          m_channels[c]->Resample(x.data(), y.data(), z.data(), offset, count, scratch.data());
+        }
+      }
+    };
+
+    unsigned int threads = (m_threads == 0) ? std::max(1u, std::thread::hardware_concurrency()) : m_threads;
+    threads = static_cast<unsigned int>(std::max<size_t>(1, std::min<size_t>(threads, tiles)));
+    std::vector<std::thread> workers;
+    for (unsigned int t = 1; t < threads; t++)
+    {
+      workers.push_back(std::thread(worker));
+    }
+    worker();
+    for (size_t t = 0; t < workers.size(); t++)
+    {
+      workers[t].join();
+    }
+  }
+
+  //! Same region, and origin, spacing and direction the same up to rounding (as stored by the image files)
+  static bool SameGrid(const itk::ImageBase<3> *a, const itk::ImageBase<3> *b)
+  {
+    if (a->GetBufferedRegion() != b->GetBufferedRegion())
+    {
+      return false;
+    }
+    const double tolerance = 1e-6;
+    for (unsigned int d = 0; d < 3; d++)
+    {
+      if ((std::abs(a->GetOrigin()[d] - b->GetOrigin()[d]) > tolerance * a->GetSpacing()[d]) ||
+        (std::abs(a->GetSpacing()[d] - b->GetSpacing()[d]) > tolerance * a->GetSpacing()[d]))
+      {
+        return false;
+      }
+      for (unsigned int e = 0; e < 3; e++)
+      {
+        if (std::abs(a->GetDirection()(d, e) - b->GetDirection()(d, e)) > tolerance)
+        {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  std::vector<std::unique_ptr<ResampleChannel> > m_channels;
+  unsigned int m_threads;
+  size_t m_slabVoxels;
+};
@@ -0,0 +1,446 @@
+/**
+\file ParallelBSplineMeanSquaresMetric.h
+
+\brief Mean squares metric of a cubic B-spline transform, computed in parallel over control point neighbourhoods
+
+With a B-spline transform, a sample moves with the 4x4x4 control points around it only, so its derivative
+has 3 * 64 non-zero entries out of 3 * (number of control points). itk::MeanSquaresImageToImageMetric uses
+these sparse weights and indexes too, but either caches 64 of each per sample or recomputes them per thread,
+and every thread adds into its own full-size derivative vector; those vectors are summed at the end, in an
+order that depends on the number of threads. This metric computes the weights of the 64 control points of
+every sample on the fly and adds its contribution straight into a single shared derivative.
+
+To do so from several threads without locks, the samples are sorted by the first control point plane (in z)
+of their support, and the sorted samples are cut into blocks of SamplesPerBlock; both only depend on the samples
+and the grid and are kept between evaluations. The threads take whole blocks, and every block adds its
+derivative into its own slice, which covers only the control point planes its samples reach (a few planes,
+since the samples are sorted by plane). Once all blocks are done, the same threads add the slices up plane by
+plane, every control point over the blocks in block order. The blocks do not depend on the number of threads,
+so neither does the order of any sum; the result is reproducible like that of ParallelMeanSquaresMetric. All
+blocks can run at the same time whatever the size of the control point grid, and the threads are started once
+per evaluation. Besides the samples, the memory used is one derivative vector and the slices, about a few
+planes of control points per block.
+
+The transform set on the metric needs to be an itk::BSplineTransform<double, 3, 3>. As in ITK, samples outside
+of the support of the control point grid are not moved and do not change the derivative.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include "itkImageToImageMetric.h"
+#include "itkBSplineTransform.h"
+
+#include "TrilinearInterpolator.h"
+
+template <typename TFixedImage, typename TMovingImage>
+class ParallelBSplineMeanSquaresMetric : public itk::ImageToImageMetric<TFixedImage, TMovingImage>
+{
+public:
+  typedef ParallelBSplineMeanSquaresMetric Self;
+  typedef itk::ImageToImageMetric<TFixedImage, TMovingImage> Superclass;
+  typedef itk::SmartPointer<Self> Pointer;
+  typedef itk::SmartPointer<const Self> ConstPointer;
+
+  itkNewMacro(Self);
+  itkTypeMacro(ParallelBSplineMeanSquaresMetric, ImageToImageMetric);
+
+  typedef typename Superclass::MeasureType MeasureType;
+  typedef typename Superclass::DerivativeType DerivativeType;
+  typedef typename Superclass::TransformParametersType TransformParametersType;
+  typedef typename Superclass::GradientPixelType GradientPixelType;
+  typedef typename TMovingImage::IndexType MovingImageIndexType;
+  typedef itk::BSplineTransform<double, 3, 3> BSplineTransformType;
+  typedef TrilinearInterpolator<TMovingImage> InterpolatorType;
+
+  //! Samples interpolated at once
+  static const size_t SamplesPerChunk = 1024;
+
+  //! Samples per block, the unit of work of a thread; a multiple of SamplesPerChunk
+  static const size_t SamplesPerBlock = 4 * SamplesPerChunk;
+
+  //! Number of threads to use; 0 picks the hardware concurrency
+  void SetNumberOfWorkers(unsigned int workers)
+  {
+    m_workers = workers;
+  }
+
+  unsigned int GetNumberOfWorkers() const
+  {
+    return m_workers;
+  }
+
+  //! Number of times value and/or derivative were computed
+  size_t GetNumberOfEvaluations() const
+  {
+    return m_evaluations;
+  }
+
+  MeasureType GetValue(const TransformParametersType &parameters) const override
+  {
+    MeasureType value;
+    DerivativeType derivative;
+    Evaluate(parameters, false, value, derivative);
+    return value;
+  }
+
+  void GetDerivative(const TransformParametersType &parameters, DerivativeType &derivative) const override
+  {
+    MeasureType value;
+    Evaluate(parameters, true, value, derivative);
+  }
+
+  void GetValueAndDerivative(const TransformParametersType &parameters, MeasureType &value, DerivativeType &derivative) const override
+  {
+    Evaluate(parameters, true, value, derivative);
+  }
+
+  //! Also draws the samples: itk::ImageToImageMetric::Initialize() leaves that to the metrics derived from it
+  void Initialize() override
+  {
+    Superclass::Initialize();
+    this->MultiThreadingInitialize();
+    m_sortKey.clear(); // new samples, sort them again
+  }
+
+protected:
+  ParallelBSplineMeanSquaresMetric() : m_workers(0), m_evaluations(0), m_insideSamples(0)
+  {
+    // the superclass would keep 64 weights and indexes per sample; they are computed on the fly here
+    this->SetUseCachingOfBSplineWeights(false);
+  }
+
+  ~ParallelBSplineMeanSquaresMetric() override
+  {
+  }
+
+private:
+  //! Control point grid of the transform, flattened for the loops below
+  struct Grid
+  {
+    const BSplineTransformType::ImageType *image; //! first coefficient image, for the geometry
+    size_t size[3]; //! control points per axis
+    size_t points; //! control points in total, the parameters of one axis
+    const double *coefficients; //! all parameters: x of every control point, then y, then z
+  };
+
+  //! Sum of a group of samples
+  struct Partial
+  {
+    double value;
+    size_t count;
+  };
+
+  /**
+  \brief Support of a sample: first control point per axis and the 4 cubic B-spline weights per axis
+
+  \return false if the support is not inside of the grid
+  */
+  static bool ComputeSupport(const Grid &grid, const typename Superclass::FixedImagePointType &point, long start[3], double weights[3][4])
+  {
+    itk::ContinuousIndex<double, 3> index;
+    grid.image->TransformPhysicalPointToContinuousIndex(point, index);
+    for (unsigned int d = 0; d < 3; d++)
+    {
+      const double base = std::floor(index[d]);
+      start[d] = static_cast<long>(base) - 1;
+      if ((start[d] < 0) || (start[d] + 4 > static_cast<long>(grid.size[d])))
+      {
+        return false;
+      }
+      const double t = index[d] - base, s = 1.0 - t;
+      weights[d][0] = s * s * s / 6.0;
+      weights[d][1] = (3.0 * t * t * t - 6.0 * t * t + 4.0) / 6.0;
+      weights[d][2] = (-3.0 * t * t * t + 3.0 * t * t + 3.0 * t + 1.0) / 6.0;
+      weights[d][3] = t * t * t / 6.0;
+    }
+    return true;
+  }
+
+  //! Per-thread buffers of EvaluateSamples()
+  struct Workspace
+  {
+    std::vector<float> x, y, z, values;
+    std::vector<unsigned char> inside;
+
+    Workspace() : x(SamplesPerChunk), y(SamplesPerChunk), z(SamplesPerChunk), values(SamplesPerChunk), inside(SamplesPerChunk)
+    {
+    }
+  };
+
+  /**
+  \brief Add the samples [first, last) of m_order: value into partial, derivative (if not NULL) into derivative
+
+  derivative holds the x, y and z entries of slicePoints control points from firstNode on, one axis after the other.
+  */
+  void EvaluateSamples(const Grid &grid, const InterpolatorType &interpolator, size_t first, size_t last,
+    Partial &partial, double *derivative, size_t firstNode, size_t slicePoints, Workspace &workspace) const
+  {
+    const size_t chunk = SamplesPerChunk;
+    float *x = workspace.x.data(), *y = workspace.y.data(), *z = workspace.z.data(), *values = workspace.values.data();
+    unsigned char *inside = workspace.inside.data();
+    for (size_t begin = first; begin < last; begin += chunk)
+    {
+      const size_t count = std::min(chunk, last - begin);
+
+      // map the chunk into the moving image and interpolate it in one go
+      for (size_t k = 0; k < count; k++)
+      {
+        typename Superclass::MovingImagePointType mapped = this->m_FixedImageSamples[m_order[begin + k]].point;
+        long start[3];
+        double weights[3][4];
+        if (ComputeSupport(grid, mapped, start, weights))
+        {
+          double displacement[3] = { 0, 0, 0 };
+          for (unsigned int c = 0; c < 64; c++)
+          {
+            const unsigned int i = c % 4, j = (c / 4) % 4, l = c / 16;
+            const size_t node = (start[0] + i) + grid.size[0] * ((start[1] + j) + grid.size[1] * (start[2] + l));
+            const double weight = weights[0][i] * weights[1][j] * weights[2][l];
+            for (unsigned int d = 0; d < 3; d++)
+            {
+              displacement[d] += weight * grid.coefficients[node + d * grid.points];
+            }
+          }
+          for (unsigned int d = 0; d < 3; d++)
+          {
+            mapped[d] += displacement[d];
+          }
+        }
+        itk::ContinuousIndex<double, 3> index;
+        this->m_MovingImage->TransformPhysicalPointToContinuousIndex(mapped, index);
+        x[k] = static_cast<float>(index[0]);
+        y[k] = static_cast<float>(index[1]);
+        z[k] = static_cast<float>(index[2]);
+      }
+      interpolator.Evaluate(x, y, z, count, values, inside);
+
+      for (size_t k = 0; k < count; k++)
+      {
+        if (!inside[k])
+        {
+          continue;
+        }
+        const typename Superclass::FixedImageSamplePoint &sample = this->m_FixedImageSamples[m_order[begin + k]];
+        const double difference = values[k] - sample.value;
+        partial.value += difference * difference;
+        partial.count++;
+        long start[3];
+        double weights[3][4];
+        if ((derivative == NULL) || !ComputeSupport(grid, sample.point, start, weights))
+        {
+          continue;
+        }
+
+        // gradient at the nearest voxel, spread over the 64 control points by their weights
+        const MovingImageIndexType index = {{ static_cast<itk::IndexValueType>(std::floor(x[k] + 0.5f)),
+          static_cast<itk::IndexValueType>(std::floor(y[k] + 0.5f)), static_cast<itk::IndexValueType>(std::floor(z[k] + 0.5f)) }};
+        const GradientPixelType gradient = this->m_GradientImage->GetPixel(index);
+        const double scaled[3] = { 2.0 * difference * gradient[0], 2.0 * difference * gradient[1], 2.0 * difference * gradient[2] };
+        for (unsigned int c = 0; c < 64; c++)
+        {
+          const unsigned int i = c % 4, j = (c / 4) % 4, l = c / 16;
+          const size_t node = (start[0] + i) + grid.size[0] * ((start[1] + j) + grid.size[1] * (start[2] + l));
+          const double weight = weights[0][i] * weights[1][j] * weights[2][l];
+          for (unsigned int d = 0; d < 3; d++)
+          {
+            derivative[node - firstNode + d * slicePoints] += weight * scaled[d];
+          }
+        }
+      }
+    }
+  }
+
+  /**
+  \brief Sort the samples by the first control point plane of their support and cut them into blocks
+
+  A counting sort; the samples outside of the grid go to the end. Only redone when the samples or the geometry
+  of the grid change, e.g. at the next level of the registration.
+  */
+  void SortSamples(const Grid &grid) const
+  {
+    std::vector<double> key(1, static_cast<double>(this->m_FixedImageSamples.size()));
+    for (unsigned int d = 0; d < 3; d++)
+    {
+      key.push_back(static_cast<double>(grid.size[d]));
+      key.push_back(grid.image->GetOrigin()[d]);
+      key.push_back(grid.image->GetSpacing()[d]);
+      for (unsigned int e = 0; e < 3; e++)
+      {
+        key.push_back(grid.image->GetDirection()(d, e));
+      }
+    }
+    if (key == m_sortKey)
+    {
+      return;
+    }
+    m_sortKey = key;
+
+    const size_t samples = this->m_FixedImageSamples.size(), groups = grid.size[2] + 1;
+    std::vector<size_t> groupStart(groups + 1, 0), sampleGroup(samples);
+    for (size_t s = 0; s < samples; s++)
+    {
+      long start[3];
+      double weights[3][4];
+      sampleGroup[s] = ComputeSupport(grid, this->m_FixedImageSamples[s].point, start, weights) ? start[2] : grid.size[2];
+      groupStart[sampleGroup[s] + 1]++;
+    }
+    for (size_t g = 0; g < groups; g++)
+    {
+      groupStart[g + 1] += groupStart[g];
+    }
+    m_order.resize(samples);
+    std::vector<size_t> next(groupStart.begin(), groupStart.end() - 1);
+    for (size_t s = 0; s < samples; s++)
+    {
+      m_order[next[sampleGroup[s]]++] = static_cast<uint32_t>(s);
+    }
+    m_insideSamples = groupStart[grid.size[2]];
+
+    // a block reaches the 4 planes from the first plane of its first sample to those of its last sample
+    const size_t blocks = (m_insideSamples + SamplesPerBlock - 1) / SamplesPerBlock;
+    m_blockFirstPlane.resize(blocks);
+    m_blockPlanes.resize(blocks);
+    m_slices.resize(blocks);
+    for (size_t b = 0; b < blocks; b++)
+    {
+      const size_t last = std::min((b + 1) * SamplesPerBlock, m_insideSamples) - 1;
+      m_blockFirstPlane[b] = sampleGroup[m_order[b * SamplesPerBlock]];
+      m_blockPlanes[b] = sampleGroup[m_order[last]] + 4 - m_blockFirstPlane[b];
+    }
+  }
+
+  void Evaluate(const TransformParametersType &parameters, bool withDerivative, MeasureType &value, DerivativeType &derivative) const
+  {
+    if (!this->m_FixedImage)
+    {
+      itkExceptionMacro("Fixed image has not been assigned");
+    }
+    const BSplineTransformType *transform = dynamic_cast<const BSplineTransformType *>(this->m_Transform.GetPointer());
+    if (transform == NULL)
+    {
+      itkExceptionMacro("ParallelBSplineMeanSquaresMetric needs a BSplineTransform<double, 3, 3>");
+    }
+    this->SetTransformParameters(parameters);
+    m_evaluations++;
+
+    Grid grid;
+    grid.image = transform->GetCoefficientImages()[0];
+    for (unsigned int d = 0; d < 3; d++)
+    {
+      grid.size[d] = grid.image->GetLargestPossibleRegion().GetSize()[d];
+    }
+    grid.points = grid.size[0] * grid.size[1] * grid.size[2];
+    grid.coefficients = parameters.data_block();
+
+    SortSamples(grid);
+    const size_t blocks = m_blockFirstPlane.size(), planeSize = grid.size[0] * grid.size[1];
+
+    InterpolatorType interpolator;
+    interpolator.SetInputImage(this->m_MovingImage);
+    std::vector<Partial> partials(blocks + 1, Partial{ 0.0, 0 });
+    std::vector<double> sums(withDerivative ? 3 * grid.points : 0, 0.0);
+    if (withDerivative)
+    {
+      for (size_t b = 0; b < blocks; b++)
+      {
+        m_slices[b].assign(3 * m_blockPlanes[b] * planeSize, 0.0);
+      }
+    }
+
+    unsigned int threads = (m_workers == 0) ? std::max(1u, std::thread::hardware_concurrency()) : m_workers;
+    threads = static_cast<unsigned int>(std::max<size_t>(1, std::min<size_t>(threads, blocks)));
+    std::atomic<size_t> nextBlock(0), finishedBlocks(0), nextPlane(0);
+    auto worker = [&]()
+    {
+      Workspace workspace;
+      for (size_t b = nextBlock++; b < blocks; b = nextBlock++)
+      {
+        const size_t slicePoints = m_blockPlanes[b] * planeSize;
+        EvaluateSamples(grid, interpolator, b * SamplesPerBlock, std::min((b + 1) * SamplesPerBlock, m_insideSamples), partials[b],
+          withDerivative ? m_slices[b].data() : NULL, m_blockFirstPlane[b] * planeSize, slicePoints, workspace);
+        finishedBlocks++;
+      }
+      if (!withDerivative)
+      {
+        return;
+      }
+
+      // every control point plane gets the slices of the blocks that reach it, in block order
+      while (finishedBlocks.load() < blocks)
+      {
+        std::this_thread::yield();
+      }
+      for (size_t plane = nextPlane++; plane < grid.size[2]; plane = nextPlane++)
+      {
+        for (size_t b = 0; b < blocks; b++)
+        {
+          if ((plane < m_blockFirstPlane[b]) || (plane >= m_blockFirstPlane[b] + m_blockPlanes[b]))
+          {
+            continue;
+          }
+          const size_t slicePoints = m_blockPlanes[b] * planeSize;
+          for (unsigned int d = 0; d < 3; d++)
+          {
+            const double *slice = m_slices[b].data() + d * slicePoints + (plane - m_blockFirstPlane[b]) * planeSize;
+            double *sum = sums.data() + d * grid.points + plane * planeSize;
+            for (size_t i = 0; i < planeSize; i++)
+            {
+              sum[i] += slice[i];
+            }
+          }
+        }
+      }
+    };
+    std::vector<std::thread> workers;
+    for (unsigned int t = 1; t < threads; t++)
+    {
+      workers.push_back(std::thread(worker));
+    }
+    worker();
+    for (size_t t = 0; t < workers.size(); t++)
+    {
+      workers[t].join();
+    }
+
+    // samples outside of the support of the grid only count for the value
+    Workspace workspace;
+    EvaluateSamples(grid, interpolator, m_insideSamples, m_order.size(), partials[blocks], NULL, 0, 0, workspace);
+
+    Partial total = { 0.0, 0 };
+    for (size_t b = 0; b <= blocks; b++)
+    {
+      total.value += partials[b].value;
+      total.count += partials[b].count;
+    }
+    if (total.count == 0)
+    {
+      itkExceptionMacro("All the sampled points mapped outside of the moving image");
+    }
+    const double count = static_cast<double>(total.count);
+    value = total.value / count;
+    if (withDerivative)
+    {
+      derivative = DerivativeType(sums.size());
+      for (size_t p = 0; p < sums.size(); p++)
+      {
+        derivative[p] = sums[p] / count;
+      }
+    }
+  }
+
+  unsigned int m_workers;
+  mutable std::atomic<size_t> m_evaluations;
+  // kept between evaluations, see SortSamples()
+  mutable std::vector<double> m_sortKey; //! number of samples and geometry of the grid the samples were sorted for
+  mutable std::vector<uint32_t> m_order; //! samples sorted by the first control point plane of their support
+  mutable size_t m_insideSamples; //! samples in the support of the grid, the first ones of m_order
+  mutable std::vector<size_t> m_blockFirstPlane, m_blockPlanes; //! control point planes every block reaches
+  mutable std::vector<std::vector<double> > m_slices; //! derivative of every block over its planes
+};
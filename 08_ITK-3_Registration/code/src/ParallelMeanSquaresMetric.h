@@ -0,0 +1,318 @@
+/**
+\file ParallelMeanSquaresMetric.h
+
+\brief Mean squares metric whose value and derivative are computed on several threads
+
+The samples of the metric are the sorted 32-bit linear offsets of VoxelSampler, set with SetFixedImageOffsets()
+instead of SetFixedImageIndexes(). The metric reads the fixed value straight from the buffer at every offset
+and maps the offset to its physical point on the fly, so besides the fixed image a sample takes 4 bytes and
+the fixed image is visited in memory order.
+
+The offsets are cut into blocks of SamplesPerBlock samples. The threads take contiguous runs of blocks and
+every block is summed on its own, in sample order, into its own value and derivative accumulators. The block
+sums are then added pairwise in a fixed tree order ((0 + 1) + (2 + 3)) + ..., so the result only depends on
+the samples and never on the number of threads: registrations are bit-for-bit reproducible on any machine
+with the same floating point.
+
+Value and derivative are the same as those of itk::MeanSquaresImageToImageMetric with a linear interpolator:
+the mean of the squared differences over the samples that map inside the moving image, and its derivative
+through the gradient image and the Jacobian of the transform. The interpolator set on the metric is not used
+for the values; every block is mapped into the moving image first and then interpolated in one call to
+TrilinearInterpolator, which uses SIMD where it can.
+
+The gradient image takes 24 bytes per voxel of the moving image. Several metrics on the same moving image
+(e.g. the starts of a multi-start registration) can share one from ComputeMovingGradient() through
+SetMovingGradientImage() and SetComputeGradient(false), instead of each computing its own in Initialize().
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include "itkImageToImageMetric.h"
+#include "itkGradientRecursiveGaussianImageFilter.h"
+
+#include "TrilinearInterpolator.h"
+
+template <typename TFixedImage, typename TMovingImage>
+class ParallelMeanSquaresMetric : public itk::ImageToImageMetric<TFixedImage, TMovingImage>
+{
+public:
+  typedef ParallelMeanSquaresMetric Self;
+  typedef itk::ImageToImageMetric<TFixedImage, TMovingImage> Superclass;
+  typedef itk::SmartPointer<Self> Pointer;
+  typedef itk::SmartPointer<const Self> ConstPointer;
+
+  itkNewMacro(Self);
+  itkTypeMacro(ParallelMeanSquaresMetric, ImageToImageMetric);
+
+  typedef typename Superclass::MeasureType MeasureType;
+  typedef typename Superclass::DerivativeType DerivativeType;
+  typedef typename Superclass::TransformType TransformType;
+  typedef typename Superclass::TransformParametersType TransformParametersType;
+  typedef typename Superclass::MovingImagePointType MovingImagePointType;
+  typedef typename Superclass::FixedImagePointType FixedImagePointType;
+  typedef typename Superclass::GradientPixelType GradientPixelType;
+  typedef typename Superclass::GradientImageType GradientImageType;
+  typedef typename TransformType::JacobianType JacobianType;
+  typedef typename TMovingImage::IndexType MovingImageIndexType;
+  typedef TrilinearInterpolator<TMovingImage> InterpolatorType;
+  typedef uint32_t OffsetType;
+  static const unsigned int MovingImageDimension = TMovingImage::ImageDimension;
+
+  //! Samples per block; blocks are the unit of work and of the reduction
+  static const size_t SamplesPerBlock = 2048;
+
+  //! Number of threads to use; 0 picks the hardware concurrency
+  void SetNumberOfWorkers(unsigned int workers)
+  {
+    m_workers = workers;
+  }
+
+  unsigned int GetNumberOfWorkers() const
+  {
+    return m_workers;
+  }
+
+  /**
+  \brief The samples, as sorted linear offsets into the buffer of the fixed image (see VoxelSampler::GetOffsets())
+
+  The offsets are not copied, so several metrics (e.g. the starts of a multi-start registration) can share them;
+  they need to stay alive while the metric is used.
+  */
+  void SetFixedImageOffsets(const std::vector<OffsetType> *offsets)
+  {
+    m_fixedOffsets = offsets;
+    this->Modified();
+  }
+
+  //! Gradient of the moving image to use instead of the one the metric computes; needs SetComputeGradient(false)
+  void SetMovingGradientImage(const GradientImageType *gradient)
+  {
+    m_movingGradient = gradient;
+    this->Modified();
+  }
+
+  //! The gradient image Initialize() computes, the same way itk::ImageToImageMetric::ComputeGradient() does
+  static typename GradientImageType::Pointer ComputeMovingGradient(const TMovingImage *movingImage)
+  {
+    typedef itk::GradientRecursiveGaussianImageFilter<TMovingImage, GradientImageType> GradientFilterType;
+    typename GradientFilterType::Pointer gradientFilter = GradientFilterType::New();
+    gradientFilter->SetInput(movingImage);
+    double maximumSpacing = 0.0;
+    for (unsigned int d = 0; d < MovingImageDimension; d++)
+    {
+      maximumSpacing = std::max(maximumSpacing, static_cast<double>(movingImage->GetSpacing()[d]));
+    }
+    gradientFilter->SetSigma(maximumSpacing);
+    gradientFilter->SetNormalizeAcrossScale(true);
+    gradientFilter->SetUseImageDirection(true);
+    gradientFilter->Update();
+    return gradientFilter->GetOutput();
+  }
+
+  void Initialize() override
+  {
+    Superclass::Initialize();
+    if (!this->GetComputeGradient() && !m_movingGradient)
+    {
+      itkExceptionMacro("SetComputeGradient(false) needs a gradient image, see SetMovingGradientImage()");
+    }
+    if ((m_fixedOffsets == NULL) || m_fixedOffsets->empty())
+    {
+      itkExceptionMacro("No samples, see SetFixedImageOffsets()");
+    }
+    if (this->m_FixedImage->GetBufferedRegion().GetNumberOfPixels() <= m_fixedOffsets->back())
+    {
+      itkExceptionMacro("Sample offsets are outside of the buffered region of the fixed image");
+    }
+  }
+
+  //! Number of times value and/or derivative were computed; safe to read while the metric is in use
+  size_t GetNumberOfEvaluations() const
+  {
+    return m_evaluations;
+  }
+
+  MeasureType GetValue(const TransformParametersType &parameters) const override
+  {
+    MeasureType value;
+    DerivativeType derivative;
+    Evaluate(parameters, false, value, derivative);
+    return value;
+  }
+
+  void GetDerivative(const TransformParametersType &parameters, DerivativeType &derivative) const override
+  {
+    MeasureType value;
+    Evaluate(parameters, true, value, derivative);
+  }
+
+  void GetValueAndDerivative(const TransformParametersType &parameters, MeasureType &value, DerivativeType &derivative) const override
+  {
+    Evaluate(parameters, true, value, derivative);
+  }
+
+protected:
+  ParallelMeanSquaresMetric() : m_workers(0), m_evaluations(0), m_fixedOffsets(NULL)
+  {
+  }
+
+  ~ParallelMeanSquaresMetric() override
+  {
+  }
+
+private:
+  //! Sums of one block, or of several blocks once reduced
+  struct Partial
+  {
+    double value;
+    size_t count;
+    std::vector<double> derivative;
+  };
+
+  //! Sum the samples of blocks [firstBlock, lastBlock), each into its own partial
+  void EvaluateBlocks(size_t firstBlock, size_t lastBlock, bool withDerivative, const InterpolatorType *interpolator,
+    Partial *partials) const
+  {
+    const size_t samples = m_fixedOffsets->size();
+    const OffsetType *offsets = m_fixedOffsets->data();
+    const typename TFixedImage::PixelType *fixedBuffer = this->m_FixedImage->GetBufferPointer();
+    const GradientImageType *gradientImage = m_movingGradient ? m_movingGradient.GetPointer() : this->m_GradientImage.GetPointer();
+    const unsigned int parameters = this->GetNumberOfParameters();
+    JacobianType jacobian; // one per thread, the transform fills it in place
+    std::vector<FixedImagePointType> points(SamplesPerBlock);
+    std::vector<float> x(SamplesPerBlock), y(SamplesPerBlock), z(SamplesPerBlock), values(SamplesPerBlock);
+    std::vector<unsigned char> inside(SamplesPerBlock);
+    for (size_t block = firstBlock; block < lastBlock; block++)
+    {
+      Partial &partial = partials[block];
+      const size_t begin = block * SamplesPerBlock, count = std::min(samples, begin + SamplesPerBlock) - begin;
+
+      // map the whole block into the moving image, then interpolate it in one go
+      for (size_t k = 0; k < count; k++)
+      {
+        this->m_FixedImage->TransformIndexToPhysicalPoint(this->m_FixedImage->ComputeIndex(offsets[begin + k]), points[k]);
+        const MovingImagePointType mapped = this->m_Transform->TransformPoint(points[k]);
+        itk::ContinuousIndex<double, MovingImageDimension> index;
+        this->m_MovingImage->TransformPhysicalPointToContinuousIndex(mapped, index);
+        x[k] = static_cast<float>(index[0]);
+        y[k] = static_cast<float>(index[1]);
+        z[k] = static_cast<float>(index[2]);
+      }
+      interpolator->Evaluate(x.data(), y.data(), z.data(), count, values.data(), inside.data());
+
+      for (size_t k = 0; k < count; k++)
+      {
+        if (!inside[k])
+        {
+          continue;
+        }
+        const double difference = values[k] - static_cast<double>(fixedBuffer[offsets[begin + k]]);
+        partial.value += difference * difference;
+        partial.count++;
+        if (!withDerivative)
+        {
+          continue;
+        }
+
+        // gradient at the nearest voxel
+        const MovingImageIndexType index = {{ static_cast<itk::IndexValueType>(std::floor(x[k] + 0.5f)),
+          static_cast<itk::IndexValueType>(std::floor(y[k] + 0.5f)), static_cast<itk::IndexValueType>(std::floor(z[k] + 0.5f)) }};
+        const GradientPixelType gradient = gradientImage->GetPixel(index);
+        this->m_Transform->ComputeJacobianWithRespectToParameters(points[k], jacobian);
+        for (unsigned int p = 0; p < parameters; p++)
+        {
+          double sum = 0;
+          for (unsigned int d = 0; d < MovingImageDimension; d++)
+          {
+            sum += jacobian(d, p) * gradient[d];
+          }
+          partial.derivative[p] += 2.0 * difference * sum;
+        }
+      }
+    }
+  }
+
+  void Evaluate(const TransformParametersType &parameters, bool withDerivative, MeasureType &value, DerivativeType &derivative) const
+  {
+    if (!this->m_FixedImage)
+    {
+      itkExceptionMacro("Fixed image has not been assigned");
+    }
+    this->SetTransformParameters(parameters);
+    m_evaluations++;
+
+    const unsigned int numberOfParameters = this->GetNumberOfParameters();
+    if (m_fixedOffsets == NULL)
+    {
+      itkExceptionMacro("No samples, see SetFixedImageOffsets()");
+    }
+    const size_t blocks = (m_fixedOffsets->size() + SamplesPerBlock - 1) / SamplesPerBlock;
+    std::vector<Partial> partials(blocks);
+    for (size_t b = 0; b < blocks; b++)
+    {
+      partials[b].value = 0;
+      partials[b].count = 0;
+      partials[b].derivative.assign(withDerivative ? numberOfParameters : 0, 0.0);
+    }
+
+    InterpolatorType interpolator;
+    interpolator.SetInputImage(this->m_MovingImage);
+
+    unsigned int threads = (m_workers == 0) ? std::max(1u, std::thread::hardware_concurrency()) : m_workers;
+    threads = static_cast<unsigned int>(std::max<size_t>(1, std::min<size_t>(threads, blocks)));
+    std::vector<std::thread> workers;
+    for (unsigned int t = 1; t < threads; t++)
+    {
+      workers.push_back(std::thread(&Self::EvaluateBlocks, this, blocks * t / threads, blocks * (t + 1) / threads,
+        withDerivative, &interpolator, partials.data()));
+    }
+    EvaluateBlocks(0, blocks / threads, withDerivative, &interpolator, partials.data());
+    for (size_t t = 0; t < workers.size(); t++)
+    {
+      workers[t].join();
+    }
+
+    // the same pairs are added in the same order whatever the number of threads
+    for (size_t stride = 1; stride < blocks; stride *= 2)
+    {
+      for (size_t b = 0; b + stride < blocks; b += 2 * stride)
+      {
+        Partial &left = partials[b];
+        const Partial &right = partials[b + stride];
+        left.value += right.value;
+        left.count += right.count;
+        for (size_t p = 0; p < left.derivative.size(); p++)
+        {
+          left.derivative[p] += right.derivative[p];
+        }
+      }
+    }
+
+    if ((blocks == 0) || (partials[0].count == 0))
+    {
+      itkExceptionMacro("All the sampled points mapped outside of the moving image");
+    }
+    const double count = static_cast<double>(partials[0].count);
+    value = partials[0].value / count;
+    if (withDerivative)
+    {
+      derivative = DerivativeType(numberOfParameters);
+      for (unsigned int p = 0; p < numberOfParameters; p++)
+      {
+        derivative[p] = partials[0].derivative[p] / count;
+      }
+    }
+  }
+
+  unsigned int m_workers;
+  mutable std::atomic<size_t> m_evaluations;
+  const std::vector<OffsetType> *m_fixedOffsets;
+  typename GradientImageType::ConstPointer m_movingGradient;
+};
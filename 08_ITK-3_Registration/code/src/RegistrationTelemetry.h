@@ -0,0 +1,207 @@
+/**
+\file RegistrationTelemetry.h
+
+\brief Per-iteration record of the optimizer, as JSON lines
+
+TelemetryObserver is attached to the RegularStepGradientDescentOptimizer of every level. After every
+iteration it writes one line to a RegistrationTelemetry:
+
+{"event":"iteration","run":"moving.nii.gz","start":0,"level":1,"iteration":7,"value":152.3,"step":0.125,
+ "parameters":[1,0,0,...],"ms":812.5,"evaluations":8}
+
+"ms" is the wall time since the registration started and "evaluations" the number of metric evaluations of
+the level so far. When a level ends, an "end" line gives its stop condition. One RegistrationTelemetry can be
+shared by the starts of a multi-start registration and the jobs of a batch; lines are written whole.
+*/
+
+#pragma once
+
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <sstream>
+#include <string>
+
+#include "itkCommand.h"
+#include "itkRegularStepGradientDescentOptimizer.h"
+
+/**
+\brief Destination of the telemetry: a JSON lines file and optionally a short live line per iteration on stderr
+*/
+class RegistrationTelemetry
+{
+public:
+  //! Default Constructor
+  RegistrationTelemetry() : m_live(false)
+  {
+  }
+
+  //! Write the records to this file, replacing it
+  void Open(const std::string &fileName)
+  {
+    m_file.open(fileName.c_str(), std::ios::out | std::ios::trunc);
+    if (!m_file)
+    {
+      itkGenericExceptionMacro("Could not open telemetry file " << fileName);
+    }
+  }
+
+  //! Also print a one-line summary of every iteration on stderr
+  void SetLiveSummary(bool live)
+  {
+    m_live = live;
+  }
+
+  //! Write one record (a JSON object without line break) and its live summary
+  void Write(const std::string &record, const std::string &summary)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_file.is_open())
+    {
+      m_file << record << '\n';
+    }
+    if (m_live)
+    {
+      std::cerr << summary << '\n';
+    }
+  }
+
+  //! Write any buffered records to the file
+  void Flush()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_file.is_open())
+    {
+      m_file.flush();
+    }
+  }
+
+  //! The text as a JSON string, with quotes
+  static std::string Quote(const std::string &text)
+  {
+    std::string quoted = "\"";
+    for (size_t i = 0; i < text.size(); i++)
+    {
+      const char c = text[i];
+      if ((c == '"') || (c == '\\'))
+      {
+        quoted += '\\';
+        quoted += c;
+      }
+      else if (static_cast<unsigned char>(c) < 0x20)
+      {
+        quoted += ' '; // no control characters in the stop conditions or file names we write
+      }
+      else
+      {
+        quoted += c;
+      }
+    }
+    return quoted + "\"";
+  }
+
+  //! The number as JSON, null if it is not finite (JSON has no NaN or infinity)
+  static std::string Number(double value)
+  {
+    if (!std::isfinite(value))
+    {
+      return "null";
+    }
+    std::ostringstream stream;
+    stream.precision(std::numeric_limits<double>::max_digits10);
+    stream << value;
+    return stream.str();
+  }
+
+private:
+  std::ofstream m_file;
+  bool m_live;
+  std::mutex m_mutex;
+};
+
+/**
+\brief Writes every iteration of a RegularStepGradientDescentOptimizer and the end of the level to a RegistrationTelemetry
+
+TMetricType needs a GetNumberOfEvaluations() member, like ParallelMeanSquaresMetric.
+*/
+template <typename TMetricType>
+class TelemetryObserver : public itk::Command
+{
+public:
+  typedef TelemetryObserver Self;
+  typedef itk::Command Superclass;
+  typedef itk::SmartPointer<Self> Pointer;
+  itkNewMacro(Self);
+
+  typedef itk::RegularStepGradientDescentOptimizer OptimizerType;
+  typedef std::chrono::high_resolution_clock ClockType;
+
+  //! Where the records go, which run and level they belong to and since when the wall time is counted
+  void Setup(RegistrationTelemetry *telemetry, const TMetricType *metric, const std::string &run, unsigned int start,
+    unsigned int level, ClockType::time_point startTime)
+  {
+    m_telemetry = telemetry;
+    m_metric = metric;
+    m_run = run;
+    m_start = start;
+    m_level = level;
+    m_startTime = startTime;
+  }
+
+  void Execute(itk::Object *caller, const itk::EventObject &event) override
+  {
+    Execute(const_cast<const itk::Object *>(caller), event);
+  }
+
+  void Execute(const itk::Object *caller, const itk::EventObject &event) override
+  {
+    const bool iteration = itk::IterationEvent().CheckEvent(&event);
+    if (!iteration && !itk::EndEvent().CheckEvent(&event))
+    {
+      return;
+    }
+    const OptimizerType *optimizer = static_cast<const OptimizerType *>(caller);
+    const double milliseconds = std::chrono::duration<double, std::milli>(ClockType::now() - m_startTime).count();
+
+    std::ostringstream record, summary;
+    record << "{\"event\":" << (iteration ? "\"iteration\"" : "\"end\"") << ",\"run\":" << RegistrationTelemetry::Quote(m_run) <<
+      ",\"start\":" << m_start << ",\"level\":" << m_level << ",\"iteration\":" << optimizer->GetCurrentIteration() <<
+      ",\"value\":" << RegistrationTelemetry::Number(optimizer->GetValue()) <<
+      ",\"step\":" << RegistrationTelemetry::Number(optimizer->GetCurrentStepLength());
+    if (iteration)
+    {
+      const OptimizerType::ParametersType &parameters = optimizer->GetCurrentPosition();
+      record << ",\"parameters\":[";
+      for (unsigned int p = 0; p < parameters.Size(); p++)
+      {
+        record << ((p == 0) ? "" : ",") << RegistrationTelemetry::Number(parameters[p]);
+      }
+      record << "]";
+    }
+    else
+    {
+      record << ",\"stop\":" << RegistrationTelemetry::Quote(optimizer->GetStopConditionDescription());
+    }
+    record << ",\"ms\":" << RegistrationTelemetry::Number(milliseconds) << ",\"evaluations\":" << m_metric->GetNumberOfEvaluations() << "}";
+
+    summary << m_run << " start " << m_start << " level " << m_level << " iteration " << optimizer->GetCurrentIteration() <<
+      ": metric " << optimizer->GetValue() << ", step " << optimizer->GetCurrentStepLength() << ", " << milliseconds << " ms" <<
+      (iteration ? "" : " (end)");
+    m_telemetry->Write(record.str(), summary.str());
+  }
+
+protected:
+  TelemetryObserver() : m_telemetry(NULL), m_metric(NULL), m_start(0), m_level(0)
+  {
+  }
+
+private:
+  RegistrationTelemetry *m_telemetry;
+  const TMetricType *m_metric;
+  std::string m_run;
+  unsigned int m_start, m_level;
+  ClockType::time_point m_startTime;
+};
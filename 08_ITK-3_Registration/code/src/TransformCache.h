@@ -0,0 +1,235 @@
+/**
+\file TransformCache.h
+
+\brief Affine transforms of finished and interrupted registrations, stored by the content of their inputs
+
+A registration is identified by a key: a hash of the pixels and geometry of the fixed image, the moving image
+and the mask, and of every option that changes the result (see prepareFixedImage() and registerToFixed()).
+Renaming or copying the files does not change the key, changing a single voxel does.
+
+For every key the cache directory holds
+- <key>.tfm, the final transform of a finished registration
+- <key>.level<n>.tfm, the transform after level n of a registration that has not finished yet
+
+All files are ITK transform files, written to a temporary file first and then renamed, so that a registration
+that is killed while writing never leaves a truncated transform behind.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <string>
+
+#include "itkAffineTransform.h"
+#include "itkTransformFileReader.h"
+#include "itkTransformFileWriter.h"
+#include "itkTransformFactoryBase.h"
+#include "itksys/SystemTools.hxx"
+
+/**
+\brief 64-bit hash of a stream of bytes
+
+The bytes are taken in 8-byte words; every word is combined with the hash, which is then scrambled with the
+finalizer of MurmurHash3. The finalizer is a bijection in which every input bit affects every output bit, so
+unlike FNV-1a on whole words (a multiply only carries bits upward) a change in the sign bit of a single value
+changes the key.
+
+Not cryptographic; only meant to tell inputs apart.
+*/
+class ContentHasher
+{
+public:
+  //! Default Constructor
+  ContentHasher() : m_hash(14695981039346656037ull)
+  {
+  }
+
+  //! Add a block of memory
+  void Add(const void *data, size_t bytes)
+  {
+    const unsigned char *bytePointer = static_cast<const unsigned char *>(data);
+    size_t i = 0;
+    for (; i + 8 <= bytes; i += 8)
+    {
+      uint64_t word;
+      std::memcpy(&word, bytePointer + i, 8);
+      Mix(word);
+    }
+    for (; i < bytes; i++)
+    {
+      Mix(bytePointer[i]);
+    }
+    Mix(bytes); // so that "ab" + "c" and "a" + "bc" differ
+  }
+
+  //! Add the bytes of a plain value
+  template <typename TValue>
+  void AddValue(const TValue &value)
+  {
+    Add(&value, sizeof(TValue));
+  }
+
+  void AddString(const std::string &text)
+  {
+    Add(text.data(), text.size());
+  }
+
+  //! Add pixel type, region, origin, spacing, direction and pixels of the buffered region of an image
+  template <typename TImageType>
+  void AddImage(const TImageType *image)
+  {
+    typedef typename TImageType::PixelType PixelType;
+    AddValue(sizeof(PixelType));
+    AddValue(std::numeric_limits<PixelType>::is_integer);
+    AddValue(std::numeric_limits<PixelType>::is_signed);
+    const typename TImageType::RegionType region = image->GetBufferedRegion();
+    for (unsigned int d = 0; d < TImageType::ImageDimension; d++)
+    {
+      AddValue(static_cast<int64_t>(region.GetIndex()[d]));
+      AddValue(static_cast<uint64_t>(region.GetSize()[d]));
+      AddValue(image->GetOrigin()[d]);
+      AddValue(image->GetSpacing()[d]);
+      for (unsigned int e = 0; e < TImageType::ImageDimension; e++)
+      {
+        AddValue(image->GetDirection()(d, e));
+      }
+    }
+    Add(image->GetBufferPointer(), region.GetNumberOfPixels() * sizeof(PixelType));
+  }
+
+  uint64_t Get() const
+  {
+    return m_hash;
+  }
+
+  //! The hash as 16 hexadecimal digits
+  std::string GetHex() const
+  {
+    char text[17];
+    std::snprintf(text, sizeof(text), "%016llx", static_cast<unsigned long long>(m_hash));
+    return text;
+  }
+
+private:
+  void Mix(uint64_t word)
+  {
+    uint64_t hash = (m_hash ^ word) + 0x9e3779b97f4a7c15ull; // the constant keeps a zero hash from staying zero
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    m_hash = hash;
+  }
+
+  uint64_t m_hash;
+};
+
+/**
+\brief Directory of cached final transforms and per-level checkpoints, see the file description
+*/
+class TransformCache
+{
+public:
+  typedef itk::AffineTransform<double, 3> TransformType;
+
+  //! Use this directory, which is created if needed
+  explicit TransformCache(const std::string &directory) : m_directory(directory)
+  {
+    if (!itksys::SystemTools::MakeDirectory(directory.c_str()))
+    {
+      itkGenericExceptionMacro("Could not create cache directory " << directory);
+    }
+    itk::TransformFactoryBase::RegisterDefaultTransforms();
+  }
+
+  const std::string &GetDirectory() const
+  {
+    return m_directory;
+  }
+
+  //! The final transform of a finished registration, NULL if there is none
+  TransformType::Pointer Load(const std::string &key) const
+  {
+    return Read(GetPath(key, ""));
+  }
+
+  //! Store the final transform and remove the checkpoints of the registration
+  void Store(const std::string &key, const TransformType *transform, unsigned int levels) const
+  {
+    Write(GetPath(key, ""), transform);
+    for (unsigned int level = 0; level < levels; level++)
+    {
+      itksys::SystemTools::RemoveFile(GetPath(key, ".level" + std::to_string(level)).c_str());
+    }
+  }
+
+  /**
+  \brief The transform after the finest level finished so far of an interrupted registration
+
+  \param key Key of the registration
+  \param levels Number of levels of the registration
+  \param level Set to the level the transform belongs to
+  \return The transform, NULL if no level was finished
+  */
+  TransformType::Pointer LoadCheckpoint(const std::string &key, unsigned int levels, unsigned int &level) const
+  {
+    for (level = levels; level-- > 0;)
+    {
+      TransformType::Pointer transform = Read(GetPath(key, ".level" + std::to_string(level)));
+      if (transform)
+      {
+        return transform;
+      }
+    }
+    return NULL;
+  }
+
+  //! Store the transform after the given level
+  void StoreCheckpoint(const std::string &key, unsigned int level, const TransformType *transform) const
+  {
+    Write(GetPath(key, ".level" + std::to_string(level)), transform);
+  }
+
+private:
+  std::string GetPath(const std::string &key, const std::string &suffix) const
+  {
+    return m_directory + "/" + key + suffix + ".tfm";
+  }
+
+  static TransformType::Pointer Read(const std::string &path)
+  {
+    if (!itksys::SystemTools::FileExists(path.c_str(), true))
+    {
+      return NULL;
+    }
+    itk::TransformFileReader::Pointer reader = itk::TransformFileReader::New();
+    reader->SetFileName(path);
+    reader->Update();
+    if (reader->GetTransformList()->empty())
+    {
+      return NULL;
+    }
+    TransformType *transform = dynamic_cast<TransformType *>(reader->GetTransformList()->front().GetPointer());
+    return transform;
+  }
+
+  static void Write(const std::string &path, const TransformType *transform)
+  {
+    const std::string partial = path.substr(0, path.size() - 4) + ".partial.tfm";
+    itk::TransformFileWriter::Pointer writer = itk::TransformFileWriter::New();
+    writer->SetInput(transform);
+    writer->SetFileName(partial);
+    writer->Update();
+    itksys::SystemTools::RemoveFile(path.c_str()); // rename does not replace files on Windows
+    if (std::rename(partial.c_str(), path.c_str()) != 0)
+    {
+      itkGenericExceptionMacro("Could not move " << partial << " to " << path);
+    }
+  }
+
+  std::string m_directory;
+};
@@ -0,0 +1,345 @@
+/**
+\file TrilinearInterpolator.h
+
+\brief Linear interpolation of a 3D image at many points per call
+
+itk::LinearInterpolateImageFunction is called once per point through a virtual function and works out the
+neighbours and weights of that point on its own. TrilinearInterpolator takes whole arrays of continuous indices
+(one array per axis) instead and interpolates them in a tight loop: with AVX2, 8 points at a time using gather
+loads; with SSE4.1, 4 points at a time with the 8 corner values loaded one by one; otherwise one point at a
+time. Both SIMD kernels are always compiled (with the target attribute of GCC and Clang, MSVC needs no flag for
+the intrinsics) and the widest one the CPU runs is picked at run time, so a build for the baseline instruction
+set still uses AVX2 where it is available.
+
+The SIMD kernels are used for float images with less than 2^31 voxels; other pixel types use the scalar path
+(the registration works on float levels, see RegistrationImageType, so only the resampling of e.g. short
+outputs does). Coordinates and results are float, which resolves positions to about 1/10000 of a voxel in a
+1024^3 image.
+
+Like itk::LinearInterpolateImageFunction, a point is inside if every continuous index lies in
+[start - 0.5, start + size - 0.5); neighbours beyond the border are replaced by the border voxel.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define TRILINEAR_INTERPOLATOR_X86
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define TRILINEAR_INTERPOLATOR_TARGET(isa)
+#else
+#define TRILINEAR_INTERPOLATOR_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+#include "itkImage.h"
+
+//! Kernels of TrilinearInterpolator, from the narrowest to the widest
+enum class TrilinearKernel
+{
+  Scalar,
+  SSE41,
+  AVX2
+};
+
+//! The widest kernel this CPU runs, detected on the first call
+inline TrilinearKernel GetWidestTrilinearKernel()
+{
+  static const TrilinearKernel widest = []()
+  {
+#if defined(TRILINEAR_INTERPOLATOR_X86)
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 0);
+    const int highestLeaf = info[0];
+    __cpuid(info, 1);
+    const bool sse41 = (info[2] & (1 << 19)) != 0;
+    // AVX registers need to be saved by the operating system as well (OSXSAVE, AVX and XCR0 bits 1 and 2)
+    const bool avx = ((info[2] & (1 << 27)) != 0) && ((info[2] & (1 << 28)) != 0) && ((_xgetbv(0) & 6) == 6);
+    bool avx2 = false;
+    if (avx && (highestLeaf >= 7))
+    {
+      __cpuidex(info, 7, 0);
+      avx2 = (info[1] & (1 << 5)) != 0;
+    }
+#else
+    __builtin_cpu_init();
+    const bool avx2 = __builtin_cpu_supports("avx2");
+    const bool sse41 = __builtin_cpu_supports("sse4.1");
+#endif
+    if (avx2)
+    {
+      return TrilinearKernel::AVX2;
+    }
+    if (sse41)
+    {
+      return TrilinearKernel::SSE41;
+    }
+#endif
+    return TrilinearKernel::Scalar;
+  }();
+  return widest;
+}
+
+template <typename TImageType>
+class TrilinearInterpolator
+{
+public:
+  typedef typename TImageType::PixelType PixelType;
+  static_assert(TImageType::ImageDimension == 3, "TrilinearInterpolator needs a 3D image");
+
+  //! Default Constructor
+  TrilinearInterpolator() : m_buffer(NULL), m_kernel(TrilinearKernel::Scalar), m_simd(false)
+  {
+  }
+
+  //! Interpolate the buffered region of this image; the image has to outlive the interpolator
+  void SetInputImage(const TImageType *image)
+  {
+    const typename TImageType::RegionType region = image->GetBufferedRegion();
+    m_buffer = image->GetBufferPointer();
+    for (unsigned int d = 0; d < 3; d++)
+    {
+      m_start[d] = static_cast<float>(region.GetIndex()[d]);
+      m_size[d] = static_cast<int>(region.GetSize()[d]);
+    }
+    m_strideY = m_size[0];
+    m_strideZ = size_t(m_size[0]) * m_size[1];
+    m_simd = std::is_same<PixelType, float>::value &&
+      (region.GetNumberOfPixels() < static_cast<size_t>(std::numeric_limits<int32_t>::max()));
+    m_kernel = m_simd ? GetWidestTrilinearKernel() : TrilinearKernel::Scalar;
+  }
+
+  /**
+  \brief Use a narrower kernel than the widest one of the CPU, e.g. to compare the kernels
+
+  Call after SetInputImage(); kernels the CPU or the pixel type does not allow are narrowed down.
+  */
+  void SetKernel(TrilinearKernel kernel)
+  {
+    m_kernel = m_simd ? std::min(kernel, GetWidestTrilinearKernel()) : TrilinearKernel::Scalar;
+  }
+
+  //! The kernel Evaluate() uses
+  TrilinearKernel GetKernel() const
+  {
+    return m_kernel;
+  }
+
+  /**
+  \brief Interpolate the image at 'count' points
+
+  \param x, y, z Continuous indices of the points, one array per axis
+  \param count Number of points
+  \param values Interpolated values, outsideValue for points outside of the image
+  \param inside If not NULL, 1 for the points inside of the image and 0 for the others
+  \param outsideValue Value of the points outside of the image
+  */
+  void Evaluate(const float *x, const float *y, const float *z, size_t count, float *values,
+    unsigned char *inside = NULL, float outsideValue = 0) const
+  {
+    size_t done = 0;
+#if defined(TRILINEAR_INTERPOLATOR_X86)
+    if (m_kernel == TrilinearKernel::AVX2)
+    {
+      done = EvaluateAVX2(reinterpret_cast<const float *>(m_buffer), x, y, z, count, values, inside, outsideValue);
+    }
+    else if (m_kernel == TrilinearKernel::SSE41)
+    {
+      done = EvaluateSSE41(reinterpret_cast<const float *>(m_buffer), x, y, z, count, values, inside, outsideValue);
+    }
+#endif
+    EvaluateScalar(x + done, y + done, z + done, count - done, values + done, (inside == NULL) ? NULL : inside + done, outsideValue);
+  }
+
+private:
+  void EvaluateScalar(const float *x, const float *y, const float *z, size_t count, float *values,
+    unsigned char *inside, float outsideValue) const
+  {
+    for (size_t i = 0; i < count; i++)
+    {
+      const float p[3] = { x[i] - m_start[0], y[i] - m_start[1], z[i] - m_start[2] };
+      bool isInside = true;
+      for (unsigned int d = 0; d < 3; d++)
+      {
+        isInside = isInside && (p[d] >= -0.5f) && (p[d] < m_size[d] - 0.5f);
+      }
+      if (inside != NULL)
+      {
+        inside[i] = isInside ? 1 : 0;
+      }
+      if (!isInside)
+      {
+        values[i] = outsideValue;
+        continue;
+      }
+
+      size_t lower[3], upper[3];
+      float weight[3];
+      for (unsigned int d = 0; d < 3; d++)
+      {
+        const float base = std::floor(p[d]);
+        weight[d] = p[d] - base;
+        lower[d] = std::max(static_cast<int>(base), 0);
+        upper[d] = std::min(static_cast<int>(base) + 1, m_size[d] - 1);
+      }
+
+      const size_t y0z0 = lower[1] * m_strideY + lower[2] * m_strideZ, y1z0 = upper[1] * m_strideY + lower[2] * m_strideZ;
+      const size_t y0z1 = lower[1] * m_strideY + upper[2] * m_strideZ, y1z1 = upper[1] * m_strideY + upper[2] * m_strideZ;
+      const float c00 = Lerp(Value(y0z0 + lower[0]), Value(y0z0 + upper[0]), weight[0]);
+      const float c10 = Lerp(Value(y1z0 + lower[0]), Value(y1z0 + upper[0]), weight[0]);
+      const float c01 = Lerp(Value(y0z1 + lower[0]), Value(y0z1 + upper[0]), weight[0]);
+      const float c11 = Lerp(Value(y1z1 + lower[0]), Value(y1z1 + upper[0]), weight[0]);
+      values[i] = Lerp(Lerp(c00, c10, weight[1]), Lerp(c01, c11, weight[1]), weight[2]);
+    }
+  }
+
+  float Value(size_t offset) const
+  {
+    return static_cast<float>(m_buffer[offset]);
+  }
+
+  static float Lerp(float a, float b, float weight)
+  {
+    return a + weight * (b - a);
+  }
+
+#if defined(TRILINEAR_INTERPOLATOR_X86)
+  //! 8 points at a time; returns the number of points done, the rest is left to the scalar path
+  TRILINEAR_INTERPOLATOR_TARGET("avx2")
+  size_t EvaluateAVX2(const float *buffer, const float *x, const float *y, const float *z, size_t count, float *values,
+    unsigned char *inside, float outsideValue) const
+  {
+    const __m256 half = _mm256_set1_ps(-0.5f), outside = _mm256_set1_ps(outsideValue);
+    const __m256 start[3] = { _mm256_set1_ps(m_start[0]), _mm256_set1_ps(m_start[1]), _mm256_set1_ps(m_start[2]) };
+    const __m256 end[3] = { _mm256_set1_ps(m_size[0] - 0.5f), _mm256_set1_ps(m_size[1] - 0.5f), _mm256_set1_ps(m_size[2] - 0.5f) };
+    const __m256i last[3] = { _mm256_set1_epi32(m_size[0] - 1), _mm256_set1_epi32(m_size[1] - 1), _mm256_set1_epi32(m_size[2] - 1) };
+    const __m256i zero = _mm256_setzero_si256(), one = _mm256_set1_epi32(1);
+    const __m256i strideY = _mm256_set1_epi32(static_cast<int>(m_strideY)), strideZ = _mm256_set1_epi32(static_cast<int>(m_strideZ));
+    const float *coordinates[3] = { x, y, z };
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+      __m256 isInside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+      __m256 weight[3];
+      __m256i lower[3], upper[3];
+      for (unsigned int d = 0; d < 3; d++)
+      {
+        const __m256 p = _mm256_sub_ps(_mm256_loadu_ps(coordinates[d] + i), start[d]);
+        isInside = _mm256_and_ps(isInside, _mm256_and_ps(_mm256_cmp_ps(p, half, _CMP_GE_OQ), _mm256_cmp_ps(p, end[d], _CMP_LT_OQ)));
+        const __m256 base = _mm256_floor_ps(p);
+        weight[d] = _mm256_sub_ps(p, base);
+        const __m256i index = _mm256_cvttps_epi32(base);
+        lower[d] = _mm256_min_epi32(_mm256_max_epi32(index, zero), last[d]);
+        upper[d] = _mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(index, one), zero), last[d]);
+      }
+
+      const __m256i y0 = _mm256_mullo_epi32(lower[1], strideY), y1 = _mm256_mullo_epi32(upper[1], strideY);
+      const __m256i z0 = _mm256_mullo_epi32(lower[2], strideZ), z1 = _mm256_mullo_epi32(upper[2], strideZ);
+      const __m256i rows[4] = { _mm256_add_epi32(y0, z0), _mm256_add_epi32(y1, z0), _mm256_add_epi32(y0, z1), _mm256_add_epi32(y1, z1) };
+      __m256 c[4];
+      for (unsigned int r = 0; r < 4; r++)
+      {
+        const __m256 a = _mm256_i32gather_ps(buffer, _mm256_add_epi32(rows[r], lower[0]), 4);
+        const __m256 b = _mm256_i32gather_ps(buffer, _mm256_add_epi32(rows[r], upper[0]), 4);
+        c[r] = _mm256_add_ps(a, _mm256_mul_ps(weight[0], _mm256_sub_ps(b, a)));
+      }
+      const __m256 c0 = _mm256_add_ps(c[0], _mm256_mul_ps(weight[1], _mm256_sub_ps(c[1], c[0])));
+      const __m256 c1 = _mm256_add_ps(c[2], _mm256_mul_ps(weight[1], _mm256_sub_ps(c[3], c[2])));
+      const __m256 value = _mm256_add_ps(c0, _mm256_mul_ps(weight[2], _mm256_sub_ps(c1, c0)));
+      _mm256_storeu_ps(values + i, _mm256_blendv_ps(outside, value, isInside));
+
+      if (inside != NULL)
+      {
+        const int bits = _mm256_movemask_ps(isInside);
+        for (unsigned int k = 0; k < 8; k++)
+        {
+          inside[i + k] = (bits >> k) & 1;
+        }
+      }
+    }
+    return i;
+  }
+
+  //! 4 points at a time; returns the number of points done, the rest is left to the scalar path
+  TRILINEAR_INTERPOLATOR_TARGET("sse4.1")
+  size_t EvaluateSSE41(const float *buffer, const float *x, const float *y, const float *z, size_t count, float *values,
+    unsigned char *inside, float outsideValue) const
+  {
+    const __m128 half = _mm_set1_ps(-0.5f), outside = _mm_set1_ps(outsideValue);
+    const __m128 start[3] = { _mm_set1_ps(m_start[0]), _mm_set1_ps(m_start[1]), _mm_set1_ps(m_start[2]) };
+    const __m128 end[3] = { _mm_set1_ps(m_size[0] - 0.5f), _mm_set1_ps(m_size[1] - 0.5f), _mm_set1_ps(m_size[2] - 0.5f) };
+    const __m128i last[3] = { _mm_set1_epi32(m_size[0] - 1), _mm_set1_epi32(m_size[1] - 1), _mm_set1_epi32(m_size[2] - 1) };
+    const __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi32(1);
+    const __m128i strideY = _mm_set1_epi32(static_cast<int>(m_strideY)), strideZ = _mm_set1_epi32(static_cast<int>(m_strideZ));
+    const float *coordinates[3] = { x, y, z };
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+      __m128 isInside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+      __m128 weight[3];
+      __m128i lower[3], upper[3];
+      for (unsigned int d = 0; d < 3; d++)
+      {
+        const __m128 p = _mm_sub_ps(_mm_loadu_ps(coordinates[d] + i), start[d]);
+        isInside = _mm_and_ps(isInside, _mm_and_ps(_mm_cmpge_ps(p, half), _mm_cmplt_ps(p, end[d])));
+        const __m128 base = _mm_floor_ps(p);
+        weight[d] = _mm_sub_ps(p, base);
+        const __m128i index = _mm_cvttps_epi32(base);
+        lower[d] = _mm_min_epi32(_mm_max_epi32(index, zero), last[d]);
+        upper[d] = _mm_min_epi32(_mm_max_epi32(_mm_add_epi32(index, one), zero), last[d]);
+      }
+
+      const __m128i y0 = _mm_mullo_epi32(lower[1], strideY), y1 = _mm_mullo_epi32(upper[1], strideY);
+      const __m128i z0 = _mm_mullo_epi32(lower[2], strideZ), z1 = _mm_mullo_epi32(upper[2], strideZ);
+      const __m128i rows[4] = { _mm_add_epi32(y0, z0), _mm_add_epi32(y1, z0), _mm_add_epi32(y0, z1), _mm_add_epi32(y1, z1) };
+      __m128 c[4];
+      for (unsigned int r = 0; r < 4; r++)
+      {
+        // no gather before AVX2: the offsets are computed together and the values loaded one by one
+        alignas(16) int32_t lowerOffsets[4], upperOffsets[4];
+        alignas(16) float a[4], b[4];
+        _mm_store_si128(reinterpret_cast<__m128i *>(lowerOffsets), _mm_add_epi32(rows[r], lower[0]));
+        _mm_store_si128(reinterpret_cast<__m128i *>(upperOffsets), _mm_add_epi32(rows[r], upper[0]));
+        for (unsigned int k = 0; k < 4; k++)
+        {
+          a[k] = buffer[lowerOffsets[k]];
+          b[k] = buffer[upperOffsets[k]];
+        }
+        const __m128 va = _mm_load_ps(a), vb = _mm_load_ps(b);
+        c[r] = _mm_add_ps(va, _mm_mul_ps(weight[0], _mm_sub_ps(vb, va)));
+      }
+      const __m128 c0 = _mm_add_ps(c[0], _mm_mul_ps(weight[1], _mm_sub_ps(c[1], c[0])));
+      const __m128 c1 = _mm_add_ps(c[2], _mm_mul_ps(weight[1], _mm_sub_ps(c[3], c[2])));
+      const __m128 value = _mm_add_ps(c0, _mm_mul_ps(weight[2], _mm_sub_ps(c1, c0)));
+      _mm_storeu_ps(values + i, _mm_blendv_ps(outside, value, isInside));
+
+      if (inside != NULL)
+      {
+        const int bits = _mm_movemask_ps(isInside);
+        for (unsigned int k = 0; k < 4; k++)
+        {
+          inside[i + k] = (bits >> k) & 1;
+        }
+      }
+    }
+    return i;
+  }
+#endif
+
+  const PixelType *m_buffer;
+  float m_start[3];
+  int m_size[3];
+  size_t m_strideY, m_strideZ;
+  TrilinearKernel m_kernel;
+  bool m_simd; //! the SIMD kernels can be used with this image
+};
@@ -0,0 +1,299 @@
+/**
+\file VoxelSampler.h
+
+\brief Chooses the voxels of the fixed image that the registration metric is computed over
+
+Comparing every voxel of the fixed image on every iteration is rarely needed; a few percent of the voxels give
+nearly the same metric at a fraction of the cost. VoxelSampler draws such a subset once per resolution level:
+
+- Uniform: the given fraction of all voxels, every voxel equally likely
+- Stratified: the grid is split into small cubes and the given fraction of the voxels of every cube is drawn
+at random from it, so the samples cover the image evenly
+- Mask: the given fraction of the voxels inside the mask (all of them for a fraction of 1)
+
+The draws come from a std::mt19937 seeded with the seed and the level, so a run can be repeated exactly. The
+samples are stored as sorted 32-bit linear offsets into the buffer of the level image, which
+ParallelMeanSquaresMetric takes as they are (SetFixedImageOffsets()) and visits in memory order.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "itkImage.h"
+
+#include "BitMaskImage.h"
+
+enum class SamplingStrategy
+{
+  Uniform,
+  Stratified,
+  Mask
+};
+
+template< unsigned int VDimension = 3 >
+class VoxelSampler
+{
+public:
+  typedef itk::ImageBase< VDimension > ImageBaseType;
+  typedef typename ImageBaseType::RegionType RegionType;
+  typedef typename ImageBaseType::IndexType IndexType;
+  typedef typename ImageBaseType::PointType PointType;
+  typedef uint32_t OffsetType;
+  static const unsigned int ImageDimension = VDimension;
+
+  //! Default Constructor
+  VoxelSampler() : m_strategy(SamplingStrategy::Mask), m_fraction(1.0), m_seed(0), m_mask(NULL), m_maskImage(NULL)
+  {
+  }
+
+  //! Default Destructor
+  ~VoxelSampler()
+  {
+  }
+
+  void SetStrategy(SamplingStrategy strategy)
+  {
+    m_strategy = strategy;
+  }
+
+  SamplingStrategy GetStrategy() const
+  {
+    return m_strategy;
+  }
+
+  //! Fraction of the candidate voxels to draw, in (0, 1]
+  void SetFraction(double fraction)
+  {
+    m_fraction = std::min(1.0, std::max(0.0, fraction));
+  }
+
+  double GetFraction() const
+  {
+    return m_fraction;
+  }
+
+  void SetSeed(unsigned int seed)
+  {
+    m_seed = seed;
+  }
+
+  //! The mask and the image that defines its geometry (i.e. the full resolution fixed image)
+  void SetMask(const BitMaskImage< VDimension > *mask, const ImageBaseType *maskImage)
+  {
+    m_mask = mask;
+    m_maskImage = maskImage;
+  }
+
+  /**
+  \brief Draw the samples of one level
+
+  \param image Fixed image or one of its pyramid levels; the samples are offsets into its largest possible region
+  \param level Resolution level, mixed into the seed so that every level gets its own draw
+  */
+  void Sample(const ImageBaseType *image, unsigned int level = 0)
+  {
+    m_region = image->GetLargestPossibleRegion();
+    const size_t voxels = m_region.GetNumberOfPixels();
+    if (voxels > std::numeric_limits< OffsetType >::max())
+    {
+      itkGenericExceptionMacro("Image has too many voxels for 32-bit sample offsets: " << voxels);
+    }
+
+    std::seed_seq seed = { m_seed, level };
+    std::mt19937 random(seed);
+    m_offsets.clear();
+
+    switch (m_strategy)
+    {
+    case SamplingStrategy::Uniform:
+      SelectUniform(voxels, std::llround(m_fraction * voxels), random, [](size_t offset) { return offset; });
+      break;
+    case SamplingStrategy::Stratified:
+      SampleStratified(random);
+      break;
+    case SamplingStrategy::Mask:
+    {
+      if (m_mask == NULL)
+      {
+        itkGenericExceptionMacro("Mask sampling needs a mask");
+      }
+      std::vector< OffsetType > inside;
+      if (m_region == m_mask->GetRegion())
+      {
+        // full resolution, the mask iterator skips empty words
+        inside.reserve(m_mask->GetNumberOfSetPixels());
+        for (typename BitMaskImage< VDimension >::ConstIterator it(*m_mask); !it.IsAtEnd(); ++it)
+        {
+          inside.push_back(static_cast< OffsetType >(it.GetOffset()));
+        }
+      }
+      else
+      {
+        // pyramid level, look up the mask at the physical location of every voxel
+        for (size_t offset = 0; offset < voxels; offset++)
+        {
+          PointType point;
+          image->TransformIndexToPhysicalPoint(ComputeIndex(offset), point);
+          IndexType maskIndex;
+          if (m_maskImage->TransformPhysicalPointToIndex(point, maskIndex) && m_mask->GetPixel(maskIndex))
+          {
+            inside.push_back(static_cast< OffsetType >(offset));
+          }
+        }
+      }
+      SelectUniform(inside.size(), std::llround(m_fraction * inside.size()), random,
+        [&inside](size_t i) { return inside[i]; });
+      break;
+    }
+    }
+
+    if (m_offsets.empty())
+    {
+      itkGenericExceptionMacro("No voxels sampled at level " << level);
+    }
+  }
+
+  //! Sorted linear offsets of the samples into the buffer of the sampled image
+  const std::vector< OffsetType > &GetOffsets() const
+  {
+    return m_offsets;
+  }
+
+  size_t GetNumberOfSamples() const
+  {
+    return m_offsets.size();
+  }
+
+  //! Region of the image that was sampled
+  const RegionType &GetRegion() const
+  {
+    return m_region;
+  }
+
+  //! Index of a linear offset in the sampled region
+  IndexType ComputeIndex(size_t offset) const
+  {
+    IndexType index;
+    for (unsigned int d = 0; d < ImageDimension; d++)
+    {
+      index[d] = m_region.GetIndex()[d] + offset % m_region.GetSize()[d];
+      offset /= m_region.GetSize()[d];
+    }
+    return index;
+  }
+
+  //! The samples as indexes, e.g. for ImageToImageMetric::SetFixedImageIndexes()
+  template< class TContainer >
+  TContainer GetIndexes() const
+  {
+    TContainer indexes;
+    indexes.reserve(m_offsets.size());
+    for (size_t i = 0; i < m_offsets.size(); i++)
+    {
+      indexes.push_back(ComputeIndex(m_offsets[i]));
+    }
+    return indexes;
+  }
+
+private:
+  /**
+  Pick 'count' of the 'candidates' items, each equally likely, in a single ordered pass (Knuth's selection
+  sampling), so the result stays in the order of the candidates without sorting.
+  */
+  template< class TCandidate >
+  void SelectUniform(size_t candidates, long long count, std::mt19937 &random, TCandidate candidate)
+  {
+    size_t needed = static_cast< size_t >(std::max(1LL, count));
+    needed = std::min(needed, candidates);
+    m_offsets.reserve(needed);
+    std::uniform_real_distribution< double > uniform(0.0, 1.0);
+    for (size_t i = 0; (i < candidates) && (needed > 0); i++)
+    {
+      if (uniform(random) * (candidates - i) < needed)
+      {
+        m_offsets.push_back(static_cast< OffsetType >(candidate(i)));
+        needed--;
+      }
+    }
+  }
+
+  /**
+  The grid is split into cubes of about 1 / fraction voxels (at least 2 voxels per axis, so the draw within a
+  cube stays random) and the given fraction of every cube is drawn from it without replacement. Cubes hold
+  whole voxels, so the count per cube carries the rounding over to the next cube: the total is
+  round(fraction * voxels) for any fraction, and cubes at the border, which are cut to the region, get their
+  share as well.
+  */
+  void SampleStratified(std::mt19937 &random)
+  {
+    const double fraction = std::max(m_fraction, 1e-9);
+    const size_t cell = std::max< size_t >(2, static_cast< size_t >(std::ceil(std::pow(1.0 / fraction, 1.0 / ImageDimension) - 1e-9)));
+    const typename RegionType::SizeType size = m_region.GetSize();
+
+    size_t cells[ImageDimension], totalCells = 1;
+    for (unsigned int d = 0; d < ImageDimension; d++)
+    {
+      cells[d] = (size[d] + cell - 1) / cell;
+      totalCells *= cells[d];
+    }
+
+    const size_t voxels = m_region.GetNumberOfPixels();
+    const size_t target = static_cast< size_t >(std::llround(fraction * voxels));
+    m_offsets.reserve(target);
+    std::uniform_real_distribution< double > uniform(0.0, 1.0);
+    size_t visited = 0;
+    for (size_t c = 0; c < totalCells; c++)
+    {
+      size_t remainder = c, begin[ImageDimension], extent[ImageDimension], cellVoxels = 1;
+      for (unsigned int d = 0; d < ImageDimension; d++)
+      {
+        begin[d] = (remainder % cells[d]) * cell;
+        extent[d] = std::min(cell, size[d] - begin[d]);
+        remainder /= cells[d];
+        cellVoxels *= extent[d];
+      }
+      visited += cellVoxels;
+
+      // samples owed after this cube, minus those already drawn
+      size_t needed = static_cast< size_t >(std::llround(fraction * visited)) - m_offsets.size();
+      needed = std::min(needed, cellVoxels);
+      for (size_t i = 0; (i < cellVoxels) && (needed > 0); i++)
+      {
+        if (uniform(random) * (cellVoxels - i) < needed)
+        {
+          size_t local = i, offset = 0, stride = 1;
+          for (unsigned int d = 0; d < ImageDimension; d++)
+          {
+            offset += (begin[d] + local % extent[d]) * stride;
+            local /= extent[d];
+            stride *= size[d];
+          }
+          m_offsets.push_back(static_cast< OffsetType >(offset));
+          needed--;
+        }
+      }
+    }
+    // the cubes are visited in raster order of the cubes, not of the voxels
+    std::sort(m_offsets.begin(), m_offsets.end());
+
+    if (m_offsets.size() != target)
+    {
+      itkGenericExceptionMacro("Stratified sampling drew " << m_offsets.size() << " voxels instead of " << target);
+    }
+  }
+
+  SamplingStrategy m_strategy;
+  double m_fraction;
+  unsigned int m_seed;
+  const BitMaskImage< VDimension > *m_mask;
+  const ImageBaseType *m_maskImage;
+  RegionType m_region;
+  std::vector< OffsetType > m_offsets;
+};
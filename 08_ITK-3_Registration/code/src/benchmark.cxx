@@ -0,0 +1,227 @@
+/**
+\brief ITK Registration Metric Benchmark
+
+Times value and derivative of ParallelMeanSquaresMetric for an increasing number of threads, with the moving
+image slightly shifted and rotated, and checks that every thread count gives exactly the same result. Also
+times itk::MeanSquaresImageToImageMetric on the same samples for reference, and resampling of the moving image
+with itk::ResampleImageFilter against resampleAffine().
+*/
+
+#include <chrono>
+#include <cmath>
+#include <thread>
+
+//! ITK headers
+#include "itkImage.h"
+#include "itkImageFileReader.h"
+#include "itkAffineTransform.h"
+#include "itkLinearInterpolateImageFunction.h"
+#include "itkMeanSquaresImageToImageMetric.h"
+#include "itkResampleImageFilter.h"
+#include "itkImageRegionConstIterator.h"
+
+#include "AffineResampler.h"
+#include "VoxelSampler.h"
+#include "ParallelMeanSquaresMetric.h"
+
+typedef itk::Image<float, 3> ImageType;
+typedef itk::AffineTransform<double, 3> TransformType;
+typedef itk::LinearInterpolateImageFunction<ImageType, double> InterpolatorType;
+
+/**
+\brief Get the itk::Image
+
+\param The itk::Image which will contain the image data
+\param File name of the image
+*/
+template <class TImageType>
+void SafeReadImage(typename TImageType::Pointer image, const std::string &fName)
+{
+  typedef TImageType ImageType;
+  typedef itk::ImageFileReader< ImageType > ImageReaderType;
+  typename ImageReaderType::Pointer reader = ImageReaderType::New();
+  reader->SetFileName(fName);
+
+  try
+  {
+    reader->Update();
+  }
+  catch (itk::ExceptionObject& e)
+  {
+    std::cerr << "Exception caught: " << e.what() << "\n";
+    return;
+  }
+
+  image->Graft(reader->GetOutput());
+  return;
+}
+
+//! Hook a metric up to the images, the samples and a fresh transform and interpolator
+template <class TMetricType>
+void setupMetric(TMetricType *metric, ImageType::Pointer fixedImage, ImageType::Pointer movingImage, const VoxelSampler<3> &sampler)
+{
+  metric->SetFixedImage(fixedImage);
+  metric->SetMovingImage(movingImage);
+  metric->SetFixedImageRegion(fixedImage->GetLargestPossibleRegion());
+  metric->SetTransform(TransformType::New());
+  metric->SetInterpolator(InterpolatorType::New());
+  metric->SetFixedImageIndexes(sampler.GetIndexes<typename TMetricType::FixedImageIndexContainer>());
+  metric->SetUseFixedImageIndexes(true);
+  metric->Initialize();
+}
+
+//! ParallelMeanSquaresMetric takes the offsets of the samples rather than their indexes
+void setupMetric(ParallelMeanSquaresMetric<ImageType, ImageType> *metric, ImageType::Pointer fixedImage, ImageType::Pointer movingImage,
+  const VoxelSampler<3> &sampler)
+{
+  metric->SetFixedImage(fixedImage);
+  metric->SetMovingImage(movingImage);
+  metric->SetFixedImageRegion(fixedImage->GetLargestPossibleRegion());
+  metric->SetTransform(TransformType::New());
+  metric->SetInterpolator(InterpolatorType::New());
+  metric->SetFixedImageOffsets(&sampler.GetOffsets());
+  metric->Initialize();
+}
+
+void echoUsage(const std::string &exeName)
+{
+  std::cout << exeName << " <fixedImage> <movingImage> [maxThreads] [samplingFraction] [repetitions]\n" <<
+    "e.g. " << exeName << " ../data/T1.nii.gz ../data/T2.nii.gz 8 0.1\n";
+}
+
+// main entry of program
+int main(int argc, char *argv[])
+{
+  try // to catch exceptions
+  {
+    if (argc < 3)
+    {
+      std::cerr << "Usage: " << std::endl;
+      echoUsage(argv[0]);
+      return EXIT_FAILURE;
+    }
+
+    const unsigned int maxThreads = (argc > 3) ? std::atoi(argv[3]) : std::max(1u, std::thread::hardware_concurrency());
+    const double fraction = (argc > 4) ? std::atof(argv[4]) : 1.0;
+    const unsigned int repetitions = (argc > 5) ? std::atoi(argv[5]) : 5;
+
+    ImageType::Pointer fixedImage = ImageType::New();
+    SafeReadImage<ImageType>(fixedImage, argv[1]);
+    ImageType::Pointer movingImage = ImageType::New();
+    SafeReadImage<ImageType>(movingImage, argv[2]);
+
+    VoxelSampler<3> sampler;
+    sampler.SetStrategy(SamplingStrategy::Uniform);
+    sampler.SetFraction(fraction);
+    sampler.Sample(fixedImage);
+
+    // a small rotation about z and a shift, so that the derivative is not 0
+    TransformType::Pointer transform = TransformType::New();
+    transform->Rotate(0, 1, 0.02);
+    TransformType::OutputVectorType shift;
+    shift.Fill(1.5);
+    transform->Translate(shift);
+    const TransformType::ParametersType parameters = transform->GetParameters();
+
+    typedef std::chrono::high_resolution_clock ClockType;
+    typedef itk::MeanSquaresImageToImageMetric<ImageType, ImageType> ITKMetricType;
+    typedef ParallelMeanSquaresMetric<ImageType, ImageType> MetricType;
+    ITKMetricType::MeasureType itkValue = 0, value = 0, referenceValue = 0;
+    ITKMetricType::DerivativeType itkDerivative, derivative, referenceDerivative;
+
+    ITKMetricType::Pointer itkMetric = ITKMetricType::New();
+    setupMetric(itkMetric.GetPointer(), fixedImage, movingImage, sampler);
+    double bestITK = 0;
+    for (unsigned int r = 0; r < repetitions; r++)
+    {
+      auto t1 = ClockType::now();
+      itkMetric->GetValueAndDerivative(parameters, itkValue, itkDerivative);
+      auto t2 = ClockType::now();
+      const double elapsed = std::chrono::duration<double, std::milli>(t2 - t1).count();
+      bestITK = (r == 0) ? elapsed : std::min(bestITK, elapsed);
+    }
+
+    std::cout << sampler.GetNumberOfSamples() << " samples\n";
+    std::cout << "metric,threads,milliseconds,speedup,value,identical\n";
+    // the ITK metric uses its own default number of threads
+    std::cout << "itk,default," << bestITK << ",1," << itkValue << ",-\n";
+
+    double bestSingle = 0;
+    for (unsigned int threads = 1; threads <= maxThreads; threads = (threads < maxThreads) ? std::min(2 * threads, maxThreads) : threads + 1)
+    {
+      MetricType::Pointer metric = MetricType::New();
+      setupMetric(metric.GetPointer(), fixedImage, movingImage, sampler);
+      metric->SetNumberOfWorkers(threads);
+
+      double best = 0;
+      for (unsigned int r = 0; r < repetitions; r++)
+      {
+        auto t1 = ClockType::now();
+        metric->GetValueAndDerivative(parameters, value, derivative);
+        auto t2 = ClockType::now();
+        const double elapsed = std::chrono::duration<double, std::milli>(t2 - t1).count();
+        best = (r == 0) ? elapsed : std::min(best, elapsed);
+      }
+      if (threads == 1)
+      {
+        bestSingle = best;
+        referenceValue = value;
+        referenceDerivative = derivative;
+      }
+
+      // bit-for-bit, not within a tolerance
+      const bool identical = (value == referenceValue) && (derivative == referenceDerivative);
+      std::cout << "parallel," << threads << "," << best << "," << bestSingle / best << "," << value << "," << (identical ? "yes" : "no") << "\n";
+      if (!identical)
+      {
+        std::cerr << "Result with " << threads << " threads differs from the result with 1 thread.\n";
+        return EXIT_FAILURE;
+      }
+    }
+
+    std::cout << "Relative difference to ITK: " << std::abs(referenceValue - itkValue) / std::max(std::abs(itkValue), 1e-12) << "\n";
+
+    // resampling of the moving image onto its own grid, as done for the output of the registration
+    typedef itk::ResampleImageFilter<ImageType, ImageType> ResampleFilterType;
+    ImageType::Pointer itkResampled, resampled;
+    double bestResampleITK = 0, bestResample = 0;
+    for (unsigned int r = 0; r < repetitions; r++)
+    {
+      ResampleFilterType::Pointer resampler = ResampleFilterType::New();
+      resampler->SetInput(movingImage);
+      resampler->SetTransform(transform);
+      resampler->SetInterpolator(InterpolatorType::New());
+      resampler->SetOutputParametersFromImage(movingImage);
+      resampler->SetDefaultPixelValue(0);
+      auto t1 = ClockType::now();
+      resampler->Update();
+      auto t2 = ClockType::now();
+      itkResampled = resampler->GetOutput();
+      resampled = resampleAffine<ImageType>(movingImage.GetPointer(), transform.GetPointer(), movingImage.GetPointer(), 0, maxThreads);
+      auto t3 = ClockType::now();
+      const double itkElapsed = std::chrono::duration<double, std::milli>(t2 - t1).count();
+      const double elapsed = std::chrono::duration<double, std::milli>(t3 - t2).count();
+      bestResampleITK = (r == 0) ? itkElapsed : std::min(bestResampleITK, itkElapsed);
+      bestResample = (r == 0) ? elapsed : std::min(bestResample, elapsed);
+    }
+
+    double maxDifference = 0;
+    itk::ImageRegionConstIterator<ImageType> itkIt(itkResampled, itkResampled->GetBufferedRegion());
+    itk::ImageRegionConstIterator<ImageType> it(resampled, resampled->GetBufferedRegion());
+    for (; !it.IsAtEnd(); ++it, ++itkIt)
+    {
+      maxDifference = std::max(maxDifference, std::abs(static_cast<double>(it.Get()) - itkIt.Get()));
+    }
+    std::cout << "resampler,threads,milliseconds,speedup\n";
+    std::cout << "itk,default," << bestResampleITK << ",1\n";
+    std::cout << "affine," << maxThreads << "," << bestResample << "," << bestResampleITK / bestResample << "\n";
+    std::cout << "Largest voxel difference to ITK: " << maxDifference << "\n";
+  }
+  catch (itk::ExceptionObject &error)
+  {
+    std::cerr << "Exception caught: " << error << "\n";
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -2,6 +2,16 @@
 \brief ITK Registration Tutorial
 */
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
 //! ITK headers
 #include "itkImage.h"
 #include "itkImageFileReader.h"
@@ -28,6 +38,11 @@
 
 #include <itkCorrelationCoefficientHistogramImageToImageMetric.h>
 
+#include "BitMaskImage.h"
+#include "AffineRegistration.h"
+#include "BSplineRegistration.h"
+#include "MultiChannelResampler.h"
+
 
 /**
 \brief Get the itk::Image
@@ -62,97 +77,327 @@ void SafeReadImage(typename TImageType::Pointer image, const std::string &fName)
 
 \param fixedImage itk::Image::Pointer to fixed image
 \param movingImage itk::Image::Pointer to moving image
-\param maskImage itk::Image::Pointer to mask of fixed image
+\param mask Bit-packed mask of fixed image, used by the mask sampling
 \param outputFileName File name of output
+\param options How the registration is to be done
+\param channels If not NULL, more images on the grid of the moving image, resampled in one pass with it
 */
-template <typename TImageType, typename TMaskImageType>
+template <typename TImageType>
 void registrationFilter(typename TImageType::Pointer fixedImage,
   typename TImageType::Pointer movingImage,
-  typename TMaskImageType::Pointer maskImage,
-  const std::string &outputFileName)
+  const BitMaskImage<3> &mask,
+  const std::string &outputFileName,
+  const RegistrationOptions &options,
+  MultiChannelResampler *channels = NULL)
 {
-  // convert mask image to input image type
-  typedef itk::CastImageFilter<TMaskImageType, TImageType> CastFilterType;
-  typename CastFilterType::Pointer cast_filter = CastFilterType::New();
-  cast_filter->SetInput(maskImage);
-  cast_filter->Update();
-  typename TImageType::Pointer mask = cast_filter->GetOutput();
-
-  typedef itk::ImageRegistrationMethod<TImageType, TImageType> RegistrationType;
-  typedef itk::AffineTransform<double, 3> TransformType;
-  typedef itk::RegularStepGradientDescentOptimizer OptimizerType;
-  typedef itk::MeanSquaresImageToImageMetric<TImageType, TImageType> MetricType;
-  typedef itk::LinearInterpolateImageFunction<TImageType, double> InterpolatorType;
-  typedef itk::NearestNeighborInterpolateImageFunction<TImageType, double> NNInterpolatorType;
-
-  typename MetricType::Pointer metric = MetricType::New(); // typename required here because template class used -> syntax
-  typename InterpolatorType::Pointer interpolator = InterpolatorType::New();
-  typename NNInterpolatorType::Pointer nn_interpolator = NNInterpolatorType::New();
-  typename RegistrationType::Pointer registration = RegistrationType::New();
-  TransformType::Pointer transform = TransformType::New();
-  OptimizerType::Pointer optimizer = OptimizerType::New();
-
-  // set the parameters 
-  registration->SetMetric(metric);
-  registration->SetOptimizer(optimizer);
-  registration->SetTransform(transform);
-  registration->SetInterpolator(interpolator);
-  //registration->SetInterpolator(nn_interpolator);
-
-  // set the inputs
-  registration->SetFixedImage(fixedImage);
-  registration->SetMovingImage(movingImage);
-  registration->SetFixedImageRegion(fixedImage->GetLargestPossibleRegion());
-
-  typename RegistrationType::ParametersType initialParameters(transform->GetNumberOfParameters());
-
-  initialParameters[0] = 1.0; // rotation
-  initialParameters[1] = 0.0;
-  initialParameters[2] = 0.0;
-  initialParameters[3] = 0.0;
-  initialParameters[4] = 1.0;
-  initialParameters[5] = 0.0;
-  initialParameters[6] = 0.0;
-  initialParameters[7] = 0.0;
-  initialParameters[8] = 1.0;
-  initialParameters[9] = 0.0; // translation
-  initialParameters[10] = 0.0;
-  initialParameters[11] = 0.0;
-
-  registration->SetInitialTransformParameters(initialParameters);
-
-  optimizer->SetMaximumStepLength(0.25);
-  optimizer->SetMinimumStepLength(0.0001);
-  optimizer->SetNumberOfIterations(20);
-
-  registration->Update();
-
-  typename RegistrationType::ParametersType finalParameters = registration->GetLastTransformParameters();
-  std::cout << "Final parameters: " << finalParameters << std::endl;
-
-  // apply transformation matrix to moving image
-  typedef itk::ResampleImageFilter<TImageType, TImageType> ResampleFilterType;
-  typename ResampleFilterType::Pointer resampler = ResampleFilterType::New();
-  
-  resampler->SetInput(movingImage);
-  resampler->SetTransform(registration->GetOutput()->Get());
-  resampler->SetSize(movingImage->GetLargestPossibleRegion().GetSize());
-  resampler->SetOutputOrigin(movingImage->GetOrigin());
-  resampler->SetOutputSpacing(movingImage->GetSpacing());
-  resampler->SetOutputDirection(movingImage->GetDirection());
-  resampler->SetDefaultPixelValue(0);
-  resampler->SetInterpolator(interpolator);
-
-  typedef itk::ImageFileWriter<TImageType> WriterType;
-  typename WriterType::Pointer writer = WriterType::New();
-  writer->SetFileName(outputFileName);
-  writer->SetInput(resampler->GetOutput());
-  writer->Update();
+  auto t1 = std::chrono::high_resolution_clock::now();
+  const FixedImageState<TImageType> fixed = prepareFixedImage<TImageType>(fixedImage, mask, options);
+  auto t2 = std::chrono::high_resolution_clock::now();
+  const double preparation = std::chrono::duration<double, std::milli>(t2 - t1).count();
+
+  const RegistrationResult result = registerToFixed<TImageType>(fixed, movingImage, options);
+  if (result.cached)
+  {
+    std::cout << "Transform taken from cache " << options.cache->GetDirectory() << "\n";
+  }
+  else if (options.levels > 1)
+  {
+    std::cout << "Multi-resolution (" << options.levels << " levels): " << preparation + result.milliseconds << " ms, final metric " << result.metricValue << "\n";
+    if (options.compare)
+    {
+      RegistrationOptions singleLevel = options;
+      singleLevel.levels = 1;
+      singleLevel.iterations.clear();
+      singleLevel.starts = 1;
+      singleLevel.runName += " (single level)";
+      auto t3 = std::chrono::high_resolution_clock::now();
+      const FixedImageState<TImageType> fullResolution = prepareFixedImage<TImageType>(fixedImage, mask, singleLevel);
+      auto t4 = std::chrono::high_resolution_clock::now();
+      const RegistrationResult reference = registerToFixed<TImageType>(fullResolution, movingImage, singleLevel);
+      const double referenceTime = std::chrono::duration<double, std::milli>(t4 - t3).count() + reference.milliseconds;
+      std::cout << "Single level: " << referenceTime << " ms, final metric " << reference.metricValue << "\n";
+      std::cout << "Speedup: " << referenceTime / (preparation + result.milliseconds) << "\n";
+    }
+  }
+  else
+  {
+    std::cout << "Single level: " << preparation + result.milliseconds << " ms, final metric " << result.metricValue << "\n";
+  }
+  std::cout << "Final parameters: " << result.parameters << std::endl;
+
+  if (options.bsplineMesh > 0)
+  {
+    const TransformType::Pointer affine = result.GetTransform();
+    const BSplineResult deformable = registerBSpline<TImageType>(fixed, movingImage, affine, options);
+    std::cout << "B-spline: " << deformable.milliseconds << " ms, final metric " << deformable.metricValue << "\n";
+    // the deformation is defined on the fixed image, so the output is on its grid
+    resampleDeformed<TImageType>(movingImage, fixedImage, composeTransforms(affine, deformable.transform), outputFileName);
+    return;
+  }
+  if ((channels != NULL) && (channels->GetNumberOfChannels() > 0))
+  {
+    // the moving image is one more channel, so every voxel is mapped only once for all of them
+    channels->AddChannel(std::unique_ptr<ResampleChannel>(new ImageResampleChannel<TImageType>(movingImage, outputFileName, false)));
+    channels->SetNumberOfThreads(options.threads);
+    channels->Resample(result.GetTransform(), movingImage);
+    return;
+  }
+  resampleMovingImage<TImageType>(movingImage, result.GetTransform(), outputFileName);
+}
+
+/**
+\brief One line of a batch file
+*/
+struct BatchJob
+{
+  std::string movingFName; //! moving image
+  std::string outputFName; //! moving image resampled onto the fixed image
+  std::string transformFName; //! ITK transform file of the affine
+};
+
+/**
+\brief Read a batch file: one "movingImage,outputFileName,transformFileName" line per registration
+
+Empty lines and lines starting with '#' are skipped.
+*/
+std::vector<BatchJob> readBatchFile(const std::string &fileName)
+{
+  std::ifstream file(fileName.c_str());
+  if (!file)
+  {
+    itkGenericExceptionMacro("Could not open batch file " << fileName);
+  }
+
+  std::vector<BatchJob> jobs;
+  std::string line;
+  for (size_t lineNumber = 1; std::getline(file, line); lineNumber++)
+  {
+    line.erase(line.find_last_not_of(" \t\r") + 1);
+    if (line.empty() || (line[0] == '#'))
+    {
+      continue;
+    }
+    std::istringstream stream(line);
+    BatchJob job;
+    if (!std::getline(stream, job.movingFName, ',') || !std::getline(stream, job.outputFName, ',') ||
+      !std::getline(stream, job.transformFName) || job.transformFName.empty())
+    {
+      itkGenericExceptionMacro("Line " << lineNumber << " of " << fileName << " is not 'movingImage,outputFileName,transformFileName'");
+    }
+    jobs.push_back(job);
+  }
+  return jobs;
+}
+
+/**
+\brief Register every moving image of the batch to the same prepared fixed image
+
+The jobs run on a pool of concurrentJobs threads that take the next job as soon as they are done with one;
+every job writes its transform and resampled image as soon as it finishes. A job that fails is reported
+and skipped.
+
+\param fixed The prepared fixed image, shared by all jobs
+\param jobs Moving images and output file names
+\param options How the registration is to be done; options.threads is the thread budget of every job
+\param concurrentJobs Number of registrations that run at the same time
+\return Number of jobs that failed
+*/
+template <typename TImageType>
+size_t registerBatch(const FixedImageState<TImageType> &fixed,
+  const std::vector<BatchJob> &jobs,
+  RegistrationOptions options,
+  unsigned int concurrentJobs)
+{
+  options.verbose = false; // the level lines of concurrent jobs would interleave
+  std::atomic<size_t> nextJob(0), failures(0), finished(0);
+  std::mutex consoleMutex;
+
+  auto worker = [&]()
+  {
+    for (size_t j = nextJob++; j < jobs.size(); j = nextJob++)
+    {
+      const BatchJob &job = jobs[j];
+      try
+      {
+        // read directly instead of through SafeReadImage, so that a missing file fails this job only
+        typedef itk::ImageFileReader<TImageType> ReaderType;
+        typename ReaderType::Pointer reader = ReaderType::New();
+        reader->SetFileName(job.movingFName);
+        reader->Update();
+        typename TImageType::Pointer movingImage = reader->GetOutput();
+
+        RegistrationOptions jobOptions = options;
+        jobOptions.runName = job.movingFName;
+        const RegistrationResult result = registerToFixed<TImageType>(fixed, movingImage, jobOptions);
+        const TransformType::Pointer transform = result.GetTransform();
+        if (options.bsplineMesh > 0)
+        {
+          const BSplineResult deformable = registerBSpline<TImageType>(fixed, movingImage, transform, jobOptions);
+          writeTransforms(transform, deformable.transform, job.transformFName);
+          resampleDeformed<TImageType>(movingImage, fixed.levels.back(), composeTransforms(transform, deformable.transform), job.outputFName);
+        }
+        else
+        {
+          writeTransform(transform, job.transformFName);
+          resampleMovingImage<TImageType>(movingImage, transform, job.outputFName);
+        }
+
+        std::lock_guard<std::mutex> lock(consoleMutex);
+        std::cout << "[" << ++finished << "/" << jobs.size() << "] " << job.movingFName << ": ";
+        if (result.cached)
+        {
+          std::cout << "from cache\n";
+        }
+        else
+        {
+          std::cout << result.milliseconds << " ms, final metric " << result.metricValue << "\n";
+        }
+      }
+      catch (itk::ExceptionObject &error)
+      {
+        failures++;
+        std::lock_guard<std::mutex> lock(consoleMutex);
+        std::cerr << "[" << ++finished << "/" << jobs.size() << "] " << job.movingFName << " failed: " << error.GetDescription() << "\n";
+      }
+    }
+  };
+
+  std::vector<std::thread> pool;
+  for (unsigned int t = 1; t < concurrentJobs; t++)
+  {
+    pool.push_back(std::thread(worker));
+  }
+  worker();
+  for (size_t t = 0; t < pool.size(); t++)
+  {
+    pool[t].join();
+  }
+  return failures;
+}
+
+/**
+\brief Call functor.template Run<TPixelType>() with the pixel type of an ITK component type
+
+\param componentType Component type as given by itk::ImageIOBase::GetComponentType()
+\param functor Object with a templated Run() member
+*/
+template <typename TFunctor>
+void callWithPixelType(itk::ImageIOBase::IOComponentType componentType, TFunctor &functor)
+{
+  switch (componentType)
+  {
+  case itk::ImageIOBase::IOComponentType::UCHAR:
+    functor.template Run<unsigned char>();
+    break;
+  case itk::ImageIOBase::IOComponentType::CHAR:
+    functor.template Run<char>();
+    break;
+  case itk::ImageIOBase::IOComponentType::USHORT:
+    functor.template Run<unsigned short>();
+    break;
+  case itk::ImageIOBase::IOComponentType::SHORT:
+    functor.template Run<short>();
+    break;
+  case itk::ImageIOBase::IOComponentType::UINT:
+    functor.template Run<unsigned int>();
+    break;
+  case itk::ImageIOBase::IOComponentType::INT:
+    functor.template Run<int>();
+    break;
+  case itk::ImageIOBase::IOComponentType::FLOAT:
+    functor.template Run<float>();
+    break;
+  case itk::ImageIOBase::IOComponentType::DOUBLE:
+    functor.template Run<double>();
+    break;
+  default:
+    itkGenericExceptionMacro("Unsupported pixel type: " << itk::ImageIOBase::GetComponentTypeAsString(componentType));
+  }
 }
 
+/**
+\brief Reads an image in its own pixel type and adds it to a MultiChannelResampler
+*/
+struct ChannelReader
+{
+  std::string inputFName, outputFName;
+  bool label; //! nearest voxel instead of linear interpolation
+  MultiChannelResampler *resampler;
+
+  template <typename TPixelType>
+  void Run()
+  {
+    typedef itk::Image<TPixelType, 3> ImageType;
+    typedef itk::ImageFileReader<ImageType> ReaderType;
+    typename ReaderType::Pointer reader = ReaderType::New();
+    reader->SetFileName(inputFName);
+    reader->Update();
+    resampler->AddChannel(std::unique_ptr<ResampleChannel>(new ImageResampleChannel<ImageType>(reader->GetOutput(), outputFName, label)));
+  }
+};
+
+/**
+\brief Reads fixed and moving image in their own pixel type (which is the same for both) and registers them
+
+In batch mode the moving images are read in the pixel type of the fixed image.
+*/
+struct RegistrationDispatch
+{
+  std::string fixedFName, movingFName, outputFName;
+  const BitMaskImage<3> *mask;
+  RegistrationOptions options;
+  std::vector<BatchJob> batch; //! jobs of the batch mode, empty for a single registration
+  unsigned int concurrentJobs; //! registrations that run at the same time in batch mode
+  size_t failures; //! number of batch jobs that failed
+  MultiChannelResampler *channels; //! more images to resample with the moving image, single registration only
+
+  template <typename TPixelType>
+  void Run()
+  {
+    typedef itk::Image<TPixelType, 3> ImageType;
+    typename ImageType::Pointer image_1 = ImageType::New(); // initialize new image
+    SafeReadImage<ImageType>(image_1, fixedFName); // read image along with exceptions
+    if (!batch.empty())
+    {
+      // pyramid and samples of the fixed image are computed once for all jobs
+      const FixedImageState<ImageType> fixed = prepareFixedImage<ImageType>(image_1, *mask, options);
+      failures = registerBatch<ImageType>(fixed, batch, options, concurrentJobs);
+      return;
+    }
+    typename ImageType::Pointer image_2 = ImageType::New();
+    SafeReadImage<ImageType>(image_2, movingFName);
+    registrationFilter<ImageType>(image_1, image_2, *mask, outputFName, options, channels);
+  }
+};
+
 void echoUsage(const std::string &exeName)
 {
-  std::cout << exeName << " <fixedImage> <movingImage> <outputFileName> <movingImageMask>\n" <<
+  std::cout << exeName << " <fixedImage> <movingImage> <outputFileName> <fixedImageMask> [options]\n" <<
+    exeName << " -batch <fixedImage> <batchFile.csv> <fixedImageMask> [options]\n" <<
+    "Batch file: one 'movingImage,outputFileName,transformFileName' line per moving image\n" <<
+    "Options:\n" <<
+    "  -levels <n>            Register coarse to fine over n pyramid levels (default: 1, full resolution only)\n" <<
+    "  -iterations <i1,i2,..> Iterations per level from coarse to fine (default: 20 at full resolution, doubled per coarser level)\n" <<
+    "  -compare               Also run the single-level registration and report time and final metric of both\n" <<
+    "  -sampling <strategy>   Voxels the metric is computed over: mask (default), uniform or stratified\n" <<
+    "  -fraction <f>          Fraction of the voxels (of the mask for mask sampling) to use, default 1\n" <<
+    "  -seed <n>              Seed of the sampling (default: 0)\n" <<
+    "  -threads <n>           Threads of the metric (default: 0, all cores); the result does not depend on it\n" <<
+    "  -jobs <n>              Batch mode: registrations that run at the same time (default: all cores)\n" <<
+    "  -starts <k>            Run k registrations from different initial rotations at the same time, keep the best (default: 1)\n" <<
+    "  -start-angle <deg>     Rotation step between the initial transforms (default: 10)\n" <<
+    "  -start-margin <f>      Cancel a start once its metric is this fraction worse than the best start (default: 0.2)\n" <<
+    "  -max-step <s>          Maximum step length of the optimizer on the coarsest level, halved per level (default: 0.25)\n" <<
+    "  -min-step <s>          Minimum step length of the optimizer (default: 0.0001)\n" <<
+    "  -cache <dir>           Reuse transforms of identical earlier registrations and resume interrupted ones from dir\n" <<
+    "  -channel <in> <out>    Also resample image 'in' (on the grid of the moving image) linearly to 'out'; repeatable\n" <<
+    "  -label <in> <out>      Also resample label image 'in' with the nearest voxel to 'out'; repeatable\n" <<
+    "  -bspline <mesh>        Add a B-spline deformable stage with this many mesh elements per axis on its coarsest grid\n" <<
+    "  -bspline-levels <n>    B-spline grid levels, the mesh doubles per level (default: 2)\n" <<
+    "  -bspline-iterations <n> Iterations per B-spline grid level (default: 20)\n" <<
+    "  -bspline-step <s>      Maximum step length of the B-spline optimizer (default: 1)\n" <<
+    "  -telemetry <file>      Write every optimizer iteration as a JSON line to file\n" <<
+    "  -telemetry-live        Print a line per optimizer iteration on stderr\n" <<
     "NOTE - Only 3D images are supported in this example.\n";
 }
 
@@ -162,20 +407,184 @@ int main(int argc, char *argv[])
   try // to catch exceptions
   {
     // basic check to see image file has been put in by the user
-    if( (argc < 2) )
+    if( (argc < 5) )
     {
       std::cerr << "Usage: " << std::endl;
       echoUsage(argv[0]);
       return EXIT_FAILURE;
     }
 
-    std::string inputFName1 = "", inputFName2 = "", inputMask2 = "", outputFName = "";
+    std::string inputFName1 = "", inputFName2 = "", inputMask2 = "", outputFName = "", batchFName = "";
     bool segFlag = false, mulFlag = false, regFlag = false;
 
-    inputFName1 = argv[2];
-    inputFName2 = argv[3];
-    inputMask2 = argv[4];
-    outputFName = argv[5];
+    // in batch mode the moving images and output names come from the batch file
+    const bool batchMode = (std::string(argv[1]) == "-batch");
+    if (batchMode)
+    {
+      inputFName1 = argv[2];
+      batchFName = argv[3];
+      inputMask2 = argv[4];
+    }
+    else
+    {
+      inputFName1 = argv[1];
+      inputFName2 = argv[2];
+      outputFName = argv[3];
+      inputMask2 = argv[4];
+    }
+
+    RegistrationTelemetry telemetry; // used when -telemetry or -telemetry-live is given
+    std::unique_ptr<TransformCache> cache; // created by -cache
+    std::vector<ChannelReader> channelReaders; // from -channel and -label
+    RegistrationOptions options;
+    unsigned int concurrentJobs = std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 5; i < argc; i++)
+    {
+      const std::string option = argv[i];
+      if ((option == "-levels") && (i + 1 < argc))
+      {
+        options.levels = std::max(1, std::atoi(argv[++i]));
+      }
+      else if ((option == "-iterations") && (i + 1 < argc))
+      {
+        std::string list = argv[++i];
+        std::replace(list.begin(), list.end(), ',', ' ');
+        std::istringstream stream(list);
+        unsigned int iterations;
+        while (stream >> iterations)
+        {
+          options.iterations.push_back(iterations);
+        }
+      }
+      else if (option == "-compare")
+      {
+        options.compare = true;
+      }
+      else if ((option == "-sampling") && (i + 1 < argc))
+      {
+        const std::string strategy = argv[++i];
+        if (strategy == "uniform")
+        {
+          options.sampling = SamplingStrategy::Uniform;
+        }
+        else if (strategy == "stratified")
+        {
+          options.sampling = SamplingStrategy::Stratified;
+        }
+        else if (strategy == "mask")
+        {
+          options.sampling = SamplingStrategy::Mask;
+        }
+        else
+        {
+          std::cerr << "Unknown sampling strategy '" << strategy << "'.\n";
+          echoUsage(argv[0]);
+          return EXIT_FAILURE;
+        }
+      }
+      else if ((option == "-fraction") && (i + 1 < argc))
+      {
+        options.samplingFraction = std::atof(argv[++i]);
+        if ((options.samplingFraction <= 0) || (options.samplingFraction > 1))
+        {
+          std::cerr << "Sampling fraction needs to be in (0, 1].\n";
+          return EXIT_FAILURE;
+        }
+      }
+      else if ((option == "-seed") && (i + 1 < argc))
+      {
+        options.seed = std::atoi(argv[++i]);
+      }
+      else if ((option == "-threads") && (i + 1 < argc))
+      {
+        options.threads = std::atoi(argv[++i]);
+      }
+      else if ((option == "-jobs") && (i + 1 < argc))
+      {
+        concurrentJobs = std::max(1, std::atoi(argv[++i]));
+      }
+      else if ((option == "-starts") && (i + 1 < argc))
+      {
+        options.starts = std::max(1, std::atoi(argv[++i]));
+      }
+      else if ((option == "-start-angle") && (i + 1 < argc))
+      {
+        options.startAngle = std::atof(argv[++i]);
+      }
+      else if ((option == "-start-margin") && (i + 1 < argc))
+      {
+        options.startMargin = std::atof(argv[++i]);
+      }
+      else if ((option == "-max-step") && (i + 1 < argc))
+      {
+        options.maximumStepLength = std::atof(argv[++i]);
+      }
+      else if ((option == "-min-step") && (i + 1 < argc))
+      {
+        options.minimumStepLength = std::atof(argv[++i]);
+      }
+      else if ((option == "-cache") && (i + 1 < argc))
+      {
+        cache.reset(new TransformCache(argv[++i]));
+        options.cache = cache.get();
+      }
+      else if ((option == "-bspline") && (i + 1 < argc))
+      {
+        options.bsplineMesh = std::max(1, std::atoi(argv[++i]));
+      }
+      else if ((option == "-bspline-levels") && (i + 1 < argc))
+      {
+        options.bsplineLevels = std::max(1, std::atoi(argv[++i]));
+      }
+      else if ((option == "-bspline-iterations") && (i + 1 < argc))
+      {
+        options.bsplineIterations = std::atoi(argv[++i]);
+      }
+      else if ((option == "-bspline-step") && (i + 1 < argc))
+      {
+        options.bsplineStepLength = std::atof(argv[++i]);
+      }
+      else if (((option == "-channel") || (option == "-label")) && (i + 2 < argc))
+      {
+        ChannelReader channel;
+        channel.inputFName = argv[i + 1];
+        channel.outputFName = argv[i + 2];
+        channel.label = (option == "-label");
+        channelReaders.push_back(channel);
+        i += 2;
+      }
+      else if ((option == "-telemetry") && (i + 1 < argc))
+      {
+        telemetry.Open(argv[++i]);
+        options.telemetry = &telemetry;
+      }
+      else if (option == "-telemetry-live")
+      {
+        telemetry.SetLiveSummary(true);
+        options.telemetry = &telemetry;
+      }
+      else
+      {
+        std::cerr << "Unknown option '" << option << "'.\n";
+        echoUsage(argv[0]);
+        return EXIT_FAILURE;
+      }
+    }
+    if (batchMode && !channelReaders.empty())
+    {
+      std::cerr << "-channel and -label are not supported in batch mode.\n";
+      return EXIT_FAILURE;
+    }
+    if ((options.bsplineMesh > 0) && !channelReaders.empty())
+    {
+      std::cerr << "-channel and -label only resample through the affine and cannot be used with -bspline.\n";
+      return EXIT_FAILURE;
+    }
+    if (!options.iterations.empty() && (options.iterations.size() != options.levels))
+    {
+      std::cerr << "Give one iteration count per level (" << options.levels << ").\n";
+      return EXIT_FAILURE;
+    }
 
     //std::string iterations_string = argv[5];
     //outputFName = outputFName + iterations_string + ".nii";
@@ -185,57 +594,95 @@ int main(int argc, char *argv[])
     im_base->SetFileName(inputFName1);
     im_base->ReadImageInformation();
 
-    itk::ImageIOBase::Pointer im_base_2 = itk::ImageIOFactory::CreateImageIO(inputFName2.c_str(),
-    im_base_2->SetFileName(inputFName2);
-    im_base_2->ReadImageInformation();
-    
-    if (im_base->GetComponentType() != im_base_2->GetComponentType())
+    if (!batchMode)
     {
-      std::cerr << "Image type mismatch between images 1 & 2. Please check files\n" <<
-        inputFName1 << " and " << inputFName2 << "\n";
-      return EXIT_FAILURE;
+      itk::ImageIOBase::Pointer im_base_2 = itk::ImageIOFactory::CreateImageIO(inputFName2.c_str(), itk::ImageIOFactory::ReadMode);
+      im_base_2->SetFileName(inputFName2);
+      im_base_2->ReadImageInformation();
+
+      if (im_base->GetComponentType() != im_base_2->GetComponentType())
+      {
+        std::cerr << "Image type mismatch between images 1 & 2. Please check files\n" <<
+          inputFName1 << " and " << inputFName2 << "\n";
+        return EXIT_FAILURE;
+      }
+      else if (im_base->GetNumberOfDimensions() != im_base_2->GetNumberOfDimensions())
+      {
+        std::cerr << "Image dimension mismatch between images 1 & 2. Please check files\n" <<
+          inputFName1 << " and " << inputFName2 << "\n";
+        return EXIT_FAILURE;
+      }
     }
-    else if (im_base->GetNumberOfDimensions() != im_base_2->GetNumberOfDimensions())
-    {
-      std::cerr << "Image dimension mismatch between images 1 & 2. Please check files\n" <<
-        inputFName1 << " and " << inputFName2 << "\n";
-      return EXIT_FAILURE;
-    } 
-    else if (im_base->GetNumberOfDimensions() != 3)
+    if (im_base->GetNumberOfDimensions() != 3)
     {
       std::cerr << "Unsupported Image Dimension. Only 3D images are currently supported.\n";
       return EXIT_FAILURE;
     }
 
-    itk::ImageIOBase::Pointer im_base_mask;
-    typedef itk::Image<unsigned char, 3> MaskImageType; // assume mask to be in short range
-    typedef itk::ImageFileReader<MaskImageType> MaskReaderType;
-    MaskReaderType::Pointer mask_reader = MaskReaderType::New();
-
-    im_base_mask = itk::ImageIOFactory::CreateImageIO(inputMask2.c_str(), itk::ImageIOFactory::ReadMode);
-    
+    itk::ImageIOBase::Pointer im_base_mask = itk::ImageIOFactory::CreateImageIO(inputMask2.c_str(), itk::ImageIOFactory::ReadMode);
     im_base_mask->SetFileName(inputMask2);
     im_base_mask->ReadImageInformation();
     
-    mask_reader->SetFileName(inputMask2);
-    mask_reader->Update();
-    
     if (im_base_mask->GetNumberOfDimensions() != 3)
     {
         std::cerr << "Unsupported Image Dimension for image mask.\n";
         return EXIT_FAILURE;
     }
+
+    BitMaskImage<3> mask; // 1 bit per voxel, any non-zero voxel of the file is inside the mask
+    mask.Read(inputMask2);
     
-    typedef float PixelType; // default pixel type is float, all voxel data is static-casted
-    typedef itk::Image<PixelType, 3> ImageType; // define image type
-    ImageType::Pointer image_1 = ImageType::New(); // initialize new image
-    SafeReadImage<ImageType>(image_1, im_base->GetFileName()); // read image along with exceptions
-    
-    std::cout << "Doing registration...\n";
-    ImageType::Pointer image_2 = ImageType::New();
-    SafeReadImage<ImageType>(image_2, inputFName2);
-    registrationFilter<ImageType, MaskImageType>(image_1, image_2, mask_reader->GetOutput(),
-        
+    // the images are registered in their own pixel type instead of being converted to float
+    std::cout << "Doing registration of " << im_base->GetComponentTypeAsString(im_base->GetComponentType()) << " images...\n";
+    RegistrationDispatch dispatch;
+    dispatch.fixedFName = inputFName1;
+    dispatch.movingFName = inputFName2;
+    dispatch.outputFName = outputFName;
+    dispatch.mask = &mask;
+    options.runName = inputFName2;
+    dispatch.options = options;
+    dispatch.concurrentJobs = concurrentJobs;
+    dispatch.failures = 0;
+    MultiChannelResampler channels;
+    dispatch.channels = &channels;
+    for (size_t c = 0; c < channelReaders.size(); c++)
+    {
+      // every channel in its own pixel type, e.g. float intensities and unsigned char labels
+      itk::ImageIOBase::Pointer channelIO = itk::ImageIOFactory::CreateImageIO(channelReaders[c].inputFName.c_str(), itk::ImageIOFactory::ReadMode);
+      if (!channelIO)
+      {
+        std::cerr << "Could not read " << channelReaders[c].inputFName << "\n";
+        return EXIT_FAILURE;
+      }
+      channelIO->SetFileName(channelReaders[c].inputFName);
+      channelIO->ReadImageInformation();
+      channelReaders[c].resampler = &channels;
+      callWithPixelType(channelIO->GetComponentType(), channelReaders[c]);
+    }
+    if (batchMode)
+    {
+      dispatch.batch = readBatchFile(batchFName);
+      if (dispatch.batch.empty())
+      {
+        std::cerr << "No registrations in batch file " << batchFName << "\n";
+        return EXIT_FAILURE;
+      }
+      dispatch.concurrentJobs = static_cast<unsigned int>(std::min<size_t>(concurrentJobs, dispatch.batch.size()));
+      if (options.threads == 0)
+      {
+        // split the cores between the jobs that run at the same time
+        dispatch.options.threads = std::max(1u, std::thread::hardware_concurrency() / dispatch.concurrentJobs);
+      }
+      std::cout << dispatch.batch.size() << " registrations, " << dispatch.concurrentJobs << " at a time with " <<
+        dispatch.options.threads << " threads each\n";
+    }
+    callWithPixelType(im_base->GetComponentType(), dispatch);
+    telemetry.Flush();
+    if (dispatch.failures > 0)
+    {
+      std::cerr << dispatch.failures << " of " << dispatch.batch.size() << " registrations failed.\n";
+      return EXIT_FAILURE;
+    }
   }
   catch (itk::ExceptionObject &error)
   {
@@ -0,0 +1,146 @@
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "itkImage.h"
+
+#include "TransformCache.h"
+#include "TrilinearInterpolator.h"
+
+typedef itk::Image< float, 3 > ImageType;
+
+const unsigned int ImageSize = 16; // voxels along every axis
+
+//! Image with the values 1, 2, 3, ... in buffer order
+ImageType::Pointer CreateRampImage()
+{
+  ImageType::SizeType size;
+  size.Fill(ImageSize);
+  ImageType::RegionType region;
+  region.SetSize(size);
+  ImageType::Pointer image = ImageType::New();
+  image->SetRegions(region);
+  image->Allocate();
+  float *buffer = image->GetBufferPointer();
+  for (size_t i = 0; i < region.GetNumberOfPixels(); i++)
+  {
+    buffer[i] = static_cast<float>(i + 1);
+  }
+  return image;
+}
+
+//! Key of an image as the transform cache computes it
+std::string ImageKey(const ImageType *image)
+{
+  ContentHasher hash;
+  hash.AddImage(image);
+  return hash.GetHex();
+}
+
+//! Flipping the sign of one voxel, or of two voxels, gives a different key; the same pixels give the same key
+bool TestSignBit()
+{
+  ImageType::Pointer image = CreateRampImage();
+  const std::string original = ImageKey(image);
+  if (ImageKey(CreateRampImage()) != original)
+  {
+    std::cerr << "Equal images have different keys\n";
+    return false;
+  }
+
+  float *buffer = image->GetBufferPointer();
+  buffer[1] = -buffer[1];
+  const std::string oneFlipped = ImageKey(image);
+  buffer[3] = -buffer[3];
+  const std::string twoFlipped = ImageKey(image);
+  std::cout << "original " << original << ", one sign flipped " << oneFlipped << ", two signs flipped " <<
+    twoFlipped << "\n";
+  return (oneFlipped != original) && (twoFlipped != original) && (twoFlipped != oneFlipped);
+}
+
+//! Every SIMD kernel the CPU runs gives the values of the scalar kernel, inside the image and across its border
+bool TestInterpolatorKernels()
+{
+  ImageType::Pointer image = CreateRampImage();
+  TrilinearInterpolator<ImageType> interpolator;
+  interpolator.SetInputImage(image);
+  const TrilinearKernel widest = interpolator.GetKernel();
+  std::cout << "widest kernel " << static_cast<int>(widest) << "\n";
+
+  // points from beyond the border to beyond the other border, and a count that leaves a remainder for every kernel
+  const size_t count = 10001;
+  std::mt19937 random(1);
+  std::uniform_real_distribution<float> coordinate(-2.0f, ImageSize + 1.0f);
+  std::vector<float> x(count), y(count), z(count);
+  for (size_t i = 0; i < count; i++)
+  {
+    x[i] = coordinate(random);
+    y[i] = coordinate(random);
+    z[i] = coordinate(random);
+  }
+
+  std::vector<float> expected(count), values(count);
+  std::vector<unsigned char> expectedInside(count), inside(count);
+  interpolator.SetKernel(TrilinearKernel::Scalar);
+  interpolator.Evaluate(x.data(), y.data(), z.data(), count, expected.data(), expectedInside.data(), -1.0f);
+
+  bool passed = true;
+  for (TrilinearKernel kernel : { TrilinearKernel::SSE41, TrilinearKernel::AVX2 })
+  {
+    if (kernel > widest)
+    {
+      continue;
+    }
+    interpolator.SetKernel(kernel);
+    interpolator.Evaluate(x.data(), y.data(), z.data(), count, values.data(), inside.data(), -1.0f);
+    for (size_t i = 0; i < count; i++)
+    {
+      // the same float operations in the same order, up to a few rounding steps where the compiler contracts to FMA
+      if ((std::fabs(values[i] - expected[i]) > 0.01f) || (inside[i] != expectedInside[i]))
+      {
+        std::cerr << "Kernel " << static_cast<int>(kernel) << " gives " << values[i] << " instead of " << expected[i] <<
+          " at (" << x[i] << ", " << y[i] << ", " << z[i] << ")\n";
+        passed = false;
+        break;
+      }
+    }
+  }
+  return passed;
+}
+
+// main entry of program
+int main(int argc, char *argv[])
+{
+  if (argc < 2)
+  {
+    std::cerr << "Usage: " << argv[0] << " -signBit | -interpolatorKernels\n";
+    return EXIT_FAILURE;
+  }
+
+  const std::string test = argv[1];
+  bool passed = false;
+  try
+  {
+    if (test == "-signBit")
+    {
+      passed = TestSignBit();
+    }
+    else if (test == "-interpolatorKernels")
+    {
+      passed = TestInterpolatorKernels();
+    }
+    else
+    {
+      std::cerr << "Unknown test " << test << "\n";
+    }
+  }
+  catch (itk::ExceptionObject &error)
+  {
+    std::cerr << "Exception caught: " << error << "\n";
+    return EXIT_FAILURE;
+  }
+
+  return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
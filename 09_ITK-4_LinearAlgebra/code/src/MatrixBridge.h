@@ -0,0 +1,261 @@
+/**
+\file MatrixBridge.h
+
+\brief Views of itk::Image buffers as VNL matrices and vectors, and VNL results handed over to itk::Image, without copies
+
+Layout: ITK stores x fastest, VNL stores matrices row by row. A 2D image of size [X, Y] is viewed as a
+matrix of Y rows and X columns, so that element (y, x) is the pixel at index (x, y), and a matrix of R rows
+and C columns becomes an image of size [C, R].
+
+- MatrixView() and VectorView() wrap the pixel buffer in vnl_matrix_ref / vnl_vector_ref.
+- SliceView() does the same for one z slice of a 3D image, which is contiguous as well.
+- StridedMatrixView addresses any 2D section of a 3D image (a slice along x or y, or a rectangle of a slice)
+  in place through its strides; VNL algorithms need contiguous data, so copy it into a vnl_matrix for those.
+- ImageFromMatrix() and ImageFromVector() move the buffer of a VNL result into a VnlImportImageContainer,
+  which keeps the VNL object alive for as long as the image uses the buffer. VNL allocates small blocks from
+  its own pool, so the buffer must be freed by VNL and never by ITK.
+
+A view does not keep the image alive: the image has to outlive it.
+*/
+
+#pragma once
+
+#include "itkImage.h"
+#include "itkImportImageContainer.h"
+
+//! VNL headers
+#include "vnl/vnl_matrix.h"
+#include "vnl/vnl_matrix_ref.h"
+#include "vnl/vnl_vector.h"
+#include "vnl/vnl_vector_ref.h"
+
+/**
+\brief Pixel container that owns a vnl_matrix or vnl_vector and exposes its buffer to an itk::Image
+*/
+template <typename TElement>
+class VnlImportImageContainer : public itk::ImportImageContainer<itk::SizeValueType, TElement>
+{
+public:
+  typedef VnlImportImageContainer Self;
+  typedef itk::ImportImageContainer<itk::SizeValueType, TElement> Superclass;
+  typedef itk::SmartPointer<Self> Pointer;
+  typedef itk::SmartPointer<const Self> ConstPointer;
+
+  itkNewMacro(Self);
+  itkTypeMacro(VnlImportImageContainer, ImportImageContainer);
+
+  //! Take over the buffer of the matrix, which is left empty
+  void TakeMatrix(vnl_matrix<TElement> &matrix)
+  {
+    m_matrix.swap(matrix);
+    m_vector.clear();
+    this->SetImportPointer(m_matrix.data_block(), m_matrix.size(), false); // VNL frees the buffer
+  }
+
+  //! Take over the buffer of the vector, which is left empty
+  void TakeVector(vnl_vector<TElement> &vector)
+  {
+    m_vector.swap(vector);
+    m_matrix.clear();
+    this->SetImportPointer(m_vector.data_block(), m_vector.size(), false);
+  }
+
+protected:
+  VnlImportImageContainer()
+  {
+  }
+
+  ~VnlImportImageContainer() override
+  {
+  }
+
+private:
+  vnl_matrix<TElement> m_matrix;
+  vnl_vector<TElement> m_vector;
+};
+
+/**
+\brief A 2D section of an image buffer, addressed through strides
+
+Element (r, c) is at data[r * rowStride + c * columnStride]; nothing is copied.
+*/
+template <typename TElement>
+class StridedMatrixView
+{
+public:
+  StridedMatrixView(TElement *data, unsigned int rows, unsigned int columns, ptrdiff_t rowStride, ptrdiff_t columnStride) :
+    m_data(data), m_rows(rows), m_columns(columns), m_rowStride(rowStride), m_columnStride(columnStride)
+  {
+  }
+
+  unsigned int rows() const
+  {
+    return m_rows;
+  }
+
+  unsigned int cols() const
+  {
+    return m_columns;
+  }
+
+  TElement &operator()(unsigned int r, unsigned int c) const
+  {
+    return m_data[r * m_rowStride + c * m_columnStride];
+  }
+
+  //! True if the elements are stored row by row without gaps, as in a vnl_matrix
+  bool IsContiguous() const
+  {
+    return (m_columnStride == 1) && ((m_rows <= 1) || (m_rowStride == static_cast<ptrdiff_t>(m_columns)));
+  }
+
+  //! Copy of the elements, for VNL algorithms
+  vnl_matrix<TElement> CopyToMatrix() const
+  {
+    vnl_matrix<TElement> matrix(m_rows, m_columns);
+    for (unsigned int r = 0; r < m_rows; r++)
+    {
+      for (unsigned int c = 0; c < m_columns; c++)
+      {
+        matrix(r, c) = (*this)(r, c);
+      }
+    }
+    return matrix;
+  }
+
+  //! Write a matrix of the same size into the section
+  void Assign(const vnl_matrix<TElement> &matrix) const
+  {
+    if ((matrix.rows() != m_rows) || (matrix.cols() != m_columns))
+    {
+      itkGenericExceptionMacro("Matrix of size " << matrix.rows() << "x" << matrix.cols() << " does not fit a view of " <<
+        m_rows << "x" << m_columns);
+    }
+    for (unsigned int r = 0; r < m_rows; r++)
+    {
+      for (unsigned int c = 0; c < m_columns; c++)
+      {
+        (*this)(r, c) = matrix(r, c);
+      }
+    }
+  }
+
+private:
+  TElement *m_data;
+  unsigned int m_rows, m_columns;
+  ptrdiff_t m_rowStride, m_columnStride;
+};
+
+//! The buffer of a 2D image as a matrix of size[1] rows and size[0] columns
+template <typename TPixel>
+vnl_matrix_ref<TPixel> MatrixView(itk::Image<TPixel, 2> *image)
+{
+  const typename itk::Image<TPixel, 2>::SizeType size = image->GetBufferedRegion().GetSize();
+  return vnl_matrix_ref<TPixel>(size[1], size[0], image->GetBufferPointer());
+}
+
+//! The buffer of an image of any dimension as a vector
+template <typename TPixel, unsigned int VDimension>
+vnl_vector_ref<TPixel> VectorView(itk::Image<TPixel, VDimension> *image)
+{
+  return vnl_vector_ref<TPixel>(image->GetBufferedRegion().GetNumberOfPixels(), image->GetBufferPointer());
+}
+
+//! Slice z (counted from the start of the buffered region) of a 3D image as a matrix of size[1] rows and size[0] columns
+template <typename TPixel>
+vnl_matrix_ref<TPixel> SliceView(itk::Image<TPixel, 3> *image, unsigned int z)
+{
+  const typename itk::Image<TPixel, 3>::SizeType size = image->GetBufferedRegion().GetSize();
+  if (z >= size[2])
+  {
+    itkGenericExceptionMacro("Slice " << z << " is outside of the " << size[2] << " slices of the image");
+  }
+  return vnl_matrix_ref<TPixel>(size[1], size[0], image->GetBufferPointer() + static_cast<size_t>(z) * size[0] * size[1]);
+}
+
+/**
+\brief A 2D section of a 3D image, in place
+
+\param image The image
+\param normal Axis the section is normal to: 0 gives (z, y) sections, 1 gives (z, x) and 2 gives (y, x)
+\param position Index along the normal axis, counted from the start of the buffered region
+\param firstRow, firstColumn, rows, columns Rectangle of the section; rows and columns 0 for the whole section
+*/
+template <typename TPixel>
+StridedMatrixView<TPixel> SectionView(itk::Image<TPixel, 3> *image, unsigned int normal, unsigned int position,
+  unsigned int firstRow = 0, unsigned int firstColumn = 0, unsigned int rows = 0, unsigned int columns = 0)
+{
+  const typename itk::Image<TPixel, 3>::SizeType size = image->GetBufferedRegion().GetSize();
+  const ptrdiff_t strides[3] = { 1, static_cast<ptrdiff_t>(size[0]), static_cast<ptrdiff_t>(size[0] * size[1]) };
+  if ((normal > 2) || (position >= size[normal]))
+  {
+    itkGenericExceptionMacro("Section " << position << " normal to axis " << normal << " is outside of the image");
+  }
+  // rows run along the slower of the two remaining axes, columns along the faster one
+  const unsigned int columnAxis = (normal == 0) ? 1 : 0, rowAxis = (normal == 2) ? 1 : 2;
+  rows = (rows == 0) ? static_cast<unsigned int>(size[rowAxis]) - firstRow : rows;
+  columns = (columns == 0) ? static_cast<unsigned int>(size[columnAxis]) - firstColumn : columns;
+  if ((firstRow + rows > size[rowAxis]) || (firstColumn + columns > size[columnAxis]))
+  {
+    itkGenericExceptionMacro("Rectangle of the section is outside of the image");
+  }
+  TPixel *data = image->GetBufferPointer() + position * strides[normal] + firstRow * strides[rowAxis] + firstColumn * strides[columnAxis];
+  return StridedMatrixView<TPixel>(data, rows, columns, strides[rowAxis], strides[columnAxis]);
+}
+
+/**
+\brief Move the buffer of a matrix into a new 2D image of size [columns, rows]; the matrix is left empty
+
+\param matrix The matrix, e.g. the result of a VNL algorithm
+\param reference If not NULL, the image takes its origin, spacing and direction
+*/
+template <typename TPixel>
+typename itk::Image<TPixel, 2>::Pointer ImageFromMatrix(vnl_matrix<TPixel> &matrix, const itk::ImageBase<2> *reference = NULL)
+{
+  typedef itk::Image<TPixel, 2> ImageType;
+  typename ImageType::SizeType size;
+  size[0] = matrix.cols();
+  size[1] = matrix.rows();
+  typename ImageType::RegionType region;
+  region.SetSize(size);
+
+  typename ImageType::Pointer image = ImageType::New();
+  if (reference != NULL)
+  {
+    image->SetOrigin(reference->GetOrigin());
+    image->SetSpacing(reference->GetSpacing());
+    image->SetDirection(reference->GetDirection());
+  }
+  image->SetRegions(region);
+
+  typename VnlImportImageContainer<TPixel>::Pointer container = VnlImportImageContainer<TPixel>::New();
+  container->TakeMatrix(matrix);
+  image->SetPixelContainer(container);
+  return image;
+}
+
+/**
+\brief Move the buffer of a vector into a new image with the given region; the vector is left empty
+
+\param vector The vector, with as many elements as the region has pixels
+\param reference The image takes its origin, spacing, direction and largest possible region
+*/
+template <typename TPixel, unsigned int VDimension>
+typename itk::Image<TPixel, VDimension>::Pointer ImageFromVector(vnl_vector<TPixel> &vector, const itk::ImageBase<VDimension> *reference)
+{
+  typedef itk::Image<TPixel, VDimension> ImageType;
+  if (vector.size() != reference->GetLargestPossibleRegion().GetNumberOfPixels())
+  {
+    itkGenericExceptionMacro("Vector of " << vector.size() << " elements does not fit an image of " <<
+      reference->GetLargestPossibleRegion().GetNumberOfPixels() << " pixels");
+  }
+
+  typename ImageType::Pointer image = ImageType::New();
+  image->CopyInformation(reference);
+  image->SetRegions(reference->GetLargestPossibleRegion());
+
+  typename VnlImportImageContainer<TPixel>::Pointer container = VnlImportImageContainer<TPixel>::New();
+  container->TakeVector(vector);
+  image->SetPixelContainer(container);
+  return image;
+}
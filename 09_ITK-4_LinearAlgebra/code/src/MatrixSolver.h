@@ -0,0 +1,537 @@
+/**
+\file MatrixSolver.h
+
+\brief Solver front end that picks the factorization of a matrix from its condition number
+
+vnl_matrix_inverse runs a full SVD, about ten times the work of an LU factorization, although the SVD is only
+needed when the matrix is (numerically) singular. MatrixSolver::Factorize() decides as follows:
+
+- a symmetric matrix with positive diagonal is tried with Cholesky (n^3/3 flops), which succeeds if and only if
+  it is positive definite; Cholesky is used unless the matrix is numerically singular
+- otherwise LU with partial pivoting (2n^3/3 flops) is computed, and used if the matrix is well conditioned
+- a moderately ill-conditioned matrix gets Householder QR (vnl_qr), which cannot suffer from element growth
+- a numerically singular or non-square matrix gets the SVD (vnl_svd), with small singular values zeroed
+
+The condition number (1-norm) is estimated from the Cholesky or LU factors with the Hager-Higham method, which
+costs a few triangular solves, O(n^2), instead of the O(n^3) of computing it. VNL has no LU factorization and
+its Cholesky works in double precision only, so both are implemented here for float and double.
+
+The report (GetReport()) tells which method was chosen, the condition estimate and the time taken.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include "itkMacro.h"
+
+//! VNL headers
+#include "vnl/vnl_matrix.h"
+#include "vnl/vnl_vector.h"
+#include "vnl/algo/vnl_qr.h"
+#include "vnl/algo/vnl_svd.h"
+
+//! Factorization used by MatrixSolver
+enum class SolverMethod
+{
+  Automatic,
+  LU,
+  Cholesky,
+  QR,
+  SVD
+};
+
+inline const char *GetSolverMethodName(SolverMethod method)
+{
+  switch (method)
+  {
+  case SolverMethod::LU:
+    return "LU";
+  case SolverMethod::Cholesky:
+    return "Cholesky";
+  case SolverMethod::QR:
+    return "QR";
+  case SolverMethod::SVD:
+    return "SVD";
+  default:
+    return "automatic";
+  }
+}
+
+/**
+\brief How MatrixSolver picks its factorization
+*/
+struct SolverOptions
+{
+  SolverMethod method = SolverMethod::Automatic; //! a fixed method, or Automatic to decide by the condition number
+  double luLimit = 0; //! condition numbers from here on get QR instead of LU; 0 for 1 / sqrt(epsilon)
+  double svdLimit = 0; //! condition numbers from here on get the SVD; 0 for 1 / (sqrt(n) * epsilon)
+  double tolerance = 0; //! singular values below tolerance times the largest one are zeroed by the SVD; 0 for n * epsilon
+};
+
+/**
+\brief What MatrixSolver::Factorize() did
+*/
+struct SolverReport
+{
+  SolverMethod method = SolverMethod::Automatic; //! the factorization used
+  double condition = 0; //! condition number: 1-norm estimate for LU and Cholesky, exact 2-norm for the SVD, infinite if singular, 0 for QR
+  double milliseconds = 0; //! time of the decision and the factorization
+};
+
+/**
+\brief Factorize a matrix once, then solve with it or invert it
+
+\param TValue float or double; all computations are done in this precision
+*/
+template <typename TValue>
+class MatrixSolver
+{
+public:
+  typedef vnl_matrix<TValue> MatrixType;
+  typedef vnl_vector<TValue> VectorType;
+
+  explicit MatrixSolver(const SolverOptions &options = SolverOptions()) : m_options(options)
+  {
+  }
+
+  //! Factorize the matrix, choosing the method as set in the options
+  const SolverReport &Factorize(const MatrixType &a)
+  {
+    auto t1 = std::chrono::high_resolution_clock::now();
+    m_report = SolverReport();
+    m_qr.reset();
+    m_svd.reset();
+    m_rows = a.rows();
+    m_columns = a.cols();
+
+    const double epsilon = std::numeric_limits<TValue>::epsilon();
+    const double svdLimit = (m_options.svdLimit > 0) ? m_options.svdLimit : 1.0 / (std::sqrt(static_cast<double>(std::max(1u, m_rows))) * epsilon);
+    const double luLimit = std::min(svdLimit, (m_options.luLimit > 0) ? m_options.luLimit : 1.0 / std::sqrt(epsilon));
+
+    SolverMethod method = m_options.method;
+    if (m_rows != m_columns)
+    {
+      if ((method != SolverMethod::Automatic) && (method != SolverMethod::SVD))
+      {
+        itkGenericExceptionMacro(GetSolverMethodName(method) << " needs a square matrix, not " << m_rows << "x" << m_columns);
+      }
+      method = SolverMethod::SVD;
+    }
+
+    switch (method)
+    {
+    case SolverMethod::Automatic:
+      if (IsSymmetricWithPositiveDiagonal(a) && FactorizeCholesky(a))
+      {
+        m_report.condition = EstimateCondition(a, SolverMethod::Cholesky);
+        m_report.method = (m_report.condition < svdLimit) ? SolverMethod::Cholesky : SolverMethod::SVD;
+      }
+      else if (FactorizeLU(a))
+      {
+        m_report.condition = EstimateCondition(a, SolverMethod::LU);
+        m_report.method = (m_report.condition < luLimit) ? SolverMethod::LU :
+          ((m_report.condition < svdLimit) ? SolverMethod::QR : SolverMethod::SVD);
+      }
+      else
+      {
+        m_report.condition = std::numeric_limits<double>::infinity();
+        m_report.method = SolverMethod::SVD;
+      }
+      break;
+    case SolverMethod::LU:
+      if (!FactorizeLU(a))
+      {
+        itkGenericExceptionMacro("The matrix is singular, LU failed");
+      }
+      m_report.condition = EstimateCondition(a, SolverMethod::LU);
+      m_report.method = SolverMethod::LU;
+      break;
+    case SolverMethod::Cholesky:
+      if (!FactorizeCholesky(a))
+      {
+        itkGenericExceptionMacro("The matrix is not symmetric positive definite, Cholesky failed");
+      }
+      m_report.condition = EstimateCondition(a, SolverMethod::Cholesky);
+      m_report.method = SolverMethod::Cholesky;
+      break;
+    default:
+      m_report.method = method;
+      break;
+    }
+
+    if (m_report.method == SolverMethod::QR)
+    {
+      m_qr.reset(new vnl_qr<TValue>(a));
+    }
+    else if (m_report.method == SolverMethod::SVD)
+    {
+      const double tolerance = (m_options.tolerance > 0) ? m_options.tolerance : std::max(m_rows, m_columns) * epsilon;
+      m_svd.reset(new vnl_svd<TValue>(a, -tolerance)); // negative: relative to the largest singular value
+      if (m_report.condition == 0)
+      {
+        m_report.condition = m_svd->well_condition() > 0 ? 1.0 / m_svd->well_condition() : std::numeric_limits<double>::infinity();
+      }
+    }
+
+    auto t2 = std::chrono::high_resolution_clock::now();
+    m_report.milliseconds = std::chrono::duration<double, std::milli>(t2 - t1).count();
+    return m_report;
+  }
+
+  const SolverReport &GetReport() const
+  {
+    return m_report;
+  }
+
+  //! X with A X = B (least squares for the SVD of a non-square matrix)
+  MatrixType Solve(const MatrixType &b) const
+  {
+    if (b.rows() != m_rows)
+    {
+      itkGenericExceptionMacro("Right hand side of " << b.rows() << " rows for a matrix of " << m_rows << " rows");
+    }
+    switch (m_report.method)
+    {
+    case SolverMethod::LU:
+    case SolverMethod::Cholesky:
+    {
+      MatrixType x = b;
+      SolveInPlace(x);
+      return x;
+    }
+    case SolverMethod::QR:
+    {
+      MatrixType x(m_columns, b.cols());
+      for (unsigned int c = 0; c < b.cols(); c++)
+      {
+        x.set_column(c, m_qr->solve(b.get_column(c)));
+      }
+      return x;
+    }
+    case SolverMethod::SVD:
+      return m_svd->solve(b);
+    default:
+      itkGenericExceptionMacro("Factorize() has not been called");
+    }
+  }
+
+  //! The inverse (the pseudo-inverse for the SVD)
+  MatrixType Inverse() const
+  {
+    switch (m_report.method)
+    {
+    case SolverMethod::LU:
+    case SolverMethod::Cholesky:
+    {
+      MatrixType x(m_rows, m_rows);
+      x.set_identity();
+      SolveInPlace(x);
+      return x;
+    }
+    case SolverMethod::QR:
+      return m_qr->inverse();
+    case SolverMethod::SVD:
+      return m_svd->pinverse();
+    default:
+      itkGenericExceptionMacro("Factorize() has not been called");
+    }
+  }
+
+private:
+  static bool IsSymmetricWithPositiveDiagonal(const MatrixType &a)
+  {
+    const unsigned int n = a.rows();
+    for (unsigned int i = 0; i < n; i++)
+    {
+      if (!(a(i, i) > 0))
+      {
+        return false;
+      }
+      for (unsigned int j = 0; j < i; j++)
+      {
+        if (a(i, j) != a(j, i))
+        {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  //! A = L L^T, L in the lower triangle of m_factor; false if A is not positive definite
+  bool FactorizeCholesky(const MatrixType &a)
+  {
+    const unsigned int n = a.rows();
+    m_factor = a;
+    for (unsigned int j = 0; j < n; j++)
+    {
+      TValue *rowJ = m_factor[j];
+      // row by row, so that the sums run over contiguous elements of two rows
+      for (unsigned int i = j; i < n; i++)
+      {
+        TValue *rowI = m_factor[i];
+        TValue sum = rowI[j];
+        for (unsigned int k = 0; k < j; k++)
+        {
+          sum -= rowI[k] * rowJ[k];
+        }
+        if (i == j)
+        {
+          if (!(sum > 0))
+          {
+            return false;
+          }
+          rowJ[j] = std::sqrt(sum);
+        }
+        else
+        {
+          rowI[j] = sum / rowJ[j];
+        }
+      }
+    }
+    return true;
+  }
+
+  //! P A = L U with partial pivoting, L (unit diagonal) and U in m_factor; false if a pivot is exactly 0
+  bool FactorizeLU(const MatrixType &a)
+  {
+    const unsigned int n = a.rows();
+    m_factor = a;
+    m_pivots.resize(n);
+    for (unsigned int k = 0; k < n; k++)
+    {
+      unsigned int pivot = k;
+      for (unsigned int i = k + 1; i < n; i++)
+      {
+        if (std::abs(m_factor(i, k)) > std::abs(m_factor(pivot, k)))
+        {
+          pivot = i;
+        }
+      }
+      if (m_factor(pivot, k) == 0)
+      {
+        return false;
+      }
+      m_pivots[k] = pivot;
+      if (pivot != k)
+      {
+        std::swap_ranges(m_factor[k], m_factor[k] + n, m_factor[pivot]);
+      }
+      const TValue *rowK = m_factor[k];
+      const TValue inversePivot = 1 / rowK[k];
+      for (unsigned int i = k + 1; i < n; i++)
+      {
+        TValue *rowI = m_factor[i];
+        const TValue factor = (rowI[k] *= inversePivot);
+        for (unsigned int j = k + 1; j < n; j++)
+        {
+          rowI[j] -= factor * rowK[j];
+        }
+      }
+    }
+    return true;
+  }
+
+  //! Replace the rows of x by the solution of A X = x with the LU or Cholesky factors, a whole row at a time
+  void SolveInPlace(MatrixType &x) const
+  {
+    const unsigned int n = m_rows, k = x.cols();
+    const bool lu = (m_report.method == SolverMethod::LU);
+    if (lu)
+    {
+      for (unsigned int i = 0; i < n; i++)
+      {
+        if (m_pivots[i] != i)
+        {
+          std::swap_ranges(x[i], x[i] + k, x[m_pivots[i]]);
+        }
+      }
+    }
+    // forward with L
+    for (unsigned int i = 0; i < n; i++)
+    {
+      TValue *rowI = x[i];
+      for (unsigned int j = 0; j < i; j++)
+      {
+        const TValue factor = m_factor(i, j);
+        const TValue *rowJ = x[j];
+        for (unsigned int c = 0; c < k; c++)
+        {
+          rowI[c] -= factor * rowJ[c];
+        }
+      }
+      if (!lu)
+      {
+        const TValue inverseDiagonal = 1 / m_factor(i, i);
+        for (unsigned int c = 0; c < k; c++)
+        {
+          rowI[c] *= inverseDiagonal;
+        }
+      }
+    }
+    // backward with U, or with L^T for Cholesky
+    for (unsigned int i = n; i-- > 0;)
+    {
+      TValue *rowI = x[i];
+      if (lu)
+      {
+        for (unsigned int j = i + 1; j < n; j++)
+        {
+          const TValue factor = m_factor(i, j);
+          const TValue *rowJ = x[j];
+          for (unsigned int c = 0; c < k; c++)
+          {
+            rowI[c] -= factor * rowJ[c];
+          }
+        }
+      }
+      const TValue inverseDiagonal = 1 / m_factor(i, i);
+      for (unsigned int c = 0; c < k; c++)
+      {
+        rowI[c] *= inverseDiagonal;
+      }
+      if (!lu)
+      {
+        // row i is final: remove it from the rows above, L^T(j, i) = L(i, j)
+        for (unsigned int j = 0; j < i; j++)
+        {
+          const TValue factor = m_factor(i, j);
+          TValue *rowJ = x[j];
+          for (unsigned int c = 0; c < k; c++)
+          {
+            rowJ[c] -= factor * rowI[c];
+          }
+        }
+      }
+    }
+  }
+
+  //! x = A^-T x with the LU factors (A^T = U^T L^T P), for the condition estimate
+  void SolveTransposedLU(VectorType &x) const
+  {
+    const unsigned int n = m_rows;
+    for (unsigned int i = 0; i < n; i++)
+    {
+      TValue sum = x[i];
+      for (unsigned int j = 0; j < i; j++)
+      {
+        sum -= m_factor(j, i) * x[j];
+      }
+      x[i] = sum / m_factor(i, i);
+    }
+    for (unsigned int i = n; i-- > 0;)
+    {
+      TValue sum = x[i];
+      for (unsigned int j = i + 1; j < n; j++)
+      {
+        sum -= m_factor(j, i) * x[j];
+      }
+      x[i] = sum;
+    }
+    for (unsigned int i = n; i-- > 0;)
+    {
+      std::swap(x[i], x[m_pivots[i]]);
+    }
+  }
+
+  /**
+  \brief Estimate of the 1-norm condition number ||A||_1 ||A^-1||_1 from the factors (Hager, Higham)
+
+  ||A^-1||_1 is the largest ||A^-1 x||_1 over ||x||_1 = 1; a few steps of a gradient ascent with solves
+  against A and A^T find it or come close, plus Higham's alternating vector for matrices that fool it.
+  */
+  double EstimateCondition(const MatrixType &a, SolverMethod method)
+  {
+    const SolverMethod chosen = m_report.method;
+    m_report.method = method; // SolveInPlace() uses the factors of this method
+    const unsigned int n = m_rows;
+    MatrixType y(n, 1);
+    VectorType z(n);
+
+    for (unsigned int i = 0; i < n; i++)
+    {
+      y(i, 0) = static_cast<TValue>(1.0 / n);
+    }
+    double inverseNorm = 0;
+    int last = -1;
+    for (unsigned int iteration = 0; iteration < 5; iteration++)
+    {
+      SolveInPlace(y);
+      double norm = 0;
+      for (unsigned int i = 0; i < n; i++)
+      {
+        norm += std::abs(y(i, 0));
+        z[i] = (y(i, 0) >= 0) ? 1 : -1;
+      }
+      if ((iteration > 0) && (norm <= inverseNorm))
+      {
+        break;
+      }
+      inverseNorm = norm;
+
+      // gradient: A^-T sign(y); the next x is the unit vector of its largest element
+      if (method == SolverMethod::LU)
+      {
+        SolveTransposedLU(z);
+      }
+      else
+      {
+        MatrixType column(z.data_block(), n, 1);
+        SolveInPlace(column); // A is symmetric
+        z.copy_in(column.data_block());
+      }
+      int largest = 0;
+      for (unsigned int i = 1; i < n; i++)
+      {
+        largest = (std::abs(z[i]) > std::abs(z[largest])) ? static_cast<int>(i) : largest;
+      }
+      if (largest == last)
+      {
+        break;
+      }
+      last = largest;
+      y.fill(0);
+      y(largest, 0) = 1;
+    }
+
+    // Higham's alternating vector
+    for (unsigned int i = 0; i < n; i++)
+    {
+      y(i, 0) = static_cast<TValue>(((i % 2) ? -1.0 : 1.0) * (1.0 + (n > 1 ? static_cast<double>(i) / (n - 1) : 0.0)));
+    }
+    SolveInPlace(y);
+    double alternative = 0;
+    for (unsigned int i = 0; i < n; i++)
+    {
+      alternative += std::abs(y(i, 0));
+    }
+    inverseNorm = std::max(inverseNorm, 2 * alternative / (3.0 * n));
+
+    double norm = 0;
+    for (unsigned int j = 0; j < n; j++)
+    {
+      double column = 0;
+      for (unsigned int i = 0; i < n; i++)
+      {
+        column += std::abs(a(i, j));
+      }
+      norm = std::max(norm, column);
+    }
+    m_report.method = chosen;
+    return std::isfinite(norm * inverseNorm) ? norm * inverseNorm : std::numeric_limits<double>::infinity();
+  }
+
+  SolverOptions m_options;
+  SolverReport m_report;
+  unsigned int m_rows = 0, m_columns = 0;
+  MatrixType m_factor;
+  std::vector<unsigned int> m_pivots;
+  std::unique_ptr< vnl_qr<TValue> > m_qr;
+  std::unique_ptr< vnl_svd<TValue> > m_svd;
+};
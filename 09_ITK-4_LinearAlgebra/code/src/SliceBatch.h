@@ -0,0 +1,600 @@
+/**
+\file SliceBatch.h
+
+\brief The same linear algebra operation on every 2D slice of a 2D, 3D or 4D image, on several threads
+
+Every slice, i.e. every [X, Y] plane of the image, is a matrix of Y rows and X columns as in MatrixBridge.h.
+A 3D image of size [X, Y, Z] has Z slices, a 4D image of size [X, Y, Z, T] has Z * T slices. The slices are
+split into one contiguous range per thread. Each thread owns a SliceWorkspace that is sized once for the
+slice shape, so nothing is allocated per slice: a slice is copied into the workspace in double precision,
+factorized there and the result is written straight into the slice of the output image.
+
+Operations (A is a slice of Y rows and X columns):
+- inverse: A^-1 by LU with partial pivoting; singular slices get the pseudo-inverse instead
+- pseudo-inverse: A^+ by SVD; the output slices have X rows and Y columns
+- truncation: the best approximation of rank k of A by SVD
+- solve: X with A X = B for the slice B of a right hand side image of K columns; LU for square A, least squares
+  by SVD otherwise or when A is singular; the output slices have X rows and K columns
+
+The SVD is the one-sided Jacobi method, which is accurate for the small and medium sized slices this is for.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <thread>
+#include <vector>
+
+#include "itkImage.h"
+
+//! The operation applied to every slice
+enum class SliceOperation
+{
+  Inverse,
+  PseudoInverse,
+  Truncation,
+  Solve
+};
+
+/**
+\brief How the slices are to be processed
+*/
+struct SliceBatchOptions
+{
+  SliceOperation operation = SliceOperation::Inverse;
+  unsigned int rank = 1; //! rank kept by the truncation
+  double tolerance = 1e-7; //! singular values below tolerance times the largest one count as 0 for the pseudo-inverse and least squares
+  unsigned int threads = 0; //! 0 picks the hardware concurrency
+};
+
+/**
+\brief Factorizations of one slice, in buffers allocated once for a slice shape
+
+All matrices are stored row by row; the SVD works on column-major copies since the Jacobi rotations combine columns.
+*/
+class SliceWorkspace
+{
+public:
+  //! Default Constructor
+  SliceWorkspace() : m_rows(0), m_columns(0), m_rhsColumns(0), m_transposed(false)
+  {
+  }
+
+  //! Size the buffers for slices of rows x columns and right hand sides of rhsColumns columns
+  void Resize(unsigned int rows, unsigned int columns, unsigned int rhsColumns = 0)
+  {
+    m_rows = rows;
+    m_columns = columns;
+    m_rhsColumns = rhsColumns;
+    const size_t large = std::max(rows, columns), small = std::min(rows, columns);
+    m_a.resize(static_cast<size_t>(rows) * columns);
+    m_pivots.resize(rows);
+    m_x.resize(std::max(large, static_cast<size_t>(rhsColumns) * columns));
+    m_w.resize(large * small);
+    m_v.resize(small * small);
+    m_sigma.resize(small);
+    m_order.resize(small);
+    m_temp.resize(small * std::max<size_t>(1, rhsColumns));
+  }
+
+  //! Copy a slice into the workspace
+  template <typename TPixel>
+  void Load(const TPixel *slice)
+  {
+    for (size_t n = 0; n < m_a.size(); n++)
+    {
+      m_a[n] = slice[n];
+    }
+  }
+
+  /**
+  \brief LU factorization with partial pivoting of the loaded square slice, in place
+
+  \return false if the slice is singular to working precision; the factorization is not usable then
+  */
+  bool FactorizeLU()
+  {
+    const unsigned int n = m_rows;
+    double scale = 0;
+    for (size_t i = 0; i < m_a.size(); i++)
+    {
+      scale = std::max(scale, std::abs(m_a[i]));
+    }
+    const double tiny = n * std::numeric_limits<double>::epsilon() * scale;
+
+    for (unsigned int k = 0; k < n; k++)
+    {
+      unsigned int pivot = k;
+      for (unsigned int i = k + 1; i < n; i++)
+      {
+        if (std::abs(m_a[i * n + k]) > std::abs(m_a[pivot * n + k]))
+        {
+          pivot = i;
+        }
+      }
+      if (!(std::abs(m_a[pivot * n + k]) > tiny))
+      {
+        return false;
+      }
+      m_pivots[k] = pivot;
+      if (pivot != k)
+      {
+        std::swap_ranges(m_a.begin() + k * n, m_a.begin() + (k + 1) * n, m_a.begin() + pivot * n);
+      }
+      const double inversePivot = 1.0 / m_a[k * n + k];
+      for (unsigned int i = k + 1; i < n; i++)
+      {
+        double *row = &m_a[i * n];
+        const double factor = (row[k] *= inversePivot);
+        const double *pivotRow = &m_a[k * n];
+        for (unsigned int j = k + 1; j < n; j++)
+        {
+          row[j] -= factor * pivotRow[j];
+        }
+      }
+    }
+    return true;
+  }
+
+  /**
+  \brief Solve with the LU factorization; x holds the right hand side on input and the solution on output
+
+  \param x Vector of m_rows elements
+  */
+  void SolveLU(double *x) const
+  {
+    const unsigned int n = m_rows;
+    for (unsigned int k = 0; k < n; k++)
+    {
+      std::swap(x[k], x[m_pivots[k]]);
+    }
+    for (unsigned int i = 1; i < n; i++)
+    {
+      double sum = x[i];
+      for (unsigned int j = 0; j < i; j++)
+      {
+        sum -= m_a[i * n + j] * x[j];
+      }
+      x[i] = sum;
+    }
+    for (unsigned int i = n; i-- > 0;)
+    {
+      double sum = x[i];
+      for (unsigned int j = i + 1; j < n; j++)
+      {
+        sum -= m_a[i * n + j] * x[j];
+      }
+      x[i] = sum / m_a[i * n + i];
+    }
+  }
+
+  /**
+  \brief Singular value decomposition of the loaded slice by one-sided Jacobi rotations
+
+  Afterwards Left(), Right() and Sigma() give A = sum_j Sigma(j) * Left(:, j) * Right(:, j)^T, and
+  Order() lists the singular values from the largest to the smallest.
+  */
+  void DecomposeSVD()
+  {
+    // the rotations work on the columns of the taller of A and A^T
+    m_transposed = (m_rows < m_columns);
+    const unsigned int p = std::max(m_rows, m_columns), q = std::min(m_rows, m_columns);
+    for (unsigned int r = 0; r < m_rows; r++)
+    {
+      for (unsigned int c = 0; c < m_columns; c++)
+      {
+        const double value = m_a[r * m_columns + c];
+        if (m_transposed)
+        {
+          m_w[r * p + c] = value;
+        }
+        else
+        {
+          m_w[c * p + r] = value;
+        }
+      }
+    }
+    std::fill(m_v.begin(), m_v.end(), 0.0);
+    for (unsigned int j = 0; j < q; j++)
+    {
+      m_v[j * q + j] = 1;
+    }
+
+    const double epsilon = std::numeric_limits<double>::epsilon() * p;
+    for (unsigned int sweep = 0; sweep < MaximumSweeps; sweep++)
+    {
+      bool rotated = false;
+      for (unsigned int j = 0; j + 1 < q; j++)
+      {
+        for (unsigned int k = j + 1; k < q; k++)
+        {
+          double *wj = &m_w[j * p], *wk = &m_w[k * p];
+          double alpha = 0, beta = 0, gamma = 0;
+          for (unsigned int i = 0; i < p; i++)
+          {
+            alpha += wj[i] * wj[i];
+            beta += wk[i] * wk[i];
+            gamma += wj[i] * wk[i];
+          }
+          if (!(std::abs(gamma) > epsilon * std::sqrt(alpha * beta)))
+          {
+            continue;
+          }
+          rotated = true;
+          const double zeta = (beta - alpha) / (2 * gamma);
+          const double t = ((zeta >= 0) ? 1.0 : -1.0) / (std::abs(zeta) + std::sqrt(1 + zeta * zeta));
+          const double c = 1 / std::sqrt(1 + t * t), s = c * t;
+          Rotate(wj, wk, p, c, s);
+          Rotate(&m_v[j * q], &m_v[k * q], q, c, s);
+        }
+      }
+      if (!rotated)
+      {
+        break;
+      }
+    }
+
+    // the column norms are the singular values, the normalized columns the singular vectors
+    for (unsigned int j = 0; j < q; j++)
+    {
+      double *wj = &m_w[j * p];
+      double norm = 0;
+      for (unsigned int i = 0; i < p; i++)
+      {
+        norm += wj[i] * wj[i];
+      }
+      m_sigma[j] = std::sqrt(norm);
+      if (m_sigma[j] > 0)
+      {
+        const double inverseNorm = 1 / m_sigma[j];
+        for (unsigned int i = 0; i < p; i++)
+        {
+          wj[i] *= inverseNorm;
+        }
+      }
+      m_order[j] = j;
+    }
+    std::sort(m_order.begin(), m_order.end(), [this](unsigned int a, unsigned int b) { return m_sigma[a] > m_sigma[b]; });
+  }
+
+  //! Element i of left singular vector j (i < rows)
+  double Left(unsigned int i, unsigned int j) const
+  {
+    return m_transposed ? m_v[j * m_rows + i] : m_w[j * m_rows + i];
+  }
+
+  //! Element i of right singular vector j (i < columns)
+  double Right(unsigned int i, unsigned int j) const
+  {
+    return m_transposed ? m_w[j * m_columns + i] : m_v[j * m_columns + i];
+  }
+
+  double Sigma(unsigned int j) const
+  {
+    return m_sigma[j];
+  }
+
+  //! Indices of the singular values, largest first
+  const std::vector<unsigned int> &Order() const
+  {
+    return m_order;
+  }
+
+  //! Inverse of the loaded square slice into output (row by row); false if the slice is singular
+  template <typename TPixel>
+  bool Invert(TPixel *output)
+  {
+    if (!FactorizeLU())
+    {
+      return false;
+    }
+    const unsigned int n = m_rows;
+    for (unsigned int c = 0; c < n; c++)
+    {
+      std::fill(m_x.begin(), m_x.begin() + n, 0.0);
+      m_x[c] = 1;
+      SolveLU(m_x.data());
+      for (unsigned int r = 0; r < n; r++)
+      {
+        output[r * n + c] = static_cast<TPixel>(m_x[r]);
+      }
+    }
+    return true;
+  }
+
+  //! Pseudo-inverse (columns x rows) of the loaded slice into output
+  template <typename TPixel>
+  void PseudoInvert(TPixel *output, double tolerance)
+  {
+    DecomposeSVD();
+    const unsigned int q = std::min(m_rows, m_columns);
+    const double cutoff = tolerance * m_sigma[m_order[0]];
+    for (unsigned int r = 0; r < m_columns; r++)
+    {
+      for (unsigned int c = 0; c < m_rows; c++)
+      {
+        double sum = 0;
+        for (unsigned int j = 0; j < q; j++)
+        {
+          if (m_sigma[j] > cutoff)
+          {
+            sum += Right(r, j) * Left(c, j) / m_sigma[j];
+          }
+        }
+        output[r * m_rows + c] = static_cast<TPixel>(sum);
+      }
+    }
+  }
+
+  //! Best approximation of the given rank of the loaded slice into output (rows x columns)
+  template <typename TPixel>
+  void Truncate(TPixel *output, unsigned int rank)
+  {
+    DecomposeSVD();
+    rank = std::min<unsigned int>(rank, static_cast<unsigned int>(m_order.size()));
+    for (unsigned int r = 0; r < m_rows; r++)
+    {
+      for (unsigned int c = 0; c < m_columns; c++)
+      {
+        double sum = 0;
+        for (unsigned int k = 0; k < rank; k++)
+        {
+          const unsigned int j = m_order[k];
+          sum += Left(r, j) * m_sigma[j] * Right(c, j);
+        }
+        output[r * m_columns + c] = static_cast<TPixel>(sum);
+      }
+    }
+  }
+
+  /**
+  \brief Solve A X = B for the loaded slice A
+
+  \param rhs B, rows x rhsColumns, row by row
+  \param output X, columns x rhsColumns, row by row
+  \return false if A is square but singular; the factorization overwrote A then, reload it for SolveLeastSquares()
+  */
+  template <typename TPixel>
+  bool Solve(const TPixel *rhs, TPixel *output, double tolerance)
+  {
+    const unsigned int k = m_rhsColumns;
+    if (m_rows != m_columns)
+    {
+      SolveLeastSquares(rhs, output, tolerance);
+      return true;
+    }
+    if (FactorizeLU())
+    {
+      for (unsigned int c = 0; c < k; c++)
+      {
+        for (unsigned int r = 0; r < m_rows; r++)
+        {
+          m_x[r] = rhs[r * k + c];
+        }
+        SolveLU(m_x.data());
+        for (unsigned int r = 0; r < m_columns; r++)
+        {
+          output[r * k + c] = static_cast<TPixel>(m_x[r]);
+        }
+      }
+      return true;
+    }
+    return false;
+  }
+
+  //! Least squares solution X = A^+ B = V S^+ U^T B of the loaded slice, see Solve()
+  template <typename TPixel>
+  void SolveLeastSquares(const TPixel *rhs, TPixel *output, double tolerance)
+  {
+    DecomposeSVD();
+    const unsigned int q = std::min(m_rows, m_columns), k = m_rhsColumns;
+    const double cutoff = tolerance * m_sigma[m_order[0]];
+    for (unsigned int j = 0; j < q; j++)
+    {
+      for (unsigned int c = 0; c < k; c++)
+      {
+        double sum = 0;
+        if (m_sigma[j] > cutoff)
+        {
+          for (unsigned int i = 0; i < m_rows; i++)
+          {
+            sum += Left(i, j) * rhs[i * k + c];
+          }
+          sum /= m_sigma[j];
+        }
+        m_temp[j * k + c] = sum;
+      }
+    }
+    for (unsigned int r = 0; r < m_columns; r++)
+    {
+      for (unsigned int c = 0; c < k; c++)
+      {
+        double sum = 0;
+        for (unsigned int j = 0; j < q; j++)
+        {
+          sum += Right(r, j) * m_temp[j * k + c];
+        }
+        output[r * k + c] = static_cast<TPixel>(sum);
+      }
+    }
+  }
+
+private:
+  //! Sweeps after which the Jacobi SVD stops even if it has not converged
+  static const unsigned int MaximumSweeps = 60;
+
+  static void Rotate(double *a, double *b, unsigned int n, double c, double s)
+  {
+    for (unsigned int i = 0; i < n; i++)
+    {
+      const double x = a[i], y = b[i];
+      a[i] = c * x - s * y;
+      b[i] = s * x + c * y;
+    }
+  }
+
+  unsigned int m_rows, m_columns, m_rhsColumns;
+  bool m_transposed;
+  std::vector<double> m_a, m_x, m_w, m_v, m_sigma, m_temp;
+  std::vector<unsigned int> m_pivots, m_order;
+};
+
+/**
+\brief What processSlices() produced
+*/
+template <class TImageType>
+struct SliceBatchResult
+{
+  typename TImageType::Pointer output;
+  size_t slices = 0; //! number of slices processed
+  size_t singularSlices = 0; //! slices that were singular for the inverse or the square solve and got the SVD result instead
+  double milliseconds = 0; //! wall time of the processing, without allocating the output
+};
+
+/**
+\brief Apply an operation to every slice of an image
+
+\param input Image of dimension 2, 3 or 4
+\param options The operation and its parameters
+\param rhs Right hand side of the solve, with slices of as many rows as the input and the same number of slices
+*/
+template <class TImageType>
+SliceBatchResult<TImageType> processSlices(const TImageType *input, const SliceBatchOptions &options, const TImageType *rhs = NULL)
+{
+  typedef typename TImageType::PixelType PixelType;
+  const unsigned int Dimension = TImageType::ImageDimension;
+  static_assert((Dimension >= 2) && (Dimension <= 4), "Slices are taken from 2D, 3D or 4D images");
+
+  const typename TImageType::SizeType size = input->GetBufferedRegion().GetSize();
+  const unsigned int rows = static_cast<unsigned int>(size[1]), columns = static_cast<unsigned int>(size[0]);
+  size_t slices = 1;
+  for (unsigned int d = 2; d < Dimension; d++)
+  {
+    slices *= size[d];
+  }
+
+  // the shape of the output slices
+  unsigned int outputRows = rows, outputColumns = columns, rhsColumns = 0;
+  typename TImageType::SpacingType spacing = input->GetSpacing();
+  switch (options.operation)
+  {
+  case SliceOperation::Inverse:
+    if (rows != columns)
+    {
+      itkGenericExceptionMacro("Slices of " << rows << "x" << columns << " have no inverse; use the pseudo-inverse");
+    }
+    break;
+  case SliceOperation::PseudoInverse:
+    std::swap(outputRows, outputColumns);
+    std::swap(spacing[0], spacing[1]);
+    break;
+  case SliceOperation::Truncation:
+    break;
+  case SliceOperation::Solve:
+  {
+    if (rhs == NULL)
+    {
+      itkGenericExceptionMacro("The solve needs a right hand side image");
+    }
+    const typename TImageType::SizeType rhsSize = rhs->GetBufferedRegion().GetSize();
+    for (unsigned int d = 1; d < Dimension; d++)
+    {
+      if (rhsSize[d] != size[d])
+      {
+        itkGenericExceptionMacro("The right hand side needs the size of the input along every axis but the first");
+      }
+    }
+    rhsColumns = static_cast<unsigned int>(rhsSize[0]);
+    outputRows = columns;
+    outputColumns = rhsColumns;
+    spacing[1] = spacing[0];
+    spacing[0] = rhs->GetSpacing()[0];
+    break;
+  }
+  }
+
+  SliceBatchResult<TImageType> result;
+  result.slices = slices;
+  typename TImageType::SizeType outputSize = size;
+  outputSize[0] = outputColumns;
+  outputSize[1] = outputRows;
+  typename TImageType::RegionType region;
+  region.SetSize(outputSize);
+  result.output = TImageType::New();
+  result.output->SetOrigin(input->GetOrigin());
+  result.output->SetSpacing(spacing);
+  result.output->SetDirection(input->GetDirection());
+  result.output->SetRegions(region);
+  result.output->Allocate();
+
+  const PixelType *inputBuffer = input->GetBufferPointer();
+  const PixelType *rhsBuffer = (rhs != NULL) ? rhs->GetBufferPointer() : NULL;
+  PixelType *outputBuffer = result.output->GetBufferPointer();
+  const size_t inputStride = static_cast<size_t>(rows) * columns, rhsStride = static_cast<size_t>(rows) * rhsColumns,
+    outputStride = static_cast<size_t>(outputRows) * outputColumns;
+
+  unsigned int threads = (options.threads == 0) ? std::max(1u, std::thread::hardware_concurrency()) : options.threads;
+  threads = static_cast<unsigned int>(std::max<size_t>(1, std::min<size_t>(threads, slices)));
+  std::vector<size_t> singular(threads, 0);
+
+  auto worker = [&](unsigned int thread)
+  {
+    SliceWorkspace workspace;
+    workspace.Resize(rows, columns, rhsColumns);
+    const size_t first = slices * thread / threads, last = slices * (thread + 1) / threads;
+    for (size_t slice = first; slice < last; slice++)
+    {
+      const PixelType *a = inputBuffer + slice * inputStride;
+      PixelType *out = outputBuffer + slice * outputStride;
+      workspace.Load(a);
+      switch (options.operation)
+      {
+      case SliceOperation::Inverse:
+        if (!workspace.Invert(out))
+        {
+          workspace.Load(a); // the failed factorization overwrote the slice
+          workspace.PseudoInvert(out, options.tolerance);
+          singular[thread]++;
+        }
+        break;
+      case SliceOperation::PseudoInverse:
+        workspace.PseudoInvert(out, options.tolerance);
+        break;
+      case SliceOperation::Truncation:
+        workspace.Truncate(out, options.rank);
+        break;
+      case SliceOperation::Solve:
+        if (!workspace.Solve(rhsBuffer + slice * rhsStride, out, options.tolerance))
+        {
+          workspace.Load(a);
+          workspace.SolveLeastSquares(rhsBuffer + slice * rhsStride, out, options.tolerance);
+          singular[thread]++;
+        }
+        break;
+      }
+    }
+  };
+
+  auto t1 = std::chrono::high_resolution_clock::now();
+  std::vector<std::thread> workers;
+  for (unsigned int t = 1; t < threads; t++)
+  {
+    workers.push_back(std::thread(worker, t));
+  }
+  worker(0);
+  for (size_t t = 0; t < workers.size(); t++)
+  {
+    workers[t].join();
+  }
+  auto t2 = std::chrono::high_resolution_clock::now();
+
+  result.milliseconds = std::chrono::duration<double, std::milli>(t2 - t1).count();
+  for (unsigned int t = 0; t < threads; t++)
+  {
+    result.singularSlices += singular[t];
+  }
+  return result;
+}
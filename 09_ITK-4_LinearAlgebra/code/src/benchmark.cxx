@@ -0,0 +1,179 @@
+/**
+\brief ITK Linear Algebra Solver Benchmark
+
+Times the inverse by MatrixSolver (automatic choice of the factorization) against the SVD inverse of
+vnl_matrix_inverse, in float and double, for matrices of size 64 up to 4096 (doubled each step):
+- well: diagonally dominant, well conditioned; LU is chosen
+- spd: symmetric positive definite; Cholesky is chosen
+- graded: the well kind with columns scaled from 1 down to epsilon^0.6, moderately ill-conditioned; QR is chosen
+- singular: two equal columns; SVD is chosen
+
+The SVD, which takes far longer, is only run up to a given size. The residual is max |A (X v) - v| for a
+random vector v, which costs O(n^2) instead of the O(n^3) of A X - I.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <string>
+
+//! VNL headers
+#include <vnl/algo/vnl_matrix_inverse.h>
+
+#include "MatrixSolver.h"
+
+/**
+\brief A test matrix of the given kind, see the file description
+
+\param kind well, spd, graded or singular
+\param size Number of rows and columns
+\param seed Seed of the random elements
+*/
+template <typename TValue>
+vnl_matrix<TValue> createMatrix(const std::string &kind, unsigned int size, unsigned int seed)
+{
+  std::mt19937 generator(seed);
+  std::uniform_real_distribution<double> uniform(-1, 1);
+  vnl_matrix<TValue> matrix(size, size);
+  for (unsigned int i = 0; i < size; i++)
+  {
+    for (unsigned int j = 0; j < size; j++)
+    {
+      matrix(i, j) = static_cast<TValue>(uniform(generator));
+    }
+  }
+
+  if (kind == "spd")
+  {
+    for (unsigned int i = 0; i < size; i++)
+    {
+      for (unsigned int j = 0; j < i; j++)
+      {
+        matrix(j, i) = matrix(i, j);
+      }
+    }
+  }
+  if (kind != "singular")
+  {
+    for (unsigned int i = 0; i < size; i++)
+    {
+      matrix(i, i) += static_cast<TValue>(size);
+    }
+  }
+  if (kind == "graded")
+  {
+    // the condition number becomes about epsilon^-0.6
+    const double epsilon = std::numeric_limits<TValue>::epsilon();
+    for (unsigned int j = 0; j < size; j++)
+    {
+      const TValue scale = static_cast<TValue>(std::pow(epsilon, 0.6 * j / (size - 1)));
+      for (unsigned int i = 0; i < size; i++)
+      {
+        matrix(i, j) *= scale;
+      }
+    }
+  }
+  else if (kind == "singular")
+  {
+    matrix.set_column(size - 1, matrix.get_column(0));
+  }
+  return matrix;
+}
+
+//! max |A (X v) - v| for a random vector v
+template <typename TValue>
+double residual(const vnl_matrix<TValue> &matrix, const vnl_matrix<TValue> &inverse)
+{
+  std::mt19937 generator(1);
+  std::uniform_real_distribution<double> uniform(-1, 1);
+  vnl_vector<TValue> v(matrix.cols());
+  for (unsigned int i = 0; i < v.size(); i++)
+  {
+    v[i] = static_cast<TValue>(uniform(generator));
+  }
+  const vnl_vector<TValue> r = matrix * (inverse * v) - v;
+  return r.inf_norm();
+}
+
+/**
+\brief Run all kinds for one precision and print a CSV line each
+
+\param precision Name of the precision for the output
+*/
+template <typename TValue>
+void runBenchmark(const std::string &precision, unsigned int maxSize, unsigned int maxSVDSize)
+{
+  typedef std::chrono::high_resolution_clock ClockType;
+  const std::string kinds[] = { "well", "spd", "graded", "singular" };
+  for (unsigned int size = 64; size <= maxSize; size *= 2)
+  {
+    for (unsigned int k = 0; k < 4; k++)
+    {
+      // the automatic choice is the SVD for singular matrices
+      const bool svd = (size <= maxSVDSize);
+      if ((kinds[k] == "singular") && !svd)
+      {
+        continue;
+      }
+      const vnl_matrix<TValue> matrix = createMatrix<TValue>(kinds[k], size, size + k);
+
+      auto t1 = ClockType::now();
+      MatrixSolver<TValue> solver;
+      const SolverReport report = solver.Factorize(matrix);
+      const vnl_matrix<TValue> inverse = solver.Inverse();
+      auto t2 = ClockType::now();
+      const double elapsed = std::chrono::duration<double, std::milli>(t2 - t1).count();
+
+      std::cout << precision << "," << kinds[k] << "," << size << "," << GetSolverMethodName(report.method) << "," <<
+        report.condition << "," << elapsed << "," << residual(matrix, inverse);
+      if (svd)
+      {
+        auto t3 = ClockType::now();
+        const vnl_matrix<TValue> svdInverse = vnl_matrix_inverse<TValue>(matrix).as_matrix();
+        auto t4 = ClockType::now();
+        const double svdElapsed = std::chrono::duration<double, std::milli>(t4 - t3).count();
+        std::cout << "," << svdElapsed << "," << svdElapsed / elapsed << "," << residual(matrix, svdInverse) << "\n";
+      }
+      else
+      {
+        std::cout << ",-,-,-\n";
+      }
+    }
+  }
+}
+
+void echoUsage(const std::string &exeName)
+{
+  std::cout << exeName << " [maxSize] [maxSVDSize]\n" <<
+    "Sizes run from 64 to maxSize (default: 4096); the SVD only up to maxSVDSize (default: 1024)\n";
+}
+
+// main entry of program
+int main(int argc, char *argv[])
+{
+  try // to catch exceptions
+  {
+    if ((argc > 1) && (std::string(argv[1]) == "-h"))
+    {
+      echoUsage(argv[0]);
+      return EXIT_SUCCESS;
+    }
+    const unsigned int maxSize = (argc > 1) ? std::atoi(argv[1]) : 4096;
+    const unsigned int maxSVDSize = (argc > 2) ? std::atoi(argv[2]) : 1024;
+
+    std::cout << "precision,matrix,size,method,condition,milliseconds,residual,svdMilliseconds,speedup,svdResidual\n";
+    runBenchmark<float>("float", maxSize, maxSVDSize);
+    runBenchmark<double>("double", maxSize, maxSVDSize);
+  }
+  catch (itk::ExceptionObject &error)
+  {
+    std::cerr << "Exception caught: " << error << "\n";
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -2,18 +2,19 @@
 \brief ITK Linear Algebra Tutorial
 */
 
+#include <algorithm>
+#include <cstdlib>
+
 //! ITK headers
 #include "itkImage.h"
 #include "itkImageFileReader.h"
 #include "itkImageFileWriter.h"
-#include "itkImportImageFilter.h"
 
-//! VNL headers
-#include "vnl/vnl_matrix.h"
-#include "vnl/vnl_matrix_ref.h"
-#include <vnl/algo/vnl_matrix_inverse.h>
+#include "MatrixBridge.h"
+#include "MatrixSolver.h"
+#include "SliceBatch.h"
 
-const unsigned int SupportedDimensions = 2;
+typedef float PixelType; // default pixel type is float, all voxel data is static-casted
 
 /**
 \brief Get the itk::Image
@@ -43,10 +44,79 @@ void SafeReadImage(typename TImageType::Pointer image, const std::string &fName)
   return;
 }
 
+/**
+\brief Apply the operation to every slice of a 2D, 3D or 4D image and write the result
+
+\param inputFName File name of the input
+\param rhsFName File name of the right hand side of the solve, empty otherwise
+\param outputFName File name of output
+\param options The operation
+*/
+template <unsigned int VDimension>
+void processVolume(const std::string &inputFName, const std::string &rhsFName, const std::string &outputFName,
+  const SliceBatchOptions &options)
+{
+  typedef itk::Image<PixelType, VDimension> ImageType;
+  typename ImageType::Pointer inputImage = ImageType::New();
+  SafeReadImage<ImageType>(inputImage, inputFName);
+  typename ImageType::Pointer rhsImage;
+  if (!rhsFName.empty())
+  {
+    rhsImage = ImageType::New();
+    SafeReadImage<ImageType>(rhsImage, rhsFName);
+  }
+
+  const SliceBatchResult<ImageType> result = processSlices<ImageType>(inputImage, options, rhsImage);
+  std::cout << result.slices << " slices in " << result.milliseconds << " ms";
+  if (result.singularSlices > 0)
+  {
+    std::cout << ", " << result.singularSlices << " singular (SVD used)";
+  }
+  std::cout << "\n";
+
+  typedef itk::ImageFileWriter<ImageType> WriterType;
+  typename WriterType::Pointer writer = WriterType::New();
+  writer->SetInput(result.output);
+  writer->SetFileName(outputFName);
+  writer->Write();
+}
+
+/**
+\brief Invert a matrix in the given precision with the solver front end and report the method it chose
+
+\param input The matrix
+\param options How the solver picks its factorization
+*/
+template <typename TValue>
+vnl_matrix<PixelType> invertMatrix(const vnl_matrix<PixelType> &input, const SolverOptions &options)
+{
+  vnl_matrix<TValue> matrix(input.rows(), input.cols());
+  std::copy(input.begin(), input.end(), matrix.begin());
+
+  MatrixSolver<TValue> solver(options);
+  const SolverReport &report = solver.Factorize(matrix);
+  const vnl_matrix<TValue> inverse = solver.Inverse();
+  std::cout << "Solver: " << GetSolverMethodName(report.method) << ", condition number " << report.condition <<
+    ", " << report.milliseconds << " ms to factorize\n";
+
+  vnl_matrix<PixelType> output(inverse.rows(), inverse.cols());
+  std::copy(inverse.begin(), inverse.end(), output.begin());
+  return output;
+}
+
 void echoUsage(const std::string &exeName)
 {
-  std::cout << exeName << " <inputImageFile1> <outputFileName>\n" <<
-    "NOTE - Only 3D images are supported in this example.\n";
+  std::cout << exeName << " <inputImageFile1> <outputFileName> [options]\n" <<
+    "Every 2D slice of the image is a matrix (rows along y, columns along x)\n" <<
+    "Options:\n" <<
+    "  -op <operation>   inverse (default), pinv (pseudo-inverse), truncate (low rank approximation) or solve\n" <<
+    "  -rank <k>         Rank kept by truncate (default: 1)\n" <<
+    "  -rhs <file>       Right hand side of solve: image with as many rows and slices as the input\n" <<
+    "  -tolerance <t>    Relative size below which singular values count as 0 (default: 1e-7)\n" <<
+    "  -threads <n>      Threads the slices are split over (default: 0, all cores)\n" <<
+    "  -solver <method>  Inverse of a single 2D image: auto (default, by condition number), lu, cholesky, qr or svd\n" <<
+    "  -precision <p>    Inverse of a single 2D image: computed in float (default) or double\n" <<
+    "NOTE - 2D, 3D and 4D images are supported in this example.\n";
 }
 
 // main entry of program
@@ -55,60 +125,159 @@ int main(int argc, char *argv[])
   try // to catch exceptions
   {
     // basic check to see image file has been put in by the user
-    if( (argc < 2) )
+    if( (argc < 3) )
     {
       std::cerr << "Usage: " << std::endl;
       echoUsage(argv[0]);
       return EXIT_FAILURE;
     }
 
-    std::string inputFName1 = "", outputFName = "";
+    std::string inputFName1 = "", outputFName = "", rhsFName = "";
     
-    inputFName1 = argv[2];
-    outputFName = argv[3];
+    inputFName1 = argv[1];
+    outputFName = argv[2];
+
+    SliceBatchOptions options;
+    SolverOptions solverOptions;
+    bool doublePrecision = false;
+    for (int i = 3; i < argc; i++)
+    {
+      const std::string option = argv[i];
+      if ((option == "-op") && (i + 1 < argc))
+      {
+        const std::string operation = argv[++i];
+        if (operation == "inverse")
+        {
+          options.operation = SliceOperation::Inverse;
+        }
+        else if (operation == "pinv")
+        {
+          options.operation = SliceOperation::PseudoInverse;
+        }
+        else if (operation == "truncate")
+        {
+          options.operation = SliceOperation::Truncation;
+        }
+        else if (operation == "solve")
+        {
+          options.operation = SliceOperation::Solve;
+        }
+        else
+        {
+          std::cerr << "Unknown operation " << operation << "\n";
+          return EXIT_FAILURE;
+        }
+      }
+      else if ((option == "-rank") && (i + 1 < argc))
+      {
+        options.rank = std::max(1, std::atoi(argv[++i]));
+      }
+      else if ((option == "-rhs") && (i + 1 < argc))
+      {
+        rhsFName = argv[++i];
+      }
+      else if ((option == "-tolerance") && (i + 1 < argc))
+      {
+        options.tolerance = std::atof(argv[++i]);
+      }
+      else if ((option == "-threads") && (i + 1 < argc))
+      {
+        options.threads = std::max(0, std::atoi(argv[++i]));
+      }
+      else if ((option == "-solver") && (i + 1 < argc))
+      {
+        const std::string method = argv[++i];
+        if (method == "auto")
+        {
+          solverOptions.method = SolverMethod::Automatic;
+        }
+        else if (method == "lu")
+        {
+          solverOptions.method = SolverMethod::LU;
+        }
+        else if (method == "cholesky")
+        {
+          solverOptions.method = SolverMethod::Cholesky;
+        }
+        else if (method == "qr")
+        {
+          solverOptions.method = SolverMethod::QR;
+        }
+        else if (method == "svd")
+        {
+          solverOptions.method = SolverMethod::SVD;
+        }
+        else
+        {
+          std::cerr << "Unknown solver " << method << "\n";
+          return EXIT_FAILURE;
+        }
+      }
+      else if ((option == "-precision") && (i + 1 < argc))
+      {
+        doublePrecision = (std::string(argv[++i]) == "double");
+      }
+      else
+      {
+        std::cerr << "Unknown option " << option << "\n";
+        echoUsage(argv[0]);
+        return EXIT_FAILURE;
+      }
+    }
+    if ((options.operation == SliceOperation::Solve) == rhsFName.empty())
+    {
+      std::cerr << "-rhs is needed by, and only used by, -op solve\n";
+      return EXIT_FAILURE;
+    }
 
     // perform sanity check
     itk::ImageIOBase::Pointer im_base = itk::ImageIOFactory::CreateImageIO(inputFName1.c_str(), itk::ImageIOFactory::ReadMode);
     im_base->SetFileName(inputFName1);
     im_base->ReadImageInformation();
-    if (im_base->GetNumberOfDimensions() != SupportedDimensions)
+    const unsigned int dimensions = im_base->GetNumberOfDimensions();
+    if ((dimensions == 3) || (dimensions == 4) || ((dimensions == 2) && (options.operation != SliceOperation::Inverse)))
+    {
+      switch (dimensions)
+      {
+      case 2:
+        processVolume<2>(im_base->GetFileName(), rhsFName, outputFName, options);
+        break;
+      case 3:
+        processVolume<3>(im_base->GetFileName(), rhsFName, outputFName, options);
+        break;
+      default:
+        processVolume<4>(im_base->GetFileName(), rhsFName, outputFName, options);
+        break;
+      }
+      std::cout << "Finished successfully.\n";
+      return EXIT_SUCCESS;
+    }
+    if (dimensions != 2)
     {
-      std::cerr << "Unsupported Image Dimension. Only 2D images are currently supported.\n";
+      std::cerr << "Unsupported Image Dimension. Only 2D, 3D and 4D images are currently supported.\n";
       return EXIT_FAILURE;
     }
 
-    typedef float PixelType; // default pixel type is float, all voxel data is static-casted
-    typedef itk::Image<PixelType, SupportedDimensions> ImageType; // define image type
+    // the inverse of a single 2D image
+    typedef itk::Image<PixelType, 2> ImageType; // define image type
     ImageType::Pointer inputImage = ImageType::New(); // initialize new image
     SafeReadImage<ImageType>(inputImage, im_base->GetFileName()); // read image along with exceptions
     
-    const unsigned int rows = inputImage->GetBufferedRegion().GetSize()[0];
-    const unsigned int cols = inputImage->GetBufferedRegion().GetSize()[1];
-
     typedef vnl_matrix< PixelType > MatrixType; // define the default matrix type for VNL
-    vnl_matrix_ref< PixelType > inputMatrix(rows, cols,
-      inputImage->GetBufferPointer()                // pointer to image data
-      );    
-
-    MatrixType outputMatrix = vnl_matrix_inverse<PixelType>(inputMatrix); // calculate inverse of image matrix
-
-    typedef itk::ImportImageFilter<PixelType, SupportedDimensions> ImportFilterType;
-    ImportFilterType::Pointer filter = ImportFilterType::New();
-    // keep image properties same
-    filter->SetOrigin(inputImage->GetOrigin());
-    filter->SetDirection(inputImage->GetDirection());
-    filter->SetSpacing(inputImage->GetSpacing());
-    filter->SetRegion(inputImage->GetBufferedRegion());
-    bool letFilterManageMemory = true;
-    filter->SetImportPointer(outputMatrix.data_block(), // set start of memory pointer
-      rows * cols, // total number of pixels for the image
-      letFilterManageMemory // filter takes care of memory management
-      );
+    // the image buffer seen as a matrix, no copy is made
+    vnl_matrix_ref< PixelType > inputMatrix = MatrixView<PixelType>(inputImage);
+
+    // calculate inverse of image matrix, with LU, Cholesky, QR or SVD as its condition number requires
+    MatrixType outputMatrix = doublePrecision ? invertMatrix<double>(inputMatrix, solverOptions) :
+      invertMatrix<float>(inputMatrix, solverOptions);
+
+    // the image takes over the buffer of the result, which VNL frees once the image is gone
+    ImageType::Pointer outputImage = ImageFromMatrix<PixelType>(outputMatrix, inputImage);
 
     // write the result out
     typedef itk::ImageFileWriter<ImageType> WriterType;
     WriterType::Pointer writer = WriterType::New();
-    writer->SetInput(filter->GetOutput());
+    writer->SetInput(outputImage);
     writer->SetFileName(outputFName);
     writer->Write();
   }
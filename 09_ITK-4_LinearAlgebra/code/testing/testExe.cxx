@@ -0,0 +1,422 @@
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "itkImage.h"
+
+#include "MatrixBridge.h"
+#include "MatrixSolver.h"
+#include "SliceBatch.h"
+
+typedef float PixelType;
+typedef itk::Image< PixelType, 2 > ImageType2D;
+typedef itk::Image< PixelType, 3 > ImageType3D;
+
+/**
+\brief Create an image whose pixel at offset n in the buffer has the value n
+
+\param size Size of the image
+*/
+template <class TImageType>
+typename TImageType::Pointer CreateRampImage(const typename TImageType::SizeType &size)
+{
+  typename TImageType::RegionType region;
+  region.SetSize(size);
+  typename TImageType::Pointer image = TImageType::New();
+  image->SetRegions(region);
+  image->Allocate();
+  for (size_t n = 0; n < region.GetNumberOfPixels(); n++)
+  {
+    image->GetBufferPointer()[n] = static_cast<PixelType>(n);
+  }
+  return image;
+}
+
+//! Matrix, vector and slice views use the image buffer itself
+bool TestViews()
+{
+  ImageType2D::SizeType size2D;
+  size2D[0] = 5; // x, the columns
+  size2D[1] = 3; // y, the rows
+  ImageType2D::Pointer image = CreateRampImage<ImageType2D>(size2D);
+
+  vnl_matrix_ref< PixelType > matrix = MatrixView<PixelType>(image);
+  if ((matrix.data_block() != image->GetBufferPointer()) || (matrix.rows() != 3) || (matrix.cols() != 5))
+  {
+    return false;
+  }
+  ImageType2D::IndexType index;
+  index[0] = 4;
+  index[1] = 1;
+  if (matrix(1, 4) != image->GetPixel(index))
+  {
+    return false;
+  }
+  // writes through the view show up in the image
+  matrix(1, 4) = -1;
+  if (image->GetPixel(index) != -1)
+  {
+    return false;
+  }
+
+  vnl_vector_ref< PixelType > vector = VectorView<PixelType, 2>(image);
+  if ((vector.data_block() != image->GetBufferPointer()) || (vector.size() != 15))
+  {
+    return false;
+  }
+
+  ImageType3D::SizeType size3D;
+  size3D[0] = 4;
+  size3D[1] = 3;
+  size3D[2] = 2;
+  ImageType3D::Pointer volume = CreateRampImage<ImageType3D>(size3D);
+  vnl_matrix_ref< PixelType > slice = SliceView<PixelType>(volume, 1);
+  if ((slice.data_block() != volume->GetBufferPointer() + 12) || (slice.rows() != 3) || (slice.cols() != 4))
+  {
+    return false;
+  }
+  ImageType3D::IndexType index3D;
+  index3D[0] = 2;
+  index3D[1] = 1;
+  index3D[2] = 1;
+  return slice(1, 2) == volume->GetPixel(index3D);
+}
+
+//! Strided sections address the voxels of the volume in place
+bool TestSections()
+{
+  ImageType3D::SizeType size;
+  size[0] = 4;
+  size[1] = 3;
+  size[2] = 5;
+  ImageType3D::Pointer volume = CreateRampImage<ImageType3D>(size);
+
+  for (unsigned int normal = 0; normal < 3; normal++)
+  {
+    const unsigned int position = 1;
+    StridedMatrixView< PixelType > section = SectionView<PixelType>(volume, normal, position);
+    for (unsigned int r = 0; r < section.rows(); r++)
+    {
+      for (unsigned int c = 0; c < section.cols(); c++)
+      {
+        ImageType3D::IndexType index;
+        index[normal] = position;
+        index[(normal == 0) ? 1 : 0] = c;
+        index[(normal == 2) ? 1 : 2] = r;
+        if (&section(r, c) != &volume->GetPixel(index))
+        {
+          return false;
+        }
+      }
+    }
+  }
+
+  // a rectangle of a z slice, and a copy of it written back
+  StridedMatrixView< PixelType > rectangle = SectionView<PixelType>(volume, 2, 3, 1, 1, 2, 2);
+  if (rectangle.IsContiguous() || (&rectangle(0, 0) != volume->GetBufferPointer() + 3 * 12 + 4 + 1))
+  {
+    return false;
+  }
+  vnl_matrix< PixelType > copy = rectangle.CopyToMatrix();
+  copy *= 2;
+  rectangle.Assign(copy);
+  if (rectangle(1, 1) != 2 * static_cast<PixelType>(3 * 12 + 2 * 4 + 2))
+  {
+    return false;
+  }
+
+  // whole z slices are contiguous
+  return SectionView<PixelType>(volume, 2, 0).IsContiguous();
+}
+
+//! Results of VNL move into images without copies and stay valid after the VNL object is gone
+bool TestOwnership()
+{
+  ImageType2D::SizeType size;
+  size[0] = 4;
+  size[1] = 3;
+  ImageType2D::Pointer reference = CreateRampImage<ImageType2D>(size);
+  ImageType2D::SpacingType spacing;
+  spacing[0] = 0.5;
+  spacing[1] = 2;
+  reference->SetSpacing(spacing);
+
+  ImageType2D::Pointer image;
+  const PixelType *buffer = NULL;
+  {
+    vnl_matrix< PixelType > matrix(3, 4); // 3 rows: y size 3
+    for (unsigned int n = 0; n < matrix.size(); n++)
+    {
+      matrix.data_block()[n] = static_cast<PixelType>(n);
+    }
+    buffer = matrix.data_block();
+    image = ImageFromMatrix<PixelType>(matrix, reference);
+    if ((image->GetBufferPointer() != buffer) || !matrix.empty())
+    {
+      return false;
+    }
+    if (image->GetPixelContainer()->GetContainerManageMemory())
+    {
+      return false; // ITK must not free memory VNL allocated
+    }
+  }
+  if ((image->GetBufferedRegion().GetSize() != size) || (image->GetSpacing() != spacing))
+  {
+    return false;
+  }
+  for (unsigned int n = 0; n < 12; n++)
+  {
+    if (image->GetBufferPointer()[n] != static_cast<PixelType>(n))
+    {
+      return false;
+    }
+  }
+
+  ImageType3D::SizeType size3D;
+  size3D[0] = 2;
+  size3D[1] = 3;
+  size3D[2] = 4;
+  ImageType3D::Pointer volume = CreateRampImage<ImageType3D>(size3D);
+  vnl_vector< PixelType > vector(24, 1);
+  buffer = vector.data_block();
+  ImageType3D::Pointer moved = ImageFromVector<PixelType, 3>(vector, volume);
+  if ((moved->GetBufferPointer() != buffer) || !vector.empty() ||
+    (moved->GetLargestPossibleRegion() != volume->GetLargestPossibleRegion()))
+  {
+    return false;
+  }
+
+  // a vector of the wrong length is refused
+  vnl_vector< PixelType > wrong(5);
+  try
+  {
+    ImageFromVector<PixelType, 3>(wrong, volume);
+    return false;
+  }
+  catch (itk::ExceptionObject &)
+  {
+  }
+  return wrong.size() == 5;
+}
+
+/**
+\brief Largest difference between the product of two row by row matrices and a third one
+
+\param a Matrix of m rows and k columns
+\param b Matrix of k rows and n columns
+\param c Matrix of m rows and n columns
+*/
+double ProductError(const PixelType *a, const PixelType *b, const PixelType *c, unsigned int m, unsigned int k, unsigned int n)
+{
+  double error = 0;
+  for (unsigned int i = 0; i < m; i++)
+  {
+    for (unsigned int j = 0; j < n; j++)
+    {
+      double sum = 0;
+      for (unsigned int l = 0; l < k; l++)
+      {
+        sum += a[i * k + l] * b[l * n + j];
+      }
+      error = std::max(error, std::abs(sum - c[i * n + j]));
+    }
+  }
+  return error;
+}
+
+//! Every slice of the batched operations satisfies its defining equation, whatever the number of threads
+bool TestSlices()
+{
+  ImageType3D::SizeType size;
+  size[0] = 5;
+  size[1] = 5;
+  size[2] = 7;
+  ImageType3D::Pointer volume = CreateRampImage<ImageType3D>(size);
+  for (size_t n = 0; n < 5 * 5 * 7; n++)
+  {
+    // diagonally dominant, so every slice is well conditioned
+    volume->GetBufferPointer()[n] = std::sin(static_cast<PixelType>(n)) + (((n % 25) % 6 == 0) ? 5 : 0);
+  }
+  std::vector< PixelType > identity(25, 0);
+  for (unsigned int i = 0; i < 5; i++)
+  {
+    identity[i * 6] = 1;
+  }
+
+  SliceBatchOptions options;
+  options.threads = 3;
+  SliceBatchResult< ImageType3D > inverse = processSlices<ImageType3D>(volume, options);
+  if ((inverse.slices != 7) || (inverse.singularSlices != 0))
+  {
+    return false;
+  }
+  for (unsigned int z = 0; z < 7; z++)
+  {
+    if (ProductError(volume->GetBufferPointer() + 25 * z, inverse.output->GetBufferPointer() + 25 * z, identity.data(), 5, 5, 5) > 1e-4)
+    {
+      return false;
+    }
+  }
+
+  // the pseudo-inverse P of a slice A of 3 rows and 5 columns has 5 rows and 3 columns, and A P A = A
+  size[1] = 3;
+  ImageType3D::Pointer wide = CreateRampImage<ImageType3D>(size);
+  for (size_t n = 0; n < 5 * 3 * 7; n++)
+  {
+    wide->GetBufferPointer()[n] = std::cos(static_cast<PixelType>(n * n));
+  }
+  options.operation = SliceOperation::PseudoInverse;
+  SliceBatchResult< ImageType3D > pseudoInverse = processSlices<ImageType3D>(wide, options);
+  if ((pseudoInverse.output->GetBufferedRegion().GetSize()[0] != 3) || (pseudoInverse.output->GetBufferedRegion().GetSize()[1] != 5))
+  {
+    return false;
+  }
+  for (unsigned int z = 0; z < 7; z++)
+  {
+    const PixelType *a = wide->GetBufferPointer() + 15 * z;
+    std::vector< PixelType > ap(9);
+    for (unsigned int i = 0; i < 3; i++)
+    {
+      for (unsigned int j = 0; j < 3; j++)
+      {
+        double sum = 0;
+        for (unsigned int l = 0; l < 5; l++)
+        {
+          sum += a[i * 5 + l] * pseudoInverse.output->GetBufferPointer()[15 * z + l * 3 + j];
+        }
+        ap[i * 3 + j] = static_cast<PixelType>(sum);
+      }
+    }
+    if (ProductError(ap.data(), a, a, 3, 3, 5) > 1e-4)
+    {
+      return false;
+    }
+  }
+
+  // the ramp slices have rank 2: no inverse, and truncation to rank 2 gives them back
+  size[1] = 5;
+  ImageType3D::Pointer ramp = CreateRampImage<ImageType3D>(size);
+  options.operation = SliceOperation::Inverse;
+  if (processSlices<ImageType3D>(ramp, options).singularSlices != 7)
+  {
+    return false;
+  }
+  options.operation = SliceOperation::Truncation;
+  options.rank = 2;
+  SliceBatchResult< ImageType3D > truncated = processSlices<ImageType3D>(ramp, options);
+  for (size_t n = 0; n < 5 * 5 * 7; n++)
+  {
+    if (std::abs(truncated.output->GetBufferPointer()[n] - ramp->GetBufferPointer()[n]) > 1e-3 * n + 1e-4)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+\brief Solve with the solver front end and check the method it picks and the solution
+
+\param matrix The matrix
+\param expected The method the automatic choice has to make
+*/
+template <typename TValue>
+bool CheckSolver(const vnl_matrix< TValue > &matrix, SolverMethod expected)
+{
+  MatrixSolver< TValue > solver;
+  if (solver.Factorize(matrix).method != expected)
+  {
+    std::cerr << "Chose " << GetSolverMethodName(solver.GetReport().method) << " instead of " << GetSolverMethodName(expected) << "\n";
+    return false;
+  }
+  const unsigned int n = matrix.rows();
+  const double tolerance = 1e3 * n * std::numeric_limits< TValue >::epsilon();
+  const vnl_matrix< TValue > inverse = solver.Inverse();
+  if (expected == SolverMethod::SVD)
+  {
+    // the pseudo-inverse P of a singular matrix satisfies A P A = A
+    return (matrix * inverse * matrix - matrix).array_inf_norm() < tolerance * matrix.array_inf_norm();
+  }
+
+  vnl_matrix< TValue > b(n, 2), identity(n, n);
+  identity.set_identity();
+  for (unsigned int i = 0; i < n; i++)
+  {
+    b(i, 0) = 1;
+    b(i, 1) = static_cast<TValue>(i);
+  }
+  const vnl_matrix< TValue > x = solver.Solve(b);
+  return ((matrix * x - b).array_inf_norm() < tolerance * b.array_inf_norm()) &&
+    ((matrix * inverse - identity).array_inf_norm() < tolerance);
+}
+
+//! The solver picks Cholesky, LU and SVD for matrices that need them, in float and double
+bool TestSolver()
+{
+  const unsigned int n = 20;
+  vnl_matrix< double > general(n, n), spd(n, n), singular(n, n);
+  for (unsigned int i = 0; i < n; i++)
+  {
+    for (unsigned int j = 0; j < n; j++)
+    {
+      general(i, j) = std::sin(1.0 + i * n + j) + ((i == j) ? n : 0);
+      spd(i, j) = std::cos(1.0 * (i + 1) * (j + 1)) + ((i == j) ? n : 0);
+      singular(i, j) = std::sin(1.0 + i * n + j % (n - 1)); // the last column repeats the first
+    }
+  }
+
+  vnl_matrix< float > generalFloat(n, n);
+  std::copy(general.begin(), general.end(), generalFloat.begin());
+  return CheckSolver(general, SolverMethod::LU) && CheckSolver(spd, SolverMethod::Cholesky) &&
+    CheckSolver(singular, SolverMethod::SVD) && CheckSolver(generalFloat, SolverMethod::LU);
+}
+
+// main entry of program
+int main(int argc, char *argv[])
+{
+  if (argc < 2)
+  {
+    std::cerr << "Usage: " << argv[0] << " -views|-sections|-ownership|-slices|-solver\n";
+    return EXIT_FAILURE;
+  }
+
+  const std::string test = argv[1];
+  bool passed = false;
+  try
+  {
+    if (test == "-views")
+    {
+      passed = TestViews();
+    }
+    else if (test == "-sections")
+    {
+      passed = TestSections();
+    }
+    else if (test == "-ownership")
+    {
+      passed = TestOwnership();
+    }
+    else if (test == "-slices")
+    {
+      passed = TestSlices();
+    }
+    else if (test == "-solver")
+    {
+      passed = TestSolver();
+    }
+    else
+    {
+      std::cerr << "Unknown test " << test << "\n";
+    }
+  }
+  catch (itk::ExceptionObject &error)
+  {
+    std::cerr << "Exception caught: " << error << "\n";
+    return EXIT_FAILURE;
+  }
+
+  return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
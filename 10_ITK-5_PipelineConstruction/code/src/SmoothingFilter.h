@@ -0,0 +1,56 @@
+/**
+\file SmoothingFilter.h
+
+\brief The Gaussian smoothing stage of the pipeline, as a discrete (FIR) or a recursive (IIR) filter
+
+itk::DiscreteGaussianImageFilter convolves with a sampled kernel whose radius grows with sigma, so its cost per
+voxel grows linearly with sigma along every axis. itk::SmoothingRecursiveGaussianImageFilter runs a recursive
+filter of fixed order (Deriche) forwards and backwards along every line, one axis after the other, so its cost
+per voxel does not depend on sigma. The lines are split over the threads. ITK gathers every line along y and z
+with a strided line iterator, so those passes still stride through memory. A recursive filter that transposes
+the volume between passes, so that every pass runs along contiguous lines, was not written; ITK's filter is
+used as it is.
+
+Neither is exact. The recursive filter approximates the Gaussian by a sum of damped cosines, off by about 0.3% of
+the peak along each axis, independently of sigma (but worse below one voxel). The discrete filter uses the
+discrete analogue of the Gaussian, cut off where the coefficients left out sum to MaximumError (0.01) or at
+MaximumKernelWidth (32); on a sampled Gaussian of variance 4 smoothed with variance 5 it is off the exact result
+by about 1.2% of the peak along each axis. In 3D these add up to about 1% for the recursive and 4% for the
+discrete filter. These figures are estimates from a model of both kernels and have not been checked against
+Test_Pipeline, which prints the measured errors; the thresholds of testing/testExe.cxx leave about twice that.
+*/
+
+#pragma once
+
+#include <cmath>
+
+#include "itkDiscreteGaussianImageFilter.h"
+#include "itkImageToImageFilter.h"
+#include "itkSmoothingRecursiveGaussianImageFilter.h"
+
+//! The filter used for the Gaussian smoothing
+enum class SmoothingMethod
+{
+  Discrete,
+  Recursive
+};
+
+/**
+\brief Create the Gaussian smoothing filter
+
+\param method Discrete (FIR) or recursive (IIR) filter
+\param variance Variance of the Gaussian in physical units, the same along every axis
+*/
+template <class TImageType>
+typename itk::ImageToImageFilter< TImageType, TImageType >::Pointer CreateSmoothingFilter(SmoothingMethod method, double variance)
+{
+  if (method == SmoothingMethod::Recursive)
+  {
+    auto recursive = itk::SmoothingRecursiveGaussianImageFilter< TImageType, TImageType >::New();
+    recursive->SetSigma(std::sqrt(variance));
+    return recursive.GetPointer();
+  }
+  auto discrete = itk::DiscreteGaussianImageFilter< TImageType, TImageType >::New();
+  discrete->SetVariance(variance);
+  return discrete.GetPointer();
+}
@@ -0,0 +1,169 @@
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <string>
+
+#include "itkImage.h"
+#include "itkImageRegionConstIterator.h"
+#include "itkImageRegionIteratorWithIndex.h"
+
+#include "SmoothingFilter.h"
+
+typedef itk::Image< float, 3 > ImageType;
+
+const unsigned int ImageSize = 48; // voxels along every axis
+const double BlobVariance = 4.0; // variance of the Gaussian blob in the test image
+
+/**
+\brief Create an image of a Gaussian blob in the center, sampled or as it is after smoothing with a Gaussian
+
+Smoothing a Gaussian of variance s with a Gaussian of variance v gives a Gaussian of variance s + v, scaled by
+(s / (s + v))^(3/2) in 3D.
+
+\param spacing Voxel spacing along every axis
+\param smoothing Variance of the smoothing in physical units, 0 for the blob itself
+*/
+ImageType::Pointer CreateBlobImage(double spacing, double smoothing)
+{
+  ImageType::SizeType size;
+  size.Fill(ImageSize);
+  ImageType::RegionType region;
+  region.SetSize(size);
+  ImageType::SpacingType spacingVector;
+  spacingVector.Fill(spacing);
+  ImageType::Pointer image = ImageType::New();
+  image->SetRegions(region);
+  image->SetSpacing(spacingVector);
+  image->Allocate();
+
+  const double blobVariance = BlobVariance * spacing * spacing, variance = blobVariance + smoothing;
+  const double scale = std::pow(blobVariance / variance, 1.5);
+  const double center = (ImageSize - 1) * spacing / 2;
+  itk::ImageRegionIteratorWithIndex< ImageType > iterator(image, region);
+  for (iterator.GoToBegin(); !iterator.IsAtEnd(); ++iterator)
+  {
+    double distance = 0;
+    for (unsigned int d = 0; d < 3; d++)
+    {
+      const double offset = iterator.GetIndex()[d] * spacing - center;
+      distance += offset * offset;
+    }
+    iterator.Set(static_cast<float>(scale * std::exp(-distance / (2 * variance))));
+  }
+  return image;
+}
+
+/**
+\brief Largest difference between two images, relative to the largest value of the second one
+
+\param image The image to check
+\param reference The expected image
+*/
+double MaximumRelativeError(const ImageType *image, const ImageType *reference)
+{
+  itk::ImageRegionConstIterator< ImageType > it1(image, image->GetBufferedRegion()), it2(reference, reference->GetBufferedRegion());
+  double error = 0, peak = 0;
+  for (it1.GoToBegin(), it2.GoToBegin(); !it1.IsAtEnd(); ++it1, ++it2)
+  {
+    error = std::max(error, std::abs(static_cast<double>(it1.Get()) - it2.Get()));
+    peak = std::max(peak, std::abs(static_cast<double>(it2.Get())));
+  }
+  return error / peak;
+}
+
+/**
+\brief Smooth the blob and compare with the exact result
+
+\param method Discrete or recursive filter
+\param variance Variance of the smoothing in voxels
+\param spacing Voxel spacing; the smoothing is done in physical units
+*/
+double SmoothingError(SmoothingMethod method, double variance, double spacing)
+{
+  auto filter = CreateSmoothingFilter< ImageType >(method, variance * spacing * spacing);
+  filter->SetInput(CreateBlobImage(spacing, 0));
+  filter->Update();
+  const double error = MaximumRelativeError(filter->GetOutput(), CreateBlobImage(spacing, variance * spacing * spacing));
+  std::cout << ((method == SmoothingMethod::Recursive) ? "recursive" : "discrete") << ", variance " << variance <<
+    " voxels: maximum error " << error << " of the peak\n";
+  return error;
+}
+
+//! Both filters come close to the exact Gaussian for the variance of the pipeline, in voxels and in physical units
+bool TestAccuracy()
+{
+  // the kernel of the discrete filter is the discrete analogue of the Gaussian, cut off where the
+  // coefficients left out sum to MaximumError (0.01), which is a few percent off the continuous Gaussian;
+  // the limits are about twice the errors estimated from a model of both kernels (0.037 and 0.009), not from
+  // measured errors; the errors printed here are the measured ones
+  return (SmoothingError(SmoothingMethod::Discrete, 5.0, 1.0) < 0.08) &&
+    (SmoothingError(SmoothingMethod::Recursive, 5.0, 1.0) < 0.02) &&
+    (SmoothingError(SmoothingMethod::Recursive, 5.0, 0.5) < 0.02);
+}
+
+//! The recursive filter stays as accurate for large variances, where the discrete kernel gets wide
+bool TestLargeVariance()
+{
+  return (SmoothingError(SmoothingMethod::Recursive, 25.0, 1.0) < 0.02) &&
+    (SmoothingError(SmoothingMethod::Recursive, 50.0, 1.0) < 0.02);
+}
+
+//! The recursive filter is closer to the exact Gaussian than the discrete one, and both are close to each other
+bool TestComparison()
+{
+  if (!(SmoothingError(SmoothingMethod::Recursive, 5.0, 1.0) < SmoothingError(SmoothingMethod::Discrete, 5.0, 1.0)))
+  {
+    return false;
+  }
+
+  ImageType::Pointer blob = CreateBlobImage(1.0, 0);
+  auto discrete = CreateSmoothingFilter< ImageType >(SmoothingMethod::Discrete, 5.0);
+  discrete->SetInput(blob);
+  discrete->Update();
+  auto recursive = CreateSmoothingFilter< ImageType >(SmoothingMethod::Recursive, 5.0);
+  recursive->SetInput(blob);
+  recursive->Update();
+
+  const double difference = MaximumRelativeError(recursive->GetOutput(), discrete->GetOutput());
+  std::cout << "recursive against discrete: maximum difference " << difference << " of the peak\n";
+  return difference < 0.06; // about twice the estimated 0.028
+}
+
+// main entry of program
+int main(int argc, char *argv[])
+{
+  if (argc < 2)
+  {
+    std::cerr << "Usage: " << argv[0] << " -accuracy|-largeVariance|-comparison\n";
+    return EXIT_FAILURE;
+  }
+
+  const std::string test = argv[1];
+  bool passed = false;
+  try
+  {
+    if (test == "-accuracy")
+    {
+      passed = TestAccuracy();
+    }
+    else if (test == "-largeVariance")
+    {
+      passed = TestLargeVariance();
+    }
+    else if (test == "-comparison")
+    {
+      passed = TestComparison();
+    }
+    else
+    {
+      std::cerr << "Unknown test " << test << "\n";
+    }
+  }
+  catch (itk::ExceptionObject &error)
+  {
+    std::cerr << "Exception caught: " << error << "\n";
+    return EXIT_FAILURE;
+  }
+
+  return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -29,6 +29,7 @@
 #include "cbicaITKSafeImageIO.h"
 
 #include "TestITK.h"
+#include "BitMaskImage.h"
 
 // main entry of program
 int main(int argc, char *argv[])
@@ -129,31 +130,29 @@ int main(int argc, char *argv[])
         }
       }
 
-      // read the mask and foreground images and initialize their iterators
-      ImagePointerType maskImage = FloatImageType::New(), lesionImage = FloatImageType::New();
-      maskImage = cbica::ReadImage<FloatImageType>(sortedSubjectsAndFiles[i].inputImages[maskLocation]);
-      lesionImage = cbica::ReadImage<FloatImageType>(sortedSubjectsAndFiles[i].inputImages[lesionLocation]);
-      IteratorType maskIt(maskImage, maskImage->GetBufferedRegion()),
-        lesionIt(lesionImage, lesionImage->GetBufferedRegion());
+      // read the mask as a bit-packed mask; the foreground is read as an image since its values are the labels
+      BitMaskImage<3> maskImage;
+      maskImage.Read(sortedSubjectsAndFiles[i].inputImages[maskLocation]);
+      ImagePointerType lesionImage = cbica::ReadImage<FloatImageType>(sortedSubjectsAndFiles[i].inputImages[lesionLocation]);
+      if (lesionImage->GetBufferedRegion() != maskImage.GetRegion())
+      {
+        itkGenericExceptionMacro("Mask and foreground images have different sizes for subject " << i);
+      }
+      const PixelType *lesionBuffer = lesionImage->GetBufferPointer();
 
-      // loop through the entire mask per subject
-      for (maskIt.GoToBegin(); !maskIt.IsAtEnd(); ++maskIt)
+      // loop through the voxels inside the mask only; empty parts of the mask are skipped a word at a time
+      for (BitMaskImage<3>::ConstIterator maskIt(maskImage); !maskIt.IsAtEnd(); ++maskIt)
       {
+        // use foreground as labels
+        labels.push_back(lesionBuffer[maskIt.GetOffset()]);
+
         // a temporary cv::Mat to hold voxel intensities
         cv::Mat tempMat;
-        // if mask contains a non-zero value, go in and store intensities
-        if (maskIt.Get() != static_cast<PixelType>(0))
+        const FloatImageType::IndexType index = maskIt.GetIndex();
+        for (size_t j = 0; j < inputImageIterators.size(); j++)
         {
-          // use foreground as labels
-          lesionIt.SetIndex(maskIt.GetIndex());
-          labels.push_back(lesionIt.Get());
-
-          tempMat = cv::Mat();
-          for (size_t j = 0; j < inputImageIterators.size(); j++)
-          {
-            inputImageIterators[j].SetIndex(maskIt.GetIndex());
-            tempMat.push_back(inputImageIterators[j].Get()); // construct temporary cv::Mat of voxel intensities
-          }
+          inputImageIterators[j].SetIndex(index);
+          tempMat.push_back(inputImageIterators[j].Get()); // construct temporary cv::Mat of voxel intensities
         }
         if (tempMat.cols > 0)
         {
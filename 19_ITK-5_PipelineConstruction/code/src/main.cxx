@@ -2,7 +2,21 @@
 \brief ITK Segmentation Tutorial
 */
 
+#include <algorithm>
 #include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <vector>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
 //! ITK headers
 #include "itkImage.h"
 #include "itkImageFileReader.h"
@@ -26,8 +40,21 @@
 #include "itkSpatialObjectToImageFilter.h"
 #include "itkAffineTransform.h"
 #include "itkNearestNeighborInterpolateImageFunction.h"
+#include "itkBinaryThresholdImageFilter.h"
+#include "itkHistogram.h"
+#include "itkIdentityTransform.h"
+#include "itkImageRegionConstIterator.h"
+#include "itkImageRegionSplitterSlowDimension.h"
+#include "itkOtsuThresholdCalculator.h"
+#include "itkStreamingImageFilter.h"
+
+#include "SmoothingFilter.h"
 
 std::string inputFile, referenceFile, outputFile;
+unsigned int streamDivisions = 1; // pieces the volume is computed in
+double upsampleFactor = 1; // the inputs are upsampled by this factor, for benchmarks on large volumes
+SmoothingMethod smoothingMethod = SmoothingMethod::Discrete; // FIR or IIR Gaussian
+double smoothingVariance = 5.0; // variance of the Gaussian
 
 /**
 \brief Get the itk::Image
@@ -57,33 +84,253 @@ typename TImageType::Pointer SafeReadImage(const std::string &fName)
 }
 
 /**
-\brief Apply connected segmentation filter
+\brief Peak resident memory of the process so far, in megabytes
+*/
+double PeakMemoryMB()
+{
+#if defined(_WIN32)
+  PROCESS_MEMORY_COUNTERS counters;
+  GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+  return counters.PeakWorkingSetSize / (1024.0 * 1024.0);
+#else
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+  return usage.ru_maxrss / (1024.0 * 1024.0); // bytes
+#else
+  return usage.ru_maxrss / 1024.0; // kilobytes
+#endif
+#endif
+}
+
+/**
+\brief Upsample an image by upsampleFactor along every axis with linear interpolation, lazily
+
+\param image Output of the reader
+*/
+template <typename TImageType>
+typename itk::ResampleImageFilter< TImageType, TImageType >::Pointer Upsample(TImageType *image)
+{
+  image->UpdateOutputInformation();
+  typename TImageType::SizeType size = image->GetLargestPossibleRegion().GetSize();
+  typename TImageType::SpacingType spacing = image->GetSpacing();
+  typename TImageType::PointType origin = image->GetOrigin();
+  for (unsigned int d = 0; d < TImageType::ImageDimension; d++)
+  {
+    // the first and last voxel centers stay where they are
+    const double extent = spacing[d] * (size[d] - 1);
+    size[d] = static_cast<typename TImageType::SizeType::SizeValueType>(std::ceil((size[d] - 1) * upsampleFactor)) + 1;
+    spacing[d] = (size[d] > 1) ? extent / (size[d] - 1) : spacing[d];
+  }
+
+  auto resample = itk::ResampleImageFilter< TImageType, TImageType >::New();
+  resample->SetInput(image);
+  resample->SetTransform(itk::IdentityTransform< double, TImageType::ImageDimension >::New());
+  resample->SetInterpolator(itk::LinearInterpolateImageFunction< TImageType, double >::New());
+  resample->SetSize(size);
+  resample->SetOutputOrigin(origin);
+  resample->SetOutputSpacing(spacing);
+  resample->SetOutputDirection(image->GetDirection());
+  return resample;
+}
+
+/**
+\brief Otsu threshold of an image that is computed piece by piece, as itk::OtsuThresholdImageFilter finds it
 
-\param image itk::Image::Pointer to input image
-\param outputFileName File name of output
+The image is requested in streamDivisions pieces twice: once for its minimum and maximum, once for the histogram
+over them (256 bins, the maximum raised by 1/100 of a bin like itk::ImageToHistogramFilter does). Only one
+piece of the image and of the streamed filters before it is in memory at a time.
+
+\param image Output of the last filter before the threshold
+*/
+template <typename TImageType>
+double StreamedOtsuThreshold(TImageType *image)
+{
+  typedef itk::Statistics::Histogram< double > HistogramType;
+  const unsigned int bins = 256;
+  const double marginalScale = 100;
+
+  image->UpdateOutputInformation();
+  const typename TImageType::RegionType largest = image->GetLargestPossibleRegion();
+  auto splitter = itk::ImageRegionSplitterSlowDimension::New();
+  const unsigned int pieces = splitter->GetNumberOfSplits(largest, streamDivisions);
+
+  double minimum = std::numeric_limits<double>::max(), maximum = -std::numeric_limits<double>::max();
+  std::vector<double> frequencies(bins, 0);
+  for (unsigned int pass = 0; pass < 2; pass++)
+  {
+    const double binWidth = (maximum - minimum) / bins;
+    for (unsigned int piece = 0; piece < pieces; piece++)
+    {
+      typename TImageType::RegionType region = largest;
+      splitter->GetSplit(piece, pieces, region);
+      image->SetRequestedRegion(region);
+      image->Update();
+
+      itk::ImageRegionConstIterator< TImageType > iterator(image, region);
+      for (iterator.GoToBegin(); !iterator.IsAtEnd(); ++iterator)
+      {
+        const double value = iterator.Get();
+        if (pass == 0)
+        {
+          minimum = std::min(minimum, value);
+          maximum = std::max(maximum, value);
+        }
+        else
+        {
+          const unsigned int bin = (binWidth > 0) ? static_cast<unsigned int>((value - minimum) / binWidth) : 0;
+          frequencies[std::min(bin, bins - 1)]++;
+        }
+      }
+    }
+    if (pass == 0)
+    {
+      maximum += (maximum - minimum) / bins / marginalScale;
+    }
+  }
+
+  HistogramType::Pointer histogram = HistogramType::New();
+  histogram->SetMeasurementVectorSize(1);
+  HistogramType::SizeType size(1);
+  size.Fill(bins);
+  HistogramType::MeasurementVectorType lower(1), upper(1);
+  lower.Fill(minimum);
+  upper.Fill(maximum);
+  histogram->Initialize(size, lower, upper);
+  for (unsigned int bin = 0; bin < bins; bin++)
+  {
+    histogram->SetFrequency(bin, frequencies[bin]);
+  }
+
+  auto calculator = itk::OtsuThresholdCalculator< HistogramType, double >::New();
+  calculator->SetInput(histogram);
+  calculator->Compute();
+  return calculator->GetThreshold();
+}
+
+/**
+\brief Histogram matching, Gaussian smoothing and Otsu threshold as one pipeline that is executed by the writer
+
+Histogram matching needs its whole inputs and would rebuild both histograms for every piece, so it is the only
+filter updated on its own: the matched image is kept whole and the input and reference images are released.
+The Otsu threshold needs the whole smoothed image, so it is computed first with StreamedOtsuThreshold(); the
+threshold itself is then applied by a StreamingImageFilter that computes the output in streamDivisions pieces.
+With one division (the default) the smoothed image is computed once and reused by both Otsu passes and the
+threshold. With more divisions only a piece of it (plus the margin of the Gaussian kernel) exists at a time,
+but it is computed three times, once per pass.
 */
 template <typename TImageType>
 void PipelineFilter()
 {
+  typedef itk::ImageFileReader< TImageType > ReaderType;
+  auto inputReader = ReaderType::New();
+  inputReader->SetFileName(inputFile);
+  auto referenceReader = ReaderType::New();
+  referenceReader->SetFileName(referenceFile);
+  typename TImageType::Pointer input = inputReader->GetOutput(), reference = referenceReader->GetOutput();
+  typename itk::ResampleImageFilter< TImageType, TImageType >::Pointer inputUpsample, referenceUpsample;
+  if (upsampleFactor != 1)
+  {
+    inputUpsample = Upsample< TImageType >(input);
+    referenceUpsample = Upsample< TImageType >(reference);
+    input = inputUpsample->GetOutput();
+    reference = referenceUpsample->GetOutput();
+  }
+
+  // histogram matching, once for the whole image; its inputs are not needed afterwards
+  typename TImageType::Pointer matched;
+  {
+    auto histoMatch = itk::HistogramMatchingImageFilter< TImageType, TImageType >::New();
+    histoMatch->SetInput(input);
+    histoMatch->SetReferenceImage(reference);
+    histoMatch->SetNumberOfHistogramLevels(125);
+    histoMatch->ThresholdAtMeanIntensityOn();
+    histoMatch->SetNumberOfMatchPoints(100);
+    histoMatch->Update();
+    matched = histoMatch->GetOutput();
+    matched->DisconnectPipeline();
+  }
+  input = NULL;
+  reference = NULL;
+  inputReader = NULL;
+  referenceReader = NULL;
+  inputUpsample = NULL;
+  referenceUpsample = NULL;
+
+  // gaussian filter
+  auto gaussianFilter = CreateSmoothingFilter< TImageType >(smoothingMethod, smoothingVariance);
+  gaussianFilter->SetInput(matched);
+  gaussianFilter->ReleaseDataFlagOn();
+
+  // otsu threshold: inside (the maximum value) at or below the threshold, 0 above it, as itk::OtsuThresholdImageFilter
+  const double threshold = StreamedOtsuThreshold< TImageType >(gaussianFilter->GetOutput());
+  std::cout << "Otsu threshold: " << threshold << "\n";
+  auto otsuThreshold = itk::BinaryThresholdImageFilter< TImageType, TImageType >::New();
+  otsuThreshold->SetInput(gaussianFilter->GetOutput());
+  otsuThreshold->SetLowerThreshold(itk::NumericTraits< typename TImageType::PixelType >::NonpositiveMin());
+  otsuThreshold->SetUpperThreshold(static_cast< typename TImageType::PixelType >(threshold));
+  otsuThreshold->SetInsideValue(itk::NumericTraits< typename TImageType::PixelType >::max());
+  otsuThreshold->SetOutsideValue(0);
+  otsuThreshold->ReleaseDataFlagOn();
+
+  // the pieces are computed one after the other, whether or not the file format can be written in pieces
+  auto streamer = itk::StreamingImageFilter< TImageType, TImageType >::New();
+  streamer->SetInput(otsuThreshold->GetOutput());
+  streamer->SetNumberOfStreamDivisions(streamDivisions);
+  streamer->Update();
+
+  // the last piece of the Gaussian has read the matched image: release it and the filters before writing
+  typename TImageType::Pointer output = streamer->GetOutput();
+  output->DisconnectPipeline();
+  streamer = NULL;
+  otsuThreshold = NULL;
+  gaussianFilter = NULL;
+  matched = NULL;
+
+  auto writer = itk::ImageFileWriter< TImageType >::New();
+  writer->SetFileName(outputFile);
+  writer->SetInput(output);
+  writer->Update();
+}
+
+/**
+\brief The same filters, each updated on its own so that every intermediate volume stays in memory
+
+Kept to compare time and memory with PipelineFilter().
+*/
+template <typename TImageType>
+void MaterializedPipelineFilter()
+{
+  typename TImageType::Pointer input = SafeReadImage< TImageType >(inputFile), reference = SafeReadImage< TImageType >(referenceFile);
+  if (upsampleFactor != 1)
+  {
+    auto inputUpsample = Upsample< TImageType >(input);
+    inputUpsample->Update();
+    input = inputUpsample->GetOutput();
+    auto referenceUpsample = Upsample< TImageType >(reference);
+    referenceUpsample->Update();
+    reference = referenceUpsample->GetOutput();
+  }
+
   // histogram matching
   auto histoMatch = itk::HistogramMatchingImageFilter< TImageType, TImageType >::New();
-  histoMatch->SetInput(SafeReadImage< TImageType >(inputFile));
-  histoMatch->SetReferenceImage(SafeReadImage< TImageType >(referenceFile));
+  histoMatch->SetInput(input);
+  histoMatch->SetReferenceImage(reference);
   histoMatch->SetNumberOfHistogramLevels(125);
   histoMatch->ThresholdAtMeanIntensityOn();
   histoMatch->SetNumberOfMatchPoints(100);
   histoMatch->Update();
 
   // gaussian filter
-  auto gaussianFilter = itk::DiscreteGaussianImageFilter< TImageType, TImageType >::New();
+  auto gaussianFilter = CreateSmoothingFilter< TImageType >(smoothingMethod, smoothingVariance);
   gaussianFilter->SetInput(histoMatch->GetOutput());
-  gaussianFilter->SetVariance(5.0);
   gaussianFilter->Update();
 
   // otsu threshold
   auto otsuThreshold = itk::OtsuThresholdImageFilter< TImageType, TImageType >::New();
   otsuThreshold->SetInput(gaussianFilter->GetOutput());
   otsuThreshold->Update();
+  std::cout << "Otsu threshold: " << otsuThreshold->GetThreshold() << "\n";
   
   auto writer = itk::ImageFileWriter< TImageType >::New();
   writer->SetFileName(outputFile);
@@ -93,7 +340,13 @@ void PipelineFilter()
 
 void echoUsage(const std::string &exeName)
 {
-  std::cout << exeName << " <inputImageFile> <referenceImageFile> <outputFileName>\n" <<
+  std::cout << exeName << " <inputImageFile> <referenceImageFile> <outputFileName> [options]\n" <<
+    "Options:\n" <<
+    "  -divisions <n>   Number of pieces the volume is computed in (default: 1)\n" <<
+    "  -upsample <f>    Upsample both images by f along every axis first, e.g. to measure on large volumes\n" <<
+    "  -materialize     Update every filter on its own and keep all intermediate volumes, for comparison\n" <<
+    "  -recursive       Smooth with the recursive (IIR) Gaussian, whose cost does not grow with the variance\n" <<
+    "  -variance <v>    Variance of the Gaussian smoothing (default: 5)\n" <<
     "NOTE - Only 3D images are supported in this example.\n";
 }
 
@@ -104,7 +357,7 @@ int main(int argc, char *argv[])
   try // to catch exceptions
   {
     // basic check to see image file has been put in by the user
-    if( (argc < 3) || (argc > 4) )
+    if( (argc < 4) )
     {
       std::cerr << "Usage: " << std::endl;
       echoUsage(argv[0]);
@@ -115,6 +368,38 @@ int main(int argc, char *argv[])
     referenceFile = argv[2];
     outputFile = argv[3];
 
+    bool materialize = false;
+    for (int i = 4; i < argc; i++)
+    {
+      const std::string option = argv[i];
+      if ((option == "-divisions") && (i + 1 < argc))
+      {
+        streamDivisions = std::max(1, std::atoi(argv[++i]));
+      }
+      else if ((option == "-upsample") && (i + 1 < argc))
+      {
+        upsampleFactor = std::max(1.0, std::atof(argv[++i]));
+      }
+      else if (option == "-materialize")
+      {
+        materialize = true;
+      }
+      else if (option == "-recursive")
+      {
+        smoothingMethod = SmoothingMethod::Recursive;
+      }
+      else if ((option == "-variance") && (i + 1 < argc))
+      {
+        smoothingVariance = std::atof(argv[++i]);
+      }
+      else
+      {
+        std::cerr << "Unknown option " << option << "\n";
+        echoUsage(argv[0]);
+        return EXIT_FAILURE;
+      }
+    }
+
     //auto im_base = itk::ImageIOFactory::CreateImageIO(inputFile.c_str(), itk::ImageIOFactory::ReadMode);
     //im_base->ReadImageInformation();
 
@@ -135,7 +420,14 @@ int main(int argc, char *argv[])
 
     std::cout << "Starting pipeline.\n";
 
-    PipelineFilter< itk::Image< float, 3 > >();
+    if (materialize)
+    {
+      MaterializedPipelineFilter< itk::Image< float, 3 > >();
+    }
+    else
+    {
+      PipelineFilter< itk::Image< float, 3 > >();
+    }
   }
   catch (itk::ExceptionObject &error)
   {
@@ -145,5 +437,6 @@ int main(int argc, char *argv[])
 
   auto t2 = std::chrono::high_resolution_clock::now();
   std::cout << "Finished successfully in " << std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1).count() << " milliseconds\n";
+  std::cout << "Peak memory: " << PeakMemoryMB() << " MB\n";
   return EXIT_SUCCESS;
 }
\ No newline at end of file
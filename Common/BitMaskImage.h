@@ -0,0 +1,435 @@
+/**
+\file BitMaskImage.h
+
+\brief Binary mask stored with 1 bit per voxel
+
+Voxels are packed in raster order into 64-bit words, so a mask takes 8 times less memory than an
+itk::Image< unsigned char > and 32 times less than an itk::Image< float >. AND, OR and NOT work on whole
+words, the volume is a population count of the words and ConstIterator visits only the voxels that are set,
+skipping 64 voxels at a time where the mask is empty.
+
+ITK has no 1-bit pixel type, and neither itk::Image nor itk::ImageAdaptor can address a voxel that is
+not a whole element of a buffer, so this is a standalone class rather than an image ITK filters can take as
+input. It keeps the geometry of the image it was made from, and Pack()/Unpack() convert from and to an
+itk::Image with that geometry. Files are read in their own pixel type and every non-zero voxel is part of
+the mask; they are written as itk::Image< unsigned char >.
+
+The header is shared by the segmentation, registration and machine learning examples through the Common
+directory of the repository.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#include "itkImage.h"
+#include "itkImageFileReader.h"
+#include "itkImageFileWriter.h"
+#include "itkImageIOFactory.h"
+
+template< unsigned int VDimension = 3 >
+class BitMaskImage
+{
+public:
+  typedef uint64_t WordType;
+  typedef itk::Image< unsigned char, VDimension > ByteImageType;
+  typedef itk::ImageBase< VDimension > ImageBaseType;
+  typedef typename ByteImageType::RegionType RegionType;
+  typedef typename ByteImageType::IndexType IndexType;
+  typedef typename ByteImageType::SpacingType SpacingType;
+  typedef typename ByteImageType::PointType PointType;
+  typedef typename ByteImageType::DirectionType DirectionType;
+  static const unsigned int ImageDimension = VDimension;
+  static const unsigned int BitsPerWord = 64;
+
+  /**
+  \brief Visits the voxels of the mask that are set, in raster order
+
+  Whole words of empty voxels are skipped with a single comparison, so sparse masks are cheap to traverse.
+  */
+  class ConstIterator
+  {
+  public:
+    ConstIterator(const BitMaskImage &mask) : m_mask(&mask)
+    {
+      GoToBegin();
+    }
+
+    //! Move to the first voxel that is set
+    void GoToBegin()
+    {
+      m_word = 0;
+      m_bits = m_mask->m_words.empty() ? 0 : m_mask->m_words[0];
+      Advance();
+    }
+
+    //! True once all voxels that are set have been visited
+    bool IsAtEnd() const
+    {
+      return (m_offset == m_mask->m_voxels);
+    }
+
+    //! Move to the next voxel that is set
+    ConstIterator &operator++()
+    {
+      m_bits &= m_bits - 1; // clear the lowest set bit, i.e. the current voxel
+      Advance();
+      return *this;
+    }
+
+    //! Linear offset of the current voxel in the buffer of an image with the same region
+    size_t GetOffset() const
+    {
+      return m_offset;
+    }
+
+    //! Index of the current voxel
+    IndexType GetIndex() const
+    {
+      return m_mask->ComputeIndex(m_offset);
+    }
+
+  private:
+    //! Find the lowest set bit, from the current word onwards
+    void Advance()
+    {
+      while ((m_bits == 0) && (++m_word < m_mask->m_words.size()))
+      {
+        m_bits = m_mask->m_words[m_word];
+      }
+      m_offset = (m_bits == 0) ? m_mask->m_voxels : m_word * BitsPerWord + TrailingZeros(m_bits);
+    }
+
+    const BitMaskImage *m_mask;
+    size_t m_word, m_offset;
+    WordType m_bits;
+  };
+
+  //! Default Constructor
+  BitMaskImage() : m_voxels(0)
+  {
+  }
+
+  //! Default Destructor
+  ~BitMaskImage()
+  {
+  }
+
+  //! Take the geometry of the largest possible region of the reference and clear every voxel
+  void Allocate(const ImageBaseType *reference)
+  {
+    m_region = reference->GetLargestPossibleRegion();
+    m_spacing = reference->GetSpacing();
+    m_origin = reference->GetOrigin();
+    m_direction = reference->GetDirection();
+    m_voxels = m_region.GetNumberOfPixels();
+    m_words.assign((m_voxels + BitsPerWord - 1) / BitsPerWord, 0);
+  }
+
+  //! Set every voxel of the image that is not 0; the image needs to be fully buffered
+  template< class TImageType >
+  void Pack(const TImageType *image)
+  {
+    Allocate(image);
+    const typename TImageType::PixelType *buffer = image->GetBufferPointer();
+    for (size_t w = 0; w < m_words.size(); w++)
+    {
+      const size_t begin = w * BitsPerWord, end = std::min< size_t >(begin + BitsPerWord, m_voxels);
+      WordType word = 0;
+      for (size_t i = begin; i < end; i++)
+      {
+        word |= WordType(buffer[i] != 0) << (i - begin);
+      }
+      m_words[w] = word;
+    }
+  }
+
+  //! The mask as an image with the same geometry, 'value' in the voxels that are set and 0 elsewhere
+  typename ByteImageType::Pointer Unpack(unsigned char value = 1) const
+  {
+    typename ByteImageType::Pointer image = ByteImageType::New();
+    image->SetRegions(m_region);
+    image->SetSpacing(m_spacing);
+    image->SetOrigin(m_origin);
+    image->SetDirection(m_direction);
+    image->Allocate();
+    image->FillBuffer(0);
+    unsigned char *buffer = image->GetBufferPointer();
+    for (ConstIterator it(*this); !it.IsAtEnd(); ++it)
+    {
+      buffer[it.GetOffset()] = value;
+    }
+    return image;
+  }
+
+  /**
+  \brief Read a mask from file; any voxel that is not 0 is set
+
+  The file is read in its own pixel type, so values such as 0.5 in a probability map or 256 in a label
+  image are set as well instead of being cast to 0 first.
+  */
+  void Read(const std::string &fileName)
+  {
+    itk::ImageIOBase::Pointer imageIO = itk::ImageIOFactory::CreateImageIO(fileName.c_str(), itk::ImageIOFactory::ReadMode);
+    if (imageIO.IsNull())
+    {
+      itkGenericExceptionMacro("Could not find an image reader for '" << fileName << "'");
+    }
+    imageIO->SetFileName(fileName);
+    imageIO->ReadImageInformation();
+
+    switch (imageIO->GetComponentType())
+    {
+    case itk::ImageIOBase::IOComponentType::UCHAR:
+      ReadAs< unsigned char >(fileName);
+      break;
+    case itk::ImageIOBase::IOComponentType::CHAR:
+      ReadAs< char >(fileName);
+      break;
+    case itk::ImageIOBase::IOComponentType::USHORT:
+      ReadAs< unsigned short >(fileName);
+      break;
+    case itk::ImageIOBase::IOComponentType::SHORT:
+      ReadAs< short >(fileName);
+      break;
+    case itk::ImageIOBase::IOComponentType::UINT:
+      ReadAs< unsigned int >(fileName);
+      break;
+    case itk::ImageIOBase::IOComponentType::INT:
+      ReadAs< int >(fileName);
+      break;
+    case itk::ImageIOBase::IOComponentType::FLOAT:
+      ReadAs< float >(fileName);
+      break;
+    default: // anything else is compared as double, which holds every value of the smaller types exactly
+      ReadAs< double >(fileName);
+      break;
+    }
+  }
+
+  //! Write the mask to file as an unsigned char image with 'value' in the voxels that are set
+  void Write(const std::string &fileName, unsigned char value = 1) const
+  {
+    typedef itk::ImageFileWriter< ByteImageType > WriterType;
+    typename WriterType::Pointer writer = WriterType::New();
+    writer->SetFileName(fileName);
+    writer->SetInput(Unpack(value));
+    writer->Update();
+  }
+
+  //! Value of the voxel at the given linear offset
+  bool GetPixel(size_t offset) const
+  {
+    return ((m_words[offset / BitsPerWord] >> (offset % BitsPerWord)) & 1) != 0;
+  }
+
+  //! Value of the voxel at the given index
+  bool GetPixel(const IndexType &index) const
+  {
+    return GetPixel(ComputeOffset(index));
+  }
+
+  //! Set or clear the voxel at the given linear offset
+  void SetPixel(size_t offset, bool value)
+  {
+    const WordType bit = WordType(1) << (offset % BitsPerWord);
+    if (value)
+    {
+      m_words[offset / BitsPerWord] |= bit;
+    }
+    else
+    {
+      m_words[offset / BitsPerWord] &= ~bit;
+    }
+  }
+
+  //! Set or clear the voxel at the given index
+  void SetPixel(const IndexType &index, bool value)
+  {
+    SetPixel(ComputeOffset(index), value);
+  }
+
+  //! Keep only the voxels that are set in both masks
+  void And(const BitMaskImage &other)
+  {
+    CheckSameRegion(other);
+    for (size_t w = 0; w < m_words.size(); w++)
+    {
+      m_words[w] &= other.m_words[w];
+    }
+  }
+
+  //! Add the voxels that are set in the other mask
+  void Or(const BitMaskImage &other)
+  {
+    CheckSameRegion(other);
+    for (size_t w = 0; w < m_words.size(); w++)
+    {
+      m_words[w] |= other.m_words[w];
+    }
+  }
+
+  //! Invert the mask
+  void Not()
+  {
+    for (size_t w = 0; w < m_words.size(); w++)
+    {
+      m_words[w] = ~m_words[w];
+    }
+    // the bits past the last voxel have to stay clear for counting and iterating
+    const size_t tail = m_voxels % BitsPerWord;
+    if (tail != 0)
+    {
+      m_words.back() &= (WordType(1) << tail) - 1;
+    }
+  }
+
+  //! Number of voxels that are set
+  size_t GetNumberOfSetPixels() const
+  {
+    size_t count = 0;
+    for (size_t w = 0; w < m_words.size(); w++)
+    {
+      count += PopCount(m_words[w]);
+    }
+    return count;
+  }
+
+  //! Physical volume of the voxels that are set
+  double GetVolume() const
+  {
+    double voxelVolume = 1;
+    for (unsigned int d = 0; d < ImageDimension; d++)
+    {
+      voxelVolume *= m_spacing[d];
+    }
+    return voxelVolume * GetNumberOfSetPixels();
+  }
+
+  //! Linear offset of an index, same as in the buffer of an itk::Image with the same region
+  size_t ComputeOffset(const IndexType &index) const
+  {
+    size_t offset = 0, stride = 1;
+    for (unsigned int d = 0; d < ImageDimension; d++)
+    {
+      offset += (index[d] - m_region.GetIndex()[d]) * stride;
+      stride *= m_region.GetSize()[d];
+    }
+    return offset;
+  }
+
+  //! Index of a linear offset
+  IndexType ComputeIndex(size_t offset) const
+  {
+    IndexType index;
+    for (unsigned int d = 0; d < ImageDimension; d++)
+    {
+      index[d] = m_region.GetIndex()[d] + offset % m_region.GetSize()[d];
+      offset /= m_region.GetSize()[d];
+    }
+    return index;
+  }
+
+  const RegionType &GetRegion() const
+  {
+    return m_region;
+  }
+
+  const SpacingType &GetSpacing() const
+  {
+    return m_spacing;
+  }
+
+  const PointType &GetOrigin() const
+  {
+    return m_origin;
+  }
+
+  const DirectionType &GetDirection() const
+  {
+    return m_direction;
+  }
+
+  //! The packed voxels, bit i % 64 of word i / 64 holds voxel i
+  const std::vector< WordType > &GetWords() const
+  {
+    return m_words;
+  }
+
+  //! Memory taken by the voxels, in bytes
+  size_t GetBufferSize() const
+  {
+    return m_words.size() * sizeof(WordType);
+  }
+
+private:
+  //! Read the file as an image of the given pixel type and pack it
+  template< class TPixelType >
+  void ReadAs(const std::string &fileName)
+  {
+    typedef itk::Image< TPixelType, VDimension > ImageType;
+    typedef itk::ImageFileReader< ImageType > ReaderType;
+    typename ReaderType::Pointer reader = ReaderType::New();
+    reader->SetFileName(fileName);
+    reader->Update();
+    Pack(reader->GetOutput());
+  }
+
+  //! Word-level kernels need both masks to cover the same voxels
+  void CheckSameRegion(const BitMaskImage &other) const
+  {
+    if (other.m_region != m_region)
+    {
+      itkGenericExceptionMacro("BitMaskImage regions differ: " << m_region << " vs. " << other.m_region);
+    }
+  }
+
+  static unsigned int PopCount(WordType word)
+  {
+#if defined(_MSC_VER) && defined(_M_X64)
+    return static_cast< unsigned int >(__popcnt64(word));
+#elif defined(__GNUC__)
+    return static_cast< unsigned int >(__builtin_popcountll(word));
+#else
+    unsigned int count = 0;
+    for (; word != 0; word &= word - 1)
+    {
+      count++;
+    }
+    return count;
+#endif
+  }
+
+  //! Position of the lowest set bit; the word must not be 0
+  static unsigned int TrailingZeros(WordType word)
+  {
+#if defined(_MSC_VER) && defined(_M_X64)
+    unsigned long position;
+    _BitScanForward64(&position, word);
+    return static_cast< unsigned int >(position);
+#elif defined(__GNUC__)
+    return static_cast< unsigned int >(__builtin_ctzll(word));
+#else
+    unsigned int position = 0;
+    for (; (word & 1) == 0; word >>= 1)
+    {
+      position++;
+    }
+    return position;
+#endif
+  }
+
+  RegionType m_region;
+  SpacingType m_spacing;
+  PointType m_origin;
+  DirectionType m_direction;
+  size_t m_voxels;
+  std::vector< WordType > m_words;
+};